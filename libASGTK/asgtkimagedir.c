@@ -312,6 +312,7 @@ const char *as_image_file_type_names_short[ASIT_Unknown + 1] = {
 	"PCX",
 	"HTML",
 	"XML",
+	"ASIM",
 	""
 };
 
@@ -99,6 +99,15 @@ TermDef BaseTerms[] = {
 	{TF_NO_MYNAME_PREPENDING, "IconThemeFallback", 18, TT_PATHNAME,
 	 BASE_IconThemeFallback_ID, NULL}
 	,
+	{TF_NO_MYNAME_PREPENDING, "ImageCacheSize", 14, TT_INTEGER,
+	 BASE_ImageCacheSize_ID, NULL}
+	,
+	{TF_NO_MYNAME_PREPENDING, "TextCacheSize", 13, TT_INTEGER,
+	 BASE_TextCacheSize_ID, NULL}
+	,
+	{TF_NO_MYNAME_PREPENDING, "GradientCacheSize", 17, TT_INTEGER,
+	 BASE_GradientCacheSize_ID, NULL}
+	,
 	{0, NULL, 0, 0, 0}
 };
 
@@ -135,6 +144,9 @@ BaseConfig *CreateBaseConfig ()
 	config->desktop_size.width = config->desktop_size.height = 1;
 	config->desktop_size.x = config->desktop_size.y = 0;
 	config->desktop_scale = 32;
+	config->image_cache_size = ASE_DEFAULT_IMAGE_CACHE_SIZE;
+	config->text_cache_size = ASE_DEFAULT_TEXT_CACHE_SIZE;
+	config->gradient_cache_size = ASE_DEFAULT_GRADIENT_CACHE_SIZE;
 
 	return config;
 }
@@ -237,6 +249,25 @@ BaseConfig *ParseBaseOptions (const char *filename, char *myname)
 			set_flags (config->set_flags, BASE_NoModuleNameCollisions_SET);
 			config->NoModuleNameCollisions = item.data.integer;
 			break;
+		case BASE_ImageCacheSize_ID:
+			set_flags (config->set_flags, BASE_ImageCacheSize_SET);
+			config->image_cache_size = item.data.integer;
+			/* errorneous value check */
+			if (config->image_cache_size < 0)
+				config->image_cache_size = 0;
+			break;
+		case BASE_TextCacheSize_ID:
+			set_flags (config->set_flags, BASE_TextCacheSize_SET);
+			config->text_cache_size = item.data.integer;
+			if (config->text_cache_size < 0)
+				config->text_cache_size = 0;
+			break;
+		case BASE_GradientCacheSize_ID:
+			set_flags (config->set_flags, BASE_GradientCacheSize_SET);
+			config->gradient_cache_size = item.data.integer;
+			if (config->gradient_cache_size < 0)
+				config->gradient_cache_size = 0;
+			break;
 		case BASE_TermCommand_ID:
 			if (item.index < MAX_TOOL_COMMANDS && item.index >= 0)
 				set_string (&(config->term_command[item.index]), item.data.string);
@@ -354,6 +385,25 @@ WriteBaseOptions (const char *filename, char *myname, BaseConfig * config,
 			Integer2FreeStorage (&BaseSyntax, tail, NULL, config->desktop_scale,
 													 BASE_DESKTOP_SCALE_ID);
 
+	/* image_cache_size */
+	if (get_flags (config->set_flags, BASE_ImageCacheSize_SET))
+		tail =
+				Integer2FreeStorage (&BaseSyntax, tail, NULL, config->image_cache_size,
+														 BASE_ImageCacheSize_ID);
+
+	/* text_cache_size */
+	if (get_flags (config->set_flags, BASE_TextCacheSize_SET))
+		tail =
+				Integer2FreeStorage (&BaseSyntax, tail, NULL, config->text_cache_size,
+														 BASE_TextCacheSize_ID);
+
+	/* gradient_cache_size */
+	if (get_flags (config->set_flags, BASE_GradientCacheSize_SET))
+		tail =
+				Integer2FreeStorage (&BaseSyntax, tail, NULL,
+														 config->gradient_cache_size,
+														 BASE_GradientCacheSize_ID);
+
 	cd.filename = filename;
 	/* writing config into the file */
 	WriteConfig (BaseConfigWriter, Storage, CDT_Filename, &cd, flags);
@@ -445,6 +495,9 @@ BaseConfig2ASEnvironment (register BaseConfig * config,
 	else
 		env->desk_pages_v = 0;
 	env->desk_scale = config->desktop_scale;
+	env->image_cache_size = config->image_cache_size;
+	env->text_cache_size = config->text_cache_size;
+	env->gradient_cache_size = config->gradient_cache_size;
 
 	switch (config->NoModuleNameCollisions % 3) {
 	case 0:
@@ -537,6 +590,7 @@ ReloadASEnvironment (ASImageManager ** old_imageman,
 	}
 
 	e = Environment;
+	set_gradient_cache_budget ((size_t)e->gradient_cache_size * 1024);
 	/* Save base filename to pass to modules */
 	if (mystrcmp (old_pixmap_path, e->pixmap_path) == 0 ||
 			(e->pixmap_path != NULL && scr->image_manager == NULL)
@@ -554,6 +608,8 @@ ReloadASEnvironment (ASImageManager ** old_imageman,
 			destroy_font_manager (scr->font_manager, False);
 
 		scr->font_manager = create_font_manager (dpy, e->font_path, NULL);
+		set_asfont_text_cache_budget (scr->font_manager,
+																	(size_t)e->text_cache_size * 1024);
 		set_xml_font_manager (scr->font_manager);
 		show_progress ("Font Path changed to \"%s\" ...",
 									 e->font_path ? e->font_path : "");
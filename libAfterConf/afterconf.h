@@ -337,7 +337,10 @@ struct FreeStorageElem *MyStyleDefinitionsList2free_storage (struct MyStyleDefin
 #define BASE_IconTheme_ID					BASE_ID_START+17
 #define BASE_IconThemePath_ID			BASE_ID_START+18
 #define BASE_IconThemeFallback_ID	BASE_ID_START+19
-#define BASE_ID_END             	BASE_ID_START+20
+#define BASE_ImageCacheSize_ID		BASE_ID_START+20
+#define BASE_TextCacheSize_ID		BASE_ID_START+21
+#define BASE_GradientCacheSize_ID	BASE_ID_START+22
+#define BASE_ID_END             	BASE_ID_START+23
 
 typedef struct
 {
@@ -346,6 +349,9 @@ typedef struct
 #define BASE_DESKTOP_SIZE_SET			(0x01<<16)
 #define BASE_DESKTOP_SCALE_SET			(0x01<<17)
 #define BASE_NoModuleNameCollisions_SET	(0x01<<18)
+#define BASE_ImageCacheSize_SET			(0x01<<19)
+#define BASE_TextCacheSize_SET			(0x01<<20)
+#define BASE_GradientCacheSize_SET		(0x01<<21)
 	ASFlagType flags, set_flags ;
     char *module_path;
     char *sound_path;
@@ -359,6 +365,9 @@ typedef struct
     ASGeometry desktop_size;
     int desktop_scale;
 	int NoModuleNameCollisions;
+	int image_cache_size;	/* in Kbytes */
+	int text_cache_size;	/* in Kbytes */
+	int gradient_cache_size;	/* in Kbytes */
 #define MAX_TOOL_COMMANDS	8
 	char *term_command[MAX_TOOL_COMMANDS] ;
 	char *browser_command[MAX_TOOL_COMMANDS] ;
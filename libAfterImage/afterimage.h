@@ -14,6 +14,7 @@
 #include "asfont.h"
 #include "ximage.h"
 #include "transform.h"
+#include "asthreads.h"
 #include "asimagexml.h"
 #include "import.h"
 #include "export.h"
@@ -213,7 +214,7 @@
  *          degrees2hue16(), hue162degrees(), normalize_degrees_val()
  *
  *   Image quantization :
- *          colormap_asimage(), destroy_colormap()
+ *          colormap_asimage(), colormap_asimage_ext(), destroy_colormap()
  *
  *   merge_scanline methods :
  *          alphablend_scanlines(), allanon_scanlines(),
@@ -265,7 +266,8 @@
  *          scale_asimage(), tile_asimage(), merge_layers(), 
  * 			make_gradient(),
  *          flip_asimage(), mirror_asimage(), pad_asimage(),
- *          blur_asimage_gauss(), fill_asimage(), adjust_asimage_hsv()
+ *          blur_asimage_gauss(), blur_asimage_box(), fill_asimage(),
+ *          adjust_asimage_hsv()
  *
  *   Import :
  *          file2ASImage(), file2pixmap()
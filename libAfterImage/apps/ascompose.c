@@ -140,6 +140,13 @@ int asvisual_empty_XErrorHandler (Display * dpy, XErrorEvent * event);
  *                       debug messages.
  *    -i --include file  include file as input prior to processing main 
  * 						 file.
+ *       --benchmark N   compose document N times with new image manager
+ *                       each time (cold), and then N more times with
+ *                       the same image manager (warm), and print time
+ *                       spent on each tag instead of showing the image.
+ *       --benchmark-json print benchmark results as JSON.
+ *       --budget ms     time per document to flag in benchmark results,
+ *                       100 ms by default.
  * PORTABILITY
  * ascompose could be used both with and without X window system. It has
  * been tested on most UNIX flavors on both 32 and 64 bit architecture.
@@ -198,6 +205,12 @@ void usage(void) {
 		"  -V --verbose       increase verbosity\n"
 		"  -q --quiet	      output as little information as possible\n"
 		"  -D --debug         show everything and debug messages\n"
+		" Benchmark options : \n"
+		"     --benchmark N   compose document N times with cold and then\n"
+		"                     with warm image manager, and print time spent\n"
+		"                     on each tag\n"
+		"     --benchmark-json print benchmark results as JSON\n"
+		"     --budget ms     flag documents taking longer than that (100 ms)\n"
 		" Interactive options : \n"
 		"  -I --interactive   run ascompose in interactive mode - tags are processed,\n" 
 		"                     as soon as they are closed.\n"
@@ -281,6 +294,7 @@ typedef struct ASComposeWinProps
 }ASComposeWinProps;
 
 Window showimage(ASImage* im, Bool looping, Window main_window, ASComposeWinProps *props, int dst_x, int dst_y);
+void benchmark_xml(char *doc_str, int runs, Bool json, double budget_ms);
 Window make_main_window(Bool on_root, ASComposeWinProps *props);	
 
 int screen = 0, depth = 0;
@@ -297,6 +311,9 @@ int main(int argc, char** argv) {
 	int i;
 	int display = 1, onroot = 0;
 	Bool quiet = False ;
+	int benchmark_runs = 0 ;
+	Bool benchmark_json = False ;
+	double benchmark_budget = 100. ;
 	enum
 	{
 		COMPOSE_Once = 0,
@@ -381,6 +398,13 @@ int main(int argc, char** argv) {
             endless_loop = True ;
 		} else if (!strcmp(argv[i], "--dont-clear")) {
             main_window_props.dont_clear = True ;
+		} else if (strcmp(argv[i], "--benchmark") == 0 && i < argc - 1) {
+			benchmark_runs = atoi( argv[++i] );
+			display = 0;
+		} else if (strcmp(argv[i], "--benchmark-json") == 0) {
+			benchmark_json = True ;
+		} else if (strcmp(argv[i], "--budget") == 0 && i < argc - 1) {
+			benchmark_budget = strtod( argv[++i], NULL );
 		}
 #ifndef X_DISPLAY_MISSING
 		  else if ((!strcmp(argv[i], "--geometry") || !strcmp(argv[i], "-g")) && i < argc + 1) {
@@ -455,7 +479,10 @@ int main(int argc, char** argv) {
 			}
 		}
 		
-		im = compose_asimage_xml(asv, NULL, NULL, doc_str, ASFLAGS_EVERYTHING, verbose, None, NULL);
+		if( benchmark_runs > 0 ) 
+			benchmark_xml( doc_str, benchmark_runs, benchmark_json, benchmark_budget );
+		else
+			im = compose_asimage_xml(asv, NULL, NULL, doc_str, ASFLAGS_EVERYTHING, verbose, None, NULL);
 		/* Save the result image if desired. */
 		if (doc_save && doc_save_type) 
 		{
@@ -757,6 +784,7 @@ int main(int argc, char** argv) {
 	LOCAL_DEBUG_OUT( "display Closed%s","");
     build_xpm_colormap( NULL );
 	LOCAL_DEBUG_OUT( "display Closed%s","");
+	flush_gradient_cache();
 	flush_default_asstorage();
 	LOCAL_DEBUG_OUT( "display Closed%s","");
 //	destroy_asvisual( asv, False );
@@ -1206,3 +1234,264 @@ char *load_stdin()
 	return complete;
 }	 
 
+
+/*************************************************************************/
+/* Benchmarking :                                                        */
+/*************************************************************************/
+typedef struct ASComposeTagProfile
+{
+	xml_elem_t *elem ;
+	int depth ;
+	char *id ;
+	unsigned long calls, cached ;
+	double wall, self_wall, cpu, self_cpu ;		/* seconds, all runs together */
+	unsigned int width, height ;				/* of the last result */
+	size_t bytes ;								/* largest result */
+}ASComposeTagProfile;
+
+typedef struct ASComposeProfile
+{
+	const char *name ;
+	ASComposeTagProfile *tags ;
+	int tags_num, tags_allocated ;
+
+	int runs ;
+	double wall, min_wall, max_wall, cpu ;		/* of whole documents */
+}ASComposeProfile;
+
+static double
+benchmark_time()
+{
+	struct timeval tv ;
+	gettimeofday( &tv, NULL );
+	return (double)tv.tv_sec + (double)tv.tv_usec/1000000. ;
+}
+
+/* tags are listed in document order, rather than in order of evaluation : */
+static void
+add_profile_tags( ASComposeProfile *prof, xml_elem_t *elem, int depth )
+{
+	for( ; elem ; elem = elem->next )
+	{
+		ASComposeTagProfile *tag ;
+		xml_elem_t *parm, *ptr ;
+
+		if( IsCDATA(elem) )
+			continue;
+		if( prof->tags_num >= prof->tags_allocated )
+		{
+			prof->tags_allocated += 32 ;
+			prof->tags = realloc( prof->tags, prof->tags_allocated*sizeof(ASComposeTagProfile));
+		}
+		tag = &(prof->tags[prof->tags_num++]);
+		memset( tag, 0x00, sizeof(ASComposeTagProfile));
+		tag->elem = elem ;
+		tag->depth = depth ;
+		parm = xml_parse_parm( elem->parm, NULL );
+		for( ptr = parm ; ptr ; ptr = ptr->next )
+			if( strcmp( ptr->tag, "id" ) == 0 )
+				tag->id = mystrdup( ptr->parm );
+		xml_elem_delete( NULL, parm );
+
+		add_profile_tags( prof, elem->child, depth+1 );
+	}
+}
+
+static void
+profile_tag_hook( ASImageXMLTagStats *stats, void *data )
+{
+	ASComposeProfile *prof = (ASComposeProfile*)data ;
+	int i ;
+
+	for( i = 0 ; i < prof->tags_num ; ++i )
+		if( prof->tags[i].elem == stats->elem )
+		{
+			ASComposeTagProfile *tag = &(prof->tags[i]);
+			++(tag->calls);
+			if( stats->cached )
+				++(tag->cached);
+			tag->wall += stats->wall_time ;
+			tag->self_wall += stats->self_wall_time ;
+			tag->cpu += stats->cpu_time ;
+			tag->self_cpu += stats->self_cpu_time ;
+			tag->width = stats->width ;
+			tag->height = stats->height ;
+			if( stats->storage_bytes > tag->bytes )
+				tag->bytes = stats->storage_bytes ;
+			break;
+		}
+}
+
+static void
+benchmark_run( ASComposeProfile *prof, xml_elem_t *doc, ASImageManager *imman, ASFontManager *fontman )
+{
+	double started = benchmark_time();
+	clock_t started_cpu = clock();
+	double wall ;
+	ASImage *im ;
+
+	set_asimage_xml_tag_hook( profile_tag_hook, prof );
+	im = compose_asimage_xml_from_doc( asv, imman, fontman, doc, ASFLAGS_EVERYTHING, verbose, None, NULL, -1, -1 );
+	set_asimage_xml_tag_hook( NULL, NULL );
+
+	wall = benchmark_time() - started ;
+	prof->cpu += (double)(clock() - started_cpu)/CLOCKS_PER_SEC ;
+	prof->wall += wall ;
+	if( prof->runs == 0 || wall < prof->min_wall )
+		prof->min_wall = wall ;
+	if( prof->runs == 0 || wall > prof->max_wall )
+		prof->max_wall = wall ;
+	++(prof->runs);
+
+	if( im )
+		safe_asimage_destroy( im );
+}
+
+static void
+print_json_string( const char *str )
+{
+	if( str == NULL )
+	{
+		fputs( "null", stdout );
+		return;
+	}
+	fputc( '"', stdout );
+	for( ; *str ; ++str )
+	{
+		if( *str == '"' || *str == '\\' )
+			printf( "\\%c", *str );
+		else if( (unsigned char)*str < 0x20 )
+			printf( "\\u%4.4x", (unsigned char)*str );
+		else
+			fputc( *str, stdout );
+	}
+	fputc( '"', stdout );
+}
+
+static void
+print_profile_table( ASComposeProfile *prof, double budget_ms )
+{
+	double per_run = 1000./prof->runs ;
+	int i ;
+
+	printf( "%s image manager: %d runs, %.2f ms per run (min %.2f, max %.2f, cpu %.2f)%s\n",
+			prof->name, prof->runs, prof->wall*per_run, prof->min_wall*1000., prof->max_wall*1000., prof->cpu*per_run,
+			(prof->wall*per_run > budget_ms)?" - OVER BUDGET":"" );
+	printf( "%-28s %-12s %7s %7s %9s %9s %9s %9s %11s %10s\n",
+			"tag", "id", "calls", "cached", "wall ms", "self ms", "cpu ms", "self cpu", "size", "bytes" );
+	for( i = 0 ; i < prof->tags_num ; ++i )
+	{
+		ASComposeTagProfile *tag = &(prof->tags[i]);
+		char size[32] = "" ;
+		int indent = (tag->depth < 12)?tag->depth*2:24 ;
+
+		if( tag->width > 0 )
+			sprintf( size, "%ux%u", tag->width, tag->height );
+		printf( "%*s%-*.*s %-12.12s %7lu %7lu %9.2f %9.2f %9.2f %9.2f %11s %10lu\n",
+				indent, "", 28-indent, 28-indent, tag->elem->tag, tag->id?tag->id:"",
+				tag->calls, tag->cached,
+				tag->wall*per_run, tag->self_wall*per_run, tag->cpu*per_run, tag->self_cpu*per_run,
+				size, (unsigned long)tag->bytes );
+	}
+	printf( "\n" );
+}
+
+static void
+print_profile_json( ASComposeProfile *prof, double budget_ms )
+{
+	double per_run = 1000./prof->runs ;
+	int i ;
+
+	printf( "  \"%s\": {\n", prof->name );
+	printf( "    \"runs\": %d, \"mean_ms\": %.3f, \"min_ms\": %.3f, \"max_ms\": %.3f, \"cpu_ms\": %.3f, \"over_budget\": %s,\n",
+			prof->runs, prof->wall*per_run, prof->min_wall*1000., prof->max_wall*1000., prof->cpu*per_run,
+			(prof->wall*per_run > budget_ms)?"true":"false" );
+	printf( "    \"tags\": [" );
+	for( i = 0 ; i < prof->tags_num ; ++i )
+	{
+		ASComposeTagProfile *tag = &(prof->tags[i]);
+		printf( "%s\n      {\"tag\": ", i?",":"" );
+		print_json_string( tag->elem->tag );
+		printf( ", \"id\": " );
+		print_json_string( tag->id );
+		printf( ", \"depth\": %d, \"calls\": %lu, \"cached\": %lu, \"wall_ms\": %.3f, \"self_ms\": %.3f, \"cpu_ms\": %.3f, \"self_cpu_ms\": %.3f, \"width\": %u, \"height\": %u, \"bytes\": %lu}",
+				tag->depth, tag->calls, tag->cached,
+				tag->wall*per_run, tag->self_wall*per_run, tag->cpu*per_run, tag->self_cpu*per_run,
+				tag->width, tag->height, (unsigned long)tag->bytes );
+	}
+	printf( "\n    ]\n  }" );
+}
+
+static void
+free_profile( ASComposeProfile *prof )
+{
+	int i ;
+	for( i = 0 ; i < prof->tags_num ; ++i )
+		if( prof->tags[i].id )
+			free( prof->tags[i].id );
+	if( prof->tags )
+		free( prof->tags );
+}
+
+/* memory warm image manager may use to keep images no longer referenced : */
+#define BENCHMARK_CACHE_BUDGET	(256*1024*1024)
+
+/* Composes document runs times with new image and font managers each time,
+ * and then runs more times with the same managers, after they were warmed
+ * up by one more run. Times are reported per run. */
+void
+benchmark_xml( char *doc_str, int runs, Bool json, double budget_ms )
+{
+	xml_elem_t *doc = xml_parse_doc( doc_str, NULL );
+	ASComposeProfile cold, warm ;
+	ASImageManager *imman ;
+	ASFontManager *fontman ;
+	ASImage *im ;
+	int i ;
+
+	if( doc == NULL )
+	{
+		show_error( "Unable to parse xml document." );
+		return;
+	}
+	memset( &cold, 0x00, sizeof(cold));
+	memset( &warm, 0x00, sizeof(warm));
+	cold.name = "cold" ;
+	warm.name = "warm" ;
+	add_profile_tags( &cold, doc->child, 0 );
+	add_profile_tags( &warm, doc->child, 0 );
+
+	for( i = 0 ; i < runs ; ++i )
+		benchmark_run( &cold, doc, NULL, NULL );
+
+	/* warm runs should find images loaded by earlier runs, so they have
+	 * to be kept around after the result is destroyed : */
+	imman = create_generic_imageman( NULL );
+	set_asimage_manager_budget( imman, BENCHMARK_CACHE_BUDGET );
+	fontman = create_generic_fontman( asv->dpy, NULL );
+	im = compose_asimage_xml_from_doc( asv, imman, fontman, doc, ASFLAGS_EVERYTHING, verbose, None, NULL, -1, -1 );
+	if( im )
+		safe_asimage_destroy( im );
+	for( i = 0 ; i < runs ; ++i )
+		benchmark_run( &warm, doc, imman, fontman );
+	destroy_image_manager( imman, False );
+	destroy_font_manager( fontman, False );
+
+	if( json )
+	{
+		printf( "{\n  \"runs\": %d, \"budget_ms\": %.3f,\n", runs, budget_ms );
+		print_profile_json( &cold, budget_ms );
+		printf( ",\n" );
+		print_profile_json( &warm, budget_ms );
+		printf( "\n}\n" );
+	}else
+	{
+		printf( "times are in ms per run, budget is %.2f ms\n\n", budget_ms );
+		print_profile_table( &cold, budget_ms );
+		print_profile_table( &warm, budget_ms );
+	}
+
+	free_profile( &cold );
+	free_profile( &warm );
+	xml_elem_delete( NULL, doc );
+}
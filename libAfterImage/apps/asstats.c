@@ -0,0 +1,153 @@
+#include "config.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+/****h* libAfterImage/tutorials/ASStats
+ * NAME
+ * ASStats
+ * SYNOPSIS
+ * libAfterImage application reporting image storage statistics.
+ * DESCRIPTION
+ * Pixel data of ASImages is kept in compressed form in ASStorage. This
+ * application loads images and prints statistics of the storage they
+ * end up in as JSON - how much memory is used by blocks, how fragmented
+ * free space is and how well data gets compressed - that could be used
+ * to tune block size and compression. Optionally half of the images is
+ * destroyed again and storage defragmented, to see how much memory gets
+ * reclaimed.
+ *
+ * Applications like window manager may publish summary of their own
+ * storage stats in root window property, and this application can
+ * print that as well.
+ * SEE ALSO
+ * Tutorial 1: ASView  - explanation of basic steps needed to use
+ *                       libAfterImage and some other simple things.
+ * SOURCE
+ */
+
+#include "../afterbase.h"
+#include "../afterimage.h"
+
+void usage()
+{
+	printf( "Usage: asstats [-h]|[-r]|[[-b block_size] [-c compression] "
+			"[-z] [-d] [-s] image ...]\n");
+	printf( "Where: image       - is image filename\n");
+	printf( "       -r          - print stats published by window manager on root window\n");
+	printf( "       block_size  - size of storage blocks in bytes\n");
+	printf( "       compression - compression level 0-100 to load images with\n");
+	printf( "       -z          - try LZ compression in addition to RLE\n");
+	printf( "       -d          - destroy every other image and defragment storage\n");
+	printf( "       -s          - summary only, without stats of individual blocks\n");
+}
+
+/* prints whatever has been published, as is : */
+int print_root_stats()
+{
+	int res = 1 ;
+#ifndef X_DISPLAY_MISSING
+	Display *dpy = XOpenDisplay(NULL);
+	if( dpy == NULL )
+		show_error( "failed to open display" );
+	else
+	{
+		Atom prop = XInternAtom( dpy, ASSTORAGE_STATS_PROPERTY, True );
+		Atom type = None ;
+		int format = 0 ;
+		unsigned long items = 0, bytes_after = 0 ;
+		unsigned char *data = NULL ;
+
+		if( prop != None )
+			if( XGetWindowProperty( dpy, DefaultRootWindow(dpy), prop, 0, 0x00FFFFFF, False,
+									AnyPropertyType, &type, &format, &items, &bytes_after,
+									&data ) == Success && data != NULL )
+			{
+				if( format == 8 && items > 0 )
+				{
+					fwrite( data, 1, items, stdout );
+					res = 0 ;
+				}
+				XFree( data );
+			}
+		if( res != 0 )
+			show_error( "no storage stats published on root window" );
+		XCloseDisplay( dpy );
+	}
+#else
+	show_error( "built without X support" );
+#endif
+	return res;
+}
+
+int main(int argc, char* argv[])
+{
+	ASImage **images ;
+	int images_count = 0 ;
+	unsigned int compression = 0 ;
+	Bool defragment = False, summary = False ;
+	ASStorageStats stats ;
+	ASStorageBlockStats *blocks = NULL ;
+	int blocks_count ;
+	char *json ;
+	int i ;
+
+	set_application_name( argv[0] );
+
+	images = safecalloc( argc, sizeof(ASImage*) );
+	for( i = 1 ; i < argc ; i++ )
+	{
+		if( strcmp( argv[i], "-h" ) == 0 )
+		{
+			usage();
+			return 0;
+		}else if( strcmp( argv[i], "-r" ) == 0 )
+			return print_root_stats();
+		else if( strcmp( argv[i], "-z" ) == 0 )
+			set_asstorage_compression( NULL, ASStorage_LZCompress );
+		else if( strcmp( argv[i], "-d" ) == 0 )
+			defragment = True ;
+		else if( strcmp( argv[i], "-s" ) == 0 )
+			summary = True ;
+		else if( strcmp( argv[i], "-b" ) == 0 && i < argc-1 )
+			set_asstorage_block_size( NULL, atoi(argv[++i]) );
+		else if( strcmp( argv[i], "-c" ) == 0 && i < argc-1 )
+			compression = atoi(argv[++i]);
+		else if( (images[images_count] = file2ASImage( argv[i], 0xFFFFFFFF, SCREEN_GAMMA, compression,
+													   getenv("IMAGE_PATH"), NULL )) != NULL )
+			++images_count ;
+		else
+			show_error( "unable to load file \"%s\"", argv[i] );
+	}
+	if( images_count == 0 )
+	{
+		usage();
+		return 1;
+	}
+
+	if( defragment )
+	{
+		for( i = 0 ; i < images_count ; i += 2 )
+			destroy_asimage( &images[i] );
+		while( defragment_asstorage( NULL, 0 ) );
+	}
+
+	blocks_count = get_asstorage_stats( NULL, &stats, NULL, 0 );
+	if( !summary && blocks_count > 0 )
+	{
+		blocks = safecalloc( blocks_count, sizeof(ASStorageBlockStats) );
+		blocks_count = get_asstorage_stats( NULL, &stats, blocks, blocks_count );
+	}
+	json = asstorage_stats2json( &stats, blocks, summary?0:blocks_count );
+	fputs( json, stdout );
+	free( json );
+	if( blocks )
+		free( blocks );
+
+	for( i = 0 ; i < images_count ; ++i )
+		if( images[i] )
+			destroy_asimage( &images[i] );
+	free( images );
+	return 0 ;
+}
+/**************/
@@ -176,6 +176,7 @@ int main(int argc, char* argv[])
 	asxml_var_cleanup();
 	custom_color_cleanup();
     build_xpm_colormap( NULL );
+	flush_gradient_cache();
 	flush_default_asstorage();
 	/* requires libAfterBase */
 	print_unfreed_mem();
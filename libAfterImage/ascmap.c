@@ -697,3 +697,546 @@ check_colorindex_counts( cmap->hash );
 	return mapped_im ;
 }
 
+
+/***********************************************************************************/
+/* median cut quantization :                                                       */
+/***********************************************************************************/
+#define MC_BITS				5
+#define MC_SIDE				(0x01<<MC_BITS)
+#define MC_CELLS			(MC_SIDE*MC_SIDE*MC_SIDE)
+#define MC_CELL(r,g,b)		((((r)>>(8-MC_BITS))<<(MC_BITS*2))|(((g)>>(8-MC_BITS))<<MC_BITS)|((b)>>(8-MC_BITS)))
+
+#define INV_BITS			6
+#define INV_CELL(r,g,b)		((((r)>>(8-INV_BITS))<<(INV_BITS*2))|(((g)>>(8-INV_BITS))<<INV_BITS)|((b)>>(8-INV_BITS)))
+#define INV_CENTER(c)		(((c)&~((0x01<<(8-INV_BITS))-1))+(0x01<<(7-INV_BITS)))
+#define INV_EMPTY			0xFFFF
+
+/* green matters most and blue least for perceived difference : */
+#define MC_RED_WEIGHT		2
+#define MC_GREEN_WEIGHT		3
+#define MC_BLUE_WEIGHT		1
+
+/* up to that many distinct colors are tracked to see if image needs any quantization at all : */
+#define MC_EXACT_HASH_SIZE(max_colors)	(((max_colors)+1)*4)
+
+typedef struct ASMCCell
+{
+	CARD32 count ;
+	double red, green, blue ;				/* sums of actual color values */
+}ASMCCell;
+
+typedef struct ASMCBox
+{
+	int lo[3], hi[3] ;						/* inclusive bounds in cells */
+	double count ;
+	double error ;							/* priority for splitting */
+}ASMCBox;
+
+typedef struct ASMCQuantizer
+{
+	ASMCCell *cells ;
+
+	/* distinct colors, while there are not too many of them : */
+	CARD32 *exact_colors ;
+	int    *exact_idx ;
+	unsigned int exact_size, exact_count ;
+	Bool exact ;
+
+	ASColormapEntry *entries ;
+	unsigned int count ;
+	int *by_green ;							/* colorcells sorted by green */
+	CARD16 *inverse ;						/* closest colorcell of each 18 bit color */
+}ASMCQuantizer;
+
+static inline Bool
+add_mc_exact_color( ASMCQuantizer *q, CARD32 rgb, unsigned int max_colors )
+{
+	unsigned int i = (rgb*0x9E3779B1)%q->exact_size ;
+	while( q->exact_colors[i] != 0xFFFFFFFF )
+	{
+		if( q->exact_colors[i] == rgb )
+			return True ;
+		if( ++i >= q->exact_size )
+			i = 0 ;
+	}
+	if( q->exact_count >= max_colors )
+		return False ;
+	q->exact_colors[i] = rgb ;
+	q->exact_idx[i] = q->exact_count++ ;
+	return True ;
+}
+
+static inline int
+get_mc_exact_index( ASMCQuantizer *q, CARD32 rgb )
+{
+	unsigned int i = (rgb*0x9E3779B1)%q->exact_size ;
+	while( q->exact_colors[i] != rgb )
+		if( ++i >= q->exact_size )
+			i = 0 ;
+	return q->exact_idx[i];
+}
+
+static void
+shrink_mc_box( ASMCQuantizer *q, ASMCBox *box )
+{
+	int lo[3] = {MC_SIDE, MC_SIDE, MC_SIDE}, hi[3] = {-1, -1, -1} ;
+	double sum[3] = {0., 0., 0.}, sum2 = 0. ;
+	int r, g, b ;
+
+	box->count = 0 ;
+	for( r = box->lo[0] ; r <= box->hi[0] ; ++r )
+		for( g = box->lo[1] ; g <= box->hi[1] ; ++g )
+		{
+			ASMCCell *cell = &(q->cells[(r<<(MC_BITS*2))|(g<<MC_BITS)]);
+			for( b = box->lo[2] ; b <= box->hi[2] ; ++b )
+				if( cell[b].count > 0 )
+				{
+					if( r < lo[0] ) lo[0] = r ;
+					if( r > hi[0] ) hi[0] = r ;
+					if( g < lo[1] ) lo[1] = g ;
+					if( g > hi[1] ) hi[1] = g ;
+					if( b < lo[2] ) lo[2] = b ;
+					if( b > hi[2] ) hi[2] = b ;
+					box->count += cell[b].count ;
+					sum[0] += cell[b].red ;
+					sum[1] += cell[b].green ;
+					sum[2] += cell[b].blue ;
+					/* cells are small enough to treat their colors as the same : */
+					sum2 += (cell[b].red*cell[b].red*MC_RED_WEIGHT + cell[b].green*cell[b].green*MC_GREEN_WEIGHT
+							 + cell[b].blue*cell[b].blue*MC_BLUE_WEIGHT)/cell[b].count ;
+				}
+		}
+	box->error = 0. ;
+	if( box->count > 0 )
+	{
+		memcpy( box->lo, lo, sizeof(lo));
+		memcpy( box->hi, hi, sizeof(hi));
+		box->error = sum2 - (sum[0]*sum[0]*MC_RED_WEIGHT + sum[1]*sum[1]*MC_GREEN_WEIGHT + sum[2]*sum[2]*MC_BLUE_WEIGHT)/box->count ;
+	}
+}
+
+/* splits box at the median of its longest weighted side, returns False
+ * if box is a single cell : */
+static Bool
+split_mc_box( ASMCQuantizer *q, ASMCBox *box, ASMCBox *new_box )
+{
+	static const int weights[3] = { MC_RED_WEIGHT, MC_GREEN_WEIGHT, MC_BLUE_WEIGHT };
+	double slices[MC_SIDE] ;
+	double half, sum ;
+	int axis = -1, longest = 0, i, r, g, b ;
+
+	for( i = 0 ; i < 3 ; ++i )
+		if( box->hi[i] > box->lo[i] && (box->hi[i] - box->lo[i])*weights[i] > longest )
+		{
+			longest = (box->hi[i] - box->lo[i])*weights[i] ;
+			axis = i ;
+		}
+	if( axis < 0 )
+		return False ;
+
+	memset( slices, 0x00, sizeof(slices));
+	for( r = box->lo[0] ; r <= box->hi[0] ; ++r )
+		for( g = box->lo[1] ; g <= box->hi[1] ; ++g )
+		{
+			ASMCCell *cell = &(q->cells[(r<<(MC_BITS*2))|(g<<MC_BITS)]);
+			for( b = box->lo[2] ; b <= box->hi[2] ; ++b )
+				slices[(axis==0)?r:((axis==1)?g:b)] += cell[b].count ;
+		}
+
+	half = box->count/2 ;
+	sum = 0 ;
+	for( i = box->lo[axis] ; i < box->hi[axis]-1 ; ++i )
+		if( (sum += slices[i]) >= half )
+			break;
+
+	*new_box = *box ;
+	box->hi[axis] = i ;
+	new_box->lo[axis] = i+1 ;
+	shrink_mc_box( q, box );
+	shrink_mc_box( q, new_box );
+	return True ;
+}
+
+static inline int
+mc_color_distance( ASColormapEntry *e, int red, int green, int blue )
+{
+	int dr = (int)e->red - red, dg = (int)e->green - green, db = (int)e->blue - blue ;
+	return dr*dr*MC_RED_WEIGHT + dg*dg*MC_GREEN_WEIGHT + db*db*MC_BLUE_WEIGHT ;
+}
+
+static int
+compare_mc_keys( const void *a, const void *b )
+{
+	return *(const int*)a - *(const int*)b ;
+}
+
+static void
+sort_mc_entries( ASMCQuantizer *q )
+{
+	unsigned int i ;
+	if( q->by_green == NULL )
+		q->by_green = safemalloc( q->count*sizeof(int));
+	/* green goes into the upper bits of the sort key : */
+	for( i = 0 ; i < q->count ; ++i )
+		q->by_green[i] = ((int)q->entries[i].green<<16)|i ;
+	qsort( q->by_green, q->count, sizeof(int), compare_mc_keys );
+	for( i = 0 ; i < q->count ; ++i )
+		q->by_green[i] &= 0x0000FFFF ;
+}
+
+/* starts from the colorcells with the same green and walks both ways
+ * until green alone puts colorcells further away than the best one : */
+static int
+find_mc_closest( ASMCQuantizer *q, int red, int green, int blue )
+{
+	ASColormapEntry *entries = q->entries ;
+	int *by_green = q->by_green ;
+	int lo = 0, hi = q->count, up, down ;
+	int best = by_green[0], best_dist = 0x7FFFFFFF ;
+
+	while( lo < hi )
+	{
+		int mid = (lo+hi)>>1 ;
+		if( (int)entries[by_green[mid]].green < green )
+			lo = mid+1 ;
+		else
+			hi = mid ;
+	}
+	up = lo ;
+	down = lo-1 ;
+	while( up < (int)q->count || down >= 0 )
+	{
+		if( up < (int)q->count )
+		{
+			ASColormapEntry *e = &(entries[by_green[up]]);
+			int dg = (int)e->green - green ;
+			if( dg*dg*MC_GREEN_WEIGHT >= best_dist )
+				up = q->count ;
+			else
+			{
+				int dist = mc_color_distance( e, red, green, blue );
+				if( dist < best_dist )
+				{
+					best_dist = dist ;
+					best = by_green[up] ;
+				}
+				++up ;
+			}
+		}
+		if( down >= 0 )
+		{
+			ASColormapEntry *e = &(entries[by_green[down]]);
+			int dg = green - (int)e->green ;
+			if( dg*dg*MC_GREEN_WEIGHT >= best_dist )
+				down = -1 ;
+			else
+			{
+				int dist = mc_color_distance( e, red, green, blue );
+				if( dist < best_dist )
+				{
+					best_dist = dist ;
+					best = by_green[down] ;
+				}
+				--down ;
+			}
+		}
+	}
+	return best ;
+}
+
+static inline int
+get_mc_index( ASMCQuantizer *q, int red, int green, int blue )
+{
+	int cell = INV_CELL(red,green,blue);
+	if( q->inverse[cell] == INV_EMPTY )
+		q->inverse[cell] = find_mc_closest( q, INV_CENTER(red), INV_CENTER(green), INV_CENTER(blue) );
+	return q->inverse[cell] ;
+}
+
+static void
+build_mc_colormap( ASMCQuantizer *q, unsigned int max_colors )
+{
+	ASMCBox *boxes = safecalloc( max_colors, sizeof(ASMCBox));
+	int boxes_num = 1 ;
+	double *sums = NULL ;
+	int i, k ;
+
+	boxes[0].hi[0] = boxes[0].hi[1] = boxes[0].hi[2] = MC_SIDE-1 ;
+	shrink_mc_box( q, &boxes[0] );
+	while( boxes_num < (int)max_colors )
+	{
+		int worst = -1 ;
+		for( i = 0 ; i < boxes_num ; ++i )
+			if( boxes[i].error > 0. && (worst < 0 || boxes[i].error > boxes[worst].error) )
+				worst = i ;
+		if( worst < 0 )
+			break;
+		if( !split_mc_box( q, &boxes[worst], &boxes[boxes_num] ) )
+			boxes[worst].error = 0. ;
+		else
+			++boxes_num ;
+	}
+
+	q->entries = safemalloc( boxes_num*sizeof(ASColormapEntry));
+	sums = safecalloc( boxes_num*4, sizeof(double));
+	for( i = 0 ; i < boxes_num ; ++i )
+	{
+		int r, g, b ;
+		double s[3] = {0., 0., 0.} ;
+		for( r = boxes[i].lo[0] ; r <= boxes[i].hi[0] ; ++r )
+			for( g = boxes[i].lo[1] ; g <= boxes[i].hi[1] ; ++g )
+			{
+				ASMCCell *cell = &(q->cells[(r<<(MC_BITS*2))|(g<<MC_BITS)]);
+				for( b = boxes[i].lo[2] ; b <= boxes[i].hi[2] ; ++b )
+				{
+					s[0] += cell[b].red ;
+					s[1] += cell[b].green ;
+					s[2] += cell[b].blue ;
+				}
+			}
+		q->entries[i].red   = (CARD8)(s[0]/boxes[i].count + 0.5) ;
+		q->entries[i].green = (CARD8)(s[1]/boxes[i].count + 0.5) ;
+		q->entries[i].blue  = (CARD8)(s[2]/boxes[i].count + 0.5) ;
+	}
+	q->count = boxes_num ;
+
+	/* one pass of k-means moves colorcells to the middle of the colors
+	 * that are actually closest to them : */
+	sort_mc_entries( q );
+	for( k = 0 ; k < MC_CELLS ; ++k )
+		if( q->cells[k].count > 0 )
+		{
+			ASMCCell *cell = &(q->cells[k]);
+			i = find_mc_closest( q, (int)(cell->red/cell->count), (int)(cell->green/cell->count), (int)(cell->blue/cell->count) );
+			sums[i*4] += cell->count ;
+			sums[i*4+1] += cell->red ;
+			sums[i*4+2] += cell->green ;
+			sums[i*4+3] += cell->blue ;
+		}
+	for( i = 0 ; i < boxes_num ; ++i )
+		if( sums[i*4] > 0 )
+		{
+			q->entries[i].red   = (CARD8)(sums[i*4+1]/sums[i*4] + 0.5) ;
+			q->entries[i].green = (CARD8)(sums[i*4+2]/sums[i*4] + 0.5) ;
+			q->entries[i].blue  = (CARD8)(sums[i*4+3]/sums[i*4] + 0.5) ;
+		}
+	sort_mc_entries( q );
+	free( sums );
+	free( boxes );
+}
+
+/* limits error carried over to neighbours, so that it does not smear
+ * sharp edges : */
+static inline int
+limit_mc_error( int err )
+{
+	if( err > 16 )
+		return (err > 48)?32:16+((err-16)>>1) ;
+	if( err < -16 )
+		return (err < -48)?-32:-16-((-16-err)>>1) ;
+	return err ;
+}
+
+static inline int
+clip_mc_color( int c )
+{
+	return (c < 0)?0:((c > 255)?255:c);
+}
+
+static void
+map_mc_row( ASMCQuantizer *q, int *dst, int width, int transp_idx, int *err_curr, int *err_next )
+{
+	int x ;
+	if( q->exact )
+	{
+		CARD32 last_rgb = 0xFFFFFFFF ;
+		int last_idx = 0 ;
+		for( x = 0 ; x < width ; ++x )
+			if( dst[x] < 0 )
+				dst[x] = transp_idx ;
+			else
+			{
+				if( (CARD32)dst[x] != last_rgb )
+				{
+					last_rgb = dst[x] ;
+					last_idx = get_mc_exact_index( q, last_rgb );
+				}
+				dst[x] = last_idx ;
+			}
+	}else if( err_curr == NULL )
+	{
+		for( x = 0 ; x < width ; ++x )
+			dst[x] = (dst[x] < 0)?transp_idx:get_mc_index( q, (dst[x]>>16)&0x00FF, (dst[x]>>8)&0x00FF, dst[x]&0x00FF );
+	}else
+	{	/* Floyd-Steinberg - errors are in 1/16th, with one extra
+		 * element on each side of the row : */
+		int *ec = err_curr+3, *en = err_next+3 ;
+		memset( err_next, 0x00, (width+2)*3*sizeof(int));
+		for( x = 0 ; x < width ; ++x, ec += 3, en += 3 )
+		{
+			int red, green, blue, idx, e ;
+			ASColormapEntry *pentry ;
+			if( dst[x] < 0 )
+			{
+				dst[x] = transp_idx ;
+				continue;
+			}
+			red   = clip_mc_color( ((dst[x]>>16)&0x00FF) + limit_mc_error( (ec[0]+8)>>4 ) );
+			green = clip_mc_color( ((dst[x]>>8 )&0x00FF) + limit_mc_error( (ec[1]+8)>>4 ) );
+			blue  = clip_mc_color( ( dst[x]     &0x00FF) + limit_mc_error( (ec[2]+8)>>4 ) );
+			dst[x] = idx = get_mc_index( q, red, green, blue );
+			pentry = &(q->entries[idx]);
+
+			e = red - pentry->red ;
+			ec[3] += e*7 ; en[-3] += e*3 ; en[0] += e*5 ; en[3] += e ;
+			e = green - pentry->green ;
+			ec[4] += e*7 ; en[-2] += e*3 ; en[1] += e*5 ; en[4] += e ;
+			e = blue - pentry->blue ;
+			ec[5] += e*7 ; en[-1] += e*3 ; en[2] += e*5 ; en[5] += e ;
+		}
+	}
+}
+
+static int *
+colormap_asimage_median_cut( ASImage *im, ASColormap *cmap, unsigned int max_colors, unsigned int dither, int opaque_threshold )
+{
+	int *mapped_im = NULL, *dst ;
+	ASImageDecoder *imdec ;
+	ASMCQuantizer q ;
+	CARD32 *a, *r, *g, *b ;
+	unsigned int y ;
+	int x, width = im->width ;
+	CARD32 last_rgb = 0xFFFFFFFF ;
+	START_TIME(started);
+
+	if((imdec = start_image_decoding( NULL /* default visual */ , im,
+		                              SCL_DO_ALL, 0, 0, im->width, 0, NULL)) == NULL )
+	{
+		LOCAL_DEBUG_OUT( "failed to start image decoding%s", "");
+		return NULL;
+	}
+	if( max_colors == 0 )
+		max_colors = 256 ;
+	else if( max_colors > INV_EMPTY )
+		max_colors = INV_EMPTY ;
+
+	memset( cmap, 0x00, sizeof(ASColormap));
+	memset( &q, 0x00, sizeof(q));
+	q.cells = safecalloc( MC_CELLS, sizeof(ASMCCell));
+	q.exact_size = MC_EXACT_HASH_SIZE(max_colors);
+	q.exact_colors = safemalloc( q.exact_size*sizeof(CARD32));
+	memset( q.exact_colors, 0xFF, q.exact_size*sizeof(CARD32));
+	q.exact_idx = safemalloc( q.exact_size*sizeof(int));
+	q.exact = True ;
+
+	/* pixels are stored as 0x00RRGGBB, or -1 when transparent, until
+	 * colormap is known : */
+	dst = mapped_im = safemalloc( im->width*im->height*sizeof(int));
+	a = imdec->buffer.alpha ;
+	r = imdec->buffer.red ;
+	g = imdec->buffer.green ;
+	b = imdec->buffer.blue ;
+	for( y = 0 ; y < im->height ; ++y, dst += width )
+	{
+		imdec->decode_image_scanline( imdec );
+		if( opaque_threshold > 0 && !cmap->has_opaque)
+		{
+			x = width ;
+			while( --x >= 0  )
+			  	if( a[x] != 0x00FF )
+				{
+					cmap->has_opaque = True;
+					break;
+				}
+		}
+		for( x = 0 ; x < width ; ++x )
+			if( (int)a[x] < opaque_threshold )
+				dst[x] = -1 ;
+			else
+			{
+				CARD32 rgb = ((r[x]&0x00FF)<<16)|((g[x]&0x00FF)<<8)|(b[x]&0x00FF) ;
+				ASMCCell *cell = &(q.cells[MC_CELL(r[x]&0x00FF,g[x]&0x00FF,b[x]&0x00FF)]);
+				dst[x] = rgb ;
+				++(cell->count);
+				cell->red += r[x]&0x00FF ;
+				cell->green += g[x]&0x00FF ;
+				cell->blue += b[x]&0x00FF ;
+				if( q.exact && rgb != last_rgb )
+				{
+					q.exact = add_mc_exact_color( &q, rgb, max_colors );
+					last_rgb = rgb ;
+				}
+			}
+	}
+	stop_image_decoding( &imdec );
+	SHOW_TIME("color histogram",started);
+
+	if( q.exact )
+	{
+		unsigned int i ;
+		q.count = q.exact_count ;
+		q.entries = safemalloc( (q.count > 0 ? q.count : 1)*sizeof(ASColormapEntry));
+		for( i = 0 ; i < q.exact_size ; ++i )
+			if( q.exact_colors[i] != 0xFFFFFFFF )
+			{
+				ASColormapEntry *pentry = &(q.entries[q.exact_idx[i]]);
+				pentry->red   = (q.exact_colors[i]>>16)&0x00FF ;
+				pentry->green = (q.exact_colors[i]>>8)&0x00FF ;
+				pentry->blue  = q.exact_colors[i]&0x00FF ;
+			}
+	}else
+	{
+		build_mc_colormap( &q, max_colors );
+		q.inverse = safemalloc( (0x01<<(INV_BITS*3))*sizeof(CARD16));
+		memset( q.inverse, 0xFF, (0x01<<(INV_BITS*3))*sizeof(CARD16));
+	}
+	free( q.cells );
+	SHOW_TIME("colormap calculation",started);
+
+	{
+		int *err_curr = NULL, *err_next = NULL ;
+		if( dither > 0 && !q.exact )
+		{
+			err_curr = safecalloc( (width+2)*3, sizeof(int));
+			err_next = safecalloc( (width+2)*3, sizeof(int));
+		}
+		for( dst = mapped_im, y = 0 ; y < im->height ; ++y, dst += width )
+		{
+			map_mc_row( &q, dst, width, q.count, err_curr, err_next );
+			if( err_curr )
+			{
+				int *tmp = err_curr ;
+				err_curr = err_next ;
+				err_next = tmp ;
+			}
+		}
+		if( err_curr )
+		{
+			free( err_curr );
+			free( err_next );
+		}
+	}
+	SHOW_TIME("mapping",started);
+
+	cmap->entries = q.entries ;
+	cmap->count = q.count ;
+	if( q.inverse )
+		free( q.inverse );
+	if( q.by_green )
+		free( q.by_green );
+	free( q.exact_colors );
+	free( q.exact_idx );
+	return mapped_im ;
+}
+
+int *
+colormap_asimage_ext( ASImage *im, ASColormap *cmap, unsigned int max_colors, unsigned int dither, int opaque_threshold, ASFlagType flags )
+{
+	if( get_flags( flags, ASCMAP_MEDIAN_CUT ) )
+	{
+		if( im == NULL || cmap == NULL || im->width == 0 )
+			return NULL;
+		return colormap_asimage_median_cut( im, cmap, max_colors, dither, opaque_threshold );
+	}
+	return colormap_asimage( im, cmap, max_colors, dither, opaque_threshold );
+}
@@ -34,7 +34,7 @@ extern "C" {
  *          ASColormap
  *
  * Functions :
- *          colormap_asimage(), destroy_colormap()
+ *          colormap_asimage(), colormap_asimage_ext(), destroy_colormap()
  *
  * Other libAfterImage modules :
  *          ascmap.h asfont.h asimage.h asvisual.h blender.h export.h
@@ -214,6 +214,42 @@ int *colormap_asimage( ASImage *im, ASColormap *cmap,
 					   int opaque_threshold );
 void destroy_colormap( ASColormap *cmap, Bool reusable );
 
+/****d* libAfterImage/ASCMAP_MEDIAN_CUT
+ * NAME
+ * ASCMAP_MEDIAN_CUT - flag selecting median cut quantization.
+ * SOURCE
+ */
+#define ASCMAP_MEDIAN_CUT		(0x01<<0)
+/*******/
+/****f* libAfterImage/colormap_asimage_ext()
+ * NAME
+ * colormap_asimage_ext()
+ * SYNOPSIS
+ * int *colormap_asimage_ext( ASImage *im, ASColormap *cmap,
+ *                            unsigned int max_colors, unsigned int dither,
+ *                            int opaque_threshold, ASFlagType flags );
+ * INPUTS
+ * flags            - ASCMAP_MEDIAN_CUT to use median cut quantization,
+ *                    0 to do the same as colormap_asimage().
+ * other            - same as for colormap_asimage().
+ * RETURN VALUE
+ * Same as for colormap_asimage().
+ * DESCRIPTION
+ * With ASCMAP_MEDIAN_CUT, if image has no more then max_colors distinct
+ * colors, they all make it into the colormap as they are. Otherwise
+ * colors are reduced to 15 bit, and the resulting color cube is
+ * recursively split at the median of the longest side of the box with
+ * the biggest error, until there are max_colors boxes. Average colors
+ * of the boxes, refined by one pass of k-means, make the colormap.
+ * Pixels are mapped to the closest colorcell, looked up through the
+ * lazily filled 18 bit inverse colormap. Any non-zero dither enables
+ * Floyd-Steinberg error diffusion, value itself is ignored.
+ * Resulting colormap has no internal hash.
+ *********/
+int *colormap_asimage_ext( ASImage *im, ASColormap *cmap,
+	                       unsigned int max_colors, unsigned int dither,
+						   int opaque_threshold, ASFlagType flags );
+
 #ifdef __cplusplus
 }
 #endif
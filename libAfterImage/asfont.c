@@ -45,6 +45,13 @@
 #include <ctype.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 #ifdef DO_CLOCKING
 #if TIME_WITH_SYS_TIME
 # include <sys/time.h>
@@ -100,6 +107,8 @@
 /*********************************************************************************/
 
 void asfont_destroy (ASHashableValue value, void *data);
+static void purge_font_text_cache( ASFont *font );
+static void destroy_text_cache( ASFontManager *fontman );
 
 ASFontManager *
 create_font_manager( Display *dpy, const char * font_path, ASFontManager *reusable_memory )
@@ -134,6 +143,7 @@ destroy_font_manager( ASFontManager *fontman, Bool reusable )
 	{
 
         destroy_ashash( &(fontman->fonts_hash) );
+		destroy_text_cache( fontman );
 
 #ifdef HAVE_FREETYPE
 		FT_Done_FreeType( fontman->ft_library);
@@ -151,6 +161,9 @@ destroy_font_manager( ASFontManager *fontman, Bool reusable )
 
 #ifdef HAVE_FREETYPE
 static int load_freetype_glyphs( ASFont *font );
+static Bool load_freetype_glyphs_from_cache( ASFont *font, const char *realfilename, int size );
+static void save_freetype_glyphs_to_cache( ASFont *font, const char *realfilename, int size );
+static void destroy_glyph_cache( struct ASGlyphCache *cache );
 #endif
 #ifndef X_DISPLAY_MISSING
 static int load_X11_glyphs( Display *dpy, ASFont *font, XFontStruct *xfs );
@@ -226,7 +239,11 @@ LOCAL_DEBUG_OUT( "face found : %p", face );
 					FT_Set_Pixel_Sizes( font->ft_face, size, size );
 					/* but let make our own cell width smaller then height */
 					font->space_size = size*2/3 ;
-	   				load_freetype_glyphs( font );
+					if( !load_freetype_glyphs_from_cache( font, realfilename, size ) )
+					{
+						load_freetype_glyphs( font );
+						save_freetype_glyphs_to_cache( font, realfilename, size );
+					}
 				}
 			}else if( verbose )
 				show_error( "FreeType library failed to load font \"%s\"", realfilename );
@@ -370,10 +387,11 @@ release_font( ASFont *font )
 static inline void
 free_glyph_data( register ASGlyph *asg )
 {
-    if( asg->pixmap )
+    if( asg->pixmap && !get_flags( asg->flags, ASGlyph_Mapped ) )
         free( asg->pixmap );
 /*fprintf( stderr, "\t\t%p\n", asg->pixmap );*/
     asg->pixmap = NULL ;
+	clear_flags( asg->flags, ASGlyph_Mapped );
 }
 
 static void
@@ -415,11 +433,17 @@ destroy_font( ASFont *font )
 #endif
         if( font->name )
 			free( font->name );
+		purge_font_text_cache( font );
         while( font->codemap )
 			destroy_glyph_range( &(font->codemap) );
         free_glyph_data( &(font->default_glyph) );
         if( font->locale_glyphs )
 			destroy_ashash( &(font->locale_glyphs) );
+#ifdef HAVE_FREETYPE
+		/* all the glyphs pointing into it are gone by now : */
+		if( font->glyph_cache )
+			destroy_glyph_cache( font->glyph_cache );
+#endif
         font->magic = 0 ;
 		free( font );
 	}
@@ -1266,7 +1290,448 @@ load_freetype_glyphs( ASFont *font )
 	load_glyph_freetype(NULL, NULL, 0, 0);
 	return max_ascend+max_descend;
 }
+
+/*************************************************************************/
+/* Persistent glyph cache :                                              */
+/*************************************************************************/
+/* Glyphs of the range preloaded by load_freetype_glyphs() are saved into 
+ * the file, that other processes opening the same font can map, instead 
+ * of rendering glyphs again. File has header, font file path, padded to 
+ * 4 bytes, array of glyph records and then RLE encoded glyph pixmaps. 
+ * Record 0 is the default glyph, followed by records for each char code 
+ * starting with ASGLYPH_CACHE_MIN_CHAR.
+ */
+#define ASGLYPH_CACHE_MAGIC		0x43474641	/* "AFGC" */
+#define ASGLYPH_CACHE_VERSION	1
+#define ASGLYPH_CACHE_MIN_CHAR	0x0021
+#define ASGLYPH_CACHE_MAX_CHAR	0x00FF
+#define ASGLYPH_CACHE_RECORDS	(ASGLYPH_CACHE_MAX_CHAR-ASGLYPH_CACHE_MIN_CHAR+2)
+/* hinting differs between FreeType versions : */
+#define ASGLYPH_CACHE_FT_VERSION	((FREETYPE_MAJOR<<16)|(FREETYPE_MINOR<<8)|FREETYPE_PATCH)
+#define ASGLYPH_CACHE_PADDED(len)	(((len)+3)&~3)
+/* sanity limit on glyph metrics read from the cache : */
+#define ASGLYPH_CACHE_MAX_DIM(size)	((size)*8+64)
+
+typedef struct ASGlyphCacheHeader
+{
+	CARD32 magic, version ;
+	CARD32 byte_order ;				/* 0x01020304 on the machine that wrote it */
+	CARD32 ft_version ;
+	CARD32 src_mtime_lo, src_mtime_hi ;
+	CARD32 src_size_lo, src_size_hi ;
+	CARD32 face_no, size, flags ;
+	CARD32 max_ascend, max_descend, max_height ;
+	CARD32 records_count ;
+	CARD32 path_len ;
+	CARD32 data_offset, data_size ;	/* glyph pixmaps */
+}ASGlyphCacheHeader;
+
+typedef struct ASGlyphCacheRecord
+{
+	CARD32 uc ;						/* unicode of the char code in writer's charset */
+	CARD32 font_gid ;
+	CARD32 pixmap_offset, pixmap_size ;	/* relative to data_offset */
+	short  width, height, lead, step, ascend, descend ;
+	CARD32 flags ;
+#define ASGC_CharPresent	(0x01<<0)	/* font has glyph for the char */
+#define ASGC_HasGlyph		(0x01<<1)	/* and glyph was loaded into the cache */
+}ASGlyphCacheRecord;
+
+typedef struct ASGlyphCache
+{
+	void 	*addr ;
+	size_t	 size ;
+	ASGlyphCacheRecord *records ;
+	CARD8 	*data ;
+}ASGlyphCache;
+
+static char *asfont_cache_dir = NULL ;
+
+static char *
+make_glyph_cache_filename( const char *realfilename, int face_no, int size, ASFlagType flags )
+{
+	char suffix[3*12+5+1] ;
+
+	sprintf( suffix, "-%d-%d-%lx.asgc", face_no, size, (unsigned long)flags );
+	return make_cache_file_name( asfont_cache_dir, realfilename, suffix );
+}
+
+/* size of the RLE stream produced by compress_glyph_pixmap(), or limit+1
+ * if the stream does not cover width*height pixels within limit bytes : */
+static unsigned int
+get_glyph_pixmap_size( const CARD8 *pixmap, int width, int height, unsigned int limit )
+{
+	int pixels = width*height ;
+	unsigned int i = 0 ;
+	do
+	{
+		CARD8 c ;
+		if( i >= limit )
+			return limit+1;
+		c = pixmap[i++] ;
+		pixels -= ((c&0x80) != 0)? 1 : (c&0x3F)+1 ;
+	}while( pixels > 0 );
+	return i;
+}
+
+static void
+destroy_glyph_cache( ASGlyphCache *cache )
+{
+#ifdef HAVE_SYS_MMAN_H
+	munmap( cache->addr, cache->size );
+#else
+	free( cache->addr );
+#endif
+	free( cache );
+}
+
+static Bool
+get_cached_glyph( ASGlyphCache *cache, unsigned long c, ASGlyph *asg )
+{
+	ASGlyphCacheRecord *rec ;
+	if( c < ASGLYPH_CACHE_MIN_CHAR || c > ASGLYPH_CACHE_MAX_CHAR )
+		return False;
+	rec = &(cache->records[c-ASGLYPH_CACHE_MIN_CHAR+1]);
+	if( !get_flags( rec->flags, ASGC_HasGlyph ) )
+		return False;
+	asg->font_gid = rec->font_gid ;
+	asg->width = rec->width ;
+	asg->height = rec->height ;
+	asg->lead = rec->lead ;
+	asg->step = rec->step ;
+	asg->ascend = rec->ascend ;
+	asg->descend = rec->descend ;
+	asg->pixmap = (rec->pixmap_size > 0)? cache->data + rec->pixmap_offset : NULL ;
+	set_flags( asg->flags, ASGlyph_Mapped );
+	return True;
+}
+
+/* Returns False if the cache has nothing to say about the char, so that 
+ * it has to be rendered the usual way : */
+static Bool
+get_cached_locale_glyph( ASFont *font, UNICODE_CHAR uc, ASGlyph **pasg )
+{
+	ASGlyphCacheRecord *records = font->glyph_cache->records ;
+	int i ;
+
+	for( i = 0x80-ASGLYPH_CACHE_MIN_CHAR+1 ; i < ASGLYPH_CACHE_RECORDS ; ++i )
+		if( records[i].uc == uc )
+		{
+			ASGlyph *asg = NULL ;
+			if( get_flags( records[i].flags, ASGC_HasGlyph ) )
+			{
+				asg = safecalloc( 1, sizeof(ASGlyph));
+				get_cached_glyph( font->glyph_cache, i+ASGLYPH_CACHE_MIN_CHAR-1, asg );
+			}else if( get_flags( records[i].flags, ASGC_CharPresent ) )
+				return False;
+			/* font metrics in the cache account for these glyphs already */
+			if( add_hash_item( font->locale_glyphs, AS_HASHABLE(uc), asg ) != ASH_Success && asg )
+			{
+				asglyph_destroy( 0, asg);
+				asg = NULL ;
+			}
+			*pasg = asg ;
+			return True;
+		}
+	return False;
+}
+
+static Bool
+glyph_cache_valid( const ASGlyphCacheHeader *hdr, size_t size, ASFont *font,
+				   const char *realfilename, int font_size, struct stat *src_st )
+{
+	const ASGlyphCacheRecord *records ;
+	size_t records_offset ;
+	int i ;
+
+	if( hdr->magic != ASGLYPH_CACHE_MAGIC || hdr->version != ASGLYPH_CACHE_VERSION ||
+		hdr->byte_order != 0x01020304 || hdr->ft_version != ASGLYPH_CACHE_FT_VERSION ||
+		hdr->src_mtime_lo != (CARD32)src_st->st_mtime ||
+		hdr->src_mtime_hi != (CARD32)(((unsigned long long)src_st->st_mtime)>>32) ||
+		hdr->src_size_lo != (CARD32)src_st->st_size ||
+		hdr->src_size_hi != (CARD32)(((unsigned long long)src_st->st_size)>>32) ||
+		hdr->face_no != (CARD32)font->ft_face->face_index || hdr->size != (CARD32)font_size ||
+		hdr->flags != get_flags( font->flags, ASF_Monospaced ) ||
+		hdr->records_count != ASGLYPH_CACHE_RECORDS ||
+		hdr->path_len != strlen( realfilename ) )
+		return False;
+
+	records_offset = sizeof(ASGlyphCacheHeader)+ASGLYPH_CACHE_PADDED(hdr->path_len);
+	if( records_offset + ASGLYPH_CACHE_RECORDS*sizeof(ASGlyphCacheRecord) > hdr->data_offset ||
+		hdr->data_offset > size || hdr->data_size > size - hdr->data_offset ||
+		memcmp( (CARD8*)hdr+sizeof(ASGlyphCacheHeader), realfilename, hdr->path_len ) != 0 )
+		return False;
+
+	if( hdr->max_ascend > ASGLYPH_CACHE_MAX_DIM(font_size) || hdr->max_descend > ASGLYPH_CACHE_MAX_DIM(font_size) ||
+		hdr->max_height != hdr->max_ascend+hdr->max_descend )
+		return False;
+
+	records = (ASGlyphCacheRecord*)((CARD8*)hdr+records_offset);
+	for( i = 0 ; i < ASGLYPH_CACHE_RECORDS ; ++i )
+	{
+		const ASGlyphCacheRecord *rec = &(records[i]);
+		if( rec->pixmap_offset > hdr->data_size ||
+			rec->pixmap_size > hdr->data_size - rec->pixmap_offset )
+			return False;
+		/* glyphs get rendered straight into the text scanlines, so they have to
+		 * fit into the font's metrics and their pixmaps have to decode in place : */
+		if( rec->width < 0 || rec->width > ASGLYPH_CACHE_MAX_DIM(font_size) ||
+			rec->height < 0 || rec->height != rec->ascend+rec->descend ||
+			rec->ascend > (int)hdr->max_ascend || rec->descend > (int)hdr->max_descend )
+			return False;
+		if( rec->pixmap_size > 0 &&
+			get_glyph_pixmap_size( (CARD8*)hdr + hdr->data_offset + rec->pixmap_offset,
+								   rec->width, rec->height, rec->pixmap_size ) != rec->pixmap_size )
+			return False;
+		/* 0x80-0xFF codes depend on the charset of the current locale : */
+		if( i > 0 && records[i].uc != CHAR2UNICODE(i+ASGLYPH_CACHE_MIN_CHAR-1) )
+			return False;
+	}
+	return True;
+}
+
+static Bool
+load_freetype_glyphs_from_cache( ASFont *font, const char *realfilename, int size )
+{
+	ASGlyphCacheHeader *hdr ;
+	ASGlyphCache *cache ;
+	ASGlyphRange **r ;
+	struct stat src_st, st ;
+	char *filename ;
+	CARD8 *data = NULL ;
+	unsigned long c ;
+	int fd ;
+
+	if( asfont_cache_dir == NULL || stat( realfilename, &src_st ) != 0 )
+		return False;
+
+	filename = make_glyph_cache_filename( realfilename, font->ft_face->face_index, size, get_flags( font->flags, ASF_Monospaced ) );
+	fd = open( filename, O_RDONLY );
+	free( filename );
+	if( fd < 0 )
+		return False;
+	if( fstat( fd, &st ) == 0 && st.st_size >= (off_t)sizeof(ASGlyphCacheHeader) )
+	{
+#ifdef HAVE_SYS_MMAN_H
+		/* file is never modified in place, so all processes share its pages : */
+		data = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+		if( data == MAP_FAILED )
+			data = NULL ;
+#else
+		if( (data = malloc( st.st_size )) != NULL )
+			if( read( fd, data, st.st_size ) != (ssize_t)st.st_size )
+			{
+				free( data );
+				data = NULL ;
+			}
+#endif
+	}
+	close( fd );
+	if( data == NULL )
+		return False;
+
+	hdr = (ASGlyphCacheHeader*)data ;
+	cache = safecalloc( 1, sizeof(ASGlyphCache));
+	cache->addr = data ;
+	cache->size = st.st_size ;
+	if( !glyph_cache_valid( hdr, st.st_size, font, realfilename, size, &src_st ) )
+	{
+		LOCAL_DEBUG_OUT( "glyph cache for \"%s\" is invalid", realfilename );
+		destroy_glyph_cache( cache );
+		return False;
+	}
+	cache->records = (ASGlyphCacheRecord*)(data+sizeof(ASGlyphCacheHeader)+ASGLYPH_CACHE_PADDED(hdr->path_len));
+	cache->data = data + hdr->data_offset ;
+	font->glyph_cache = cache ;
+
+	/* same ranges as split_freetype_glyph_range( 0x0021, 0x007F ) would produce,
+	 * glyphs themselves are copied out of the cache on first use : */
+	r = &(font->codemap);
+	for( c = ASGLYPH_CACHE_MIN_CHAR ; c <= 0x007F ; ++c )
+		if( get_flags( cache->records[c-ASGLYPH_CACHE_MIN_CHAR+1].flags, ASGC_CharPresent ) )
+		{
+			*r = safecalloc( 1, sizeof(ASGlyphRange));
+			(*r)->min_char = c ;
+			while( c <= 0x007F && get_flags( cache->records[c-ASGLYPH_CACHE_MIN_CHAR+1].flags, ASGC_CharPresent ) )
+				++c ;
+			(*r)->max_char = c ;
+			(*r)->glyphs = safecalloc( (c - (*r)->min_char) + 1, sizeof(ASGlyph));
+			r = &((*r)->above);
+		}
+	if( get_flags( cache->records[0].flags, ASGC_HasGlyph ) )
+	{
+		ASGlyphCacheRecord *rec = &(cache->records[0]);
+		ASGlyph *asg = &(font->default_glyph);
+		asg->font_gid = rec->font_gid ;
+		asg->width = rec->width ;
+		asg->height = rec->height ;
+		asg->lead = rec->lead ;
+		asg->step = rec->step ;
+		asg->ascend = rec->ascend ;
+		asg->descend = rec->descend ;
+		asg->pixmap = (rec->pixmap_size > 0)? cache->data + rec->pixmap_offset : NULL ;
+		set_flags( asg->flags, ASGlyph_Mapped );
+	}
+	font->locale_glyphs = create_ashash( 0, NULL, NULL, asglyph_destroy );
+	font->max_ascend = hdr->max_ascend ;
+	font->max_descend = hdr->max_descend ;
+	font->max_height = hdr->max_height ;
+	LOCAL_DEBUG_OUT( "font \"%s\" loaded from glyph cache", realfilename );
+	return True;
+}
+
+typedef struct ASGlyphCacheWriteData
+{
+	ASGlyphCacheHeader *hdr ;
+	const char *realfilename ;
+	ASGlyphCacheRecord *records ;
+	ASGlyph **glyphs ;
+}ASGlyphCacheWriteData;
+
+static Bool
+write_glyph_cache_file( const char *tmpname, void *data )
+{
+	ASGlyphCacheWriteData *wd = (ASGlyphCacheWriteData*)data ;
+	ASGlyphCacheHeader *hdr = wd->hdr ;
+	ASGlyphCacheRecord *records = wd->records ;
+	static const CARD8 pad[4] = {0, 0, 0, 0};
+	FILE *fp ;
+	Bool success ;
+	int i ;
+
+	if( (success = ((fp = fopen( tmpname, "wb" )) != NULL)) )
+	{
+		success = ( fwrite( hdr, sizeof(ASGlyphCacheHeader), 1, fp ) == 1 &&
+					fwrite( wd->realfilename, 1, hdr->path_len, fp ) == hdr->path_len &&
+					fwrite( pad, 1, ASGLYPH_CACHE_PADDED(hdr->path_len)-hdr->path_len, fp ) == ASGLYPH_CACHE_PADDED(hdr->path_len)-hdr->path_len &&
+					fwrite( records, sizeof(ASGlyphCacheRecord), ASGLYPH_CACHE_RECORDS, fp ) == ASGLYPH_CACHE_RECORDS );
+		for( i = 0 ; i < ASGLYPH_CACHE_RECORDS && success ; ++i )
+			if( records[i].pixmap_size > 0 )
+				success = ( fwrite( wd->glyphs[i]->pixmap, 1, records[i].pixmap_size, fp ) == records[i].pixmap_size );
+		if( fclose( fp ) != 0 )
+			success = False ;
+	}
+	return success;
+}
+
+static void
+save_freetype_glyphs_to_cache( ASFont *font, const char *realfilename, int size )
+{
+	ASGlyph *glyphs[ASGLYPH_CACHE_RECORDS] ;
+	ASGlyphCacheRecord *records ;
+	ASGlyphCacheHeader hdr ;
+	ASGlyphCacheWriteData wd ;
+	struct stat src_st ;
+	char *filename ;
+	CARD32 data_size = 0 ;
+	int i ;
+
+	if( asfont_cache_dir == NULL || stat( realfilename, &src_st ) != 0 )
+		return;
+
+	records = safecalloc( ASGLYPH_CACHE_RECORDS, sizeof(ASGlyphCacheRecord));
+	glyphs[0] = &(font->default_glyph) ;
+	records[0].flags = ASGC_CharPresent|ASGC_HasGlyph ;
+	for( i = 1 ; i < ASGLYPH_CACHE_RECORDS ; ++i )
+	{
+		unsigned long c = i+ASGLYPH_CACHE_MIN_CHAR-1 ;
+		UNICODE_CHAR uc = CHAR2UNICODE(c);
+		ASGlyph *asg = NULL ;
+
+		records[i].uc = uc ;
+		if( FT_Get_Char_Index( font->ft_face, uc ) != 0 )
+		{
+			set_flags( records[i].flags, ASGC_CharPresent );
+			if( c <= 0x007F )
+			{
+				ASGlyphRange *r ;
+				for( r = font->codemap ; r != NULL ; r = r->above )
+					if( r->min_char <= c && r->max_char > c )
+					{
+						asg = &(r->glyphs[c-r->min_char]) ;
+						break;
+					}
+			}else
+			{
+				ASHashData hdata = {0} ;
+				if( get_hash_item( font->locale_glyphs, AS_HASHABLE(uc), &hdata.vptr ) == ASH_Success )
+					asg = hdata.vptr ;
+			}
+			if( asg )
+				set_flags( records[i].flags, ASGC_HasGlyph );
+		}
+		glyphs[i] = asg ;
+	}
+	for( i = 0 ; i < ASGLYPH_CACHE_RECORDS ; ++i )
+		if( glyphs[i] )
+		{
+			ASGlyph *asg = glyphs[i] ;
+			records[i].font_gid = asg->font_gid ;
+			records[i].width = asg->width ;
+			records[i].height = asg->height ;
+			records[i].lead = asg->lead ;
+			records[i].step = asg->step ;
+			records[i].ascend = asg->ascend ;
+			records[i].descend = asg->descend ;
+			if( asg->pixmap )
+			{
+				records[i].pixmap_offset = data_size ;
+				records[i].pixmap_size = get_glyph_pixmap_size( asg->pixmap, asg->width, asg->height, 0xFFFFFFFF );
+				data_size += records[i].pixmap_size ;
+			}
+		}
+
+	memset( &hdr, 0x00, sizeof(hdr));
+	hdr.magic = ASGLYPH_CACHE_MAGIC ;
+	hdr.version = ASGLYPH_CACHE_VERSION ;
+	hdr.byte_order = 0x01020304 ;
+	hdr.ft_version = ASGLYPH_CACHE_FT_VERSION ;
+	hdr.src_mtime_lo = (CARD32)src_st.st_mtime ;
+	hdr.src_mtime_hi = (CARD32)(((unsigned long long)src_st.st_mtime)>>32) ;
+	hdr.src_size_lo = (CARD32)src_st.st_size ;
+	hdr.src_size_hi = (CARD32)(((unsigned long long)src_st.st_size)>>32) ;
+	hdr.face_no = font->ft_face->face_index ;
+	hdr.size = size ;
+	hdr.flags = get_flags( font->flags, ASF_Monospaced );
+	hdr.max_ascend = font->max_ascend ;
+	hdr.max_descend = font->max_descend ;
+	hdr.max_height = font->max_height ;
+	hdr.records_count = ASGLYPH_CACHE_RECORDS ;
+	hdr.path_len = strlen( realfilename );
+	hdr.data_offset = sizeof(hdr) + ASGLYPH_CACHE_PADDED(hdr.path_len) + ASGLYPH_CACHE_RECORDS*sizeof(ASGlyphCacheRecord);
+	hdr.data_size = data_size ;
+
+	filename = make_glyph_cache_filename( realfilename, hdr.face_no, size, hdr.flags );
+	wd.hdr = &hdr ;
+	wd.realfilename = realfilename ;
+	wd.records = records ;
+	wd.glyphs = glyphs ;
+	if( !write_cache_file( filename, write_glyph_cache_file, &wd ) )
+	{
+		LOCAL_DEBUG_OUT( "failed to save glyphs of \"%s\" to cache \"%s\"", realfilename, filename );
+	}
+	free( filename );
+	free( records );
+}
+#endif
+
+void
+set_asfont_cache_dir( const char *dir )
+{
+#ifdef HAVE_FREETYPE
+	struct stat stbuf;
+	if( asfont_cache_dir && dir && !strcmp( asfont_cache_dir, dir ) )
+		return;
+
+	if( asfont_cache_dir )
+	{
+		free( asfont_cache_dir );
+		asfont_cache_dir = NULL;
+	}
+	if( dir && stat( dir, &stbuf ) == 0 && S_ISDIR( stbuf.st_mode ) )
+		asfont_cache_dir = mystrdup( dir );
 #endif
+}
 
 static inline ASGlyph *get_unicode_glyph( const UNICODE_CHAR uc, ASFont *font )
 {
@@ -1284,13 +1749,20 @@ LOCAL_DEBUG_OUT( "looking for glyph for char %lu (%p) if range (%ld,%ld)", uc, a
 LOCAL_DEBUG_OUT( "Found glyph for char %lu (%p)", uc, asg );
 				if( asg->width > 0 && asg->pixmap != NULL )
 					return asg;
+#ifdef HAVE_FREETYPE
+				if( font->glyph_cache != NULL && asg->pixmap == NULL &&
+					get_cached_glyph( font->glyph_cache, uc, asg ) &&
+					asg->width > 0 && asg->pixmap != NULL )
+					return asg;
+#endif
 				break;
 			}
 	}
 	if( get_hash_item( font->locale_glyphs, AS_HASHABLE(uc), &hdata.vptr ) != ASH_Success )
 	{
 #ifdef HAVE_FREETYPE
-		asg = load_freetype_locale_glyph( font, uc );
+		if( font->glyph_cache == NULL || !get_cached_locale_glyph( font, uc, &asg ) )
+			asg = load_freetype_locale_glyph( font, uc );
 LOCAL_DEBUG_OUT( "glyph for char %lu  loaded as %p", uc, asg );
 #endif
 	}else
@@ -1626,6 +2098,296 @@ get_text_glyph_map (const char *text, ASFont *font, ASGlyphMap *map, ASTextAttri
 	return True;
 }
 
+/*********************************************************************************/
+/* text cache :                                                                  */
+/*********************************************************************************/
+/* Everything that affects the layout goes into the key, colors only 
+ * matter for the image : */
+typedef struct ASTextCacheKey
+{
+	ASFont 		*font ;
+	ASFlagType	 rendition_flags ;
+	int 		 type, char_type ;
+	unsigned int tab_size, origin, tab_stops_num ;
+	int			 spacing_x, spacing_y ;
+	int			 max_ascend, max_height ;	/* changes as new glyphs are loaded */
+	int 		 length ;
+	int 		 text_size ;	/* tab stops and text bytes follow */
+}ASTextCacheKey;
+
+typedef struct ASTextCacheEntry
+{
+	struct ASTextCacheEntry *prev, *next ;	/* LRU list */
+	CARD32 		 hash ;
+	size_t 		 key_size ;
+	CARD8 		*key ;
+	size_t 		 size ;				/* memory used by the entry */
+
+	Bool 		 size_valid ;
+	unsigned int width, height ;	/* get_text_size_internal() results */
+	ASGlyphMap	 map ;				/* glyphs_num is 0 unless laid out */
+	ASImage 	*im ;
+	ARGB32		 im_fore_color ;
+}ASTextCacheEntry;
+
+static ASHashKey
+text_cache_hash_value( ASHashableValue value, ASHashKey hash_size )
+{
+	return ((ASTextCacheEntry*)value)->hash % hash_size ;
+}
+
+static long
+text_cache_compare( ASHashableValue value1, ASHashableValue value2 )
+{
+	ASTextCacheEntry *e1 = (ASTextCacheEntry*)value1 ;
+	ASTextCacheEntry *e2 = (ASTextCacheEntry*)value2 ;
+	if( e1->hash != e2->hash )
+		return (e1->hash > e2->hash)? 1 : -1;
+	if( e1->key_size != e2->key_size )
+		return (e1->key_size > e2->key_size)? 1 : -1;
+	return memcmp( e1->key, e2->key, e1->key_size );
+}
+
+static void
+destroy_text_cache_entry( ASTextCacheEntry *entry )
+{
+	if( entry->im )
+		destroy_asimage( &(entry->im) );
+	free_glyph_map( &(entry->map), True );
+	free( entry->key );
+	free( entry );
+}
+
+static void
+text_cache_destroy( ASHashableValue value, void *data )
+{
+	destroy_text_cache_entry( (ASTextCacheEntry*)value );
+}
+
+/* number of bytes of the text that would be looked at : */
+static int
+get_text_key_size( const char *text, ASCharType char_type, int length )
+{
+	int count = 0 ;
+	if( char_type == ASCT_Unicode )
+	{
+		const UNICODE_CHAR *uc = (const UNICODE_CHAR*)text ;
+		while( (length <= 0 || count < length) && uc[count] != 0 )
+			++count ;
+		return count*sizeof(UNICODE_CHAR);
+	}else if( char_type == ASCT_UTF8 && length > 0 )
+	{
+		int k ;
+		for( k = 0 ; k < length && text[count] != '\0' ; ++k )
+			count += UTF8_CHAR_SIZE(text[count]);
+		return count;
+	}
+	while( (length <= 0 || count < length) && text[count] != '\0' )
+		++count ;
+	return count;
+}
+
+static void
+unlink_text_cache_entry( ASFontManager *fontman, ASTextCacheEntry *entry )
+{
+	if( entry->prev )
+		entry->prev->next = entry->next ;
+	else
+		fontman->text_cache_head = entry->next ;
+	if( entry->next )
+		entry->next->prev = entry->prev ;
+	else
+		fontman->text_cache_tail = entry->prev ;
+	entry->prev = entry->next = NULL ;
+}
+
+static void
+remove_text_cache_entry( ASFontManager *fontman, ASTextCacheEntry *entry )
+{
+	unlink_text_cache_entry( fontman, entry );
+	fontman->text_cache_used -= entry->size ;
+	--(fontman->text_cache_count);
+	if( remove_hash_item( fontman->text_cache, AS_HASHABLE(entry), NULL, True ) != ASH_Success )
+		destroy_text_cache_entry( entry );
+}
+
+static void
+evict_cached_text( ASFontManager *fontman, size_t budget )
+{
+	while( fontman->text_cache_tail != NULL && fontman->text_cache_used > budget )
+	{
+		remove_text_cache_entry( fontman, fontman->text_cache_tail );
+		++(fontman->text_cache_evictions);
+	}
+}
+
+/* Returns existing or newly added entry for the text, or NULL if text 
+ * is not to be cached. Entry is only valid until text_cache_entry_updated()
+ * is called : */
+static ASTextCacheEntry *
+get_text_cache_entry( const char *text, ASFont *font, ASTextAttributes *attr, int length )
+{
+	ASFontManager *fontman = font? font->fontman : NULL ;
+	ASTextCacheEntry *entry ;
+	ASTextCacheKey key ;
+	ASHashData hdata = {0} ;
+	CARD32 hash = 0x811C9DC5 ;
+	size_t tabs_size, i ;
+
+	if( fontman == NULL || fontman->text_cache_budget == 0 || text == NULL || attr->width != 0 )
+		return NULL;
+
+	memset( &key, 0x00, sizeof(key));
+	key.font = font ;
+	key.rendition_flags = attr->rendition_flags ;
+	key.type = attr->type ;
+	key.char_type = attr->char_type ;
+	key.tab_size = attr->tab_size ;
+	key.origin = attr->origin ;
+	key.tab_stops_num = attr->tab_stops? attr->tab_stops_num : 0 ;
+	key.spacing_x = font->spacing_x ;
+	key.spacing_y = font->spacing_y ;
+	key.max_ascend = font->max_ascend ;
+	key.max_height = font->max_height ;
+	key.length = length ;
+	key.text_size = get_text_key_size( text, attr->char_type, length );
+	tabs_size = key.tab_stops_num*sizeof(unsigned int);
+
+	entry = safecalloc( 1, sizeof(ASTextCacheEntry));
+	entry->key_size = sizeof(key)+tabs_size+key.text_size ;
+	entry->key = safemalloc( entry->key_size );
+	memcpy( entry->key, &key, sizeof(key));
+	if( tabs_size > 0 )
+		memcpy( entry->key+sizeof(key), attr->tab_stops, tabs_size );
+	memcpy( entry->key+sizeof(key)+tabs_size, text, key.text_size );
+	for( i = 0 ; i < entry->key_size ; ++i )
+		hash = (hash ^ entry->key[i]) * 0x01000193 ;
+	entry->hash = hash ;
+
+	if( fontman->text_cache == NULL )
+		fontman->text_cache = create_ashash( 0, text_cache_hash_value, text_cache_compare, text_cache_destroy );
+	if( get_hash_item( fontman->text_cache, AS_HASHABLE(entry), &hdata.vptr ) == ASH_Success )
+	{
+		destroy_text_cache_entry( entry );
+		entry = hdata.vptr ;
+		unlink_text_cache_entry( fontman, entry );
+	}else
+	{
+		if( add_hash_item( fontman->text_cache, AS_HASHABLE(entry), entry ) != ASH_Success )
+		{
+			destroy_text_cache_entry( entry );
+			return NULL;
+		}
+		entry->size = sizeof(ASTextCacheEntry)+entry->key_size ;
+		fontman->text_cache_used += entry->size ;
+		++(fontman->text_cache_count);
+	}
+	/* most recently used goes first : */
+	entry->next = fontman->text_cache_head ;
+	if( fontman->text_cache_head )
+		fontman->text_cache_head->prev = entry ;
+	else
+		fontman->text_cache_tail = entry ;
+	fontman->text_cache_head = entry ;
+	return entry;
+}
+
+/* call after adding results to the entry - that may evict it */
+static void
+text_cache_entry_updated( ASFont *font, ASTextCacheEntry *entry )
+{
+	ASFontManager *fontman = font->fontman ;
+	size_t size = sizeof(ASTextCacheEntry)+entry->key_size ;
+
+	if( entry->map.glyphs )
+		size += entry->map.glyphs_num*(sizeof(ASGlyph*)+sizeof(short)) ;
+	if( entry->im )
+		size += asimage_memory_size( entry->im );
+	fontman->text_cache_used += size - entry->size ;
+	entry->size = size ;
+	evict_cached_text( fontman, fontman->text_cache_budget );
+}
+
+static void
+purge_font_text_cache( ASFont *font )
+{
+	ASFontManager *fontman = font->fontman ;
+	if( fontman && fontman->text_cache_count > 0 )
+	{
+		ASTextCacheEntry *entry = fontman->text_cache_head ;
+		while( entry )
+		{
+			ASTextCacheEntry *next = entry->next ;
+			if( ((ASTextCacheKey*)entry->key)->font == font )
+				remove_text_cache_entry( fontman, entry );
+			entry = next ;
+		}
+	}
+}
+
+static void
+destroy_text_cache( ASFontManager *fontman )
+{
+	evict_cached_text( fontman, 0 );
+	if( fontman->text_cache )
+		destroy_ashash( &(fontman->text_cache) );
+}
+
+/* Glyph map is shared with the cache if entry is not NULL, and must not be 
+ * freed then : */
+static Bool
+get_cached_text_glyph_map( const char *text, ASFont *font, ASGlyphMap *map, ASTextAttributes *attr, int length, ASTextCacheEntry *entry )
+{
+	if( entry != NULL )
+	{
+		if( entry->map.glyphs == NULL )
+		{
+			if( !get_text_glyph_map( text, font, &(entry->map), attr, length) )
+				return False;
+		}
+		*map = entry->map ;
+		return True;
+	}
+	return get_text_glyph_map( text, font, map, attr, length);
+}
+
+size_t
+set_asfont_text_cache_budget( ASFontManager *fontman, size_t budget )
+{
+	size_t old_budget = 0 ;
+	if( fontman )
+	{
+		old_budget = fontman->text_cache_budget ;
+		fontman->text_cache_budget = budget ;
+		evict_cached_text( fontman, budget );
+	}
+	return old_budget;
+}
+
+void
+flush_asfont_text_cache( ASFontManager *fontman )
+{
+	if( fontman )
+		evict_cached_text( fontman, 0 );
+}
+
+void
+get_asfont_text_cache_stats( ASFontManager *fontman, ASTextCacheStats *stats )
+{
+	if( stats == NULL )
+		return;
+	memset( stats, 0x00, sizeof(ASTextCacheStats));
+	if( fontman )
+	{
+		stats->budget = fontman->text_cache_budget ;
+		stats->used = fontman->text_cache_used ;
+		stats->cached_count = fontman->text_cache_count ;
+		stats->hits = fontman->text_cache_hits ;
+		stats->misses = fontman->text_cache_misses ;
+		stats->evictions = fontman->text_cache_evictions ;
+	}
+}
+
 #define GET_TEXT_SIZE_LOOP(getglyph,incr,len) \
 	do{ Bool terminated = True; ++i ;\
 		if( len == 0 || i < len )	\
@@ -1668,11 +2430,26 @@ get_text_size_internal( const char *src_text, ASFont *font, ASTextAttributes *at
 	int space_size = 0;
 	int offset_3d_x = 0, offset_3d_y = 0 ;
 	int last_gid = 0 ;
+	ASTextCacheEntry *entry = NULL ;
 
 
 	apply_text_3D_type( attr->type, &offset_3d_x, &offset_3d_y );
 	if( src_text == NULL || font == NULL )
 		return False;
+
+	if( x_positions == NULL && (entry = get_text_cache_entry( src_text, font, attr, length )) != NULL )
+	{
+		if( entry->size_valid )
+		{
+			++(font->fontman->text_cache_hits);
+			if( width )
+				*width = entry->width;
+			if( height )
+				*height = entry->height;
+			return True ;
+		}
+		++(font->fontman->text_cache_misses);
+	}
 	
 	offset_3d_x += font->spacing_x ;
 	offset_3d_y += font->spacing_y ;
@@ -1726,6 +2503,13 @@ get_text_size_internal( const char *src_text, ASFont *font, ASTextAttributes *at
 		*width = w;
 	if( height )
 		*height = h;
+	if( entry )
+	{
+		entry->width = w ;
+		entry->height = h ;
+		entry->size_valid = True ;
+		text_cache_entry_updated( font, entry );
+	}
 	return True ;
 }
 
@@ -1867,6 +2651,7 @@ draw_text_internal( const char *text, ASFont *font, ASTextAttributes *attr, int
 	int offset_3d_x = 0, offset_3d_y = 0  ;
 	CARD32 back_color = 0 ;
 	CARD32 alpha_7 = 0x007F, alpha_9 = 0x009F, alpha_A = 0x00AF, alpha_C = 0x00CF, alpha_F = 0x00FF, alpha_E = 0x00EF;
+	ASTextCacheEntry *entry ;
 	START_TIME(started);	   
 
 	// Perform line breaks if a fixed width is specified
@@ -1896,7 +2681,19 @@ draw_text_internal( const char *text, ASFont *font, ASTextAttributes *attr, int
 	}	    
 
 LOCAL_DEBUG_CALLER_OUT( "text = \"%s\", font = %p, compression = %d", text, font, compression );
-	if( !get_text_glyph_map( text, font, &map, attr, length) )
+	if( (entry = get_text_cache_entry( text, font, attr, length )) != NULL )
+	{
+		if( entry->im != NULL && entry->im_fore_color == attr->fore_color )
+		{
+			++(font->fontman->text_cache_hits);
+			im = clone_asimage( entry->im, 0xFFFFFFFF );
+			if( compression == 0 )
+				set_flags( im->flags, ASIM_NO_COMPRESSION );
+			return im;
+		}
+		++(font->fontman->text_cache_misses);
+	}
+	if( !get_cached_text_glyph_map( text, font, &map, attr, length, entry ) )
 		return NULL;
 	
 	if( map.width <= 0 ) 
@@ -2097,7 +2894,15 @@ LOCAL_DEBUG_OUT( "line_height is %d, space_size is %d, base_line is %d", line_he
 			}
 		}
 	}while( map.glyphs[i] != GLYPH_EOT );
-    free_glyph_map( &map, True );
+	if( entry )
+	{
+		if( entry->im )
+			destroy_asimage( &(entry->im) );
+		entry->im = clone_asimage( im, 0xFFFFFFFF );
+		entry->im_fore_color = attr->fore_color ;
+		text_cache_entry_updated( font, entry );
+	}else
+	    free_glyph_map( &map, True );
 	free( memory );
 	free( scanlines );
 	if( rgb_memory ) 
@@ -2256,8 +3061,9 @@ draw_text_xrender(  ASVisual *asv, const void *text, ASFont *font, ASTextAttribu
 	int i ;
 	int missing_glyphs = 0 ;
 	int glyphs_bmap_size = 0, max_height = 0 ;
+	ASTextCacheEntry *entry = get_text_cache_entry( text, font, attr, length );
 
-	if( !get_text_glyph_map( text, font, &map, attr, length) )
+	if( !get_cached_text_glyph_map( text, font, &map, attr, length, entry ) )
 		return;
 	
 	if( map.width == 0 ) 
@@ -2347,7 +3153,10 @@ draw_text_xrender(  ASVisual *asv, const void *text, ASFont *font, ASTextAttribu
 	}	 
 	
 	/* xrender code ends here : */
-	free_glyph_map( &map, True );	  
+	if( entry )
+		text_cache_entry_updated( font, entry );
+	else
+		free_glyph_map( &map, True );	  
 }
 
 #endif
@@ -46,6 +46,7 @@ extern "C" {
  *
  * Functions :
  *          create_font_manager(), destroy_font_manager(),
+ *          set_asfont_cache_dir(), set_asfont_text_cache_budget(),
  *          open_freetype_font(), open_X11_font(), get_asfont(),
  *          destroy_font(), print_asfont(), print_asglyph(),
  *          draw_text(),
@@ -120,6 +121,9 @@ typedef struct ASGlyph
 									 */
 	unsigned int font_gid ;		    /* index of the glyph inside the font( TTF only ) */
 	long 		 xrender_gid ;	    /* Used only with XRender  - gid of the glyph in GlyphSet */	    
+	ASFlagType   flags ;
+#define ASGlyph_Mapped		(0x01<<0)	/* pixmap belongs to the mmapped glyph
+										 * cache file and must not be freed */
 }ASGlyph;
 /*************/
 
@@ -201,6 +205,8 @@ typedef struct ASFont
 #else
 	CARD32         *pad;
 #endif
+	struct ASGlyphCache *glyph_cache; /* mmapped file with glyphs rendered 
+									   * by another process, if any */
 	
 	unsigned long	xrender_glyphset ;  /* GlyphSet is the actuall datatype, 
 										 * but for easier compilation - 
@@ -238,9 +244,34 @@ typedef struct ASFontManager
 #else
 	void       *pad ;
 #endif
+	/* text recently measured or drawn with fonts of this manager, kept
+	 * while under text_cache_budget (see set_asfont_text_cache_budget()): */
+	ASHashTable *text_cache ;
+	struct ASTextCacheEntry *text_cache_head, *text_cache_tail ; /* most/least recently used */
+	size_t		 text_cache_budget, text_cache_used ;
+	unsigned int text_cache_count ;
+	unsigned long text_cache_hits, text_cache_misses, text_cache_evictions ;
 }ASFontManager;
 /*************/
 
+/****s* libAfterImage/ASTextCacheStats
+ * NAME
+ * ASTextCacheStats - snapshot of ASFontManager's text cache counters.
+ * DESCRIPTION
+ * hits and misses count get_text_size() and draw_text() family calls
+ * that were or were not served from the cache, evictions counts entries
+ * dropped to stay within the budget.
+ * SOURCE
+ */
+typedef struct ASTextCacheStats
+{
+	size_t        budget ;       /* bytes allowed for cached text */
+	size_t        used ;         /* bytes used by cached text */
+	unsigned int  cached_count ; /* number of cached strings */
+	unsigned long hits, misses, evictions ;
+}ASTextCacheStats;
+/*************/
+
 /****d* libAfterImage/ASText3DType
  * NAME
  * ASText3DType - Available types of 3D text to be drawn.
@@ -340,6 +371,61 @@ typedef struct ASTextAttributes
 struct ASFontManager *create_font_manager( Display *dpy, const char * font_path, struct ASFontManager *reusable_memory );
 void    destroy_font_manager( struct ASFontManager *fontman, Bool reusable );
 
+/****f* libAfterImage/asfont/set_asfont_cache_dir()
+ * NAME
+ * set_asfont_cache_dir() - enables persistent cache of rendered glyphs.
+ * SYNOPSIS
+ * void set_asfont_cache_dir( const char *dir );
+ * INPUTS
+ * dir         - existing directory to keep glyph cache files in, or NULL
+ *               to disable the cache.
+ * DESCRIPTION
+ * Once cache directory is set, glyphs of 0x21-0xFF range rendered by
+ * open_freetype_font() are written into the cache file, keyed on font
+ * file's path, face, size, monospacing and FreeType version. Any
+ * process opening the same font later on, while font file's
+ * modification time and size remain the same, maps that file instead
+ * of rendering glyphs, and only copies glyph's geometry out of it when
+ * glyph is used for the first time. Glyph's pixmaps are used directly
+ * from the mapping, thus shared between all processes.
+ *********/
+void set_asfont_cache_dir( const char *dir );
+
+/****f* libAfterImage/asfont/set_asfont_text_cache_budget()
+ * NAME
+ * set_asfont_text_cache_budget() sets amount of memory that could be
+ * used to keep layout and rendered images of recently used text.
+ * NAME
+ * flush_asfont_text_cache() drops all the cached text.
+ * NAME
+ * get_asfont_text_cache_stats() reports cache counters.
+ * SYNOPSIS
+ * size_t set_asfont_text_cache_budget( ASFontManager *fontman,
+ *                                      size_t budget );
+ * void flush_asfont_text_cache( ASFontManager *fontman );
+ * void get_asfont_text_cache_stats( ASFontManager *fontman,
+ *                                   ASTextCacheStats *stats );
+ * INPUTS
+ * fontman - pointer to valid ASFontManager object.
+ * budget  - number of bytes, 0 disables caching.
+ * stats   - pointer to the structure to receive counters.
+ * RETURN VALUE
+ * set_asfont_text_cache_budget() returns previous budget.
+ * DESCRIPTION
+ * With non-zero budget, size calculated by get_text_size() family of
+ * functions, as well as glyph map and image produced by draw_text()
+ * family, are remembered for each string, keyed on the text, font and
+ * text attributes. Same string measured or drawn again is then
+ * served from the cache - draw functions return a clone of the cached
+ * image, sharing its scanlines. Least recently used strings are dropped
+ * whenever memory used by cached data exceeds the budget. Text drawn
+ * with fixed width in ASTextAttributes, and get_fancy_text_size() calls
+ * requesting x_positions, bypass the cache.
+ *********/
+size_t set_asfont_text_cache_budget( struct ASFontManager *fontman, size_t budget );
+void   flush_asfont_text_cache( struct ASFontManager *fontman );
+void   get_asfont_text_cache_stats( struct ASFontManager *fontman, ASTextCacheStats *stats );
+
 /****f* libAfterImage/asfont/open_freetype_font()
  * NAME
  * open_freetype_font()
@@ -371,7 +457,9 @@ void    destroy_font_manager( struct ASFontManager *fontman, Bool reusable );
  * library. If requested face is not available in the font - face 0 will
  * be used.
  * On success all the font's glyphs will be rendered and cached, and
- * needed font geometry info collected.
+ * needed font geometry info collected. If glyph cache file for the font
+ * is available ( see set_asfont_cache_dir() ), glyphs are taken from it
+ * on first use instead.
  * When FreeType Library is not available that function does nothing.
  *********/
 /****f* libAfterImage/asfont/open_X11_font()
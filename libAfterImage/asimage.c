@@ -66,6 +66,7 @@
 #include "blender.h"
 #include "asimage.h"
 #include "ascmap.h"
+#include "transform.h"
 
 static ASVisual __as_dummy_asvisual = {0};
 static ASVisual *__as_default_asvisual = &__as_dummy_asvisual ;
@@ -118,6 +119,47 @@ Bool asimage_use_mmx = True;
 Bool asimage_use_mmx = False;
 #endif
 
+static CARD32 __as_cpu_features = 0 ;
+static CARD32 __as_cpu_features_mask = ASIM_CPU_ALL ;
+static Bool   __as_cpu_features_detected = False ;
+
+CARD32
+get_asimage_cpu_features()
+{
+	if( !__as_cpu_features_detected )
+	{
+		CARD32 features = 0 ;
+#ifdef ASIM_X86_SIMD_DISPATCH
+		__builtin_cpu_init();
+		if( __builtin_cpu_supports("mmx") )
+			set_flags( features, ASIM_CPU_MMX );
+		if( __builtin_cpu_supports("sse2") )
+			set_flags( features, ASIM_CPU_SSE2 );
+		if( __builtin_cpu_supports("avx2") )
+			set_flags( features, ASIM_CPU_AVX2 );
+#endif
+		__as_cpu_features = features & __as_cpu_features_mask ;
+		__as_cpu_features_detected = True ;
+#ifdef HAVE_MMX
+		asimage_use_mmx = get_flags( __as_cpu_features, ASIM_CPU_MMX )?True:False ;
+#endif
+		LOCAL_DEBUG_OUT( "cpu features = 0x%lX", (unsigned long)__as_cpu_features );
+		select_blend_scanlines_impl( __as_cpu_features );
+		select_asstorage_impl( __as_cpu_features );
+		select_gradient_impl( __as_cpu_features );
+		select_asvisual_impl( __as_cpu_features );
+	}
+	return __as_cpu_features;
+}
+
+CARD32
+set_asimage_cpu_features_mask( CARD32 mask )
+{
+	__as_cpu_features_mask = mask ;
+	__as_cpu_features_detected = False ;
+	return get_asimage_cpu_features();
+}
+
 /* *********************   ASImage  ************************************/
 void
 asimage_init (ASImage * im, Bool free_resources)
@@ -214,7 +256,9 @@ asimage_replace (ASImage *im, ASImage *from)
 			int ref_count = im->ref_count ;
 			ASImageManager *imageman = im->imageman ;
 			char *name = im->name ;
-			ASFlagType  saved_flags = im->flags & (ASIM_NAME_IS_FILENAME|ASIM_NO_COMPRESSION) ;
+			ASFlagType  saved_flags = im->flags & (ASIM_NAME_IS_FILENAME|ASIM_NO_COMPRESSION|ASIM_LZ_COMPRESSION) ;
+			ASImage *cache_prev = im->cache_prev, *cache_next = im->cache_next ;
+			size_t cache_size = im->cache_size ;
 
 			im->name = NULL ; 
 			asimage_init (im, True);
@@ -226,6 +270,9 @@ asimage_replace (ASImage *im, ASImage *from)
 			im->ref_count = ref_count ; 
 			im->imageman = imageman ;
 			im->name = name ;
+			im->cache_prev = cache_prev ;
+			im->cache_next = cache_next ;
+			im->cache_size = cache_size ;
 			set_flags( im->flags, saved_flags );
 
 			return True ;
@@ -383,6 +430,144 @@ purge_asimage_registry()
 }
 
 /* ******************** ASImageManager ****************************/
+size_t
+asimage_memory_size( ASImage *im )
+{
+	size_t size = sizeof(ASImage) + im->height*IC_NUM_CHANNELS*sizeof(ASStorageID);
+	ASStorageSlot slot ;
+	int i ;
+
+	if( im->red )
+		for( i = im->height*IC_NUM_CHANNELS-1 ; i >= 0 ; --i )
+			if( im->red[i] != 0 && query_storage_slot( NULL, im->red[i], &slot ) )
+				size += ASStorageSlot_FULL_SIZE(&slot) ;
+#ifndef X_DISPLAY_MISSING
+	if( im->alt.ximage )
+		size += im->alt.ximage->bytes_per_line*im->alt.ximage->height ;
+	if( im->alt.mask_ximage )
+		size += im->alt.mask_ximage->bytes_per_line*im->alt.mask_ximage->height ;
+#endif
+	if( im->alt.argb32 )
+		size += im->width*im->height*sizeof(ARGB32);
+	if( im->alt.vector )
+		size += im->width*im->height*sizeof(double);
+	if( im->name )
+		size += strlen( im->name )+1 ;
+	return size;
+}
+
+static inline Bool
+is_asimage_cached( ASImage *im )
+{
+	return ( im->imageman != NULL &&
+			 (im->cache_prev != NULL || im->imageman->cache_head == im) );
+}
+
+static void
+uncache_asimage( ASImage *im )
+{
+	ASImageManager *imman = im->imageman ;
+	if( !is_asimage_cached( im ) )
+		return;
+	if( im->cache_prev )
+		im->cache_prev->cache_next = im->cache_next ;
+	else
+		imman->cache_head = im->cache_next ;
+	if( im->cache_next )
+		im->cache_next->cache_prev = im->cache_prev ;
+	else
+		imman->cache_tail = im->cache_prev ;
+	imman->cache_used -= im->cache_size ;
+	--(imman->cache_count);
+	im->cache_prev = im->cache_next = NULL ;
+	im->cache_size = 0 ;
+}
+
+static void
+evict_cached_asimages( ASImageManager *imman, size_t budget )
+{
+	while( imman->cache_tail != NULL && imman->cache_used > budget )
+	{
+		ASImage *im = imman->cache_tail ;
+		uncache_asimage( im );
+		++(imman->cache_evictions);
+		LOCAL_DEBUG_OUT( "evicting image \"%s\" %p, %ld bytes still cached", im->name, im, (long)imman->cache_used );
+		if( remove_hash_item(imman->image_hash, (ASHashableValue)(char*)im->name, NULL, True) != ASH_Success )
+		{
+			im->imageman = NULL ;
+			destroy_asimage( &im );
+		}
+	}
+}
+
+/* called when image's reference count drops to zero - returns True
+ * if image is to be kept in the cache : */
+static Bool
+cache_asimage( ASImage *im )
+{
+	ASImageManager *imman = im->imageman ;
+	im->ref_count = 0 ;
+	if( is_asimage_cached( im ) )
+		return True;
+	if( imman->cache_budget == 0 || im->name == NULL )
+		return False;
+	flush_asimage_cache( im );
+	im->cache_size = asimage_memory_size( im );
+	if( im->cache_size > imman->cache_budget )
+	{
+		im->cache_size = 0 ;
+		return False;
+	}
+	im->cache_prev = NULL ;
+	im->cache_next = imman->cache_head ;
+	if( imman->cache_head )
+		imman->cache_head->cache_prev = im ;
+	else
+		imman->cache_tail = im ;
+	imman->cache_head = im ;
+	imman->cache_used += im->cache_size ;
+	++(imman->cache_count);
+	evict_cached_asimages( imman, imman->cache_budget );
+	return True;
+}
+
+size_t
+set_asimage_manager_budget( ASImageManager *imman, size_t budget )
+{
+	size_t old_budget = 0 ;
+	if( !AS_ASSERT(imman) )
+	{
+		old_budget = imman->cache_budget ;
+		imman->cache_budget = budget ;
+		evict_cached_asimages( imman, budget );
+	}
+	return old_budget;
+}
+
+void
+flush_asimage_manager_cache( ASImageManager *imman )
+{
+	if( !AS_ASSERT(imman) )
+		evict_cached_asimages( imman, 0 );
+}
+
+void
+get_asimage_manager_stats( ASImageManager *imman, ASImageManagerStats *stats )
+{
+	if( stats == NULL )
+		return;
+	memset( stats, 0x00, sizeof(ASImageManagerStats));
+	if( !AS_ASSERT(imman) )
+	{
+		stats->budget = imman->cache_budget ;
+		stats->used = imman->cache_used ;
+		stats->cached_count = imman->cache_count ;
+		stats->hits = imman->cache_hits ;
+		stats->misses = imman->cache_misses ;
+		stats->evictions = imman->cache_evictions ;
+	}
+}
+
 static void
 asimage_destroy (ASHashableValue value, void *data)
 {
@@ -394,7 +579,10 @@ asimage_destroy (ASHashableValue value, void *data)
 			if( AS_ASSERT_NOTVAL(im->magic, MAGIC_ASIMAGE) )
 				im = NULL ;
 			else
+			{
+				uncache_asimage( im );
 				im->imageman = NULL ;
+			}
 		}
 		if( im == NULL || (char*)value != im->name ) 
 			free( (char*)value );/* name */
@@ -461,7 +649,13 @@ store_asimage( ASImageManager* imageman, ASImage *im, const char *name )
 		if( im->imageman == NULL )
 		{
 			int hash_res ;
-			char *stored_name = mystrdup( name );
+			char *stored_name ;
+			ASImage *old = query_asimage( imageman, name );
+			/* unreferenced image kept in cache must not prevent new
+			 * one from taking its name : */
+			if( old && old->ref_count <= 0 && is_asimage_cached( old ) )
+				remove_hash_item(imageman->image_hash, (ASHashableValue)(char*)old->name, NULL, True);
+			stored_name = mystrdup( name );
 			if( im->name ) 
 				free( im->name );
 			im->name = stored_name ;
@@ -504,8 +698,11 @@ fetch_asimage( ASImageManager* imageman, const char *name )
     ASImage *im = query_asimage( imageman, name );
     if( im )
 	{
+		uncache_asimage( im );
         im->ref_count++ ;
-	}
+		++(imageman->cache_hits);
+	}else if( imageman )
+		++(imageman->cache_misses);
 	return im;
 }
 
@@ -523,6 +720,7 @@ dup_asimage( ASImage* im )
 	if( !AS_ASSERT(im) && !AS_ASSERT(im->imageman) )
 	{
 /*		fprintf( stderr, __FUNCTION__" on image %p ref_count = %d\n", im, im->ref_count ); */
+		uncache_asimage( im );
 		im->ref_count++ ;
 		return im;
 	}else if( im ) 
@@ -544,8 +742,12 @@ release_asimage( ASImage *im )
 			{
 				ASImageManager *imman = im->imageman ;
 				if( !AS_ASSERT(imman) )
-                    if( remove_hash_item(imman->image_hash, (ASHashableValue)(char*)im->name, NULL, True) != ASH_Success )
+				{
+					if( cache_asimage( im ) )
+						res = 0 ;
+                    else if( remove_hash_item(imman->image_hash, (ASHashableValue)(char*)im->name, NULL, True) != ASH_Success )
                         destroy_asimage( &im );
+				}
 			}else
 				res = im->ref_count ;
 		}
@@ -562,7 +764,10 @@ forget_asimage( ASImage *im )
 		{
 			ASImageManager *imman = im->imageman ;
 			if( !AS_ASSERT(imman) )
+			{
+				uncache_asimage( im );
 				remove_hash_item(imman->image_hash, (ASHashableValue)(char*)im->name, NULL, False);
+			}
             im->ref_count = 0;
             im->imageman = NULL;
 		}
@@ -580,6 +785,7 @@ relocate_asimage( ASImageManager* to_imageman, ASImage *im )
 			int ref_count = im->ref_count ; 
 			if( imman != NULL )
 			{
+				uncache_asimage( im );
 				remove_hash_item(imman->image_hash, (ASHashableValue)(char*)im->name, NULL, False);
 	            im->ref_count = 0;
     	        im->imageman = NULL;
@@ -601,6 +807,9 @@ forget_asimage_name( ASImageManager *imman, const char *name )
 {
     if( !AS_ASSERT(imman) && name != NULL )
 	{
+		ASImage *im = query_asimage( imman, name );
+		if( im )
+			uncache_asimage( im );
         remove_hash_item(imman->image_hash, AS_HASHABLE((char*)name), NULL, False);
     }
 }
@@ -617,7 +826,7 @@ safe_asimage_destroy( ASImage *im )
 			if( imman != NULL )
 			{
                 res = --(im->ref_count) ;
-                if( im->ref_count <= 0 )
+                if( im->ref_count <= 0 && !cache_asimage( im ) )
 					remove_hash_item(imman->image_hash, (ASHashableValue)(char*)im->name, NULL, True);
             }else
 			{
@@ -640,7 +849,15 @@ release_asimage_by_name( ASImageManager *imageman, char *name )
 		if( get_hash_item( imageman->image_hash, AS_HASHABLE((char*)name), &hdata.vptr) == ASH_Success )
 		{
 			im = hdata.vptr ;
-			res = release_asimage( im );
+			if( im->magic == MAGIC_ASIMAGE )
+			{
+				/* image is released by name when that name is about to
+				 * be reused, so it is not kept in the cache : */
+				if( --(im->ref_count) > 0 )
+					res = im->ref_count ;
+				else
+					remove_hash_item(imageman->image_hash, (ASHashableValue)(char*)im->name, NULL, True);
+			}
 		}
 	}
 	return res ;
@@ -798,6 +1015,9 @@ destroy_image_layers( register ASImageLayer *l, int count, Bool reusable )
 /* **********************************************************************/
 /*  Compression/decompression 										   */
 /* **********************************************************************/
+#define ASIM_STORAGE_COMPRESSION(im) \
+	(get_flags((im)->flags,ASIM_LZ_COMPRESSION)?ASStorage_RLEDiffCompress|ASStorage_LZCompress:ASStorage_RLEDiffCompress)
+
 size_t
 asimage_add_line_mono (ASImage * im, ColorPart color, CARD8 value, unsigned int y)
 {
@@ -821,7 +1041,8 @@ asimage_add_line (ASImage * im, ColorPart color, register CARD32 * data, unsigne
 		return 0;
 	if( im->channels[color][y] ) 
 		forget_data( NULL, im->channels[color][y] ); 
-	im->channels[color][y] = store_data( NULL, (CARD8*)data, im->width*4, ASStorage_RLEDiffCompress|ASStorage_32Bit, 0);
+	im->channels[color][y] = store_data( NULL, (CARD8*)data, im->width*4, 
+										 ASIM_STORAGE_COMPRESSION(im)|ASStorage_32Bit, 0);
 	return im->width;
 }
 
@@ -836,22 +1057,22 @@ asimage_add_line_bgra (ASImage * im, register CARD32 * data, unsigned int y)
 		forget_data( NULL, im->channels[IC_ALPHA][y] ); 
 	im->channels[IC_ALPHA][y] = store_data( NULL, (CARD8*)data, im->width*4, 
 	                                        ASStorage_24BitShift|ASStorage_Masked|
-											ASStorage_RLEDiffCompress|ASStorage_32Bit, 0);
+											ASIM_STORAGE_COMPRESSION(im)|ASStorage_32Bit, 0);
 	if( im->channels[IC_RED][y] ) 
 		forget_data( NULL, im->channels[IC_RED][y] ); 
 	im->channels[IC_RED][y] = store_data( NULL, (CARD8*)data, im->width*4, 
 	                                        ASStorage_16BitShift|ASStorage_Masked|
-											ASStorage_RLEDiffCompress|ASStorage_32Bit, 0);
+											ASIM_STORAGE_COMPRESSION(im)|ASStorage_32Bit, 0);
 	if( im->channels[IC_GREEN][y] ) 
 		forget_data( NULL, im->channels[IC_GREEN][y] ); 
 	im->channels[IC_GREEN][y] = store_data( NULL, (CARD8*)data, im->width*4, 
 	                                        ASStorage_8BitShift|ASStorage_Masked|
-											ASStorage_RLEDiffCompress|ASStorage_32Bit, 0);
+											ASIM_STORAGE_COMPRESSION(im)|ASStorage_32Bit, 0);
 	if( im->channels[IC_BLUE][y] ) 
 		forget_data( NULL, im->channels[IC_BLUE][y] ); 
 	im->channels[IC_BLUE][y] = store_data( NULL, (CARD8*)data, im->width*4, 
 	                                        ASStorage_Masked|
-											ASStorage_RLEDiffCompress|ASStorage_32Bit, 0);
+											ASIM_STORAGE_COMPRESSION(im)|ASStorage_32Bit, 0);
 	return im->width;
 }
 
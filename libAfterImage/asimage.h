@@ -183,8 +183,18 @@ typedef struct ASImage
 #define ASIM_RGB_IS_BITMAP		(0x01<<5) 
 #define ASIM_XIMAGE_NOT_USEFUL	(0x01<<6)
 #define ASIM_NAME_IS_FILENAME	(0x01<<7)
+#define ASIM_LZ_COMPRESSION		(0x01<<8) /* Try LZ compression of scanlines 
+										   * in addition to RLE - slower, but 
+										   * better for photographic images */
 
   ASFlagType			 flags ;    /* combination of the above flags */
+
+  /* unreferenced images kept by ASImageManager's cache form LRU list : */
+  struct ASImage		*cache_prev, *cache_next ;
+  size_t				 cache_size ;	/* memory used by image while cached */
+  /* for images loaded from file - to tell if file has changed since : */
+  time_t				 src_mtime ;
+  size_t				 src_size ;
   
 } ASImage;
 /*******/
@@ -219,9 +229,33 @@ typedef struct ASImageManager
 	/* misc stuff that may come handy : */
 	char 	     *search_path[MAX_SEARCH_PATHS+1];
 	double 		  gamma ;
+	/* images no longer referenced are kept around until cache_budget
+	 * bytes is exceeded (see set_asimage_manager_budget()) : */
+	size_t		  cache_budget, cache_used ;
+	unsigned int  cache_count ;
+	struct ASImage *cache_head, *cache_tail ; /* most/least recently used */
+	unsigned long cache_hits, cache_misses, cache_evictions ;
 }ASImageManager;
 /*************/
 
+/****s* libAfterImage/ASImageManagerStats
+ * NAME
+ * ASImageManagerStats - snapshot of ASImageManager cache counters.
+ * DESCRIPTION
+ * hits and misses count fetch_asimage() calls that did or did not find
+ * an image with requested name, evictions counts unreferenced images
+ * destroyed to stay within the budget.
+ * SOURCE
+ */
+typedef struct ASImageManagerStats
+{
+	size_t        budget ;       /* bytes allowed for unreferenced images */
+	size_t        used ;         /* bytes used by unreferenced images */
+	unsigned int  cached_count ; /* number of unreferenced images kept */
+	unsigned long hits, misses, evictions ;
+}ASImageManagerStats;
+/*************/
+
 
 /* Auxiliary data structures : */
 /****s* libAfterImage/ASVectorPalette
@@ -447,6 +481,59 @@ typedef struct ASGradient
 
 extern Bool asimage_use_mmx ;
 
+/****d* libAfterImage/asimage/ASIM_CPU_
+ * FUNCTION
+ * CPU features that could be used to speed up image processing.
+ * Those are detected at runtime, so that the same binary could be used
+ * on older CPUs, while still using wider instruction sets where
+ * available.
+ * NAME
+ * ASIM_CPU_MMX  - MMX instruction set;
+ * NAME
+ * ASIM_CPU_SSE2 - SSE2 instruction set;
+ * NAME
+ * ASIM_CPU_AVX2 - AVX2 instruction set;
+ * SOURCE
+ */
+#define ASIM_CPU_MMX		(0x01<<0)
+#define ASIM_CPU_SSE2		(0x01<<1)
+#define ASIM_CPU_AVX2		(0x01<<2)
+#define ASIM_CPU_ALL		(ASIM_CPU_MMX|ASIM_CPU_SSE2|ASIM_CPU_AVX2)
+/********/
+
+/* x86 code paths selected at runtime require gcc's target attribute
+ * and __builtin_cpu_supports() : */
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)) && \
+	(__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define ASIM_X86_SIMD_DISPATCH
+#endif
+
+/****f* libAfterImage/asimage/get_asimage_cpu_features()
+ * NAME
+ * get_asimage_cpu_features() - detects CPU features usable by library.
+ * NAME
+ * set_asimage_cpu_features_mask() - restricts CPU features in use.
+ * SYNOPSIS
+ * CARD32 get_asimage_cpu_features();
+ * CARD32 set_asimage_cpu_features_mask( CARD32 mask );
+ * INPUTS
+ * mask - combination of ASIM_CPU_ flags that library is allowed to use.
+ * RETURN VALUE
+ * Both return set of ASIM_CPU_ flags currently in use.
+ * DESCRIPTION
+ * get_asimage_cpu_features() queries CPU on first call and then selects
+ * best implementation of scanline merging functions and other
+ * vectorized code paths. It also sets asimage_use_mmx accordingly.
+ * It is called automatically from create_asvisual(), and at first
+ * use of any of the runtime dispatched functions.
+ * set_asimage_cpu_features_mask() could be used to disable some of the
+ * instruction sets, for example in order to compare results of
+ * vectorized code with the results of plain C code. All vectorized
+ * code paths produce results identical to the plain C code.
+ *********/
+CARD32 get_asimage_cpu_features();
+CARD32 set_asimage_cpu_features_mask( CARD32 mask );
+
 /****f* libAfterImage/asimage/asimage_init()
  * NAME 
  * asimage_init() frees datamembers of the supplied ASImage structure, and
@@ -725,7 +812,11 @@ ASImage *dup_asimage  ( ASImage* im );         /* increment ref countif applicab
  * name            - unique name of the image.
  * DESCRIPTION
  * Decrements reference count on the ASImage object and destroys it if
- * reference count is below zero.
+ * reference count is below zero, unless ASImageManager has a cache
+ * budget set, in which case image is kept around until it is needed
+ * again or evicted (see set_asimage_manager_budget()).
+ * release_asimage_by_name() never keeps image around, as it is
+ * normally used to free the name for the new image.
  *********/
 int      release_asimage( ASImage *im );
 int		 release_asimage_by_name( ASImageManager *imman, char *name );
@@ -758,6 +849,52 @@ void     forget_asimage_name( ASImageManager *imman, const char *name );
  *********/
 int		 safe_asimage_destroy( ASImage *im );
 
+/****f* libAfterImage/asimage/set_asimage_manager_budget()
+ * NAME
+ * set_asimage_manager_budget() sets amount of memory that could be used
+ * to keep unreferenced images around.
+ * NAME
+ * flush_asimage_manager_cache() destroys all unreferenced images.
+ * NAME
+ * get_asimage_manager_stats() reports cache counters.
+ * SYNOPSIS
+ * size_t set_asimage_manager_budget( ASImageManager *imman, size_t budget );
+ * void flush_asimage_manager_cache( ASImageManager *imman );
+ * void get_asimage_manager_stats( ASImageManager *imman,
+ *                                 ASImageManagerStats *stats );
+ * INPUTS
+ * imman  - pointer to valid ASImageManager object.
+ * budget - number of bytes, 0 disables caching.
+ * stats  - pointer to the structure to receive counters.
+ * RETURN VALUE
+ * set_asimage_manager_budget() returns previous budget.
+ * DESCRIPTION
+ * By default image is destroyed as soon as its reference count drops to
+ * zero. With non-zero budget such images stay in ASImageManager's hash,
+ * in least recently used order, and fetch_asimage()/get_asimage() will
+ * return them without reloading them from disk, unless image's file was
+ * changed since. Storing new image under the name of unreferenced one
+ * destroys the old one. Least recently used
+ * images get destroyed whenever memory used by unreferenced images -
+ * compressed scanlines and cached XImages/ARGB32 data - exceeds the
+ * budget. Images bigger than the budget are destroyed right away.
+ *********/
+size_t   set_asimage_manager_budget( ASImageManager *imman, size_t budget );
+void     flush_asimage_manager_cache( ASImageManager *imman );
+void     get_asimage_manager_stats( ASImageManager *imman, ASImageManagerStats *stats );
+
+/****f* libAfterImage/asimage/asimage_memory_size()
+ * NAME
+ * asimage_memory_size() estimates memory used by the image.
+ * SYNOPSIS
+ * size_t asimage_memory_size( ASImage *im );
+ * DESCRIPTION
+ * Returns size of the compressed scanlines of the image, as well as
+ * of all of its alternative forms and the structure itself. Scanlines
+ * shared with other images are counted in full.
+ *********/
+size_t   asimage_memory_size( ASImage *im );
+
 /****f* libAfterImage/print_asimage_manager()
  * NAME
  * print_asimage_manager() prints list of images referenced in given 
@@ -1111,6 +1248,42 @@ typedef struct XRectangle
 XRectangle*
 get_asimage_channel_rects( ASImage *src, int channel, unsigned int threshold, unsigned int *rects_count_ret );
 
+/****f* libAfterImage/asimage/make_cache_file_name()
+ * NAME
+ * make_cache_file_name() - names cache file after the source file.
+ * NAME
+ * write_cache_file() - atomically writes cache file.
+ * SYNOPSIS
+ * char *make_cache_file_name( const char *cache_dir,
+ *                             const char *src_path,
+ *                             const char *suffix );
+ * Bool write_cache_file( const char *filename,
+ *                        write_cache_file_func write_func,
+ *                        void *data );
+ * INPUTS
+ * cache_dir   - directory holding cache files;
+ * src_path    - full path of the file cached data was made from;
+ * suffix      - appended to the hash of src_path, to tell apart
+ *               different data made out of the same file;
+ * filename    - name of the cache file to write;
+ * write_func  - function writing cache file contents into given file;
+ * data        - passed to write_func as is.
+ * RETURN VALUE
+ * make_cache_file_name() returns newly allocated file name, that
+ * should be freed by the caller. write_cache_file() returns True if
+ * write_func succeeded and file was put in place.
+ * DESCRIPTION
+ * Caches of thumbnails, images and font glyphs name their files after
+ * 64 bit hash of the source path. Since hashes may collide, full source
+ * path must be stored in the file and checked when it is read.
+ * write_cache_file() lets write_func write into temporary file, unique
+ * to this process, and then renames it in place, so that other processes
+ * sharing the same directory never see partially written file.
+ *********/
+typedef Bool (*write_cache_file_func)( const char *tmpname, void *data );
+char *make_cache_file_name( const char *cache_dir, const char *src_path, const char *suffix );
+Bool  write_cache_file( const char *filename, write_cache_file_func write_func, void *data );
+
 void
 raw2scanline( register CARD8 *row, struct ASScanline *buf, CARD8 *gamma_table, unsigned int width, Bool grayscale, Bool do_alpha );
 
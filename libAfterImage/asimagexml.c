@@ -374,6 +374,8 @@ Bool save_asimage_to_file(const char *file2bsaved, ASImage *im,
 			params.xpm.dither = 6;
 	} else if (!mystrcasecmp(strtype, "xbm")) {
 		params.type = ASIT_Xbm;
+	} else if (!mystrcasecmp(strtype, "asim")) {
+		params.type = ASIT_ASImage;
 	} else if (!mystrcasecmp(strtype, "tiff")) {
 		params.type = ASIT_Tiff;
 		params.tiff.compression_type = TIFF_COMPRESSION_NONE ;
@@ -432,6 +434,148 @@ typedef struct ASImageXMLState
 
 }ASImageXMLState;
 
+/* operations tags are resolved into : */
+typedef enum
+{
+	ASXML_Op_Unknown = 0,		/* containers and unrecognized tags - result of the first child */
+	ASXML_Op_Composite,
+	ASXML_Op_Text,
+	ASXML_Op_Img,
+	ASXML_Op_Recall,
+	ASXML_Op_Release,
+	ASXML_Op_Color,
+	ASXML_Op_Printf,
+	ASXML_Op_Set,
+	ASXML_Op_If,
+	ASXML_Op_Unless,
+	ASXML_Op_Gradient,
+	ASXML_Op_Solid,
+	ASXML_Op_Save,
+	ASXML_Op_Background,
+	ASXML_Op_Blur,
+	ASXML_Op_Bevel,
+	ASXML_Op_Mirror,
+	ASXML_Op_Rotate,
+	ASXML_Op_Scale,
+	ASXML_Op_Slice,
+	ASXML_Op_Crop,
+	ASXML_Op_Tile,
+	ASXML_Op_Hsv,
+	ASXML_Op_Pad,
+	ASXML_Op_Pixelize,
+	ASXML_Op_Color2alpha,
+	ASXML_Ops
+}ASXmlOp;
+
+static const char *asxml_op_tags[ASXML_Ops] =
+{
+	NULL, "composite", "text", "img", "recall", "release", "color", "printf", "set",
+	"if", "unless", "gradient", "solid", "save", "background", "blur", "bevel",
+	"mirror", "rotate", "scale", "slice", "crop", "tile", "hsv", "pad", "pixelize",
+	"color2alpha"
+};
+
+static int
+asxml_tag2op( const char *tag )
+{
+	int op ;
+	for( op = ASXML_Ops-1 ; op > ASXML_Op_Unknown ; --op )
+		if( strcmp( tag, asxml_op_tags[op] ) == 0 )
+			break;
+	return op ;
+}
+
+/* single element of the compiled document. Nodes are kept in document
+ * order, so that subtree of the node i occupies nodes i through end-1 : */
+typedef struct ASXmlNode
+{
+#define ASXmlNode_SizeDependent	(0x01<<0)	/* depends on target.width/target.height */
+#define ASXmlNode_SideEffects	(0x01<<1)	/* defines variables, releases images, prints or saves */
+#define ASXmlNode_Opaque		(0x01<<2)	/* uses images from outside of the document */
+#define ASXmlNode_Cacheable		(0x01<<3)	/* result is a function of its inputs only */
+#define ASXmlNode_CacheRoot		(0x01<<4)	/* cacheable with not cacheable parent */
+	ASFlagType flags ;
+	xml_elem_t *elem ;
+	int op ;
+	xml_elem_t *parm ;			/* pre-parsed attributes */
+	char *id ;					/* points into parm */
+	int parent, end ;
+	CARD32 hash ;				/* hash of the subtree's xml */
+
+	/* explicit dependencies of the element itself : */
+	char **vars ;				/* variables used in attribute's expressions */
+	int vars_num, vars_allocated ;
+	int *producers ;			/* nodes defining images referenced by id */
+	int producers_num, producers_allocated ;
+	char **files ;				/* image files loaded, point into parm */
+	int files_num, files_allocated ;
+
+	/* inputs of the whole subtree, for cache roots only : */
+	char **in_vars ;
+	int in_vars_num ;
+	int *in_producers ;
+	int in_producers_num ;
+	char **in_files ;
+	int in_files_num ;
+	int *inputs ;				/* values of inputs at the time of evaluation */
+	int inputs_num ;
+
+	ASImage *result ;			/* memoized result and its inputs */
+	CARD32 result_key ;
+	int *result_inputs ;
+	int version ;				/* changes every time result is recomputed */
+	unsigned long evaluated ;	/* last pass node was evaluated in */
+}ASXmlNode;
+
+struct ASImageXMLProgram
+{
+	xml_elem_t *doc ;
+	ASXmlNode *nodes ;
+	int nodes_num ;
+	ASHashTable *elem2node ;
+
+	CARD32 context ;			/* hash of managers and flags results were built with */
+	Bool busy ;
+	unsigned long evaluations ;
+	unsigned long hits, misses ;
+};
+
+/* program being evaluated by compose_asimage_xml_compiled() : */
+static ASImageXMLProgram *_as_xml_program = NULL ;
+
+static ASXmlNode *get_xml_program_node( ASImageXMLProgram *prog, xml_elem_t *elem );
+static ASImage *fetch_xml_node_result( ASImageXMLProgram *prog, ASXmlNode *node, ASImageManager *imman );
+
+/* images built ahead of time for layers of <composite> evaluated in parallel : */
+typedef struct ASXmlPrefetched
+{
+	xml_elem_t *elem ;
+	ASImage *im ;				/* not attached to any image manager */
+	Bool memo_missed ;			/* memoized result was looked up already */
+}ASXmlPrefetched;
+
+typedef struct ASXmlLayerJobs
+{
+	ASImageXMLState *state ;
+	xml_elem_t **elems ;
+	ASImage **images ;
+	xml_elem_t **sparms ;
+	int count ;
+
+	ASXmlPrefetched *prefetched ;
+	int prefetched_num, prefetched_allocated ;
+}ASXmlLayerJobs;
+
+/* set while layers are being built by worker threads : */
+static ASXmlLayerJobs *_as_xml_layer_jobs = NULL ;
+
+/* profiling of tags evaluation, see set_asimage_xml_tag_hook() : */
+static asimage_xml_tag_hook _as_xml_tag_hook = NULL ;
+static void *_as_xml_tag_hook_data = NULL ;
+static int _as_xml_tag_depth = 0 ;
+/* time spent on nested tags of the tag being evaluated : */
+static double _as_xml_nested_wall_time = 0., _as_xml_nested_cpu_time = 0. ;
+
 
 ASImage *commit_xml_image_built( ASImageXMLState *state, char *id, ASImage *result )
 {
@@ -642,6 +786,179 @@ handle_asxml_tag_text( ASImageXMLState *state, xml_elem_t* doc, xml_elem_t* parm
 
 	return result;
 }
+/*************************************************************************/
+/* Parallel evaluation of <composite> layers :                           */
+/*************************************************************************/
+static Bool
+is_xml_color_list_numeric( const char *str )
+{
+	while( *str )
+	{
+		while( isspace((int)*str) ) ++str ;
+		if( *str != '\0' && *str != '#' )
+			return False ;
+		while( *str && !isspace((int)*str) ) ++str ;
+	}
+	return True ;
+}
+
+/* Layer could be built by worker thread if it neither defines nor releases
+ * anything, and uses image manager, fonts, or X server (for named colors)
+ * only from <img>, <recall> and <text>, which are then built in advance by
+ * the calling thread : */
+static Bool
+is_parallel_xml_layer( xml_elem_t *elem, Bool layer_root )
+{
+	xml_elem_t *parm, *ptr ;
+	Bool ok = True ;
+	Bool source ;
+	int op ;
+
+	if( IsCDATA(elem) )
+		return True ;
+	op = asxml_tag2op( elem->tag );
+	switch( op )
+	{
+		case ASXML_Op_Release :
+		case ASXML_Op_Color :
+		case ASXML_Op_Printf :
+		case ASXML_Op_Set :
+		case ASXML_Op_If :
+		case ASXML_Op_Unless :
+		case ASXML_Op_Save :
+			return False ;
+	}
+	source = (op == ASXML_Op_Img || op == ASXML_Op_Recall || op == ASXML_Op_Text);
+
+	parm = xml_parse_parm( elem->parm, NULL );
+	for( ptr = parm ; ptr && ok ; ptr = ptr->next )
+	{
+		if( strcmp(ptr->tag, "id") == 0 )
+			ok = False ;
+		else if( source )
+			continue;
+		else if( strcmp(ptr->tag, "refid") == 0 )
+			ok = False ;
+		else if( strcmp(ptr->tag, "crefid") == 0 )		/* used by composite itself */
+			ok = layer_root ;
+		else if( strcmp(ptr->tag, "color") == 0 || strcmp(ptr->tag, "colors") == 0 ||
+				 strcmp(ptr->tag, "fgcolor") == 0 || strcmp(ptr->tag, "bgcolor") == 0 ||
+				 (strcmp(ptr->tag, "tint") == 0 && !layer_root) )
+			ok = is_xml_color_list_numeric( ptr->parm );
+	}
+	xml_elem_delete( NULL, parm );
+
+	if( !source )
+		for( ptr = elem->child ; ptr && ok ; ptr = ptr->next )
+			ok = is_parallel_xml_layer( ptr, False );
+	return ok ;
+}
+
+static void
+add_prefetched_xml( ASXmlLayerJobs *jobs, xml_elem_t *elem, ASImage *im, Bool memo_missed )
+{
+	ASXmlPrefetched *pf ;
+	if( jobs->prefetched_num >= jobs->prefetched_allocated )
+	{
+		jobs->prefetched_allocated += 8 ;
+		jobs->prefetched = realloc( jobs->prefetched, jobs->prefetched_allocated*sizeof(ASXmlPrefetched) );
+	}
+	pf = &(jobs->prefetched[jobs->prefetched_num++]);
+	pf->elem = elem ;
+	pf->im = im ;
+	pf->memo_missed = memo_missed ;
+}
+
+static ASXmlPrefetched *
+find_prefetched_xml( ASXmlLayerJobs *jobs, xml_elem_t *elem )
+{
+	int i ;
+	for( i = 0 ; i < jobs->prefetched_num ; ++i )
+		if( jobs->prefetched[i].elem == elem )
+			return &(jobs->prefetched[i]);
+	return NULL ;
+}
+
+/* builds source images of the layer, in document order : */
+static void
+prefetch_xml_layer( ASXmlLayerJobs *jobs, xml_elem_t *elem )
+{
+	ASImageXMLState *state = jobs->state ;
+	ASXmlNode *node ;
+	int op ;
+
+	if( IsCDATA(elem) )
+		return ;
+	node = get_xml_program_node( _as_xml_program, elem );
+	op = node?node->op:asxml_tag2op( elem->tag );
+	if( op == ASXML_Op_Img || op == ASXML_Op_Recall || op == ASXML_Op_Text )
+	{
+		ASImage *im = build_image_from_xml( state->asv, state->imman, state->fontman, elem, NULL, state->flags, state->verbose, state->display_win );
+		if( im && im->imageman )
+		{/* workers may not touch image manager's reference counts */
+			ASImage *tmp = clone_asimage( im, SCL_DO_ALL );
+			safe_asimage_destroy( im );
+			im = tmp ;
+		}
+		add_prefetched_xml( jobs, elem, im, False );
+	}else
+	{
+		xml_elem_t *child ;
+		if( node && get_flags( node->flags, ASXmlNode_CacheRoot ) )
+		{/* memoized results are looked up here, so that counters are not shared */
+			ASImage *im = fetch_xml_node_result( _as_xml_program, node, state->imman );
+			add_prefetched_xml( jobs, elem, im, (im == NULL) );
+			if( im )
+			{
+				node->evaluated = _as_xml_program->evaluations ;
+				return ;
+			}
+		}
+		for( child = elem->child ; child ; child = child->next )
+			prefetch_xml_layer( jobs, child );
+	}
+}
+
+static void
+build_xml_layers_job( void *data, int job, int jobs_count )
+{
+	ASXmlLayerJobs *jobs = (ASXmlLayerJobs*)data ;
+	ASImageXMLState *state = jobs->state ;
+	int i ;
+	for( i = job ; i < jobs->count ; i += jobs_count )
+		jobs->images[i] = build_image_from_xml( state->asv, state->imman, state->fontman, jobs->elems[i], &(jobs->sparms[i]), state->flags, state->verbose, state->display_win );
+}
+
+static void
+build_xml_layers_parallel( ASImageXMLState *state, xml_elem_t **elems, ASImage **images, xml_elem_t **sparms, int count, int threads )
+{
+	ASXmlLayerJobs jobs ;
+	ASXmlLayerJobs *old_jobs = _as_xml_layer_jobs ;
+	int i ;
+
+	memset( &jobs, 0x00, sizeof(ASXmlLayerJobs) );
+	jobs.state = state ;
+	jobs.elems = elems ;
+	jobs.images = images ;
+	jobs.sparms = sparms ;
+	jobs.count = count ;
+	for( i = 0 ; i < count ; ++i )
+		prefetch_xml_layer( &jobs, elems[i] );
+
+	if( state->verbose > 1 )
+		show_progress("Building [%d] layers with [%d] threads, [%d] source images built in advance.", count, threads, jobs.prefetched_num);
+
+	_as_xml_layer_jobs = &jobs ;
+	run_asimage_jobs( build_xml_layers_job, &jobs, (count < threads)?count:threads );
+	_as_xml_layer_jobs = old_jobs ;
+
+	for( i = 0 ; i < jobs.prefetched_num ; ++i )
+		if( jobs.prefetched[i].im )
+			destroy_asimage( &(jobs.prefetched[i].im) );
+	if( jobs.prefetched )
+		free( jobs.prefetched );
+}
+
 /****** libAfterImage/asimagexml/composite
  * NAME
  * composite - superimpose arbitrary number of images on top of each
@@ -700,9 +1017,119 @@ handle_asxml_tag_text( ASImageXMLState *state, xml_elem_t* doc, xml_elem_t* parm
  *          Tinting can both lighten and darken an image. Tinting color
  *          0 or #7f7f7f7f yields no tinting. Tinting can be performed
  *          on any channel, including alpha channel.
+ *
+ *  When set_asimage_threads() allows it, consecutive subimages that do not
+ *  define or release anything (no id, set, color, printf, release, save,
+ *  if or unless inside, no refid, and only #hex colors) are built by worker
+ *  threads at the same time. Their img, recall and text tags are still
+ *  evaluated in the document order first, so the result is the same as
+ *  with sequential processing. Layers are never built in parallel while
+ *  set_asimage_xml_tag_hook() is profiling tags.
  * SEE ALSO
  * libAfterImage
  ******/
+#define  ASXML_ALIGN_LEFT 	(0x01<<0)
+#define  ASXML_ALIGN_RIGHT 	(0x01<<1)
+#define  ASXML_ALIGN_TOP    (0x01<<2)
+#define  ASXML_ALIGN_BOTTOM (0x01<<3)
+
+/* places built subimage according to its attributes, returns new number of layers : */
+static int
+add_xml_composite_layer( ASImageLayer *layers, int *align, int num, ASImage *im, xml_elem_t *sparm, ASImageManager *imman, merge_scanlines_func op_func, int *pwidth, int *pheight )
+{
+	int x = 0, y = 0;
+	int clip_x = 0, clip_y = 0;
+	int clip_width = 0, clip_height = 0;
+	ARGB32 tint = 0;
+	Bool tile = False ;
+
+	layers[num].im = im ;
+	if( im )
+	{
+		clip_width = layers[num].im->width;
+		clip_height = layers[num].im->height;
+	}
+	if (sparm)
+	{
+		xml_elem_t* tmp;
+		const char* x_str = NULL;
+		const char* y_str = NULL;
+		const char* clip_x_str = NULL;
+		const char* clip_y_str = NULL;
+		const char* clip_width_str = NULL;
+		const char* clip_height_str = NULL;
+		const char* refid = NULL;
+		for (tmp = sparm ; tmp ; tmp = tmp->next) {
+			if (!strcmp(tmp->tag, "crefid")) refid = tmp->parm;
+			else if (!strcmp(tmp->tag, "x")) x_str = tmp->parm;
+			else if (!strcmp(tmp->tag, "y")) y_str = tmp->parm;
+			else if (!strcmp(tmp->tag, "clip_x")) clip_x_str = tmp->parm;
+			else if (!strcmp(tmp->tag, "clip_y")) clip_y_str = tmp->parm;
+			else if (!strcmp(tmp->tag, "clip_width")) clip_width_str = tmp->parm;
+			else if (!strcmp(tmp->tag, "clip_height")) clip_height_str = tmp->parm;
+			else if (!strcmp(tmp->tag, "tint")) parse_argb_color(tmp->parm, &tint);
+			else if (!strcmp(tmp->tag, "tile")) tile = True;
+			else if (!strcmp(tmp->tag, "align"))
+			{
+				if (!strcmp(tmp->parm, "left"))set_flags( align[num], ASXML_ALIGN_LEFT);
+				else if (!strcmp(tmp->parm, "right"))set_flags( align[num], ASXML_ALIGN_RIGHT);
+				else if (!strcmp(tmp->parm, "center"))set_flags( align[num], ASXML_ALIGN_LEFT|ASXML_ALIGN_RIGHT);
+			}else if (!strcmp(tmp->tag, "valign"))
+			{
+				if (!strcmp(tmp->parm, "top"))set_flags( align[num], ASXML_ALIGN_TOP) ;
+				else if (!strcmp(tmp->parm, "bottom"))set_flags( align[num], ASXML_ALIGN_BOTTOM);
+				else if (!strcmp(tmp->parm, "middle"))set_flags( align[num], ASXML_ALIGN_TOP|ASXML_ALIGN_BOTTOM);
+			}
+		}
+		if (refid) {
+			ASImage* refimg = fetch_asimage(imman, refid);
+			if (refimg) {
+				x = refimg->width;
+				y = refimg->height;
+			}
+			safe_asimage_destroy(refimg );
+		}
+		x = x_str ? (int)parse_math(x_str, NULL, x) : 0;
+		y = y_str ? (int)parse_math(y_str, NULL, y) : 0;
+		clip_x = clip_x_str ? (int)parse_math(clip_x_str, NULL, x) : 0;
+		clip_y = clip_y_str ? (int)parse_math(clip_y_str, NULL, y) : 0;
+		if( clip_width_str )
+			clip_width = (int)parse_math(clip_width_str, NULL, clip_width);
+		else if( tile )
+			clip_width = 0 ;
+		if( clip_height_str )
+			clip_height = (int)parse_math(clip_height_str, NULL, clip_height);
+		else if( tile )
+			clip_height = 0 ;
+	}
+	if (layers[num].im) {
+		layers[num].dst_x = x;
+		layers[num].dst_y = y;
+		layers[num].clip_x = clip_x;
+		layers[num].clip_y = clip_y;
+		layers[num].clip_width = clip_width ;
+		layers[num].clip_height = clip_height ;
+		layers[num].tint = tint;
+		layers[num].bevel = 0;
+		layers[num].merge_scanlines = op_func;
+		if( clip_width + x > 0 )
+		{
+			if( *pwidth < clip_width + x )
+				*pwidth = clip_width + x;
+		}else
+			if (*pwidth < (int)(layers[num].im->width)) *pwidth = layers[num].im->width;
+		if( clip_height + y > 0 )
+		{
+			if( *pheight < clip_height + y )
+				*pheight = clip_height + y ;
+		}else
+			if (*pheight < (int)(layers[num].im->height)) *pheight = layers[num].im->height;
+		num++;
+	}
+	if (sparm) xml_elem_delete(NULL, sparm);
+	return num ;
+}
+
 static ASImage *
 handle_asxml_tag_composite( ASImageXMLState *state, xml_elem_t* doc, xml_elem_t* parm )
 {
@@ -714,12 +1141,12 @@ handle_asxml_tag_composite( ASImageXMLState *state, xml_elem_t* doc, xml_elem_t*
 	int num = 0;
 	int width = 0, height = 0;
 	ASImageLayer *layers;
-#define  ASXML_ALIGN_LEFT 	(0x01<<0)
-#define  ASXML_ALIGN_RIGHT 	(0x01<<1)
-#define  ASXML_ALIGN_TOP    (0x01<<2)
-#define  ASXML_ALIGN_BOTTOM (0x01<<3)
 	int *align ;
-	int i ;
+	int i, k, count, run ;
+	int threads = get_asimage_threads();
+	xml_elem_t **children ;
+	ASImage **images ;
+	xml_elem_t **sparms ;
 	merge_scanlines_func op_func = NULL ;
 
 	LOCAL_DEBUG_OUT("doc = %p, parm = %p", doc, parm );
@@ -747,100 +1174,32 @@ handle_asxml_tag_composite( ASImageXMLState *state, xml_elem_t* doc, xml_elem_t*
 	/* Build the layers first. */
 	layers = create_image_layers( num );
 	align = safecalloc( num, sizeof(int));
+	children = safecalloc( num, sizeof(xml_elem_t*));
+	images = safecalloc( num, sizeof(ASImage*));
+	sparms = safecalloc( num, sizeof(xml_elem_t*));
+
+	for (count = 0, ptr = doc->child ; ptr ; ptr = ptr->next)
+		if (strcmp(ptr->tag, cdata_str))
+			children[count++] = ptr ;
 
-	for (num = 0, ptr = doc->child ; ptr ; ptr = ptr->next)
+	for( num = 0, k = 0 ; k < count ; k += run )
 	{
-		int x = 0, y = 0;
-		int clip_x = 0, clip_y = 0;
-		int clip_width = 0, clip_height = 0;
-		ARGB32 tint = 0;
-		Bool tile = False ;
-		xml_elem_t* sparm = NULL;
-		if (!strcmp(ptr->tag, cdata_str)) continue;
-		if( (layers[num].im = build_image_from_xml(state->asv, state->imman, state->fontman, ptr, &sparm, state->flags, state->verbose, state->display_win)) != NULL )
-		{
-			clip_width = layers[num].im->width;
-			clip_height = layers[num].im->height;
-		}
-		if (sparm)
-		{
-			xml_elem_t* tmp;
-			const char* x_str = NULL;
-			const char* y_str = NULL;
-			const char* clip_x_str = NULL;
-			const char* clip_y_str = NULL;
-			const char* clip_width_str = NULL;
-			const char* clip_height_str = NULL;
-			const char* refid = NULL;
-			for (tmp = sparm ; tmp ; tmp = tmp->next) {
-				if (!strcmp(tmp->tag, "crefid")) refid = tmp->parm;
-				else if (!strcmp(tmp->tag, "x")) x_str = tmp->parm;
-				else if (!strcmp(tmp->tag, "y")) y_str = tmp->parm;
-				else if (!strcmp(tmp->tag, "clip_x")) clip_x_str = tmp->parm;
-				else if (!strcmp(tmp->tag, "clip_y")) clip_y_str = tmp->parm;
-				else if (!strcmp(tmp->tag, "clip_width")) clip_width_str = tmp->parm;
-				else if (!strcmp(tmp->tag, "clip_height")) clip_height_str = tmp->parm;
-				else if (!strcmp(tmp->tag, "tint")) parse_argb_color(tmp->parm, &tint);
-				else if (!strcmp(tmp->tag, "tile")) tile = True;
-				else if (!strcmp(tmp->tag, "align"))
-				{
-					if (!strcmp(tmp->parm, "left"))set_flags( align[num], ASXML_ALIGN_LEFT);
-					else if (!strcmp(tmp->parm, "right"))set_flags( align[num], ASXML_ALIGN_RIGHT);
-					else if (!strcmp(tmp->parm, "center"))set_flags( align[num], ASXML_ALIGN_LEFT|ASXML_ALIGN_RIGHT);
-				}else if (!strcmp(tmp->tag, "valign"))
-				{
-					if (!strcmp(tmp->parm, "top"))set_flags( align[num], ASXML_ALIGN_TOP) ;
-					else if (!strcmp(tmp->parm, "bottom"))set_flags( align[num], ASXML_ALIGN_BOTTOM);
-					else if (!strcmp(tmp->parm, "middle"))set_flags( align[num], ASXML_ALIGN_TOP|ASXML_ALIGN_BOTTOM);
-				}
-			}
-			if (refid) {
-				ASImage* refimg = fetch_asimage(state->imman, refid);
-				if (refimg) {
-					x = refimg->width;
-					y = refimg->height;
-				}
-				safe_asimage_destroy(refimg );
-			}
-			x = x_str ? (int)parse_math(x_str, NULL, x) : 0;
-			y = y_str ? (int)parse_math(y_str, NULL, y) : 0;
-			clip_x = clip_x_str ? (int)parse_math(clip_x_str, NULL, x) : 0;
-			clip_y = clip_y_str ? (int)parse_math(clip_y_str, NULL, y) : 0;
-			if( clip_width_str )
-				clip_width = (int)parse_math(clip_width_str, NULL, clip_width);
-			else if( tile )
-				clip_width = 0 ;
-			if( clip_height_str )
-				clip_height = (int)parse_math(clip_height_str, NULL, clip_height);
-			else if( tile )
-				clip_height = 0 ;
-		}
-		if (layers[num].im) {
-			layers[num].dst_x = x;
-			layers[num].dst_y = y;
-			layers[num].clip_x = clip_x;
-			layers[num].clip_y = clip_y;
-			layers[num].clip_width = clip_width ;
-			layers[num].clip_height = clip_height ;
-			layers[num].tint = tint;
-			layers[num].bevel = 0;
-			layers[num].merge_scanlines = op_func;
-			if( clip_width + x > 0 )
-			{
-				if( width < clip_width + x )
-					width = clip_width + x;
-			}else
-				if (width < (int)(layers[num].im->width)) width = layers[num].im->width;
-			if( clip_height + y > 0 )
-			{
-				if( height < clip_height + y )
-					height = clip_height + y ;
-			}else
-				if (height < (int)(layers[num].im->height)) height = layers[num].im->height;
-			num++;
-		}
-		if (sparm) xml_elem_delete(NULL, sparm);
+		run = 1 ;
+		if( threads > 1 && _as_xml_tag_hook == NULL && is_parallel_xml_layer( children[k], True ) )
+			while( k+run < count && is_parallel_xml_layer( children[k+run], True ) )
+				++run ;
+		if( run > 1 )
+			build_xml_layers_parallel( state, &children[k], &images[k], &sparms[k], run, threads );
+		else
+			images[k] = build_image_from_xml(state->asv, state->imman, state->fontman, children[k], &sparms[k], state->flags, state->verbose, state->display_win);
+		/* layers built at the same time did not change any variables,
+		 * so their attributes evaluate the same as if built in turn : */
+		for( i = k ; i < k+run ; ++i )
+			num = add_xml_composite_layer( layers, align, num, images[i], sparms[i], state->imman, op_func, &width, &height );
 	}
+	free( sparms );
+	free( images );
+	free( children );
 
 	if (num && merge && layers[0].im ) {
 		width = layers[0].im->width;
@@ -1576,7 +1935,7 @@ handle_asxml_tag_background( ASImageXMLState *state, xml_elem_t* doc, xml_elem_t
  * NAME
  * blur - perform a gaussian blurr on an image.
  * SYNOPSIS
- * <blur id="new_id" horz="radius" vert="radius" channels="argb">
+ * <blur id="new_id" horz="radius" vert="radius" channels="argb" type="gauss|box">
  * ATTRIBUTES
  * id       Optional. Image will be given this name for future reference.
  * horz     Optional. Horizontal radius of the blur in pixels.
@@ -1586,6 +1945,14 @@ handle_asxml_tag_background( ASImageXMLState *state, xml_elem_t* doc, xml_elem_t
  *                       r - red,
  *                       g - green,
  *                       b - blue
+ * type     Optional. Blur algorithm to use :
+ *                       gauss - exact gaussian blur (default), limited
+ *                               to radius of 128 and getting slower
+ *                               as radius grows;
+ *                       box   - fast approximation with several box
+ *                               blurs, that takes the same time with
+ *                               any radius. Use it for radii above 20
+ *                               or so.
  * NOTES
  * This tag applies to the first image contained within the tag.  Any
  * further images will be discarded.
@@ -1597,11 +1964,13 @@ handle_asxml_tag_blur( ASImageXMLState *state, xml_elem_t* doc, xml_elem_t* parm
 	xml_elem_t* ptr ;
 	int horz = 0, vert = 0;
     int filter = SCL_DO_ALL;
+	Bool box = False ;
 	LOCAL_DEBUG_OUT("doc = %p, parm = %p, imtmp = %p", doc, parm, imtmp );
 	for (ptr = parm ; ptr ; ptr = ptr->next)
 	{
 		if (!strcmp(ptr->tag, "horz")) horz = atoi(ptr->parm);
         else if (!strcmp(ptr->tag, "vert")) vert = atoi(ptr->parm);
+        else if (!strcmp(ptr->tag, "type")) box = (mystrcasecmp(ptr->parm, "box") == 0);
         else if (!strcmp(ptr->tag, "channels"))
         {
             int i = 0 ;
@@ -1621,9 +1990,12 @@ handle_asxml_tag_blur( ASImageXMLState *state, xml_elem_t* doc, xml_elem_t* parm
             }
         }
 	}
-    result = blur_asimage_gauss(state->asv, imtmp, horz, vert, filter, ASA_ASImage, 0, ASIMAGE_QUALITY_DEFAULT);
+	if( box )
+		result = blur_asimage_box(state->asv, imtmp, horz, vert, filter, ASA_ASImage, 0, ASIMAGE_QUALITY_DEFAULT);
+	else
+	    result = blur_asimage_gauss(state->asv, imtmp, horz, vert, filter, ASA_ASImage, 0, ASIMAGE_QUALITY_DEFAULT);
 	if( state->verbose > 1 )
-		show_progress("Blurrer image with radii %d, %d.", horz, vert);
+		show_progress("Blurred image with radii %d, %d%s.", horz, vert, box?" using box blur":"");
 	return result;
 }
 
@@ -2314,19 +2686,130 @@ handle_asxml_tag_pad( ASImageXMLState *state, xml_elem_t* doc, xml_elem_t* parm,
 	return result;
 }
 
+/*************************************************************************/
+/* Memoization of compiled document's operations :                       */
+/*************************************************************************/
+#define ASXML_HASH_INIT		0x811C9DC5
+#define ASXML_HASH_PRIME	0x01000193
+
+static CARD32
+asxml_hash_string( CARD32 hash, const char *str )
+{
+	if( str )
+		while( *str )
+			hash = (hash ^ (CARD8)*(str++)) * ASXML_HASH_PRIME ;
+	return (hash ^ 0xFF) * ASXML_HASH_PRIME ;
+}
+
+static CARD32
+asxml_hash_int( CARD32 hash, int val )
+{
+	int i ;
+	for( i = 0 ; i < 4 ; ++i, val >>= 8 )
+		hash = (hash ^ (val&0x00FF)) * ASXML_HASH_PRIME ;
+	return hash ;
+}
+
+static CARD32
+asxml_hash_pointer( CARD32 hash, void *ptr )
+{
+	unsigned long val = (unsigned long)ptr ;
+	hash = asxml_hash_int( hash, (int)(val&0xFFFFFFFF) );
+	return asxml_hash_int( hash, (int)((val>>16)>>16) );
+}
+
+static ASXmlNode *
+get_xml_program_node( ASImageXMLProgram *prog, xml_elem_t *elem )
+{
+	ASHashData hdata = {0} ;
+	if( prog == NULL || prog->elem2node == NULL || elem == NULL )
+		return NULL ;
+	if( get_hash_item( prog->elem2node, AS_HASHABLE(elem), &hdata.vptr ) != ASH_Success )
+		return NULL ;
+	return (ASXmlNode*)hdata.vptr ;
+}
+
+/* Collects current values of node's inputs and returns clone of memoized
+ * result if those are the same as the result was built with. Image files
+ * are looked up the same way image manager will load them : */
+static ASImage *
+fetch_xml_node_result( ASImageXMLProgram *prog, ASXmlNode *node, ASImageManager *imman )
+{
+	int i, k = 0 ;
+	CARD32 key = node->hash ;
+
+	for( i = 0 ; i < node->in_vars_num ; ++i )
+		node->inputs[k++] = asxml_var_get( node->in_vars[i] );
+	for( i = 0 ; i < node->in_producers_num ; ++i )
+	{
+		ASXmlNode *producer = &(prog->nodes[node->in_producers[i]]);
+		/* producer skipped during this pass leaves image id undefined : */
+		node->inputs[k++] = (producer->evaluated == prog->evaluations)?producer->version:-1 ;
+	}
+	for( i = 0 ; i < node->in_files_num ; ++i )
+	{
+		time_t mtime = -1 ;
+		size_t size = 0 ;
+		if( imman )
+			stat_image_file_in_path( node->in_files[i], imman->search_path, &mtime, &size );
+		node->inputs[k++] = (int)mtime ;
+		node->inputs[k++] = (int)size ;
+	}
+	for( i = 0 ; i < k ; ++i )
+		key = asxml_hash_int( key, node->inputs[i] );
+
+	if( node->result && node->result_key == key &&
+		( k == 0 || memcmp( node->inputs, node->result_inputs, k*sizeof(int) ) == 0 ) )
+	{
+		ASImage *im = clone_asimage( node->result, SCL_DO_ALL );
+		if( im )
+		{
+			++(prog->hits) ;
+			return im ;
+		}
+	}
+	node->result_key = key ;
+	++(prog->misses) ;
+	return NULL ;
+}
+
+static void
+store_xml_node_result( ASImageXMLProgram *prog, ASXmlNode *node, ASImage *result )
+{
+	if( node->result )
+		destroy_asimage( &(node->result) );
+	if( result )
+	{
+		node->result = clone_asimage( result, SCL_DO_ALL );
+		if( node->inputs_num > 0 )
+			memcpy( node->result_inputs, node->inputs, node->inputs_num*sizeof(int) );
+	}
+	++(node->version) ;
+}
+
 #define REPLACE_STRING(str,val) do {if(str)free(str);(str) = (val);}while(0)
 
 /* Each tag is only allowed to return ONE image. */
-ASImage*
-build_image_from_xml( ASVisual *asv, ASImageManager *imman, ASFontManager *fontman, xml_elem_t* doc, xml_elem_t** rparm, ASFlagType flags, int verbose, Window display_win)
+static ASImage*
+evaluate_xml_tag( ASVisual *asv, ASImageManager *imman, ASFontManager *fontman, xml_elem_t* doc, xml_elem_t** rparm, ASFlagType flags, int verbose, Window display_win, Bool *cached)
 {
 	xml_elem_t* ptr;
 	char* id = NULL;
 	ASImage* result = NULL;
 	ASImageXMLState state ;
+	ASXmlNode *node = NULL ;
+	Bool memoized = False ;
+	ASXmlPrefetched *prefetched = NULL ;
 
 	if( IsCDATA(doc) )  return NULL ;
 
+	if( _as_xml_layer_jobs && (prefetched = find_prefetched_xml( _as_xml_layer_jobs, doc )) != NULL && !prefetched->memo_missed )
+	{
+		if( rparm )
+			*rparm = xml_parse_parm(doc->parm, NULL);
+		return prefetched->im?clone_asimage( prefetched->im, SCL_DO_ALL ):NULL ;
+	}
+
 	memset( &state, 0x00, sizeof(state));
 	state.flags = flags ;
 	state.asv = asv ;
@@ -2337,13 +2820,28 @@ build_image_from_xml( ASVisual *asv, ASImageManager *imman, ASFontManager *fontm
 
 	if( doc )
 	{
-		xml_elem_t* parm = xml_parse_parm(doc->parm, NULL);
+		xml_elem_t* parm ;
 		xml_elem_t* ptr ;
 		char* refid = NULL;
 		char* width_str = NULL;
 		char* height_str = NULL;
 		ASImage *refimg = NULL ;
 		int width = 0, height = 0 ;
+		int op ;
+		/* compiled document has attributes parsed already, but caller
+		 * asking for them gets its own copy : */
+		Bool own_parm = True ;
+
+		if( (node = get_xml_program_node( _as_xml_program, doc )) != NULL )
+		{
+			op = node->op ;
+			own_parm = (rparm != NULL);
+			parm = own_parm?xml_parse_parm(doc->parm, NULL):node->parm ;
+		}else
+		{
+			op = asxml_tag2op( doc->tag );
+			parm = xml_parse_parm(doc->parm, NULL);
+		}
 		LOCAL_DEBUG_OUT("parm = %p", parm);
 
 		for (ptr = parm ; ptr ; ptr = ptr->next)
@@ -2358,93 +2856,127 @@ build_image_from_xml( ASVisual *asv, ASImageManager *imman, ASFontManager *fontm
 		if( id )
 			if( (result = fetch_asimage( imman, id)) != NULL )
 			{
+				if( cached )
+					*cached = True ;
 				free( id );
-				xml_elem_delete(NULL, parm);
+				if( own_parm )
+					xml_elem_delete(NULL, parm);
 				return result ;
 			}
 
-		if( refid )
-			refimg = fetch_asimage( imman, refid);
+		/* unless looked up already while building layers in parallel : */
+		if( node && get_flags( node->flags, ASXmlNode_CacheRoot ) && prefetched == NULL )
+			memoized = ((result = fetch_xml_node_result( _as_xml_program, node, imman )) != NULL);
+		if( cached )
+			*cached = memoized ;
 
-		if (!strcmp(doc->tag, "composite"))
-			result = handle_asxml_tag_composite( &state, doc, parm );
-		else if (!strcmp(doc->tag, "text"))
-			result = handle_asxml_tag_text( &state, doc, parm );
-		else if (!strcmp(doc->tag, "img"))
-		{
-			translate_tag_size(	width_str, height_str, NULL, refimg, &width, &height );
-			result = handle_asxml_tag_img( &state, doc, parm, width, height );
-		}else if (!strcmp(doc->tag, "recall"))
-			result = handle_asxml_tag_recall( &state, doc, parm );
-		else if (!strcmp(doc->tag, "release"))
-			result = handle_asxml_tag_release( &state, doc, parm );
-		else if (!strcmp(doc->tag, "color"))
-			result = handle_asxml_tag_color( &state, doc, parm );
-		else if (!strcmp(doc->tag, "printf"))
-			result = handle_asxml_tag_printf( &state, doc, parm );
-		else if (!strcmp(doc->tag, "set"))
-			result = handle_asxml_tag_set( &state, doc, parm );
-		else if (!strcmp(doc->tag, "if") || !strcmp(doc->tag, "unless") )
-			result = handle_asxml_tag_if( &state, doc, parm );
-		else if ( !strcmp(doc->tag, "gradient") )
-		{
-			translate_tag_size(	width_str, height_str, NULL, refimg, &width, &height );
-			if( width > 0 && height > 0 )
-				result = handle_asxml_tag_gradient( &state, doc, parm, width, height );
-		}else if (!strcmp(doc->tag, "solid"))
-		{
-			translate_tag_size(	width_str, height_str, NULL, refimg, &width, &height );
-			if( width > 0 && height > 0 )
-				result = handle_asxml_tag_solid( &state, doc, parm, width, height);
-		}else
+		if( !memoized )
 		{
-			ASImage *imtmp = NULL ;
+			if( refid )
+				refimg = fetch_asimage( imman, refid);
 
-			for (ptr = doc->child ; ptr && !imtmp ; ptr = ptr->next)
-				imtmp = build_image_from_xml(asv, imman, fontman, ptr, NULL, flags, verbose, display_win);
-
-			if( imtmp )
+			switch( op )
 			{
-				if (imtmp && !strcmp(doc->tag, "save"))
-					result = handle_asxml_tag_save( &state, doc, parm, imtmp );
-				else if (imtmp && !strcmp(doc->tag, "background"))
-					result = handle_asxml_tag_background( &state, doc, parm, imtmp );
-				else if (imtmp && !strcmp(doc->tag, "blur"))
-					result = handle_asxml_tag_blur( &state, doc, parm, imtmp );
-				else
+				case ASXML_Op_Composite :
+					result = handle_asxml_tag_composite( &state, doc, parm );
+					break;
+				case ASXML_Op_Text :
+					result = handle_asxml_tag_text( &state, doc, parm );
+					break;
+				case ASXML_Op_Img :
+					{
+						unsigned long hits = imman?imman->cache_hits:0 ;
+						translate_tag_size(	width_str, height_str, NULL, refimg, &width, &height );
+						result = handle_asxml_tag_img( &state, doc, parm, width, height );
+						/* file has been loaded already : */
+						if( cached && imman && imman->cache_hits != hits )
+							*cached = True ;
+					}
+					break;
+				case ASXML_Op_Recall :
+					result = handle_asxml_tag_recall( &state, doc, parm );
+					break;
+				case ASXML_Op_Release :
+					result = handle_asxml_tag_release( &state, doc, parm );
+					break;
+				case ASXML_Op_Color :
+					result = handle_asxml_tag_color( &state, doc, parm );
+					break;
+				case ASXML_Op_Printf :
+					result = handle_asxml_tag_printf( &state, doc, parm );
+					break;
+				case ASXML_Op_Set :
+					result = handle_asxml_tag_set( &state, doc, parm );
+					break;
+				case ASXML_Op_If :
+				case ASXML_Op_Unless :
+					result = handle_asxml_tag_if( &state, doc, parm );
+					break;
+				case ASXML_Op_Gradient :
+					translate_tag_size(	width_str, height_str, NULL, refimg, &width, &height );
+					if( width > 0 && height > 0 )
+						result = handle_asxml_tag_gradient( &state, doc, parm, width, height );
+					break;
+				case ASXML_Op_Solid :
+					translate_tag_size(	width_str, height_str, NULL, refimg, &width, &height );
+					if( width > 0 && height > 0 )
+						result = handle_asxml_tag_solid( &state, doc, parm, width, height);
+					break;
+				default :
 				{
-					translate_tag_size(	width_str, height_str, imtmp, refimg, &width, &height );
+					ASImage *imtmp = NULL ;
+
+					for (ptr = doc->child ; ptr && !imtmp ; ptr = ptr->next)
+						imtmp = build_image_from_xml(asv, imman, fontman, ptr, NULL, flags, verbose, display_win);
 
-					if ( width > 0 && height > 0 )
+					if( imtmp )
 					{
-#define HANDLE_SIZED_TAG(ttag) \
-		else if( !strcmp(doc->tag, #ttag) )	result = handle_asxml_tag_##ttag( &state, doc, parm, imtmp, width, height )
-						if (0){}
-						HANDLE_SIZED_TAG(bevel);
-						HANDLE_SIZED_TAG(mirror);
-						HANDLE_SIZED_TAG(rotate);
-						HANDLE_SIZED_TAG(scale);
-						HANDLE_SIZED_TAG(slice);
-						HANDLE_SIZED_TAG(crop);
-						HANDLE_SIZED_TAG(tile);
-						HANDLE_SIZED_TAG(hsv);
-						HANDLE_SIZED_TAG(pad);
-						HANDLE_SIZED_TAG(pixelize);
-						HANDLE_SIZED_TAG(color2alpha);
+						switch( op )
+						{
+							case ASXML_Op_Save :
+								result = handle_asxml_tag_save( &state, doc, parm, imtmp );
+								break;
+							case ASXML_Op_Background :
+								result = handle_asxml_tag_background( &state, doc, parm, imtmp );
+								break;
+							case ASXML_Op_Blur :
+								result = handle_asxml_tag_blur( &state, doc, parm, imtmp );
+								break;
+							default :
+								translate_tag_size(	width_str, height_str, imtmp, refimg, &width, &height );
+
+								if ( width > 0 && height > 0 )
+									switch( op )
+									{
+#define HANDLE_SIZED_TAG(ttag,top) \
+		case top : result = handle_asxml_tag_##ttag( &state, doc, parm, imtmp, width, height ); break
+										HANDLE_SIZED_TAG(bevel,ASXML_Op_Bevel);
+										HANDLE_SIZED_TAG(mirror,ASXML_Op_Mirror);
+										HANDLE_SIZED_TAG(rotate,ASXML_Op_Rotate);
+										HANDLE_SIZED_TAG(scale,ASXML_Op_Scale);
+										HANDLE_SIZED_TAG(slice,ASXML_Op_Slice);
+										HANDLE_SIZED_TAG(crop,ASXML_Op_Crop);
+										HANDLE_SIZED_TAG(tile,ASXML_Op_Tile);
+										HANDLE_SIZED_TAG(hsv,ASXML_Op_Hsv);
+										HANDLE_SIZED_TAG(pad,ASXML_Op_Pad);
+										HANDLE_SIZED_TAG(pixelize,ASXML_Op_Pixelize);
+										HANDLE_SIZED_TAG(color2alpha,ASXML_Op_Color2alpha);
 #undef HANDLE_SIZED_TAG
+									}
+						}
+
+						if( result != imtmp )
+							safe_asimage_destroy(imtmp);
 					}
 				}
-
-				if( result != imtmp )
-					safe_asimage_destroy(imtmp);
 			}
-		}
 
-		if( refimg )
-			release_asimage( refimg );
+			if( refimg )
+				release_asimage( refimg );
+		}
 
 		if (rparm) *rparm = parm;
-		else xml_elem_delete(NULL, parm);
+		else if( own_parm ) xml_elem_delete(NULL, parm);
 	}
 	LOCAL_DEBUG_OUT("result = %p, id = \"%s\"", result, id?id:"(null)" );
 
@@ -2473,6 +3005,13 @@ build_image_from_xml( ASVisual *asv, ASImageManager *imman, ASFontManager *fontm
 			xml_elem_delete(NULL, tparm);
 	}
 
+	if( node )
+	{
+		if( !memoized && get_flags( node->flags, ASXmlNode_CacheRoot ) )
+			store_xml_node_result( _as_xml_program, node, result );
+		node->evaluated = _as_xml_program->evaluations ;
+	}
+
 	LOCAL_DEBUG_OUT("result = %p", result );
 	result = commit_xml_image_built( &state, id, result );
 	if( id )
@@ -2485,6 +3024,576 @@ build_image_from_xml( ASVisual *asv, ASImageManager *imman, ASFontManager *fontm
 	return result;
 }
 
+static double
+xml_wall_time()
+{
+#ifndef _WIN32
+	struct timeval tv ;
+	gettimeofday( &tv, NULL );
+	return (double)tv.tv_sec + (double)tv.tv_usec/1000000. ;
+#else
+	return (double)clock()/CLOCKS_PER_SEC ;
+#endif
+}
+
+void
+set_asimage_xml_tag_hook( asimage_xml_tag_hook hook, void *data )
+{
+	_as_xml_tag_hook = hook ;
+	_as_xml_tag_hook_data = data ;
+}
+
+ASImage*
+build_image_from_xml( ASVisual *asv, ASImageManager *imman, ASFontManager *fontman, xml_elem_t* doc, xml_elem_t** rparm, ASFlagType flags, int verbose, Window display_win)
+{
+	ASImageXMLTagStats stats ;
+	double started_wall, started_cpu ;
+	double outer_nested_wall, outer_nested_cpu ;
+	ASImage *result ;
+
+	if( _as_xml_tag_hook == NULL || doc == NULL || IsCDATA(doc) )
+		return evaluate_xml_tag( asv, imman, fontman, doc, rparm, flags, verbose, display_win, NULL );
+
+	memset( &stats, 0x00, sizeof(stats));
+	stats.elem = doc ;
+	stats.depth = _as_xml_tag_depth++ ;
+	outer_nested_wall = _as_xml_nested_wall_time ;
+	outer_nested_cpu = _as_xml_nested_cpu_time ;
+	_as_xml_nested_wall_time = _as_xml_nested_cpu_time = 0. ;
+
+	started_wall = xml_wall_time();
+	started_cpu = (double)clock()/CLOCKS_PER_SEC ;
+	result = evaluate_xml_tag( asv, imman, fontman, doc, rparm, flags, verbose, display_win, &stats.cached );
+	stats.wall_time = xml_wall_time() - started_wall ;
+	stats.cpu_time = (double)clock()/CLOCKS_PER_SEC - started_cpu ;
+
+	stats.self_wall_time = stats.wall_time - _as_xml_nested_wall_time ;
+	stats.self_cpu_time = stats.cpu_time - _as_xml_nested_cpu_time ;
+	if( stats.self_wall_time < 0. ) stats.self_wall_time = 0. ;
+	if( stats.self_cpu_time < 0. ) stats.self_cpu_time = 0. ;
+	if( result )
+	{
+		stats.width = result->width ;
+		stats.height = result->height ;
+		stats.storage_bytes = asimage_memory_size( result );
+	}
+	--_as_xml_tag_depth ;
+
+	_as_xml_tag_hook( &stats, _as_xml_tag_hook_data );
+
+	/* time spent in the hook is charged to the nested tag,
+	 * so it does not show up as enclosing tag's own time : */
+	_as_xml_nested_wall_time = outer_nested_wall + (xml_wall_time() - started_wall) ;
+	_as_xml_nested_cpu_time = outer_nested_cpu + ((double)clock()/CLOCKS_PER_SEC - started_cpu) ;
+	return result ;
+}
+
+/*************************************************************************/
+/* Compiling documents :                                                  */
+/*************************************************************************/
+static int
+count_xml_program_nodes( xml_elem_t *elem )
+{
+	int count = 0 ;
+	for( ; elem ; elem = elem->next )
+		if( !IsCDATA(elem) )
+			count += 1 + count_xml_program_nodes( elem->child );
+	return count ;
+}
+
+static CARD32
+hash_xml_elem( CARD32 hash, xml_elem_t *elem )
+{
+	xml_elem_t *child ;
+	hash = asxml_hash_string( hash, elem->tag );
+	hash = asxml_hash_string( hash, elem->parm );
+	for( child = elem->child ; child ; child = child->next )
+		hash = hash_xml_elem( hash, child );
+	return asxml_hash_string( hash, NULL );
+}
+
+static int
+add_xml_program_nodes( ASImageXMLProgram *prog, xml_elem_t *elem, int parent, int idx )
+{
+	for( ; elem ; elem = elem->next )
+	{
+		ASXmlNode *node ;
+		xml_elem_t *ptr ;
+		if( IsCDATA(elem) )
+			continue;
+		node = &(prog->nodes[idx]);
+		node->elem = elem ;
+		node->op = asxml_tag2op( elem->tag );
+		node->parm = xml_parse_parm( elem->parm, NULL );
+		node->parent = parent ;
+		node->hash = hash_xml_elem( ASXML_HASH_INIT, elem );
+		for( ptr = node->parm ; ptr ; ptr = ptr->next )
+			if( strcmp( ptr->tag, "id" ) == 0 )
+				node->id = ptr->parm ;
+		add_hash_item( prog->elem2node, AS_HASHABLE(elem), node );
+		node->end = add_xml_program_nodes( prog, elem->child, idx, idx+1 );
+		idx = node->end ;
+	}
+	return idx ;
+}
+
+static void
+add_xml_node_var( ASXmlNode *node, const char *name, int len )
+{
+	int i ;
+	for( i = 0 ; i < node->vars_num ; ++i )
+		if( strncmp( node->vars[i], name, len ) == 0 && node->vars[i][len] == '\0' )
+			return ;
+	if( node->vars_num >= node->vars_allocated )
+	{
+		node->vars_allocated += 4 ;
+		node->vars = realloc( node->vars, node->vars_allocated*sizeof(char*) );
+	}
+	node->vars[node->vars_num++] = mystrndup( name, len );
+}
+
+static void
+add_xml_node_producer( ASXmlNode *node, int producer )
+{
+	int i ;
+	for( i = 0 ; i < node->producers_num ; ++i )
+		if( node->producers[i] == producer )
+			return ;
+	if( node->producers_num >= node->producers_allocated )
+	{
+		node->producers_allocated += 4 ;
+		node->producers = realloc( node->producers, node->producers_allocated*sizeof(int) );
+	}
+	node->producers[node->producers_num++] = producer ;
+}
+
+/* collects variables the same way parse_math() will look them up : */
+static void
+collect_xml_node_vars( ASXmlNode *node, const char *str )
+{
+	while( (str = strchr( str, '$' )) != NULL )
+	{
+		const char *end ;
+		for( end = ++str ; *end && !isspace((int)*end) && *end != '+' && *end != '-' && *end != '*' && *end != '!' && *end != '/' && *end != ')' ; ++end );
+		if( end > str )
+			add_xml_node_var( node, str, end-str );
+		str = end ;
+	}
+}
+
+static void
+add_xml_node_file( ASXmlNode *node, char *file )
+{
+	int i ;
+	for( i = 0 ; i < node->files_num ; ++i )
+		if( strcmp( node->files[i], file ) == 0 )
+			return ;
+	if( node->files_num >= node->files_allocated )
+	{
+		node->files_allocated += 4 ;
+		node->files = realloc( node->files, node->files_allocated*sizeof(char*) );
+	}
+	node->files[node->files_num++] = file ;
+}
+
+/* image references either have to be defined within the document, or are
+ * treated as filenames, loaded through image manager : */
+static void
+collect_xml_node_images( ASImageXMLProgram *prog, ASXmlNode *node, char *name, Bool id_only )
+{
+	int i ;
+	Bool found = False ;
+	for( i = 0 ; i < prog->nodes_num ; ++i )
+		if( prog->nodes[i].id && strcmp( prog->nodes[i].id, name ) == 0 )
+		{
+			add_xml_node_producer( node, i );
+			found = True ;
+		}
+	if( !found )
+	{
+		if( id_only )
+			set_flags( node->flags, ASXmlNode_Opaque );
+		else
+			add_xml_node_file( node, name );
+	}
+}
+
+static Bool
+is_xml_var_in_list( char **list, int num, const char *name )
+{
+	while( --num >= 0 )
+		if( strcmp( list[num], name ) == 0 )
+			return True ;
+	return False ;
+}
+
+static Bool
+add_xml_volatile_var( char ***list, int *num, int *allocated, const char *name, const char *suffix )
+{
+	char *full = safemalloc( strlen(name) + (suffix?strlen(suffix):0) + 1 );
+	sprintf( full, "%s%s", name, suffix?suffix:"" );
+	if( is_xml_var_in_list( *list, *num, full ) )
+	{
+		free( full );
+		return False ;
+	}
+	if( *num >= *allocated )
+	{
+		*allocated += 8 ;
+		*list = realloc( *list, (*allocated)*sizeof(char*) );
+	}
+	(*list)[(*num)++] = full ;
+	return True ;
+}
+
+static void
+mark_xml_node_size_dependent( ASImageXMLProgram *prog, int i )
+{
+	ASXmlNode *node = &(prog->nodes[i]);
+	int k ;
+	/* conditions select what gets evaluated, thus everything inside : */
+	if( node->op == ASXML_Op_If || node->op == ASXML_Op_Unless )
+		for( k = i ; k < node->end ; ++k )
+			set_flags( prog->nodes[k].flags, ASXmlNode_SizeDependent );
+	for( k = i ; k >= 0 ; k = prog->nodes[k].parent )
+		set_flags( prog->nodes[k].flags, ASXmlNode_SizeDependent );
+}
+
+/* Finds out what depends on the target size : anything referencing
+ * target.width/target.height, variables and images derived from those,
+ * and anything that contains such elements. Repeated until nothing
+ * changes, since variables persist between evaluations, and thus
+ * later definition may affect earlier reference. */
+static void
+resolve_xml_size_dependency( ASImageXMLProgram *prog )
+{
+	char **vvars = NULL ;
+	int vvars_num = 0, vvars_allocated = 0 ;
+	Bool changed = True ;
+	int i, k ;
+
+	add_xml_volatile_var( &vvars, &vvars_num, &vvars_allocated, ASXMLVAR_TargetWidth, NULL );
+	add_xml_volatile_var( &vvars, &vvars_num, &vvars_allocated, ASXMLVAR_TargetHeight, NULL );
+
+	while( changed )
+	{
+		changed = False ;
+		for( i = 0 ; i < prog->nodes_num ; ++i )
+		{
+			ASXmlNode *node = &(prog->nodes[i]);
+			Bool dependent = False ;
+			for( k = 0 ; k < node->vars_num && !dependent ; ++k )
+				dependent = is_xml_var_in_list( vvars, vvars_num, node->vars[k] );
+			for( k = 0 ; k < node->producers_num && !dependent ; ++k )
+				dependent = get_flags( prog->nodes[node->producers[k]].flags, ASXmlNode_SizeDependent );
+			if( dependent && !get_flags( node->flags, ASXmlNode_SizeDependent ) )
+			{
+				mark_xml_node_size_dependent( prog, i );
+				changed = True ;
+			}
+		}
+		for( i = 0 ; i < prog->nodes_num ; ++i )
+		{
+			ASXmlNode *node = &(prog->nodes[i]);
+			if( !get_flags( node->flags, ASXmlNode_SizeDependent ) )
+				continue;
+			if( node->id )
+			{
+				if( add_xml_volatile_var( &vvars, &vvars_num, &vvars_allocated, node->id, ".width" ) )
+					changed = True ;
+				if( add_xml_volatile_var( &vvars, &vvars_num, &vvars_allocated, node->id, ".height" ) )
+					changed = True ;
+			}
+			if( node->op == ASXML_Op_Set )
+			{
+				xml_elem_t *ptr ;
+				const char *var = NULL, *var_domain = NULL ;
+				for( ptr = node->parm ; ptr ; ptr = ptr->next )
+				{
+					if( !strcmp(ptr->tag, "var") ) 			var = ptr->parm ;
+					else if( !strcmp(ptr->tag, "domain") ) 	var_domain = ptr->parm ;
+				}
+				if( var )
+				{
+					Bool added ;
+					if( var_domain && var_domain[0] != '\0' )
+					{
+						char *tmp = safemalloc( strlen(var_domain) + 1 + strlen(var) + 1 );
+						sprintf( tmp, ( var_domain[strlen(var_domain)-1] != '.' )?"%s.":"%s", var_domain );
+						added = add_xml_volatile_var( &vvars, &vvars_num, &vvars_allocated, tmp, var );
+						free( tmp );
+					}else
+						added = add_xml_volatile_var( &vvars, &vvars_num, &vvars_allocated, var, NULL );
+					if( added )
+						changed = True ;
+				}
+			}
+		}
+	}
+	for( i = 0 ; i < vvars_num ; ++i )
+		free( vvars[i] );
+	if( vvars )
+		free( vvars );
+}
+
+/* Result of the element could be memoized if it depends on nothing but
+ * its attributes, variables and images produced by other memoized
+ * elements, and does not leave anything behind except for its own id. */
+static void
+resolve_xml_cacheable( ASImageXMLProgram *prog )
+{
+	Bool changed = True ;
+	int i, k, p ;
+
+	for( i = 0 ; i < prog->nodes_num ; ++i )
+	{
+		ASXmlNode *node = &(prog->nodes[i]);
+		Bool cacheable = !get_flags( node->flags, ASXmlNode_SizeDependent|ASXmlNode_Opaque|ASXmlNode_SideEffects );
+		for( k = i+1 ; k < node->end && cacheable ; ++k )
+			if( get_flags( prog->nodes[k].flags, ASXmlNode_Opaque|ASXmlNode_SideEffects ) || prog->nodes[k].id )
+				cacheable = False ;
+		if( cacheable )
+			set_flags( node->flags, ASXmlNode_Cacheable );
+	}
+	while( changed )
+	{
+		changed = False ;
+		for( i = 0 ; i < prog->nodes_num ; ++i )
+		{
+			ASXmlNode *node = &(prog->nodes[i]);
+			if( !get_flags( node->flags, ASXmlNode_Cacheable ) )
+				continue;
+			for( k = i ; k < node->end ; ++k )
+				for( p = 0 ; p < prog->nodes[k].producers_num ; ++p )
+					if( !get_flags( prog->nodes[prog->nodes[k].producers[p]].flags, ASXmlNode_Cacheable ) )
+					{
+						clear_flags( node->flags, ASXmlNode_Cacheable );
+						changed = True ;
+						k = node->end ;
+						break;
+					}
+		}
+	}
 
+	for( i = 0 ; i < prog->nodes_num ; ++i )
+	{
+		ASXmlNode *node = &(prog->nodes[i]);
+		int vars_num = 0, producers_num = 0, files_num = 0 ;
+		if( !get_flags( node->flags, ASXmlNode_Cacheable ) || node->op == ASXML_Op_Recall ||
+			( node->parent >= 0 && get_flags( prog->nodes[node->parent].flags, ASXmlNode_Cacheable ) ) )
+			continue;
+		set_flags( node->flags, ASXmlNode_CacheRoot );
+		for( k = i ; k < node->end ; ++k )
+		{
+			vars_num += prog->nodes[k].vars_num ;
+			producers_num += prog->nodes[k].producers_num ;
+			files_num += prog->nodes[k].files_num ;
+		}
+		if( vars_num > 0 )
+			node->in_vars = safemalloc( vars_num*sizeof(char*) );
+		if( producers_num > 0 )
+			node->in_producers = safemalloc( producers_num*sizeof(int) );
+		if( files_num > 0 )
+			node->in_files = safemalloc( files_num*sizeof(char*) );
+		for( k = i ; k < node->end ; ++k )
+		{
+			ASXmlNode *sub = &(prog->nodes[k]);
+			for( p = 0 ; p < sub->vars_num ; ++p )
+				if( !is_xml_var_in_list( node->in_vars, node->in_vars_num, sub->vars[p] ) )
+					node->in_vars[node->in_vars_num++] = sub->vars[p] ;
+			for( p = 0 ; p < sub->producers_num ; ++p )
+			{
+				int j = node->in_producers_num ;
+				while( --j >= 0 && node->in_producers[j] != sub->producers[p] );
+				if( j < 0 )
+					node->in_producers[node->in_producers_num++] = sub->producers[p] ;
+			}
+			/* modification time and size of each file : */
+			for( p = 0 ; p < sub->files_num ; ++p )
+				if( !is_xml_var_in_list( node->in_files, node->in_files_num, sub->files[p] ) )
+					node->in_files[node->in_files_num++] = sub->files[p] ;
+		}
+		node->inputs_num = node->in_vars_num + node->in_producers_num + node->in_files_num*2 ;
+		if( node->inputs_num > 0 )
+		{
+			node->inputs = safecalloc( node->inputs_num, sizeof(int) );
+			node->result_inputs = safecalloc( node->inputs_num, sizeof(int) );
+		}
+	}
+}
 
+ASImageXMLProgram *
+compile_asimage_xml( const char *doc_str )
+{
+	/* attributes of <composite> children, used by the composite itself : */
+	static const char *layer_attrs[] = { "crefid", "x", "y", "clip_x", "clip_y", "clip_width", "clip_height", "tint", "tile", "align", "valign", NULL };
+	ASImageXMLProgram *prog ;
+	xml_elem_t *doc ;
+	int i, k ;
+
+	if( doc_str == NULL || (doc = xml_parse_doc( doc_str, NULL )) == NULL )
+		return NULL ;
+
+	prog = safecalloc( 1, sizeof(ASImageXMLProgram));
+	prog->doc = doc ;
+	prog->nodes_num = count_xml_program_nodes( doc->child );
+	if( prog->nodes_num > 0 )
+	{
+		prog->nodes = safecalloc( prog->nodes_num, sizeof(ASXmlNode));
+		prog->elem2node = create_ashash( 0, pointer_hash_value, NULL, NULL );
+		add_xml_program_nodes( prog, doc->child, -1, 0 );
+	}
 
+	/* making dependencies explicit : */
+	for( i = 0 ; i < prog->nodes_num ; ++i )
+	{
+		ASXmlNode *node = &(prog->nodes[i]);
+		xml_elem_t *ptr ;
+
+		if( node->op == ASXML_Op_Release || node->op == ASXML_Op_Color ||
+			node->op == ASXML_Op_Printf || node->op == ASXML_Op_Set || node->op == ASXML_Op_Save )
+			set_flags( node->flags, ASXmlNode_SideEffects );
+
+		for( ptr = node->parm ; ptr ; ptr = ptr->next )
+		{
+			ASXmlNode *user = node ;
+			if( node->parent >= 0 && prog->nodes[node->parent].op == ASXML_Op_Composite )
+				for( k = 0 ; layer_attrs[k] ; ++k )
+					if( strcmp( ptr->tag, layer_attrs[k] ) == 0 )
+					{
+						user = &(prog->nodes[node->parent]);
+						break;
+					}
+
+			collect_xml_node_vars( user, ptr->parm );
+
+			if( !strcmp(ptr->tag, "refid") || !strcmp(ptr->tag, "srcid") ||
+				!strcmp(ptr->tag, "crefid") || !strcmp(ptr->tag, "bgimage") )
+				collect_xml_node_images( prog, user, ptr->parm, True );
+			else if( !strcmp(ptr->tag, "fgimage") || !strcmp(ptr->tag, "default_src") )
+				collect_xml_node_images( prog, user, ptr->parm, False );
+			else if( !strcmp(ptr->tag, "src") )
+			{
+				if( !strcmp(ptr->parm, "xroot:") )
+					set_flags( user->flags, ASXmlNode_Opaque );
+				else
+					collect_xml_node_images( prog, user, ptr->parm, False );
+			}
+		}
+	}
+	resolve_xml_size_dependency( prog );
+	resolve_xml_cacheable( prog );
+	return prog ;
+}
+
+ASImage *
+compose_asimage_xml_compiled( ASVisual *asv, ASImageManager *imman, ASFontManager *fontman, ASImageXMLProgram *prog, ASFlagType flags, int verbose, Window display_win, const char *path, int target_width, int target_height)
+{
+	ASImageXMLProgram *old_program = _as_xml_program ;
+	ASImage *im ;
+	CARD32 context = ASXML_HASH_INIT ;
+
+	if( prog == NULL )
+		return NULL ;
+	if( prog->busy )
+	{/* document including itself - evaluate without memoization */
+		_as_xml_program = NULL ;
+		im = compose_asimage_xml_from_doc( asv, imman, fontman, prog->doc, flags, verbose, display_win, path, target_width, target_height );
+		_as_xml_program = old_program ;
+		return im;
+	}
+
+	/* memoized images are only valid for the same managers : */
+	context = asxml_hash_pointer( context, asv?asv->dpy:NULL );
+	context = asxml_hash_pointer( context, imman );
+	context = asxml_hash_pointer( context, fontman );
+	context = asxml_hash_int( context, (int)flags );
+	context = asxml_hash_string( context, path );
+	if( context != prog->context )
+	{
+		flush_asimage_xml_cache( prog );
+		prog->context = context ;
+	}
+
+	prog->busy = True ;
+	++(prog->evaluations) ;
+	_as_xml_program = prog ;
+	im = compose_asimage_xml_from_doc( asv, imman, fontman, prog->doc, flags, verbose, display_win, path, target_width, target_height );
+	_as_xml_program = old_program ;
+	prog->busy = False ;
+	return im;
+}
+
+void
+flush_asimage_xml_cache( ASImageXMLProgram *prog )
+{
+	int i ;
+	if( prog == NULL )
+		return ;
+	for( i = 0 ; i < prog->nodes_num ; ++i )
+		if( prog->nodes[i].result )
+		{
+			destroy_asimage( &(prog->nodes[i].result) );
+			++(prog->nodes[i].version) ;
+		}
+}
+
+void
+get_asimage_xml_cache_stats( ASImageXMLProgram *prog, ASImageXMLCacheStats *stats )
+{
+	int i ;
+	if( stats == NULL )
+		return ;
+	memset( stats, 0x00, sizeof(ASImageXMLCacheStats));
+	if( prog == NULL )
+		return ;
+	stats->nodes = prog->nodes_num ;
+	for( i = 0 ; i < prog->nodes_num ; ++i )
+	{
+		ASXmlNode *node = &(prog->nodes[i]);
+		if( get_flags( node->flags, ASXmlNode_SizeDependent ) )
+			++(stats->size_dependent);
+		if( get_flags( node->flags, ASXmlNode_CacheRoot ) )
+			++(stats->cacheable);
+		if( node->result )
+		{
+			++(stats->cached_count);
+			stats->used += asimage_memory_size( node->result );
+		}
+	}
+	stats->evaluations = prog->evaluations ;
+	stats->hits = prog->hits ;
+	stats->misses = prog->misses ;
+}
+
+void
+destroy_asimage_xml_program( ASImageXMLProgram *prog )
+{
+	int i, k ;
+	if( prog == NULL )
+		return ;
+	for( i = 0 ; i < prog->nodes_num ; ++i )
+	{
+		ASXmlNode *node = &(prog->nodes[i]);
+		if( node->result )
+			destroy_asimage( &(node->result) );
+		if( node->parm )
+			xml_elem_delete( NULL, node->parm );
+		for( k = 0 ; k < node->vars_num ; ++k )
+			free( node->vars[k] );
+		if( node->vars ) free( node->vars );
+		if( node->producers ) free( node->producers );
+		if( node->files ) free( node->files );
+		if( node->in_vars ) free( node->in_vars );
+		if( node->in_producers ) free( node->in_producers );
+		if( node->in_files ) free( node->in_files );
+		if( node->inputs ) free( node->inputs );
+		if( node->result_inputs ) free( node->result_inputs );
+	}
+	if( prog->nodes )
+		free( prog->nodes );
+	if( prog->elem2node )
+		destroy_ashash( &(prog->elem2node) );
+	xml_elem_delete( NULL, prog->doc );
+	free( prog );
+}
@@ -62,6 +62,149 @@ compose_asimage_xml_from_doc(ASVisual *asv,
 							 const char *path, 
 							 int target_width, int target_height);
 
+/****s* libAfterImage/ASImageXMLProgram
+ * NAME
+ * ASImageXMLProgram - xml document compiled for repeated evaluation.
+ * DESCRIPTION
+ * Holds parsed document along with an operation for each of its tags,
+ * pre-parsed attributes, and dependencies of each tag on variables and
+ * on images produced by other tags. Tags depending on target.width or
+ * target.height, directly or through such dependencies, are marked as
+ * size dependent. Results of tags that depend on nothing but their
+ * inputs are memoized between evaluations.
+ *********/
+typedef struct ASImageXMLProgram ASImageXMLProgram;
+
+/****s* libAfterImage/ASImageXMLCacheStats
+ * NAME
+ * ASImageXMLCacheStats - snapshot of compiled document's counters.
+ * DESCRIPTION
+ * hits and misses count memoized tags that were or were not served
+ * from the cache while evaluating the document.
+ * SOURCE
+ */
+typedef struct ASImageXMLCacheStats
+{
+	unsigned int  nodes ;          /* number of compiled tags */
+	unsigned int  size_dependent ; /* tags recomputed when target size changes */
+	unsigned int  cacheable ;      /* tags which results get memoized */
+	unsigned int  cached_count ;   /* number of memoized images */
+	size_t        used ;           /* bytes used by memoized images */
+	unsigned long evaluations ;
+	unsigned long hits, misses ;
+}ASImageXMLCacheStats;
+/*************/
+
+/****f* libAfterImage/asimagexml/compile_asimage_xml()
+ * NAME
+ * compile_asimage_xml() parses xml document and compiles it into
+ * reusable ASImageXMLProgram.
+ * NAME
+ * compose_asimage_xml_compiled() evaluates compiled document.
+ * NAME
+ * flush_asimage_xml_cache() drops results memoized by the document.
+ * NAME
+ * get_asimage_xml_cache_stats() reports document's counters.
+ * NAME
+ * destroy_asimage_xml_program() frees compiled document.
+ * SYNOPSIS
+ * ASImageXMLProgram *compile_asimage_xml( const char *doc_str );
+ * ASImage *compose_asimage_xml_compiled( ASVisual *asv,
+ *                                        ASImageManager *imman,
+ *                                        ASFontManager *fontman,
+ *                                        ASImageXMLProgram *prog,
+ *                                        ASFlagType flags, int verbose,
+ *                                        Window display_win,
+ *                                        const char *path,
+ *                                        int target_width,
+ *                                        int target_height );
+ * void flush_asimage_xml_cache( ASImageXMLProgram *prog );
+ * void get_asimage_xml_cache_stats( ASImageXMLProgram *prog,
+ *                                   ASImageXMLCacheStats *stats );
+ * void destroy_asimage_xml_program( ASImageXMLProgram *prog );
+ * INPUTS
+ * doc_str - text of the xml document.
+ * prog    - document returned by compile_asimage_xml().
+ * stats   - pointer to the structure to receive counters.
+ * other   - same as for compose_asimage_xml_at_size().
+ * RETURN VALUE
+ * compile_asimage_xml() returns NULL if document could not be parsed.
+ * compose_asimage_xml_compiled() returns same image as
+ * compose_asimage_xml_at_size() would for the same document.
+ * DESCRIPTION
+ * Compiled document could be evaluated any number of times, at any
+ * target size. Results of tags that neither depend on target size, nor
+ * store images under id, define variables, or write files from within,
+ * are memoized along with values of the variables and versions of
+ * the images they used, and are reused by later evaluations for as long
+ * as those remain the same. Thus changing target size only recomputes
+ * tags depending on it. Memoized results are dropped if document is
+ * evaluated with different image or font managers, flags or path.
+ * Results using image files are only reused while modification time
+ * and size of those files remain the same. Documents loaded as images
+ * are only checked themselves, flush_asimage_xml_cache() should be used
+ * when images they reference change. Tags using images stored by some
+ * other document, or the root background, are never memoized.
+ *********/
+ASImageXMLProgram *compile_asimage_xml( const char *doc_str );
+ASImage *
+compose_asimage_xml_compiled(ASVisual *asv,
+							 struct ASImageManager *imman,
+							 struct ASFontManager *fontman,
+							 ASImageXMLProgram *prog,
+							 ASFlagType flags,
+							 int verbose,
+							 Window display_win,
+							 const char *path,
+							 int target_width, int target_height);
+void flush_asimage_xml_cache( ASImageXMLProgram *prog );
+void get_asimage_xml_cache_stats( ASImageXMLProgram *prog, ASImageXMLCacheStats *stats );
+void destroy_asimage_xml_program( ASImageXMLProgram *prog );
+
+/****s* libAfterImage/ASImageXMLTagStats
+ * NAME
+ * ASImageXMLTagStats - measurements of single tag evaluation.
+ * DESCRIPTION
+ * Times are in seconds. wall_time and cpu_time include time spent on
+ * nested tags, while self_wall_time and self_cpu_time do not. cpu_time
+ * is that of the whole process, as reported by clock().
+ * cached is set when result was not built, but taken from the image
+ * manager by id, or from the results memoized by compiled document, or
+ * when <img> found its file loaded already.
+ * SOURCE
+ */
+typedef struct ASImageXMLTagStats
+{
+	struct xml_elem_t *elem ;      /* tag evaluated */
+	int           depth ;          /* 0 for top level tags */
+	double        wall_time, self_wall_time ;
+	double        cpu_time, self_cpu_time ;
+	unsigned int  width, height ;  /* of the result, 0 if none */
+	size_t        storage_bytes ;  /* asimage_memory_size() of the result */
+	Bool          cached ;
+}ASImageXMLTagStats;
+
+typedef void (*asimage_xml_tag_hook)( ASImageXMLTagStats *stats, void *data );
+/*************/
+
+/****f* libAfterImage/asimagexml/set_asimage_xml_tag_hook()
+ * NAME
+ * set_asimage_xml_tag_hook() installs function to be called after
+ * each tag gets evaluated.
+ * SYNOPSIS
+ * void set_asimage_xml_tag_hook( asimage_xml_tag_hook hook, void *data );
+ * INPUTS
+ * hook - function receiving measurements of each tag, or NULL to
+ *        stop profiling.
+ * data - pointer passed to hook as is.
+ * DESCRIPTION
+ * Hook is called once for every evaluation of every tag, nested tags
+ * being reported before enclosing ones. Profiling has little overhead,
+ * but while hook is installed <composite> layers are always built
+ * sequentially, so that time could be attributed to the tags properly.
+ *********/
+void set_asimage_xml_tag_hook( asimage_xml_tag_hook hook, void *data );
+
 void show_asimage(ASVisual *asv, ASImage* im, Window w, long delay);
 ASImage* build_image_from_xml( ASVisual *asv,
                                struct ASImageManager *imman,
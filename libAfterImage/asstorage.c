@@ -49,7 +49,13 @@
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h>
 #endif
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
 #include <memory.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 #ifndef HAVE_ZLIB_H
 #include "zlib/zlib.h"
@@ -64,13 +70,132 @@
 #endif
 
 #include "asstorage.h"
+#include "asimage.h"
+
+#ifdef ASIM_X86_SIMD_DISPATCH
+#include <immintrin.h>
+#endif
 
 /* default storage : */
 
 ASStorage *_as_default_storage = NULL ;
 
-#define get_default_asstorage()   (_as_default_storage?_as_default_storage:(_as_default_storage=create_asstorage()))
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+/* Storage lock guards array of blocks, and each block has its own lock 
+ * guarding its slots. Storage lock is always obtained before block lock 
+ * and never while holding one, and no thread ever holds more then one 
+ * block locked. */
+#define ASSTORAGE_RDLOCK(s)			pthread_rwlock_rdlock( (pthread_rwlock_t*)((s)->lock) )
+#define ASSTORAGE_WRLOCK(s)			pthread_rwlock_wrlock( (pthread_rwlock_t*)((s)->lock) )
+#define ASSTORAGE_UNLOCK(s)			pthread_rwlock_unlock( (pthread_rwlock_t*)((s)->lock) )
+#define ASSTORAGE_LOCK_BLOCK(b)		pthread_mutex_lock( (pthread_mutex_t*)((b)->lock) )
+#define ASSTORAGE_TRYLOCK_BLOCK(b)	(pthread_mutex_trylock( (pthread_mutex_t*)((b)->lock) ) == 0)
+#define ASSTORAGE_UNLOCK_BLOCK(b)	pthread_mutex_unlock( (pthread_mutex_t*)((b)->lock) )
+#else
+#define ASSTORAGE_RDLOCK(s)			do{}while(0)
+#define ASSTORAGE_WRLOCK(s)			do{}while(0)
+#define ASSTORAGE_UNLOCK(s)			do{}while(0)
+#define ASSTORAGE_LOCK_BLOCK(b)		do{}while(0)
+#define ASSTORAGE_TRYLOCK_BLOCK(b)	True
+#define ASSTORAGE_UNLOCK_BLOCK(b)	do{}while(0)
+#endif
+
+#if defined(HAVE_PTHREAD) && defined(__GNUC__)
+#define ASSTORAGE_ATOMIC_ADD(var,val)	__sync_fetch_and_add( &(var), (val) )
+#define ASSTORAGE_ATOMIC_SUB(var,val)	__sync_fetch_and_sub( &(var), (val) )
+#define ASSTORAGE_PUBLISH(ptr,val)		__sync_bool_compare_and_swap( &(ptr), NULL, (val) )
+#else
+#define ASSTORAGE_ATOMIC_ADD(var,val)	((var) += (val))
+#define ASSTORAGE_ATOMIC_SUB(var,val)	((var) -= (val))
+#define ASSTORAGE_PUBLISH(ptr,val)		(((ptr) = (val)) != NULL)
+#endif
+
+ASStorage *create_asstorage();
+void destroy_asstorage(ASStorage **pstorage);
+
+static ASStorage *
+get_default_asstorage()
+{
+	if( _as_default_storage == NULL ) 
+	{
+		ASStorage *storage = create_asstorage();
+		if( !ASSTORAGE_PUBLISH( _as_default_storage, storage ) ) 
+			destroy_asstorage( &storage );  /* some other thread got there first */
+	}
+	return _as_default_storage;
+}
+
+/* Compression buffers are kept per thread. We also remember what block 
+ * thread stored its data into most recently, so that different threads 
+ * would tend to use different blocks and would not wait on each other : */
+typedef struct ASStorageScratch
+{
+	ASStorageDiff  *diff_buf ;
+	CARD8  *comp_buf ;
+	size_t 	comp_buf_size ; 
+	CARD16 *lz_hash ;
+
+	ASStorage *arena_storage ;
+	int 	arena_block ;  		/* index of the block + 1 */
+}ASStorageScratch;
+
+static void
+destroy_storage_scratch( void *data )
+{
+	ASStorageScratch *scratch = (ASStorageScratch*)data ;
+	if( scratch ) 
+	{
+		if( scratch->comp_buf )
+			free( scratch->comp_buf);
+		if( scratch->diff_buf )
+			free( scratch->diff_buf);
+		if( scratch->lz_hash )
+			free( scratch->lz_hash);
+		free( scratch );
+	}
+}
 
+#ifdef HAVE_PTHREAD
+static pthread_key_t  _as_scratch_key ;
+static pthread_once_t _as_scratch_key_once = PTHREAD_ONCE_INIT ;
+
+static void
+create_scratch_key()
+{
+	pthread_key_create( &_as_scratch_key, destroy_storage_scratch );
+}
+#define get_thread_scratch()  	((ASStorageScratch*)pthread_getspecific( _as_scratch_key ))
+#define set_thread_scratch(s)  	pthread_setspecific( _as_scratch_key, (s) )
+#else
+static ASStorageScratch *_as_scratch = NULL ;
+#define get_thread_scratch()  	_as_scratch
+#define set_thread_scratch(s)  	(_as_scratch = (s))
+#endif
+
+static ASStorageScratch *
+get_storage_scratch( size_t size )
+{
+	ASStorageScratch *scratch ;
+#ifdef HAVE_PTHREAD
+	pthread_once( &_as_scratch_key_once, create_scratch_key );
+#endif
+	if( (scratch = get_thread_scratch()) == NULL ) 
+	{
+		scratch = safecalloc( 1, sizeof(ASStorageScratch) );
+		set_thread_scratch( scratch );
+	}
+	if( scratch->comp_buf_size < size ) 
+	{	
+		scratch->comp_buf_size = ((size/AS_STORAGE_PAGE_SIZE)+1)*AS_STORAGE_PAGE_SIZE ;
+		scratch->comp_buf = realloc( scratch->comp_buf, scratch->comp_buf_size );
+		scratch->diff_buf = realloc( scratch->diff_buf, scratch->comp_buf_size*sizeof(ASStorageDiff) );
+#ifdef DEBUG_ALLOCS
+		show_debug( __FILE__,"get_storage_scratch",__LINE__," realloced compression buffer to %d+%d*%d",scratch->comp_buf_size, scratch->comp_buf_size, sizeof(ASStorageDiff) );
+#endif 
+	}
+	return scratch;
+}
 
 /************************************************************************/
 /* Private Functions : 													*/
@@ -82,6 +207,14 @@ ASStorage *_as_default_storage = NULL ;
 static size_t UsedMemory = 0 ;
 static size_t UncompressedSize = 0, CompressedSize = 0 ;
 
+/* Memory area holding slots of one or more mapped blocks : */
+typedef struct ASStorageMapping
+{
+	void   *addr ;
+	size_t  size ;
+	int 	blocks_count ;	/* mapping is released with the last block */
+}ASStorageMapping;
+
 static inline ASStorageID 
 make_asstorage_id( int block_id, int slot_id )
 {
@@ -249,6 +382,32 @@ compute_diff32_24bitshift_masked( register ASStorageDiff *diff, CARD8 *data, int
 	}
 }	   
 
+typedef void (*compute_diff8_func_type)(ASStorageDiff*,CARD8*,int);
+typedef int  (*find_nonzero_diff_func_type)(ASStorageDiff*,int,int);
+typedef void (*expand_data8_func_type)(CARD32*,CARD8*,int);
+
+/* implementations of the codec functions are selected at runtime 
+ * by select_asstorage_impl() - see below */
+
+static int 
+find_nonzero_diff_c( ASStorageDiff *diff, int start, int end )
+{
+	while( start < end && diff[start] == 0 ) 
+		++start ;
+	return start;
+}
+
+static void 
+expand_data8_c( CARD32 *dst32, CARD8 *src8, int size )
+{
+	register int i;
+	for( i = 0 ;  i < size ; ++i ) 
+		dst32[i] = src8[i] ;
+}
+
+static find_nonzero_diff_func_type find_nonzero_diff_impl = find_nonzero_diff_c ;
+static expand_data8_func_type expand_data8_impl = expand_data8_c ;
+
 static int 
 rlediff_compress( CARD8 *buffer,  ASStorageDiff *diff, int size )
 {
@@ -267,13 +426,10 @@ rlediff_compress( CARD8 *buffer,  ASStorageDiff *diff, int size )
 		
 		if( d == 0 ) 
 		{
-			int zero_size = 0 ;  /* intentionally ! */ 
-			while( ++i < size && zero_size < 127 ) 	 
-			{	
-				if( diff[i] != 0 ) 
-					break;
-				++zero_size ;
-			}
+			int zero_size ;
+			int run_end = find_nonzero_diff_impl( diff, i+1, (size-i > 128)? i+128 : size );
+			zero_size = run_end - i - 1 ;  /* intentionally ! */ 
+			i = run_end ;
 #if defined(DEBUG_COMPRESS) && !defined(NO_DEBUG_OUTPUT)
 			fprintf( stderr, "comp_size = %d at line %d\n", comp_size, __LINE__ );
 #endif
@@ -475,6 +631,42 @@ rlediff_compress( CARD8 *buffer,  ASStorageDiff *diff, int size )
 	return comp_size ;
 }	 
 
+/* decode 16 outputs at a time of 4 bit and 8 bit runs : */
+typedef CARD8 (*decode_deltas_func_type)(CARD8*,CARD8*,int,CARD8);
+
+static CARD8
+decode_4bit_deltas_c( CARD8 *buffer, CARD8 *data, int count, CARD8 last_val )
+{
+	int i ;
+	for( i = 0 ; i < count ; i += 2 ) 
+	{
+		CARD8 c = *(data++) ;
+		CARD8 mod = ((c>>4)&0x07)+1;
+		last_val = (c&0x80)?last_val - mod : last_val + mod ;
+		*(buffer++) = last_val ;
+		mod = (c&0x07)+1;
+		last_val = (c&0x08)?last_val - mod : last_val + mod ;
+		*(buffer++) = last_val ;
+	}
+	return last_val;
+}
+
+static CARD8
+decode_8bit_deltas_c( CARD8 *buffer, CARD8 *data, int count, CARD8 last_val )
+{
+	int i ;
+	for( i = 0 ; i < count ; ++i ) 
+	{
+		CARD8 mod = (data[i]&0x7F)+8;
+		last_val = (data[i]&0x80)?last_val - mod : last_val + mod ;
+		buffer[i] = last_val ;
+	}
+	return last_val;
+}
+
+static decode_deltas_func_type decode_4bit_deltas_impl = decode_4bit_deltas_c ;
+static decode_deltas_func_type decode_8bit_deltas_impl = decode_8bit_deltas_c ;
+
 static int
 rlediff_decompress_bitmap( CARD8 *buffer,  CARD8* data, int size, CARD8 bitmap_value )
 {
@@ -485,9 +677,9 @@ rlediff_decompress_bitmap( CARD8 *buffer,  CARD8* data, int size, CARD8 bitmap_v
 
 	while( in_bytes < size ) 
 	{
-		count = ((unsigned int)(data[in_bytes++])+1) ;
-		while( --count > 0 ) 
-			buffer[out_bytes++] = curr_val ;
+		count = data[in_bytes++] ;
+		memset( buffer+out_bytes, curr_val, count );
+		out_bytes += count ;
 		curr_val = (curr_val == bitmap_value)? 0 : bitmap_value ;
 	}
 	
@@ -515,12 +707,20 @@ rlediff_decompress( CARD8 *buffer,  CARD8* data, int size )
 		if( (c & RLE_ZERO_MASK) == 0 ) 			   
 		{
 			count = (int)c  + 1 ;
-			while( --count >= 0 )  	  
-				buffer[out_bytes++] = last_val ;
+			memset( buffer+out_bytes, last_val, count );
+			out_bytes += count ;
 		}else if( (c & RLE_NOZERO_SHORT_MASK ) == RLE_NOZERO_SHORT_SIG ) 
 		{
 			count = c & RLE_NOZERO_SHORT_LENGTH ;
 			++count ;
+			if( count >= 16 ) 
+			{
+				int vec_count = count&(~15) ;
+				last_val = decode_4bit_deltas_impl( buffer+out_bytes, data+in_bytes, vec_count, last_val );
+				out_bytes += vec_count ;
+				in_bytes += vec_count>>1 ;
+				count -= vec_count ;
+			}
 			while( --count >= 0 ) 
 			{
 				CARD8 mod = ((data[in_bytes]>>4)&0x07)+1;
@@ -568,13 +768,10 @@ rlediff_decompress( CARD8 *buffer,  CARD8* data, int size )
 				}
 			}else if( (c & RLE_NOZERO_LONG_MASK ) == RLE_NOZERO_LONG2_SIG ) 
 			{
-				while( --count >= 0 ) 
-				{
-					CARD8 mod = (data[in_bytes]&0x7F)+8;
-					last_val = (data[in_bytes]&0x80)?last_val - mod : last_val + mod ;
-					buffer[out_bytes++] = last_val ;
-					++in_bytes ;
-				}
+				last_val = ((count == 16)? decode_8bit_deltas_impl : decode_8bit_deltas_c)
+								( buffer+out_bytes, data+in_bytes, count, last_val );
+				out_bytes += count ;
+				in_bytes += count ;
 			}else
 			{
 				Bool sign = ((c & RLE_NOZERO_LONG_MASK ) == RLE_9BIT_NEG_SIG);
@@ -594,6 +791,150 @@ rlediff_decompress( CARD8 *buffer,  CARD8* data, int size )
 }	 
 
 
+/* LZ compression of the byte to byte differences. It is only worth it 
+ * for lines that do not compress well with RLE-diff, such as photographs 
+ * with repeating details. Encoding is a sequence of :
+ * 	LLLLMMMM [L...] literals [offset_lo offset_hi [M...]]
+ * where LLLL is the count of literals and MMMM is the length of match 
+ * minus LZ_MIN_MATCH. Count of 15 is followed by extra bytes added to it, 
+ * until byte other then 255 is encountered. Data ends with literals, 
+ * and there is no match following the very last sequence.
+ */
+#define LZ_HASH_BITS		12
+#define LZ_MIN_MATCH		4
+#define LZ_MAX_OFFSET		0x0000FFFF
+#define LZ_MAX_SIZE			0x0000FFFF  /* positions are kept in CARD16 hash */
+
+static inline CARD32
+lz_read32( CARD8 *data ) 
+{
+	CARD32 v ;
+	memcpy( &v, data, sizeof(CARD32) );
+	return v;
+}
+
+static inline int
+lz_write_count( CARD8 *buffer, int out, int count ) 
+{
+	while( count >= 255 ) 
+	{
+		buffer[out++] = 255 ;
+		count -= 255 ;
+	}
+	buffer[out++] = count ;
+	return out;
+}
+
+/* returns new size of the output, or 0 if it would exceed max_size */
+static int
+lz_emit_sequence( CARD8 *buffer, int out, int max_size, CARD8 *literals, int lit_count, int offset, int match_len )
+{
+	int match_code = (match_len > 0)? match_len - LZ_MIN_MATCH : 0 ;
+	/* worst case size of the sequence : */
+	if( out + 1 + lit_count + lit_count/255 + 1 + 2 + match_code/255 + 1 > max_size ) 
+		return 0;
+	buffer[out++] = ((lit_count >= 15)? 0xF0 : (lit_count<<4))|((match_code >= 15)? 0x0F : match_code) ;
+	if( lit_count >= 15 ) 
+		out = lz_write_count( buffer, out, lit_count-15 );
+	memcpy( buffer+out, literals, lit_count );
+	out += lit_count ;
+	if( match_len > 0 ) 
+	{
+		buffer[out++] = offset&0x00FF ;
+		buffer[out++] = (offset>>8)&0x00FF ;
+		if( match_code >= 15 ) 
+			out = lz_write_count( buffer, out, match_code-15 );
+	}
+	return out;
+}
+
+static int 
+lz_compress( CARD8 *buffer, CARD8 *data, int size, int max_size, CARD16 *hash )
+{
+	int i = 0, anchor = 0, out = 0 ;
+
+	if( size > LZ_MAX_SIZE || size < LZ_MIN_MATCH*2 ) 
+		return 0;
+	memset( hash, 0x00, sizeof(CARD16)<<LZ_HASH_BITS );
+	while( i + LZ_MIN_MATCH <= size ) 
+	{
+		CARD32 seq = lz_read32( data+i );
+		int h = (seq*2654435761U)>>(32-LZ_HASH_BITS) ;
+		int ref = (int)hash[h] - 1 ;
+		hash[h] = i+1 ;
+		if( ref >= 0 && i - ref <= LZ_MAX_OFFSET && lz_read32( data+ref ) == seq ) 
+		{
+			int len = LZ_MIN_MATCH ;
+			while( i+len < size && data[ref+len] == data[i+len] ) 
+				++len ;
+			if( (out = lz_emit_sequence( buffer, out, max_size, data+anchor, i-anchor, i-ref, len )) == 0 ) 
+				return 0;
+			i += len ;
+			anchor = i ;
+		}else
+			++i ;
+	}
+	if( anchor < size ) 
+		if( (out = lz_emit_sequence( buffer, out, max_size, data+anchor, size-anchor, 0, 0 )) == 0 ) 
+			return 0;
+	return out;
+}
+
+/* reads extension bytes of the length field, returns False if input ends
+ * before the length does : */
+static inline Bool
+lz_extend_length( CARD8 *data, int size, int *in_bytes, int *count )
+{
+	int c ;
+	do
+	{
+		if( *in_bytes >= size )
+			return False;
+		c = data[(*in_bytes)++] ;
+		*count += c ;
+	}while( c == 255 );
+	return True;
+}
+
+static int
+lz_decompress( CARD8 *buffer,  CARD8* data, int size, int uncompressed_size )
+{
+	int in_bytes = 0, out_bytes = 0 ;
+
+	while( in_bytes < size ) 
+	{
+		int token = data[in_bytes++] ;
+		int count = token>>4, offset, c ;
+		if( count == 15 && !lz_extend_length( data, size, &in_bytes, &count ) )
+			break;                            /* corrupted data */
+		if( out_bytes + count > uncompressed_size || in_bytes + count > size ) 
+			break;                            /* corrupted data */
+		memcpy( buffer+out_bytes, data+in_bytes, count );
+		out_bytes += count ;
+		in_bytes += count ;
+		if( in_bytes + 2 > size ) 
+			break;                            /* last sequence */
+		offset = data[in_bytes]|(((int)data[in_bytes+1])<<8) ;
+		in_bytes += 2 ;
+		count = (token&0x0F) + LZ_MIN_MATCH ;
+		if( (token&0x0F) == 15 && !lz_extend_length( data, size, &in_bytes, &count ) )
+			break;
+		if( offset == 0 || offset > out_bytes || out_bytes + count > uncompressed_size ) 
+			break;
+		if( offset >= count ) 
+			memcpy( buffer+out_bytes, buffer+out_bytes-offset, count );
+		else
+		{	/* overlapping match repeats last offset bytes */
+			CARD8 *src = buffer+out_bytes-offset ;
+			for( c = 0 ; c < count ; ++c ) 
+				buffer[out_bytes+c] = src[c] ;
+		}
+		out_bytes += count ;
+	}
+	LOCAL_DEBUG_OUT( "in_bytes = %d, out_bytes = %d, size = %d", in_bytes, out_bytes, size );
+	return out_bytes;
+}
+
 static int
 copy_data_tinted (CARD8 *buffer, CARD32 *data32, int size, CARD32 tint)
 {
@@ -709,87 +1050,446 @@ copy_data32_24bitshift_masked( CARD8 *buffer, CARD32 *data32, int size)
 }
 
 
+/*************************************************************************/
+/* vectorized implementations of the codec :                              */
+/* Diff computation, search for the end of zero runs, and conversion     */
+/* between 8 and 32 bit data are done with SSE2 or AVX2, selected at     */
+/* runtime. Results are always identical to the C code above, so the     */
+/* format of the compressed data does not depend on the CPU.             */
+/*************************************************************************/
+#ifdef ASIM_X86_SIMD_DISPATCH
+
+#define V_ATTR	__attribute__((target("sse2")))
+
+static inline V_ATTR __m128i
+extract_diff_data_sse2( __m128i v, __m128i shift, __m128i mask )
+{
+	return _mm_and_si128( _mm_srl_epi32( v, shift ), mask );
+}
+
+/* 16 bit truncation of 32 bit differences, same as assigning int to short : */
+static inline V_ATTR __m128i
+pack_diffs_sse2( __m128i lo, __m128i hi )
+{
+	lo = _mm_srai_epi32( _mm_slli_epi32( lo, 16 ), 16 );
+	hi = _mm_srai_epi32( _mm_slli_epi32( hi, 16 ), 16 );
+	return _mm_packs_epi32( lo, hi );
+}
+
+static inline V_ATTR void
+compute_diff32_shift_sse2( ASStorageDiff *diff, CARD8 *data, int size, int shift_bits, CARD32 mask_bits )
+{
+	CARD32 *data32 = (CARD32*)data ;
+	__m128i shift = _mm_cvtsi32_si128( shift_bits ), mask = _mm_set1_epi32( mask_bits );
+	int i = 1 ;
+	diff[0] = (ASStorageDiff)((data32[0]>>shift_bits)&mask_bits) ;
+	for( ; i+8 <= size ; i += 8 ) 
+	{
+		__m128i lo = _mm_sub_epi32( extract_diff_data_sse2( _mm_loadu_si128((__m128i*)(data32+i)), shift, mask ),
+									extract_diff_data_sse2( _mm_loadu_si128((__m128i*)(data32+i-1)), shift, mask ));
+		__m128i hi = _mm_sub_epi32( extract_diff_data_sse2( _mm_loadu_si128((__m128i*)(data32+i+4)), shift, mask ),
+									extract_diff_data_sse2( _mm_loadu_si128((__m128i*)(data32+i+3)), shift, mask ));
+		_mm_storeu_si128( (__m128i*)(diff+i), pack_diffs_sse2( lo, hi ) );
+	}
+	for( ; i < size ; ++i ) 
+		diff[i] = (ASStorageDiff)((data32[i]>>shift_bits)&mask_bits) - (ASStorageDiff)((data32[i-1]>>shift_bits)&mask_bits) ;
+}
+
+static V_ATTR void
+compute_diff8_sse2( ASStorageDiff *diff, CARD8 *data, int size ) 
+{
+	__m128i zero = _mm_setzero_si128();
+	int i = 1 ;
+	diff[0] = data[0] ;
+	for( ; i+16 <= size ; i += 16 ) 
+	{
+		__m128i curr = _mm_loadu_si128((__m128i*)(data+i)), prev = _mm_loadu_si128((__m128i*)(data+i-1));
+		_mm_storeu_si128( (__m128i*)(diff+i), _mm_sub_epi16( _mm_unpacklo_epi8( curr, zero ), _mm_unpacklo_epi8( prev, zero )));
+		_mm_storeu_si128( (__m128i*)(diff+i+8), _mm_sub_epi16( _mm_unpackhi_epi8( curr, zero ), _mm_unpackhi_epi8( prev, zero )));
+	}
+	for( ; i < size ; ++i ) 
+		diff[i] = (ASStorageDiff)data[i] - (ASStorageDiff)data[i-1] ;
+}
+
+static V_ATTR int 
+find_nonzero_diff_sse2( ASStorageDiff *diff, int start, int end )
+{
+	__m128i zero = _mm_setzero_si128();
+	for( ; start+8 <= end ; start += 8 ) 
+	{
+		int zeros = _mm_movemask_epi8( _mm_cmpeq_epi16( _mm_loadu_si128((__m128i*)(diff+start)), zero ));
+		if( zeros != 0x0FFFF ) 
+			return start + (__builtin_ctz( ~zeros )>>1);
+	}
+	return find_nonzero_diff_c( diff, start, end );
+}
+
+static inline V_ATTR int
+copy_data32_shift_sse2( CARD8 *buffer, CARD32 *data32, int size, int shift_bits )
+{
+	__m128i shift = _mm_cvtsi32_si128( shift_bits ), mask = _mm_set1_epi32( 0x0FF );
+	int i = 0 ;
+	for( ; i+16 <= size ; i += 16 ) 
+	{
+		__m128i v0 = extract_diff_data_sse2( _mm_loadu_si128((__m128i*)(data32+i)), shift, mask );
+		__m128i v1 = extract_diff_data_sse2( _mm_loadu_si128((__m128i*)(data32+i+4)), shift, mask );
+		__m128i v2 = extract_diff_data_sse2( _mm_loadu_si128((__m128i*)(data32+i+8)), shift, mask );
+		__m128i v3 = extract_diff_data_sse2( _mm_loadu_si128((__m128i*)(data32+i+12)), shift, mask );
+		_mm_storeu_si128( (__m128i*)(buffer+i), _mm_packus_epi16( _mm_packs_epi32( v0, v1 ), _mm_packs_epi32( v2, v3 ) ));
+	}
+	for( ; i < size ; ++i ) 
+		buffer[i] = data32[i]>>shift_bits ;
+	return size;
+}
+
+static V_ATTR void 
+expand_data8_sse2( CARD32 *dst32, CARD8 *src8, int size )
+{
+	__m128i zero = _mm_setzero_si128();
+	int i = 0 ;
+	for( ; i+16 <= size ; i += 16 ) 
+	{
+		__m128i v = _mm_loadu_si128((__m128i*)(src8+i));
+		__m128i lo = _mm_unpacklo_epi8( v, zero ), hi = _mm_unpackhi_epi8( v, zero );
+		_mm_storeu_si128( (__m128i*)(dst32+i),    _mm_unpacklo_epi16( lo, zero ));
+		_mm_storeu_si128( (__m128i*)(dst32+i+4),  _mm_unpackhi_epi16( lo, zero ));
+		_mm_storeu_si128( (__m128i*)(dst32+i+8),  _mm_unpacklo_epi16( hi, zero ));
+		_mm_storeu_si128( (__m128i*)(dst32+i+12), _mm_unpackhi_epi16( hi, zero ));
+	}
+	expand_data8_c( dst32+i, src8+i, size-i );
+}
+
+/* 16 byte wide prefix sum of deltas, starting at last_val : */
+static inline V_ATTR __m128i
+accumulate_deltas_sse2( __m128i deltas, CARD8 last_val )
+{
+	deltas = _mm_add_epi8( deltas, _mm_slli_si128( deltas, 1 ));
+	deltas = _mm_add_epi8( deltas, _mm_slli_si128( deltas, 2 ));
+	deltas = _mm_add_epi8( deltas, _mm_slli_si128( deltas, 4 ));
+	deltas = _mm_add_epi8( deltas, _mm_slli_si128( deltas, 8 ));
+	return _mm_add_epi8( deltas, _mm_set1_epi8( last_val ));
+}
+
+/* (value ^ sign) - sign == sign ? -value : value */
+#define APPLY_DELTA_SIGN_SSE2(v,sign)	_mm_sub_epi8( _mm_xor_si128( (v), (sign) ), (sign) )
+
+static V_ATTR CARD8
+decode_4bit_deltas_sse2( CARD8 *buffer, CARD8 *data, int count, CARD8 last_val )
+{
+	__m128i zero = _mm_setzero_si128(), seven = _mm_set1_epi8( 0x07 ), one = _mm_set1_epi8( 0x01 );
+	__m128i eight = _mm_set1_epi8( 0x08 );
+	int i ;
+	for( i = 0 ; i < count ; i += 16, data += 8, buffer += 16 ) 
+	{
+		__m128i c = _mm_loadl_epi64( (__m128i*)data );
+		__m128i hi = _mm_add_epi8( _mm_and_si128( _mm_srli_epi16( c, 4 ), seven ), one );
+		__m128i lo = _mm_add_epi8( _mm_and_si128( c, seven ), one );
+		__m128i res ;
+		hi = APPLY_DELTA_SIGN_SSE2( hi, _mm_cmplt_epi8( c, zero ));
+		lo = APPLY_DELTA_SIGN_SSE2( lo, _mm_cmpeq_epi8( _mm_and_si128( c, eight ), eight ));
+		res = accumulate_deltas_sse2( _mm_unpacklo_epi8( hi, lo ), last_val );
+		_mm_storeu_si128( (__m128i*)buffer, res );
+		last_val = _mm_extract_epi16( res, 7 )>>8 ;
+	}
+	return last_val;
+}
+
+static V_ATTR CARD8
+decode_8bit_deltas_sse2( CARD8 *buffer, CARD8 *data, int count, CARD8 last_val )
+{
+	__m128i zero = _mm_setzero_si128();
+	int i ;
+	for( i = 0 ; i < count ; i += 16, data += 16, buffer += 16 ) 
+	{
+		__m128i c = _mm_loadu_si128( (__m128i*)data );
+		__m128i mod = _mm_add_epi8( _mm_and_si128( c, _mm_set1_epi8( 0x7F ) ), _mm_set1_epi8( 8 ));
+		__m128i res = accumulate_deltas_sse2( APPLY_DELTA_SIGN_SSE2( mod, _mm_cmplt_epi8( c, zero )), last_val );
+		_mm_storeu_si128( (__m128i*)buffer, res );
+		last_val = _mm_extract_epi16( res, 7 )>>8 ;
+	}
+	return last_val;
+}
+
+#undef V_ATTR
+#define V_ATTR	__attribute__((target("avx2")))
+
+static inline V_ATTR __m256i
+extract_diff_data_avx2( __m256i v, __m128i shift, __m256i mask )
+{
+	return _mm256_and_si256( _mm256_srl_epi32( v, shift ), mask );
+}
+
+static inline V_ATTR void
+compute_diff32_shift_avx2( ASStorageDiff *diff, CARD8 *data, int size, int shift_bits, CARD32 mask_bits )
+{
+	CARD32 *data32 = (CARD32*)data ;
+	__m128i shift = _mm_cvtsi32_si128( shift_bits ); 
+	__m256i mask = _mm256_set1_epi32( mask_bits );
+	int i = 1 ;
+	diff[0] = (ASStorageDiff)((data32[0]>>shift_bits)&mask_bits) ;
+	for( ; i+16 <= size ; i += 16 ) 
+	{
+		__m256i lo = _mm256_sub_epi32( extract_diff_data_avx2( _mm256_loadu_si256((__m256i*)(data32+i)), shift, mask ),
+									   extract_diff_data_avx2( _mm256_loadu_si256((__m256i*)(data32+i-1)), shift, mask ));
+		__m256i hi = _mm256_sub_epi32( extract_diff_data_avx2( _mm256_loadu_si256((__m256i*)(data32+i+8)), shift, mask ),
+									   extract_diff_data_avx2( _mm256_loadu_si256((__m256i*)(data32+i+7)), shift, mask ));
+		lo = _mm256_srai_epi32( _mm256_slli_epi32( lo, 16 ), 16 );
+		hi = _mm256_srai_epi32( _mm256_slli_epi32( hi, 16 ), 16 );
+		/* packs works within 128 bit lanes, so we need to put quads back in order : */
+		_mm256_storeu_si256( (__m256i*)(diff+i), _mm256_permute4x64_epi64( _mm256_packs_epi32( lo, hi ), 0xD8 ));
+	}
+	for( ; i < size ; ++i ) 
+		diff[i] = (ASStorageDiff)((data32[i]>>shift_bits)&mask_bits) - (ASStorageDiff)((data32[i-1]>>shift_bits)&mask_bits) ;
+}
+
+static V_ATTR void
+compute_diff8_avx2( ASStorageDiff *diff, CARD8 *data, int size ) 
+{
+	int i = 1 ;
+	diff[0] = data[0] ;
+	for( ; i+16 <= size ; i += 16 ) 
+	{
+		__m256i curr = _mm256_cvtepu8_epi16( _mm_loadu_si128((__m128i*)(data+i)));
+		__m256i prev = _mm256_cvtepu8_epi16( _mm_loadu_si128((__m128i*)(data+i-1)));
+		_mm256_storeu_si256( (__m256i*)(diff+i), _mm256_sub_epi16( curr, prev ));
+	}
+	for( ; i < size ; ++i ) 
+		diff[i] = (ASStorageDiff)data[i] - (ASStorageDiff)data[i-1] ;
+}
+
+static V_ATTR int 
+find_nonzero_diff_avx2( ASStorageDiff *diff, int start, int end )
+{
+	__m256i zero = _mm256_setzero_si256();
+	for( ; start+16 <= end ; start += 16 ) 
+	{
+		unsigned int zeros = _mm256_movemask_epi8( _mm256_cmpeq_epi16( _mm256_loadu_si256((__m256i*)(diff+start)), zero ));
+		if( zeros != 0xFFFFFFFF ) 
+			return start + (__builtin_ctz( ~zeros )>>1);
+	}
+	return find_nonzero_diff_sse2( diff, start, end );
+}
+
+static inline V_ATTR int
+copy_data32_shift_avx2( CARD8 *buffer, CARD32 *data32, int size, int shift_bits )
+{
+	__m128i shift = _mm_cvtsi32_si128( shift_bits ); 
+	__m256i mask = _mm256_set1_epi32( 0x0FF );
+	__m256i order = _mm256_setr_epi32( 0, 4, 1, 5, 2, 6, 3, 7 );
+	int i = 0 ;
+	for( ; i+32 <= size ; i += 32 ) 
+	{
+		__m256i v0 = extract_diff_data_avx2( _mm256_loadu_si256((__m256i*)(data32+i)), shift, mask );
+		__m256i v1 = extract_diff_data_avx2( _mm256_loadu_si256((__m256i*)(data32+i+8)), shift, mask );
+		__m256i v2 = extract_diff_data_avx2( _mm256_loadu_si256((__m256i*)(data32+i+16)), shift, mask );
+		__m256i v3 = extract_diff_data_avx2( _mm256_loadu_si256((__m256i*)(data32+i+24)), shift, mask );
+		__m256i packed = _mm256_packus_epi16( _mm256_packs_epi32( v0, v1 ), _mm256_packs_epi32( v2, v3 ));
+		_mm256_storeu_si256( (__m256i*)(buffer+i), _mm256_permutevar8x32_epi32( packed, order ));
+	}
+	copy_data32_shift_sse2( buffer+i, data32+i, size-i, shift_bits );
+	return size;
+}
+
+static V_ATTR void 
+expand_data8_avx2( CARD32 *dst32, CARD8 *src8, int size )
+{
+	int i = 0 ;
+	for( ; i+16 <= size ; i += 16 ) 
+	{
+		_mm256_storeu_si256( (__m256i*)(dst32+i),   _mm256_cvtepu8_epi32( _mm_loadl_epi64((__m128i*)(src8+i))));
+		_mm256_storeu_si256( (__m256i*)(dst32+i+8), _mm256_cvtepu8_epi32( _mm_loadl_epi64((__m128i*)(src8+i+8))));
+	}
+	expand_data8_c( dst32+i, src8+i, size-i );
+}
+
+#undef V_ATTR
+
+#define DEFINE_CODEC_VEC(suffix) \
+static __attribute__((target(#suffix))) void compute_diff32_##suffix( ASStorageDiff *diff, CARD8 *data, int size ) \
+{	compute_diff32_shift_##suffix( diff, data, size, 0, 0xFFFFFFFF ); } \
+static __attribute__((target(#suffix))) void compute_diff32_8bitshift_##suffix( ASStorageDiff *diff, CARD8 *data, int size ) \
+{	compute_diff32_shift_##suffix( diff, data, size, 8, 0xFFFFFFFF ); } \
+static __attribute__((target(#suffix))) void compute_diff32_16bitshift_##suffix( ASStorageDiff *diff, CARD8 *data, int size ) \
+{	compute_diff32_shift_##suffix( diff, data, size, 16, 0xFFFFFFFF ); } \
+static __attribute__((target(#suffix))) void compute_diff32_masked_##suffix( ASStorageDiff *diff, CARD8 *data, int size ) \
+{	compute_diff32_shift_##suffix( diff, data, size, 0, 0x0FF ); } \
+static __attribute__((target(#suffix))) void compute_diff32_8bitshift_masked_##suffix( ASStorageDiff *diff, CARD8 *data, int size ) \
+{	compute_diff32_shift_##suffix( diff, data, size, 8, 0x0FF ); } \
+static __attribute__((target(#suffix))) void compute_diff32_16bitshift_masked_##suffix( ASStorageDiff *diff, CARD8 *data, int size ) \
+{	compute_diff32_shift_##suffix( diff, data, size, 16, 0x0FF ); } \
+static __attribute__((target(#suffix))) void compute_diff32_24bitshift_masked_##suffix( ASStorageDiff *diff, CARD8 *data, int size ) \
+{	compute_diff32_shift_##suffix( diff, data, size, 24, 0x0FF ); } \
+/* (CARD8) cast masks the value anyway, so masked variants are the same : */ \
+static __attribute__((target(#suffix))) int copy_data32_##suffix( CARD8 *buffer, CARD32 *data32, int size ) \
+{	return copy_data32_shift_##suffix( buffer, data32, size, 0 ); } \
+static __attribute__((target(#suffix))) int copy_data32_8bitshift_##suffix( CARD8 *buffer, CARD32 *data32, int size ) \
+{	return copy_data32_shift_##suffix( buffer, data32, size, 8 ); } \
+static __attribute__((target(#suffix))) int copy_data32_16bitshift_##suffix( CARD8 *buffer, CARD32 *data32, int size ) \
+{	return copy_data32_shift_##suffix( buffer, data32, size, 16 ); } \
+static __attribute__((target(#suffix))) int copy_data32_24bitshift_##suffix( CARD8 *buffer, CARD32 *data32, int size ) \
+{	return copy_data32_shift_##suffix( buffer, data32, size, 24 ); } 
+
+DEFINE_CODEC_VEC(sse2)
+DEFINE_CODEC_VEC(avx2)
+
+#endif /* ASIM_X86_SIMD_DISPATCH */
+
+static Bool codec_impl_selected = False ;
+static compute_diff8_func_type compute_diff8_impl = compute_diff8 ;
+static compute_diff_func_type compute_diff_impl[2][4] = 
+{	{	compute_diff32, compute_diff32_8bitshift, compute_diff32_16bitshift, 
+		compute_diff32_24bitshift_masked /* to clear the sign bit ! */ },
+	{	compute_diff32_masked, compute_diff32_8bitshift_masked, compute_diff32_16bitshift_masked, 
+		compute_diff32_24bitshift_masked }
+};
+static copy_data32_func_type copy_data32_impl[2][4] = 
+{	{	copy_data32, copy_data32_8bitshift, copy_data32_16bitshift, 
+		copy_data32_24bitshift_masked /* to clear the sign bit ! */ },
+	{	copy_data32_masked, copy_data32_8bitshift_masked, copy_data32_16bitshift_masked, 
+		copy_data32_24bitshift_masked }
+};
+
+#define SET_CODEC_IMPL(suffix) \
+	do{	compute_diff8_impl = compute_diff8_##suffix ; \
+		compute_diff_impl[0][0] = compute_diff32_##suffix ; \
+		compute_diff_impl[0][1] = compute_diff32_8bitshift_##suffix ; \
+		compute_diff_impl[0][2] = compute_diff32_16bitshift_##suffix ; \
+		compute_diff_impl[0][3] = compute_diff32_24bitshift_masked_##suffix ; \
+		compute_diff_impl[1][0] = compute_diff32_masked_##suffix ; \
+		compute_diff_impl[1][1] = compute_diff32_8bitshift_masked_##suffix ; \
+		compute_diff_impl[1][2] = compute_diff32_16bitshift_masked_##suffix ; \
+		compute_diff_impl[1][3] = compute_diff32_24bitshift_masked_##suffix ; \
+		copy_data32_impl[0][0] = copy_data32_impl[1][0] = copy_data32_##suffix ; \
+		copy_data32_impl[0][1] = copy_data32_impl[1][1] = copy_data32_8bitshift_##suffix ; \
+		copy_data32_impl[0][2] = copy_data32_impl[1][2] = copy_data32_16bitshift_##suffix ; \
+		copy_data32_impl[0][3] = copy_data32_impl[1][3] = copy_data32_24bitshift_##suffix ; \
+		find_nonzero_diff_impl = find_nonzero_diff_##suffix ; \
+		expand_data8_impl = expand_data8_##suffix ; \
+		/* 16 bytes at a time is all decoder can do, so SSE2 only : */ \
+		decode_4bit_deltas_impl = decode_4bit_deltas_sse2 ; \
+		decode_8bit_deltas_impl = decode_8bit_deltas_sse2 ; }while(0)
+
+void
+select_asstorage_impl( CARD32 cpu_features )
+{
+	/* every table entry is valid at all times, so that threads running 
+	 * codec concurrently with this will simply use either implementation : */
+#ifdef ASIM_X86_SIMD_DISPATCH
+	if( get_flags( cpu_features, ASIM_CPU_AVX2 ) )
+		SET_CODEC_IMPL(avx2);
+	else if( get_flags( cpu_features, ASIM_CPU_SSE2 ) )
+		SET_CODEC_IMPL(sse2);
+	else
+#endif
+	{
+		compute_diff8_impl = compute_diff8 ;
+		compute_diff_impl[0][0] = compute_diff32 ;
+		compute_diff_impl[0][1] = compute_diff32_8bitshift ;
+		compute_diff_impl[0][2] = compute_diff32_16bitshift ;
+		compute_diff_impl[0][3] = compute_diff32_24bitshift_masked ; /* to clear the sign bit ! */
+		compute_diff_impl[1][0] = compute_diff32_masked ;
+		compute_diff_impl[1][1] = compute_diff32_8bitshift_masked ;
+		compute_diff_impl[1][2] = compute_diff32_16bitshift_masked ;
+		compute_diff_impl[1][3] = compute_diff32_24bitshift_masked ;
+		copy_data32_impl[0][0] = copy_data32 ;
+		copy_data32_impl[0][1] = copy_data32_8bitshift ;
+		copy_data32_impl[0][2] = copy_data32_16bitshift ;
+		copy_data32_impl[0][3] = copy_data32_24bitshift_masked ; /* to clear the sign bit ! */
+		copy_data32_impl[1][0] = copy_data32_masked ;
+		copy_data32_impl[1][1] = copy_data32_8bitshift_masked ;
+		copy_data32_impl[1][2] = copy_data32_16bitshift_masked ;
+		copy_data32_impl[1][3] = copy_data32_24bitshift_masked ;
+		find_nonzero_diff_impl = find_nonzero_diff_c ;
+		expand_data8_impl = expand_data8_c ;
+		decode_4bit_deltas_impl = decode_4bit_deltas_c ;
+		decode_8bit_deltas_impl = decode_8bit_deltas_c ;
+	}
+	codec_impl_selected = True ;
+}
+
+#define CHECK_CODEC_IMPL() \
+	do{ if( !codec_impl_selected ) get_asimage_cpu_features(); }while(0)
+
+static copy_data32_tinted_func_type copy_data32_tinted_func[2][4] = 
+{	{
+		copy_data_tinted,
+		copy_data_tinted_8bitshift,
+		copy_data_tinted_16bitshift,
+		copy_data_tinted_24bitshift_masked /* to clear the sign bit ! */
+	},
+	{
+		copy_data_tinted_masked,
+		copy_data_tinted_8bitshift_masked,
+		copy_data_tinted_16bitshift_masked,
+		copy_data_tinted_24bitshift_masked
+	}
+};
+
+/* converts data into plane of 8 bit values, applying tint. 
+ * Returns False if data could be used as is */
+static Bool
+make_stored_plane( CARD8 *buffer, CARD8 *data, int plane_size, ASFlagType flags, CARD32 tint )
+{
+	if( get_flags( flags, ASStorage_32Bit ) )
+	{
+		CARD32 *data32 = (CARD32*)data ;
+		if( tint != 0x000000FF ) 
+			copy_data32_tinted_func [get_flags(flags,ASStorage_Masked)?1:0]
+				                 	[ASStorage_Flags2ShiftIdx(flags)](buffer, data32, plane_size, tint);
+		else
+			copy_data32_impl [get_flags(flags,ASStorage_Masked)?1:0]
+				           	 [ASStorage_Flags2ShiftIdx(flags)](buffer, data32, plane_size);
+	}else if( tint != 0x000000FF ) 
+	{
+		int i ;
+		for( i = 0 ; i < plane_size ; ++i )
+			buffer[i] = (((CARD32)data[i])*tint)>>8 ;
+	}else
+		return False;
+	return True;
+}
+
+/* if RLE-diff got line down to that fraction of the original - 
+ * there is no point spending time on LZ : */
+#define LZ_SKIP_RATIO	8
+
 static CARD8* 
-compress_stored_data( ASStorage *storage, CARD8 *data, int size, ASFlagType *flags, int *compressed_size,
+compress_stored_data( CARD8 *data, int size, ASFlagType *flags, int *compressed_size,
 					  CARD32 bitmap_threshold )
 {
-	/* TODO: just a stub for now - need to implement compression */
 	int comp_size = size ;
 	CARD8  *buffer = data ;
+	ASStorageScratch *scratch = get_storage_scratch( size );
+	int plane_size = get_flags( *flags, ASStorage_32Bit )? size/4 : size ;
+	Bool try_lz = get_flags( *flags, ASStorage_LZCompress ) ;
+	CARD32 tint = get_flags( *flags, ASStorage_Bitmap )? 0x00FF : bitmap_threshold ;
 
-	static compute_diff_func_type compute_diff_func[2][4] = 
-	{	{
-			compute_diff32,
-			compute_diff32_8bitshift,
-			compute_diff32_16bitshift,
-			compute_diff32_24bitshift_masked /* to clear the sign bit ! */
-		},
-		{
-			compute_diff32_masked,
-			compute_diff32_8bitshift_masked,
-			compute_diff32_16bitshift_masked,
-			compute_diff32_24bitshift_masked
-		}
-	};
-
-	static copy_data32_tinted_func_type copy_data32_tinted_func[2][4] = 
-	{	{
-			copy_data_tinted,
-			copy_data_tinted_8bitshift,
-			copy_data_tinted_16bitshift,
-			copy_data_tinted_24bitshift_masked /* to clear the sign bit ! */
-		},
-		{
-			copy_data_tinted_masked,
-			copy_data_tinted_8bitshift_masked,
-			copy_data_tinted_16bitshift_masked,
-			copy_data_tinted_24bitshift_masked
-		}
-	};
-
-	static copy_data32_func_type copy_data32_func[2][4] = 
-	{	{
-			copy_data32,
-			copy_data32_8bitshift,
-			copy_data32_16bitshift,
-			copy_data32_24bitshift_masked /* to clear the sign bit ! */
-		},
-		{
-			copy_data32_masked,
-			copy_data32_8bitshift_masked,
-			copy_data32_16bitshift_masked,
-			copy_data32_24bitshift_masked
-		}
-	};
-
+	CHECK_CODEC_IMPL();
+	clear_flags( *flags, ASStorage_LZCompress );
 	if( size < ASStorageSlot_SIZE ) 
+	{	
 		clear_flags( *flags, ASStorage_RLEDiffCompress );
+		try_lz = False ;
+	}
 
 	if (get_flags( *flags, ASStorage_Bitmap )) /* always compress bitmaps !!!! */
+	{	
 		set_flags( *flags, ASStorage_RLEDiffCompress );
+		try_lz = False ;
+	}
 
 	if( get_flags( *flags, ASStorage_RLEDiffCompress ) )
 	{
-		int uncompressed_size = size ;
+		int uncompressed_size = plane_size ;
 
 		clear_flags( *flags, ASStorage_RLEDiffCompress );
-		if( (int)storage->comp_buf_size < size ) 
-		{	
-			storage->comp_buf_size = ((size/AS_STORAGE_PAGE_SIZE)+1)*AS_STORAGE_PAGE_SIZE ;
-			storage->comp_buf = realloc( storage->comp_buf, storage->comp_buf_size );
-			storage->diff_buf = realloc( storage->diff_buf, storage->comp_buf_size*sizeof(ASStorageDiff) );
-#ifdef DEBUG_ALLOCS
-			show_debug( __FILE__,"compress_stored_data",__LINE__," realloced compression buffer to %d+%d*%d",storage->comp_buf_size, storage->comp_buf_size, sizeof(ASStorageDiff) );
-#endif 
-		}
-		buffer = storage->comp_buf ;
+		buffer = scratch->comp_buf ;
 		if( buffer ) 
 		{
 			if( get_flags( *flags, ASStorage_Bitmap ) )
 			{	
 				if( get_flags( *flags, ASStorage_32Bit ) ) 
 				{
-					uncompressed_size = size / 4 ;
 					if( get_flags( *flags, ASStorage_BitShift ) )
 						bitmap_threshold = bitmap_threshold<<ASStorage_Flags2Shift(*flags) ;
 					comp_size = rlediff_compress_bitmap32( buffer, data, uncompressed_size, bitmap_threshold );
@@ -797,23 +1497,21 @@ compress_stored_data( ASStorage *storage, CARD8 *data, int size, ASFlagType *fla
 					comp_size = rlediff_compress_bitmap8( buffer, data, uncompressed_size, bitmap_threshold );
 			}else 
 			{
-				ASStorageDiff tint = bitmap_threshold ;
 				if( get_flags( *flags, ASStorage_32Bit ) ) 
 				{	
-					uncompressed_size = size / 4 ;
-					compute_diff_func[get_flags(*flags,ASStorage_Masked)?1:0]
-					                 [ASStorage_Flags2ShiftIdx(*flags)](storage->diff_buf, data, uncompressed_size );
+					compute_diff_impl[get_flags(*flags,ASStorage_Masked)?1:0]
+					                 [ASStorage_Flags2ShiftIdx(*flags)](scratch->diff_buf, data, uncompressed_size );
 				}else
-					compute_diff8( storage->diff_buf, data, uncompressed_size ); 	  
+					compute_diff8_impl( scratch->diff_buf, data, uncompressed_size ); 	  
 				
 				if( tint != 255 )
 				{
 					int i;
-					ASStorageDiff *diff = storage->diff_buf ; 
+					ASStorageDiff *diff = scratch->diff_buf ; 
 					for( i = 0 ; i < uncompressed_size ; ++i ) 
-						diff[i] = (diff[i]*tint)/256 ;
+						diff[i] = (diff[i]*(ASStorageDiff)tint)/256 ;
 				}	 
-				comp_size = rlediff_compress( buffer, storage->diff_buf, uncompressed_size );
+				comp_size = rlediff_compress( buffer, scratch->diff_buf, uncompressed_size );
 			}
 
 			if( comp_size == 0 )	 
@@ -821,60 +1519,55 @@ compress_stored_data( ASStorage *storage, CARD8 *data, int size, ASFlagType *fla
 				buffer = data ;
 				comp_size = size ;
 			}else
-			{	
 				set_flags( *flags, ASStorage_RLEDiffCompress );
-				UncompressedSize += size ;
-				CompressedSize += comp_size ;
-			}
 		}else
 			buffer = data ;	 
 		
 		LOCAL_DEBUG_OUT( "size = %d, compressed_size = %d, flags = 0x%lX", size, comp_size, *flags );
 	}	 
 
-	if( buffer == data )
+	/* LZ is tried on whatever RLE-diff could not handle well, 
+	 * and result is used only if its smaller : */
+	if( try_lz && (buffer == data || comp_size > plane_size/LZ_SKIP_RATIO) )
 	{
-		CARD32 tint = get_flags( *flags, ASStorage_Bitmap )? 0x00FF : bitmap_threshold ;
-		if( get_flags( *flags, ASStorage_32Bit ) )
+		/* diff buffer is at least twice the size of the data : */
+		CARD8 *plane = (CARD8*)(scratch->diff_buf) ;
+		CARD8 *lz_buf = plane + plane_size ;
+		int lz_size, i ;
+
+		if( make_stored_plane( plane, data, plane_size, *flags, tint ) ) 
 		{
-			CARD32 *data32 = (CARD32*)data ;
-			size /= 4;
-			if( (int)(storage->comp_buf_size) < size ) 
-			{	
-				storage->comp_buf_size = ((size/AS_STORAGE_PAGE_SIZE)+1)*AS_STORAGE_PAGE_SIZE ;
-				storage->comp_buf = realloc( storage->comp_buf, storage->comp_buf_size );
-				storage->diff_buf = realloc( storage->diff_buf, storage->comp_buf_size*sizeof(ASStorageDiff) );
-#ifdef DEBUG_ALLOCS
-			show_debug( __FILE__,"compress_stored_data",__LINE__," realloced compression buffer to %d+%d*%d",storage->comp_buf_size, storage->comp_buf_size, sizeof(ASStorageDiff) );
-#endif 
-
-			}
-			buffer = storage->comp_buf ;
-			if( tint != 0x000000FF ) 
-			{	
-				copy_data32_tinted_func [get_flags(*flags,ASStorage_Masked)?1:0]
-					                 	[ASStorage_Flags2ShiftIdx(*flags)](buffer, data32, size, tint);
-			}else
-			{
-				copy_data32_func [get_flags(*flags,ASStorage_Masked)?1:0]
-					           	 [ASStorage_Flags2ShiftIdx(*flags)](buffer, data32, size);
-
-			}	 
-		}else if( tint != 0x000000FF ) 
+			for( i = plane_size-1 ; i > 0 ; --i ) 
+				plane[i] -= plane[i-1] ;
+		}else
 		{
-			if( (int)storage->comp_buf_size < size ) 
-			{	
-				storage->comp_buf_size = ((size/AS_STORAGE_PAGE_SIZE)+1)*AS_STORAGE_PAGE_SIZE ;
-				storage->comp_buf = realloc( storage->comp_buf, storage->comp_buf_size );
-				storage->diff_buf = realloc( storage->diff_buf, storage->comp_buf_size*sizeof(ASStorageDiff) );
-#ifdef DEBUG_ALLOCS
-			show_debug( __FILE__,"compress_stored_data",__LINE__," realloced compression buffer to %d+%d*%d",storage->comp_buf_size, storage->comp_buf_size, sizeof(ASStorageDiff) );
-#endif 
-			}
-			buffer = storage->comp_buf ;
-			for( comp_size = 0 ; comp_size < size ; ++comp_size )
-				buffer[comp_size] = (((CARD32)data[comp_size])*tint)>>8 ;
-		}	 
+			plane[0] = data[0] ;
+			for( i = 1 ; i < plane_size ; ++i ) 
+				plane[i] = data[i] - data[i-1] ;
+		}
+		if( scratch->lz_hash == NULL ) 
+			scratch->lz_hash = safemalloc( sizeof(CARD16)<<LZ_HASH_BITS );
+		lz_size = lz_compress( lz_buf, plane, plane_size, 
+							   (buffer == data)? plane_size-1 : comp_size-1, scratch->lz_hash );
+		if( lz_size > 0 ) 
+		{
+			clear_flags( *flags, ASStorage_RLEDiffCompress );
+			set_flags( *flags, ASStorage_LZCompress );
+			buffer = lz_buf ;
+			comp_size = lz_size ;
+		}
+		LOCAL_DEBUG_OUT( "size = %d, lz_size = %d, flags = 0x%lX", size, lz_size, *flags );
+	}
+
+	if( get_flags( *flags, ASStorage_RLEDiffCompress|ASStorage_LZCompress ) )
+	{
+		ASSTORAGE_ATOMIC_ADD( UncompressedSize, size );
+		ASSTORAGE_ATOMIC_ADD( CompressedSize, comp_size );
+	}else if( buffer == data )
+	{
+		if( make_stored_plane( scratch->comp_buf, data, plane_size, *flags, tint ) ) 
+			buffer = scratch->comp_buf ;
+		comp_size = plane_size ;
 	}	
 	if( compressed_size ) 
 		*compressed_size = comp_size ;
@@ -882,7 +1575,7 @@ compress_stored_data( ASStorage *storage, CARD8 *data, int size, ASFlagType *fla
 }
 
 static CARD8 *
-decompress_stored_data( ASStorage *storage, CARD8 *data, int size, int uncompressed_size, 
+decompress_stored_data( CARD8 *data, int size, int uncompressed_size, 
 						ASFlagType flags, CARD8 bitmap_value )
 {
 	CARD8  *buffer = data ;
@@ -890,17 +1583,82 @@ decompress_stored_data( ASStorage *storage, CARD8 *data, int size, int uncompres
 	LOCAL_DEBUG_OUT( "size = %d, uncompressed_size = %d, flags = 0x%lX", size, uncompressed_size, flags );
 	if( get_flags( flags, ASStorage_RLEDiffCompress ))
 	{
-		buffer = storage->comp_buf ;
+		buffer = get_storage_scratch( uncompressed_size )->comp_buf ;
 		if( get_flags( flags, ASStorage_Bitmap ) )
 			rlediff_decompress_bitmap( buffer, data, size, bitmap_value );	 
 		else			
 			rlediff_decompress( buffer, data, size );	 
 		/* need to check decompressed size */
+	}else if( get_flags( flags, ASStorage_LZCompress ))
+	{
+		int i, out_bytes ;
+		buffer = get_storage_scratch( uncompressed_size )->comp_buf ;
+		out_bytes = lz_decompress( buffer, data, size, uncompressed_size );
+		if( out_bytes < uncompressed_size ) 
+			memset( buffer+out_bytes, 0x00, uncompressed_size-out_bytes );
+		for( i = 1 ; i < uncompressed_size ; ++i ) 
+			buffer[i] += buffer[i-1] ;
 	}
 	
 	return buffer;
 }
 
+/* walks compressed data without decoding it, to make sure that it expands 
+ * into exactly uncompressed_size bytes, and does not reach past its end : */
+static Bool
+stored_data_valid( CARD8 *data, int size, int uncompressed_size, ASFlagType flags )
+{
+	int in_bytes = 0, out_bytes = 0 ;
+
+	if( uncompressed_size <= 0 ) 
+		return False;
+	switch( get_flags( flags, ASStorage_CompressionType ) )
+	{
+		case 0 :
+			return ( size >= uncompressed_size );
+		case ASStorage_LZCompress :
+			return True;           /* lz_decompress() checks every sequence */
+		case ASStorage_RLEDiffCompress :
+			break;
+		default :
+			return False;
+	}
+	if( get_flags( flags, ASStorage_Bitmap ) )
+	{
+		while( in_bytes < size ) 
+			out_bytes += data[in_bytes++] ;
+		return ( out_bytes == uncompressed_size );
+	}
+	/* see rlediff_decompress() for the encoding : */
+	in_bytes = out_bytes = 1 ;
+	while( in_bytes < size && out_bytes <= uncompressed_size ) 
+	{
+		CARD8 c = data[in_bytes++] ;
+		int count ;
+		if( (c & RLE_ZERO_MASK) == 0 ) 			   
+		{
+			out_bytes += (int)c + 1 ;
+			continue;
+		}
+		if( (c & RLE_NOZERO_SHORT_MASK ) == RLE_NOZERO_SHORT_SIG ) 
+		{
+			count = (c & RLE_NOZERO_SHORT_LENGTH) + 1 ;
+			in_bytes += (count+1)>>1 ;
+		}else
+		{
+			count = (c & RLE_NOZERO_LONG_LENGTH) + 1 ;
+			if( (c & RLE_NOZERO_LONG_MASK ) == RLE_NOZERO_LONG1_SIG ) 
+				in_bytes += (count+3)>>2 ;
+			else
+				in_bytes += count ;
+		}
+		if( in_bytes > size ) 
+			return False;
+		out_bytes += count ;
+	}
+	return ( out_bytes == uncompressed_size );
+}
+
 static void
 add_storage_slots( ASStorageBlock *block )
 {
@@ -928,7 +1686,7 @@ add_storage_slots( ASStorageBlock *block )
 		show_debug( __FILE__,"add_storage_slots",__LINE__,"reallocating %d slots pointers", block->slots_count );
 	block->slots = guarded_realloc( block->slots, block->slots_count*sizeof(ASStorageSlot*));
 #endif
-	UsedMemory += count*sizeof(ASStorageSlot*) ;
+	ASSTORAGE_ATOMIC_ADD( UsedMemory, count*sizeof(ASStorageSlot*) );
 	memset( &(block->slots[i]),	0x00, count*sizeof(ASStorageSlot*) );
 }
 
@@ -953,7 +1711,7 @@ create_asstorage_block( int useable_size )
 		PRINT_MEM_STATS(msg);
 	}
 #endif
-	UsedMemory += allocate_size ;
+	ASSTORAGE_ATOMIC_ADD( UsedMemory, allocate_size );
 	if( ptr == NULL ) 
 		return NULL;
 	block = ptr ;
@@ -966,7 +1724,7 @@ create_asstorage_block( int useable_size )
 	if( block->slots == NULL ) 
 	{	
 		free( ptr ); 
-		UsedMemory -= allocate_size ;
+		ASSTORAGE_ATOMIC_SUB( UsedMemory, allocate_size );
 #ifdef DEBUG_ALLOCS
 		show_debug( __FILE__,"create_asstorage_block",__LINE__,"freeing block %p, size = %d, total used = %d", ptr, allocate_size, UsedMemory );
 #endif
@@ -982,17 +1740,80 @@ create_asstorage_block( int useable_size )
 	block->slots[0]->index = 0 ;
 	block->last_used = 0;
 	block->first_free = 0 ;
+#ifdef HAVE_PTHREAD
+	block->lock = safemalloc( sizeof(pthread_mutex_t) );
+	pthread_mutex_init( (pthread_mutex_t*)(block->lock), NULL );
+#endif
 	
 	LOCAL_DEBUG_OUT("Storage block created : block ptr = %p, slots ptr = %p", block, block->slots );
 	
 	return block;
 }
 
+/* Slots of mapped blocks may be mapped read-only, so whenever one has to be
+ * changed, it is copied out into memory of its own first. Copied slot keeps
+ * its index, and data_size bytes of data are reserved in it : */
+static inline Bool
+is_slot_mapped( ASStorageBlock *block, ASStorageSlot *slot )
+{
+	return ( get_flags( block->flags, ASStorage_MappedBlock ) &&
+			 slot >= block->start && slot < block->end );
+}
+
+static ASStorageSlot *
+copy_out_mapped_slot( ASStorageBlock *block, ASStorageSlot *slot, int data_size )
+{
+	int usable_size = (data_size+15)&0x8FFFFFF0 ;
+	ASStorageSlot *copy = malloc( ASStorageSlot_SIZE + usable_size );
+
+	if( copy == NULL ) 
+		return NULL;
+	memcpy( copy, slot, ASStorageSlot_SIZE + min( usable_size, (int)ASStorageSlot_USABLE_SIZE(slot) ) );
+	block->slots[slot->index] = copy ;
+	ASSTORAGE_ATOMIC_ADD( UsedMemory, ASStorageSlot_SIZE + usable_size );
+	return copy;
+}
+
+static inline void
+free_mapped_slot_copy( ASStorageSlot *slot )
+{
+	ASSTORAGE_ATOMIC_SUB( UsedMemory, ASStorageSlot_FULL_SIZE(slot) );
+	free( slot );
+}
+
 static void
 destroy_asstorage_block( ASStorageBlock *block )
 {
-	UsedMemory -= block->slots_count * sizeof(ASStorageSlot*) ;
-	UsedMemory -= block->size + sizeof(ASStorageBlock) ;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy( (pthread_mutex_t*)(block->lock) );
+	free( block->lock );
+#endif
+	ASSTORAGE_ATOMIC_SUB( UsedMemory, block->slots_count * sizeof(ASStorageSlot*) );
+	if( get_flags( block->flags, ASStorage_MappedBlock ) ) 
+	{ /* slots are not part of the block - only the header and copies are ours : */
+		ASStorageMapping *mapping = block->mapping ;
+		int i ;
+		for( i = 0 ; i < block->slots_count ; ++i ) 
+			if( block->slots[i] != NULL && !is_slot_mapped( block, block->slots[i] ) ) 
+				free_mapped_slot_copy( block->slots[i] );
+		ASSTORAGE_ATOMIC_SUB( UsedMemory, sizeof(ASStorageBlock) );
+		if( --(mapping->blocks_count) <= 0 ) 
+		{
+			if( mapping->addr != NULL ) 
+			{
+#ifdef HAVE_SYS_MMAN_H
+				munmap( mapping->addr, mapping->size );
+#else
+				free( mapping->addr );
+#endif
+			}
+			free( mapping );
+		}
+		free( block->slots );
+		free( block );
+		return;
+	}
+	ASSTORAGE_ATOMIC_SUB( UsedMemory, block->size + sizeof(ASStorageBlock) );
 
 #ifndef DEBUG_ALLOCS
 	free( block->slots );
@@ -1009,28 +1830,23 @@ destroy_asstorage_block( ASStorageBlock *block )
 
 }
 
+#define block_has_room(block,size)	(!get_flags((block)->flags,ASStorage_MappedBlock) && \
+										 (block)->total_free > (size) && \
+										 (block)->total_free > AS_STORAGE_NOUSE_THRESHOLD && \
+										 (block)->last_used+2 < AS_STORAGE_MAX_SLOTS_CNT)
+
+/* Returns index of unused entry in blocks array, growing it if needed. 
+ * Storage must be locked exclusively : */
 static int
-select_storage_block( ASStorage *storage, int compressed_size, ASFlagType flags, int block_id_start )
+get_free_block_idx( ASStorage *storage )
 {
-	int i ;
-	int new_block = -1 ; 
-	compressed_size += ASStorageSlot_SIZE;
-	i = block_id_start - 1 ;
-	if( i < 0 ) 
-		i = 0 ;
-	for( ; i < storage->blocks_count ; ++i ) 
-	{
-		ASStorageBlock *block = storage->blocks[i];
-		if( block )
-		{	
-			if( block->total_free > compressed_size && 
-				block->total_free > AS_STORAGE_NOUSE_THRESHOLD && 
-				block->last_used+2 < AS_STORAGE_MAX_SLOTS_CNT  )
-				return i+1;
-		}else if( new_block < 0 ) 
+	int i, new_block = -1 ;
+	for( i = 0 ; i < storage->blocks_count ; ++i ) 
+		if( storage->blocks[i] == NULL ) 
+		{
 			new_block = i ;
-	}		
-	/* no available blocks found - need to allocate a new block */
+			break;
+		}
 	if( new_block  < 0 ) 
 	{
 		i = new_block = storage->blocks_count ;
@@ -1039,17 +1855,74 @@ select_storage_block( ASStorage *storage, int compressed_size, ASFlagType flags,
 		storage->blocks = realloc( storage->blocks, storage->blocks_count*sizeof(ASStorageBlock*));
 #else
 		storage->blocks = guarded_realloc( storage->blocks, storage->blocks_count*sizeof(ASStorageBlock*));
-		show_debug( __FILE__,"select_storage_block",__LINE__,"reallocated %d blocks pointers", storage->blocks_count );
+		show_debug( __FILE__,"get_free_block_idx",__LINE__,"reallocated %d blocks pointers", storage->blocks_count );
 #endif		   
-		UsedMemory += 16*sizeof(ASStorageBlock*) ;
+		ASSTORAGE_ATOMIC_ADD( UsedMemory, 16*sizeof(ASStorageBlock*) );
 
 		while( ++i < storage->blocks_count )
 			storage->blocks[i] = NULL ;
 	}	 
-	storage->blocks[new_block] = create_asstorage_block( max(storage->default_block_size, compressed_size) );		
-	if( storage->blocks[new_block] == NULL )  /* memory allocation failed ! */ 
-		new_block = -1 ;
-	return new_block+1;
+	return new_block;
+}
+
+/* Returns locked block with enough free space, searching from block_idx_start.
+ * Blocks locked by other threads are skipped, so that concurrent producers 
+ * end up storing data in separate blocks. */
+static ASStorageBlock *
+select_storage_block( ASStorage *storage, int compressed_size, ASFlagType flags, int block_idx_start, int *pblock_idx )
+{
+	int i ;
+	int new_block = -1 ; 
+	ASStorageScratch *scratch = get_storage_scratch( 0 );
+	ASStorageBlock *block ;
+
+	compressed_size += ASStorageSlot_SIZE;
+	ASSTORAGE_RDLOCK(storage);
+	if( scratch->arena_storage == storage ) 
+	{	/* trying block we've used last time first : */
+		i = scratch->arena_block - 1 ;
+		if( i >= block_idx_start && i < storage->blocks_count ) 
+			if( (block = storage->blocks[i]) != NULL ) 
+			{
+				ASSTORAGE_LOCK_BLOCK(block);
+				if( block_has_room( block, compressed_size ) ) 
+				{
+					ASSTORAGE_UNLOCK(storage);
+					*pblock_idx = i ;
+					return block;
+				}
+				ASSTORAGE_UNLOCK_BLOCK(block);
+			}
+	}
+	for( i = block_idx_start ; i < storage->blocks_count ; ++i ) 
+		if( (block = storage->blocks[i]) != NULL )
+			if( ASSTORAGE_TRYLOCK_BLOCK(block) )
+			{	
+				if( block_has_room( block, compressed_size ) ) 
+				{
+					ASSTORAGE_UNLOCK(storage);
+					scratch->arena_storage = storage ;
+					scratch->arena_block = i+1 ;
+					*pblock_idx = i ;
+					return block;
+				}
+				ASSTORAGE_UNLOCK_BLOCK(block);
+			}
+	ASSTORAGE_UNLOCK(storage);
+
+	/* no available blocks found - need to allocate a new block */
+	ASSTORAGE_WRLOCK(storage);
+	new_block = get_free_block_idx( storage );
+	block = storage->blocks[new_block] = create_asstorage_block( max(storage->default_block_size, compressed_size) );		
+	if( block != NULL )  /* memory allocation may fail ! */ 
+	{
+		ASSTORAGE_LOCK_BLOCK(block);
+		scratch->arena_storage = storage ;
+		scratch->arena_block = new_block+1 ;
+		*pblock_idx = new_block ;
+	}
+	ASSTORAGE_UNLOCK(storage);
+	return block;
 }
 
 static inline void
@@ -1092,12 +1965,26 @@ join_storage_slots( ASStorageBlock *block, ASStorageSlot *from_slot, ASStorageSl
 }
 
 
+/* used to account for time spent on defragmentation - only differences matter */
+static unsigned long
+storage_time_usec()
+{
+#ifndef _WIN32
+	struct timeval tv ;
+	gettimeofday( &tv, NULL );
+	return (unsigned long)tv.tv_sec*1000000 + tv.tv_usec ;
+#else
+	return (unsigned long)(((double)clock()*1000000)/CLOCKS_PER_SEC) ;
+#endif
+}
+
 static inline void
 defragment_storage_block( ASStorageBlock *block )
 {
 	ASStorageSlot *brk, *next_used, **slots = block->slots ;
 	int i, first_free = -1;
 	unsigned long total_free = 0 ;
+	unsigned long start_time = storage_time_usec();
 	brk = next_used = block->start ; 
 	
 	
@@ -1178,6 +2065,7 @@ defragment_storage_block( ASStorageBlock *block )
 	}
 	
 	block->total_free = total_free ;
+	clear_flags( block->flags, ASStorage_BlockFragmented );
 	LOCAL_DEBUG_OUT( "total_free after defrag = %ld, first_free = %d, last_used = %d", total_free, block->first_free, block->last_used );
 	
 	slots = block->slots ;
@@ -1194,6 +2082,8 @@ defragment_storage_block( ASStorageBlock *block )
 		if( slots[i] == NULL ) 
 			++(block->unused_count);
 	}
+	++(block->defrag_count);
+	block->defrag_time += storage_time_usec() - start_time ;
 }
 
 static ASStorageSlot *
@@ -1221,6 +2111,13 @@ select_storage_slot( ASStorageBlock *block, int size )
 					int single_slot_size = size+ASStorageSlot_SIZE ; 
 					int size_to_match = single_slot_size+ASStorageSlot_SIZE ;
 					++empty_slots_checked ;
+					/* slot freed by data of the same size ( references mostly ) 
+					 * could be reused as is, without splitting it : */
+					if( (int)ASStorageSlot_USABLE_SIZE(slot) == ((size+15)&0x8FFFFFF0) ) 
+					{
+						if( empty_slots_checked > 50 ) ++(block->long_searches);
+						return slot;
+					}
 					
 					do
 					{
@@ -1372,6 +2269,7 @@ store_data_in_block( ASStorageBlock *block, CARD8 *data, int size, int compresse
 	LOCAL_DEBUG_OUT( "dst = %p, compressed_size = %d", dst, compressed_size );
 	memcpy( dst, data, compressed_size );
 	slot->flags = (unsigned short)(flags | ASStorage_Used) ;
+	++(block->used_count);
 	slot->ref_count = ref_count;
 	slot->size = compressed_size ;
 	slot->uncompressed_size = size ;
@@ -1396,35 +2294,32 @@ static ASStorageID
 store_compressed_data( ASStorage *storage, CARD8* data, int size, int compressed_size, int ref_count, ASFlagType flags )
 {
 	int id = 0 ;
-	int block_id = 0;
+	int block_idx = 0;
+	ASStorageBlock *block ;
 	
-	do
+	while( id == 0 && 
+		   (block = select_storage_block( storage, compressed_size, flags, block_idx, &block_idx )) != NULL )
 	{	
-		block_id = select_storage_block( storage, compressed_size, flags, block_id );
-		LOCAL_DEBUG_OUT( "selected block %d", block_id );
-		if( block_id > 0 ) 
+		int slot_id ;
+		LOCAL_DEBUG_OUT( "selected block %d", block_idx );
+		slot_id = store_data_in_block(  block, data, size, compressed_size, ref_count, flags );
+		LOCAL_DEBUG_OUT( "slot id %X", slot_id );
+		if( slot_id > 0 )	
+			id = make_asstorage_id( block_idx+1, slot_id );
+		else if( block->total_free >= compressed_size+ASStorageSlot_SIZE  ) 
 		{
-			int slot_id = store_data_in_block(  storage->blocks[block_id-1], 
-												data, size, 
-												compressed_size, ref_count, flags );
-
-			LOCAL_DEBUG_OUT( "slot id %X", slot_id );
-			if( slot_id > 0 )	
-				id = make_asstorage_id( block_id, slot_id );
-			else
-				if( storage->blocks[block_id-1]->total_free >= compressed_size+ASStorageSlot_SIZE  ) 
-				{
-					show_error( "failed to store data in block. Total free size = %d, desired size = %d", storage->blocks[block_id-1]->total_free, compressed_size+ASStorageSlot_SIZE );
-					break;
-				}
+			show_error( "failed to store data in block. Total free size = %d, desired size = %d", block->total_free, compressed_size+ASStorageSlot_SIZE );
+			ASSTORAGE_UNLOCK_BLOCK(block);
+			break;
 		}
-	}while( block_id != 0 && id == 0 );
+		ASSTORAGE_UNLOCK_BLOCK(block);
+		++block_idx ;
+	}
 	return id ;		
 }	  
 
 
-
-
+/* must be called with storage locked */
 static inline ASStorageBlock *
 find_storage_block( ASStorage *storage, ASStorageID id )
 {	
@@ -1434,6 +2329,18 @@ find_storage_block( ASStorage *storage, ASStorageID id )
 	return NULL ;
 }
 
+/* returns locked block */
+static ASStorageBlock *
+lock_storage_block( ASStorage *storage, ASStorageID id )
+{
+	ASStorageBlock *block ;
+	ASSTORAGE_RDLOCK(storage);
+	if( (block = find_storage_block( storage, id )) != NULL ) 
+		ASSTORAGE_LOCK_BLOCK(block);
+	ASSTORAGE_UNLOCK(storage);
+	return block;
+}
+
 static inline ASStorageSlot *
 find_storage_slot( ASStorageBlock *block, ASStorageID id )
 {	
@@ -1452,51 +2359,187 @@ find_storage_slot( ASStorageBlock *block, ASStorageID id )
 static inline void 
 free_storage_slot( ASStorageBlock *block, ASStorageSlot *slot)
 {
+	--(block->used_count);
+	if( get_flags( block->flags, ASStorage_MappedBlock ) )
+	{ /* mapped slots are never reused - just drop it : */
+		block->slots[slot->index] = NULL ;
+		if( !is_slot_mapped( block, slot ) ) 
+			free_mapped_slot_copy( slot );
+		return;
+	}
 	slot->flags = 0 ;
+	if( slot->index < block->first_free ) 
+		block->first_free = slot->index ;
 	block->total_free += ASStorageSlot_USABLE_SIZE(slot) ;
+	set_flags( block->flags, ASStorage_BlockFragmented );
 }	 
 
 static Bool 
 is_block_empty( ASStorageBlock *block)
 {
-	int i = block->last_used+1;
-	ASStorageSlot **slots = block->slots ;
-	while( --i >= 0 ) 
-	{
-		if( slots[i] )
-			if( slots[i]->flags != 0 ) 
-				return False;	 
-	}	
-	return True;	
+	/* kept up to date by store_data_in_block() and free_storage_slot() */
+	return (block->used_count <= 0);
 }	 
 
+/* Block must not be locked by the caller. Holding storage lock exclusively 
+ * guarantees that nobody is looking the block up, and by locking the block 
+ * itself we wait for the last user to finish with it : */
 static void 
 free_storage_block( ASStorage *storage, int block_idx  )
 {
-	ASStorageBlock *block = storage->blocks[block_idx] ;
-	storage->blocks[block_idx] = NULL ;
-	destroy_asstorage_block( block );
+	ASStorageBlock *block ;
+	ASSTORAGE_WRLOCK(storage);
+	if( block_idx < storage->blocks_count && (block = storage->blocks[block_idx]) != NULL ) 
+	{
+		Bool empty ;
+		ASSTORAGE_LOCK_BLOCK(block);
+		empty = is_block_empty( block );
+		ASSTORAGE_UNLOCK_BLOCK(block);
+		if( empty ) /* somebody may have stored something in it by now */
+		{
+			storage->defrag_count += block->defrag_count ;
+			storage->defrag_time += block->defrag_time ;
+			storage->blocks[block_idx] = NULL ;
+			destroy_asstorage_block( block );
+		}
+	}
+	ASSTORAGE_UNLOCK(storage);
 }	 
 
+/* Blocks with less then that portion of them used get shrunk by background 
+ * defragmentation, instead of having its free pages released */
+#define AS_STORAGE_SPARSE_BLOCK_RATIO	8
+
+#if defined(HAVE_SYS_MMAN_H) && defined(MADV_DONTNEED)
+#define ASSTORAGE_USE_MADVISE
+#endif
+
+/* Block must be locked and compacted. Contents of the free space past the 
+ * header of the last free slot is never looked at, so we can let the system 
+ * have its pages back until block fills up again. Such pages read as zeros 
+ * afterwards, same as they were in freshly allocated block.
+ * Returns number of bytes released : */
+static int
+release_block_free_space( ASStorageBlock *block )
+{
+#ifdef ASSTORAGE_USE_MADVISE
+	static long page_size = 0 ; 
+	CARD8 *from, *to ;
+
+	if( page_size <= 0 ) 
+	{
+#ifdef _SC_PAGESIZE
+		page_size = sysconf( _SC_PAGESIZE );
+#endif
+		if( page_size <= 0 ) 
+			page_size = AS_STORAGE_PAGE_SIZE ;
+	}
+	if( block->total_free < page_size ) 
+		return 0;
+	from = (CARD8*)(block->end) - block->total_free ;
+	to = (CARD8*)(block->end) ;
+	from = (CARD8*)((((unsigned long)from)+page_size-1)&~(page_size-1));
+	to = (CARD8*)(((unsigned long)to)&~(page_size-1));
+	if( to > from ) 
+		if( madvise( from, to - from, MADV_DONTNEED ) == 0 ) 
+			return to - from ;
+#endif
+	return 0;
+}
+
+/* Shrinks sparsely used block to the size of its data, so that memory 
+ * would be returned even where we can't release pages of the free space. 
+ * Slots keep their indexes and block keeps its place in the array, so that 
+ * ids remain valid. Block must not be locked by the caller - block pointer 
+ * may change, and that requires storage being locked exclusively.
+ * Returns number of bytes freed : */
+static int
+shrink_storage_block( ASStorage *storage, int block_idx )
+{
+	ASStorageBlock *block, *new_block ;
+	int freed = 0 ;
+
+	ASSTORAGE_WRLOCK(storage);
+	if( block_idx < storage->blocks_count && (block = storage->blocks[block_idx]) != NULL ) 
+	{
+		ASSTORAGE_LOCK_BLOCK(block);
+		if( block->pinned == 0 ) 
+		{
+			int old_size = block->size + sizeof(ASStorageBlock) ;
+			int new_size ;
+			CARD8 *used_end ;
+
+			/* something could have been stored in it since it was compacted,
+			 * so we do it again to get single free slot past all the used ones : */
+			defragment_storage_block( block );
+			used_end = (CARD8*)(block->end) ;
+			if( block->total_free > 0 ) 
+				used_end -= block->total_free + ASStorageSlot_SIZE ;
+			new_size = (used_end - (CARD8*)block) + ASStorageSlot_SIZE ;
+
+			LOCAL_DEBUG_OUT( "block = %p, old_size = %d, new_size = %d", block, old_size, new_size );
+			if( block->total_free > 0 && new_size + AS_STORAGE_PAGE_SIZE <= old_size ) 
+			{
+				/* old address may not be used once realloc() is done : */
+				uintptr_t old_addr = (uintptr_t)block ;
+#ifndef DEBUG_ALLOCS
+				new_block = realloc( block, new_size );
+#else
+				new_block = guarded_realloc( block, new_size );
+#endif
+				if( new_block != NULL ) 
+				{
+					long delta = (long)((uintptr_t)new_block - old_addr) ;
+					int i ;
+
+					block = new_block ;
+					if( delta != 0 ) 
+					{
+						block->start = (ASStorageSlot*)((CARD8*)(block->start) + delta) ;
+						for( i = 0 ; i <= block->last_used ; ++i ) 
+							if( block->slots[i] ) 
+								block->slots[i] = (ASStorageSlot*)((CARD8*)(block->slots[i]) + delta) ;
+					}
+					/* free slot is gone, and there is no room left in the block : */
+					block->end = (ASStorageSlot*)(used_end + delta) ;
+					destroy_storage_slot( block, block->first_free );
+					block->first_free = block->last_used+1 ;
+					block->total_free = 0 ;
+					block->size = new_size - sizeof(ASStorageBlock) ;
+					storage->blocks[block_idx] = block ;
+					freed = old_size - new_size ;
+					ASSTORAGE_ATOMIC_SUB( UsedMemory, freed );
+					storage->shrunk_bytes += freed ;
+				}
+			}
+		}
+		ASSTORAGE_UNLOCK_BLOCK(block);
+	}
+	ASSTORAGE_UNLOCK(storage);
+	return freed;
+}
+
+/* Block containing id must be locked by the caller, and will remain locked 
+ * on return. If body of the data has to be relocated into a different block, 
+ * block gets temporarily unlocked, and in case some other thread has 
+ * converted the slot in between - id of the unneeded copy is returned 
+ * in *unused_id, to be forgotten by the caller once it unlocks the block. */
 static ASStorageSlot *
-convert_slot_to_ref( ASStorage *storage, ASStorageID id )	
+convert_slot_to_ref( ASStorage *storage, ASStorageBlock *block, ASStorageID id, ASStorageID *unused_id )	
 {
 	int block_idx = StorageID2BlockIdx(id);
-	ASStorageBlock *block;
 	ASStorageID target_id = 0;
 	int slot_id = 0 ;
 	int ref_index, body_index ;
 	ASStorageSlot *ref_slot, *body_slot ;
 	
-	block = find_storage_block(storage, id);
-	
 	LOCAL_DEBUG_OUT( "block = %p, block->total_free = %d", block, block->total_free );
 	/* Two strategies here - 1 - the fast one - we try to allocate new slot 
 	 * and avoid copying the body of the data over - we can do that only if
 	 * there is enough space in its block, otherwise we have to relocate it 
 	 * into different block, which is slower.
 	 */
-	if( block->total_free > sizeof(ASStorageID))
+	if( block->total_free > sizeof(ASStorageID) && !get_flags( block->flags, ASStorage_MappedBlock ))
 	{	
 		slot_id = store_data_in_block(  block, (CARD8*)&target_id, 
 										sizeof(ASStorageID), sizeof(ASStorageID), 0, 
@@ -1504,6 +2547,7 @@ convert_slot_to_ref( ASStorage *storage, ASStorageID id )
 	}
 	LOCAL_DEBUG_OUT( "block = %p, block->total_free = %d, slot_id = 0x%X", block, block->total_free, slot_id );
 	
+	ASSTORAGE_ATOMIC_ADD( storage->ref_conversions, 1 );
 	if( slot_id > 0 )
 	{ 	/* We can use fast strategy : now we need to swap contents of the slots */
 		ref_index = slot_id-1 ;
@@ -1531,24 +2575,28 @@ convert_slot_to_ref( ASStorage *storage, ASStorageID id )
 	}else
 	{/* otherwise we have to relocate the actuall body into a different block, 
 	  * which is somewhat tricky : */
+		ASStorageScratch *scratch ;
+		int size, uncompressed_size, ref_count ; 
+		ASFlagType flags ;
+
+		ASSTORAGE_ATOMIC_ADD( storage->ref_relocations, 1 );
 		ref_index = StorageID2SlotIdx(id); ;
 		ref_slot = block->slots[ref_index] ;
-		
-		if( block->total_free > (int)ref_slot->size )
-		{
-			/* there is a danger of us trying to reuse same block and defragmented it in between,
-			 * which will screw up the data */
-#ifndef NO_DEBUG_OUTPUT
-			fprintf( stderr, "\t\t %s:%d DANGEROUS RELOCATION! size = %ld",  __FILE__, __LINE__, ref_slot->size );
-#endif						   
-			memcpy( storage->comp_buf, ASStorage_Data(ref_slot), ref_slot->size );
-			target_id = store_compressed_data(  storage, storage->comp_buf, 
-										   		ref_slot->uncompressed_size, 
-										   		ref_slot->size, ref_slot->ref_count, ref_slot->flags );
-		}else	 
-			target_id = store_compressed_data( storage, ASStorage_Data(ref_slot), 
-										   	ref_slot->uncompressed_size, 
-										   	ref_slot->size, ref_slot->ref_count, ref_slot->flags );
+		size = ref_slot->size ;
+		uncompressed_size = ref_slot->uncompressed_size ;
+		ref_count = ref_slot->ref_count ;
+		flags = ref_slot->flags ;
+		/* there is a danger of us trying to reuse same block and defragmented it in between,
+		 * which will screw up the data - so we store a copy : */
+		scratch = get_storage_scratch( size );
+		memcpy( scratch->comp_buf, ASStorage_Data(ref_slot), size );
+		/* we keep on using block pointer, so it must not be shrunk meanwhile : */
+		++(block->pinned);
+		ASSTORAGE_UNLOCK_BLOCK(block);
+		target_id = store_compressed_data( storage, scratch->comp_buf, 
+										   uncompressed_size, size, ref_count, flags );
+		ASSTORAGE_LOCK_BLOCK(block);
+		--(block->pinned);
 		/* lets do this again, in case block was defragmented */
 		ref_slot = block->slots[ref_index] ;
 
@@ -1561,8 +2609,26 @@ convert_slot_to_ref( ASStorage *storage, ASStorageID id )
 			{	int *a = NULL ; *a = 0 ;}
 #endif						   
 		}
+		if( get_flags( ref_slot->flags, ASStorage_Reference ) )
+		{
+			*unused_id = target_id ;
+			return ref_slot;
+		}
 		
-		split_storage_slot( block, ref_slot, sizeof(ASStorageID));
+		if( get_flags( block->flags, ASStorage_MappedBlock ) ) 
+		{ /* body lives elsewhere now, so copy needs only room for reference : */
+			ASStorageSlot *copy = copy_out_mapped_slot( block, ref_slot, sizeof(ASStorageID) );
+			if( copy == NULL ) 
+			{
+				*unused_id = target_id ;
+				return NULL;
+			}
+			if( !is_slot_mapped( block, ref_slot ) ) /* copied out before */
+				free_mapped_slot_copy( ref_slot );
+			ref_slot = copy ;
+			ref_slot->size = sizeof(ASStorageID) ;
+		}else
+			split_storage_slot( block, ref_slot, sizeof(ASStorageID));
 		ref_slot->uncompressed_size = sizeof(ASStorageID) ; 
 		set_flags( ref_slot->flags, ASStorage_Reference );
 		clear_flags( ref_slot->flags, ASStorage_CompressionType );
@@ -1593,11 +2659,18 @@ static void card8_card8_cpy( ASStorageDstBuffer *dst, void *src, size_t size)
 
 static void card8_card32_cpy( ASStorageDstBuffer *dst, void *src, size_t size)
 {
-	register CARD32 *dst32 = (CARD32*)dst->buffer + dst->offset ;
-	register CARD8  *src8  = (CARD8*)src ;
-	register int i;
-	for( i = 0 ;  i < (int)size ; ++i ) 
-		dst32[i] = src8[i] ;
+	expand_data8_impl( (CARD32*)dst->buffer + dst->offset, (CARD8*)src, size );
+}	 
+
+/* writes every byte into its own lane of packed ARGB32 pixels, lane is
+ * passed to us as threshold : */
+static void card8_argb32_cpy( ASStorageDstBuffer *dst, void *src, size_t size)
+{
+	register CARD8 *dst8 = (CARD8*)((CARD32*)dst->buffer + dst->offset) + dst->threshold ;
+	register CARD8 *src8 = (CARD8*)src ;
+	register size_t i ;
+	for( i = 0 ; i < size ; ++i )
+		dst8[i<<2] = src8[i] ;
 }	 
 
 static void 
@@ -1662,7 +2735,9 @@ static int
 fetch_data_int( ASStorage *storage, ASStorageID id, ASStorageDstBuffer *buffer, int offset, int buf_size, CARD8 bitmap_value, 
 		  		data_cpy_func_type cpy_func, int *original_size)
 {
-	ASStorageSlot *slot = find_storage_slot( find_storage_block( storage, id ), id );
+	ASStorageBlock *block = lock_storage_block( storage, id );
+	ASStorageSlot *slot = find_storage_slot( block, id );
+	int result = 0 ;
 	LOCAL_DEBUG_OUT( "slot = %p", slot );
 	if( slot && buffer && buf_size > 0 )
 	{
@@ -1673,6 +2748,8 @@ fetch_data_int( ASStorage *storage, ASStorageID id, ASStorageDstBuffer *buffer,
 			ASStorageID target_id = 0;
 			memcpy( &target_id, ASStorage_Data(slot), sizeof( ASStorageID ));				   
 			LOCAL_DEBUG_OUT( "target_id = %lX", target_id );
+			/* target can't go away while we hold reference to it : */
+			ASSTORAGE_UNLOCK_BLOCK(block);
 			if( target_id != 0 ) 
 				return fetch_data_int(storage, target_id, buffer, offset, buf_size, bitmap_value, cpy_func, original_size);
 			else
@@ -1685,8 +2762,8 @@ fetch_data_int( ASStorage *storage, ASStorageID id, ASStorageDstBuffer *buffer,
 			bitmap_value = AS_STORAGE_DEFAULT_BMAP_VALUE ;
 
 		{
-			CARD8 *tmp = decompress_stored_data( storage, ASStorage_Data(slot), slot->size,
-													uncomp_size, slot->flags, bitmap_value );
+			CARD8 *tmp = decompress_stored_data( ASStorage_Data(slot), slot->size,
+												 uncomp_size, slot->flags, bitmap_value );
 			while( offset > uncomp_size ) offset -= uncomp_size ; 
 			while( offset < 0 ) offset += uncomp_size ; 
 			
@@ -1712,9 +2789,11 @@ fetch_data_int( ASStorage *storage, ASStorageID id, ASStorageDstBuffer *buffer,
 			}
 		}
 		LOCAL_DEBUG_OUT( "uncompressed_size = %d", buffer->offset );
-		return buffer->offset ;
+		result = buffer->offset ;
 	}
-	return 0;
+	if( block ) 
+		ASSTORAGE_UNLOCK_BLOCK(block);
+	return result;
 }
 
 /************************************************************************/
@@ -1728,9 +2807,15 @@ create_asstorage()
 #else
 	ASStorage *storage = guarded_calloc(1, sizeof(ASStorage));
 #endif
-	UsedMemory += sizeof(ASStorage) ;
+	ASSTORAGE_ATOMIC_ADD( UsedMemory, sizeof(ASStorage) );
 	if( storage )
+	{
 		storage->default_block_size = AS_STORAGE_DEF_BLOCK_SIZE ;
+#ifdef HAVE_PTHREAD
+		storage->lock = safemalloc( sizeof(pthread_rwlock_t) );
+		pthread_rwlock_init( (pthread_rwlock_t*)(storage->lock), NULL );
+#endif
+	}
 	return storage ;
 }
 
@@ -1752,6 +2837,79 @@ set_asstorage_block_size( ASStorage *storage, int new_size )
 	return old_size;
 }
 
+ASFlagType 
+set_asstorage_compression( ASStorage *storage, ASFlagType compression )
+{
+	ASFlagType old_compression ;
+	
+	if( storage == NULL ) 
+		storage = get_default_asstorage();
+	
+	old_compression = storage->compression ; 
+	/* bitmap is handled separately, and we don't really want zlib : */
+	storage->compression = compression&ASStorage_CompressionType&(~ASStorage_ZlibCompress) ;
+	return old_compression;
+}
+
+Bool 
+defragment_asstorage( ASStorage *storage, int max_work )
+{
+	int i, checked = 0, work = 0 ; 
+	Bool more_work = False ;
+
+	/* there is nothing to defragment if default storage has not been created yet : */
+	if( storage == NULL ) 
+		storage = _as_default_storage ;
+	if( storage == NULL ) 
+		return False;
+	if( max_work <= 0 ) 
+		max_work = storage->default_block_size ;
+
+	ASSTORAGE_RDLOCK(storage);
+	i = storage->defrag_cursor ;
+	while( checked < storage->blocks_count && work < max_work ) 
+	{
+		ASStorageBlock *block ;
+		Bool shrink = False ;
+
+		if( i >= storage->blocks_count ) 
+			i = 0 ;
+		if( (block = storage->blocks[i]) != NULL ) 
+		{	
+			if( ASSTORAGE_TRYLOCK_BLOCK(block) )
+			{	/* mapped blocks never move their slots around : */
+				if( get_flags( block->flags, ASStorage_BlockFragmented ) && 
+					!get_flags( block->flags, ASStorage_MappedBlock ) ) 
+				{
+					int used = block->size - block->total_free ;
+					work += used ;
+					defragment_storage_block( block );
+					block->long_searches = 0 ;
+					if( used < block->size/AS_STORAGE_SPARSE_BLOCK_RATIO && block->pinned == 0 ) 
+						shrink = True ;
+					else
+						ASSTORAGE_ATOMIC_ADD( storage->released_bytes, release_block_free_space( block ) );
+				}
+				ASSTORAGE_UNLOCK_BLOCK(block);
+			}else  /* somebody is busy with it - lets come back later */
+				more_work = True ;
+		}
+		++checked ;
+		++i ;
+		if( shrink ) 
+		{
+			ASSTORAGE_UNLOCK(storage);
+			shrink_storage_block( storage, i-1 );
+			ASSTORAGE_RDLOCK(storage);
+		}
+	}
+	if( checked < storage->blocks_count ) 
+		more_work = True ;
+	storage->defrag_cursor = i ;
+	ASSTORAGE_UNLOCK(storage);
+	return more_work;
+}
+
 void 
 destroy_asstorage(ASStorage **pstorage)
 {
@@ -1765,7 +2923,7 @@ destroy_asstorage(ASStorage **pstorage)
 			for( i = 0 ; i < storage->blocks_count ; ++i ) 
 				if( storage->blocks[i] ) 
 					destroy_asstorage_block( storage->blocks[i] );
-			UsedMemory -= storage->blocks_count * sizeof(ASStorageBlock*) ;
+			ASSTORAGE_ATOMIC_SUB( UsedMemory, storage->blocks_count * sizeof(ASStorageBlock*) );
 #ifndef DEBUG_ALLOCS
 			free( storage->blocks );
 #else	
@@ -1773,12 +2931,12 @@ destroy_asstorage(ASStorage **pstorage)
 #endif
 
 		}	
-		if( storage->comp_buf )
-			free( storage->comp_buf);
-		if( storage->diff_buf )
-			free( storage->diff_buf);
+#ifdef HAVE_PTHREAD
+		pthread_rwlock_destroy( (pthread_rwlock_t*)(storage->lock) );
+		free( storage->lock );
+#endif
 
-		UsedMemory -= sizeof(ASStorage) ;
+		ASSTORAGE_ATOMIC_SUB( UsedMemory, sizeof(ASStorage) );
 #ifndef DEBUG_ALLOCS
 		free( storage );
 #else	
@@ -1791,8 +2949,18 @@ destroy_asstorage(ASStorage **pstorage)
 void 
 flush_default_asstorage()
 {
+	ASStorageScratch *scratch ;
 	if( _as_default_storage != NULL )
 		destroy_asstorage(&_as_default_storage);
+#ifdef HAVE_PTHREAD
+	pthread_once( &_as_scratch_key_once, create_scratch_key );
+#endif
+	/* other threads free their buffers on exit */
+	if( (scratch = get_thread_scratch()) != NULL ) 
+	{
+		destroy_storage_scratch( scratch );
+		set_thread_scratch( NULL );
+	}
 }
 
 ASStorageID 
@@ -1815,9 +2983,11 @@ store_data(ASStorage *storage, CARD8 *data, int size, ASFlagType flags, CARD8 bi
 	}else
 		bitmap_threshold32 = 0x000000FF ;  /* to disable the tint ! */ 
 			 
+	if( get_flags( flags, ASStorage_CompressionType ) )
+		set_flags( flags, storage->compression );
 	if( !get_flags(flags, ASStorage_Reference))
 		if( get_flags( flags, ASStorage_CompressionType ) || get_flags( flags, ASStorage_32Bit ) )
-			buffer = compress_stored_data( storage, data, size, &flags, &compressed_size, bitmap_threshold32 );
+			buffer = compress_stored_data( data, size, &flags, &compressed_size, bitmap_threshold32 );
 	
 	return store_compressed_data( storage, buffer, 
 								  get_flags( flags, ASStorage_32Bit )?size/4:size, 
@@ -1846,9 +3016,11 @@ store_data_tinted(ASStorage *storage, CARD8 *data, int size, ASFlagType flags, C
 			tint32 = (tint32 * AS_STORAGE_DEFAULT_BMAP_THRESHOLD) >>8 ;
 	}
 	
+	if( get_flags( flags, ASStorage_CompressionType ) )
+		set_flags( flags, storage->compression );
 	if( !get_flags(flags, ASStorage_Reference))
 		if( get_flags( flags, ASStorage_CompressionType ) || get_flags( flags, ASStorage_32Bit ) )
-			buffer = compress_stored_data( storage, data, size, &flags, &compressed_size, tint32 );
+			buffer = compress_stored_data( data, size, &flags, &compressed_size, tint32 );
 	
 	return store_compressed_data( storage, buffer, 
 								  get_flags( flags, ASStorage_32Bit )?size/4:size, 
@@ -1891,12 +3063,38 @@ fetch_data32(ASStorage *storage, ASStorageID id, CARD32 *buffer, int offset, int
 		ASStorageDstBuffer buf ; 
 		buf.offset = 0 ; 
 		buf.buffer = buffer ;
-	  	
+		CHECK_CODEC_IMPL();
 		return fetch_data_int( storage, id, &buf, offset, buf_size, bitmap_value, card8_card32_cpy, original_size );
 	}
 	return 0 ;	
 }
 
+int  
+fetch_data_interleaved(ASStorage *storage, ASStorageID id, CARD32 *buffer, int shift, int offset, int buf_size, CARD8 bitmap_value, int *original_size)
+{
+	int dumm ;
+	if( storage == NULL ) 
+		storage = get_default_asstorage();
+	
+	if( original_size == NULL ) 
+		original_size = &dumm ;
+	*original_size = 0;
+	if( storage != NULL && id != 0 )
+	{
+		ASStorageDstBuffer buf ; 
+		buf.offset = 0 ; 
+		buf.buffer = buffer ;
+#ifdef WORDS_BIGENDIAN
+		buf.threshold = 3-((shift>>3)&0x03) ;
+#else
+		buf.threshold = (shift>>3)&0x03 ;
+#endif
+		CHECK_CODEC_IMPL();
+		return fetch_data_int( storage, id, &buf, offset, buf_size, bitmap_value, card8_argb32_cpy, original_size );
+	}
+	return 0 ;	
+}
+
 int  
 threshold_stored_data(ASStorage *storage, ASStorageID id, unsigned int *runs, int width, unsigned int threshold)
 {
@@ -1941,63 +3139,232 @@ query_storage_slot(ASStorage *storage, ASStorageID id, ASStorageSlot *dst )
 	
 	if( storage != NULL && id != 0 && dst != NULL )
 	{	
-		ASStorageSlot *slot = find_storage_slot( find_storage_block( storage, id ), id );
+		ASStorageBlock *block = lock_storage_block( storage, id );
+		ASStorageSlot *slot = find_storage_slot( block, id );
+		Bool res = False ;
+		ASStorageID target_id = 0;
 		LOCAL_DEBUG_OUT( "slot = %p", slot );
 		if( slot )
 		{
 			if( get_flags( slot->flags, ASStorage_Reference) )
 			{
-				ASStorageID target_id = 0;
 			 	memcpy( &target_id, ASStorage_Data(slot), sizeof( ASStorageID ));				   
 				LOCAL_DEBUG_OUT( "target_id = %lX", target_id );
-				if( target_id == id ) 
-				{
-					show_error( "reference refering to self id = %lX", id );
-					return False;
-				}
-				return query_storage_slot(storage, target_id, dst);
-			}	 
-			*dst = *slot ;
-			return True ;
+			}else
+			{
+				*dst = *slot ;
+				res = True ;
+			}
+		}
+		if( block ) 
+			ASSTORAGE_UNLOCK_BLOCK(block);
+		if( target_id == id ) 
+		{
+			show_error( "reference refering to self id = %lX", id );
+			return False;
 		}
+		if( target_id != 0 ) 
+			return query_storage_slot(storage, target_id, dst);
+		return res;
 	}
 	return False;	  
 }
 
-int 
-print_storage_slot(ASStorage *storage, ASStorageID id)
+Bool 
+query_storage_slot_data(ASStorage *storage, ASStorageID id, ASStorageSlot *dst, CARD8 *data, int data_size )
 {
 	if( storage == NULL ) 
 		storage = get_default_asstorage();
 	
-	if( storage != NULL && id != 0 )
+	if( storage != NULL && id != 0 && dst != NULL )
 	{	
-		ASStorageSlot *slot = find_storage_slot( find_storage_block( storage, id ), id );
-		fprintf (stderr, "Storage ID 0x%lX-> slot %p", (unsigned long)id, slot);
+		ASStorageBlock *block = lock_storage_block( storage, id );
+		ASStorageSlot *slot = find_storage_slot( block, id );
+		Bool res = False ;
+		ASStorageID target_id = 0;
 		if( slot )
 		{
-			int i ;
+			if( get_flags( slot->flags, ASStorage_Reference) )
+			 	memcpy( &target_id, ASStorage_Data(slot), sizeof( ASStorageID ));				   
+			else
+			{
+				*dst = *slot ;
+				if( data != NULL && (int)slot->size <= data_size ) 
+				{
+					memcpy( data, ASStorage_Data(slot), slot->size );
+					res = True ;
+				}
+			}
+		}
+		if( block ) 
+			ASSTORAGE_UNLOCK_BLOCK(block);
+		if( target_id == id ) 
+		{
+			show_error( "reference refering to self id = %lX", id );
+			return False;
+		}
+		if( target_id != 0 ) 
+			return query_storage_slot_data(storage, target_id, dst, data, data_size);
+		return res;
+	}
+	return False;	  
+}
+
+static ASStorageBlock *
+create_mapped_block( ASStorageMapping *mapping, ASStorageSlot *first, ASStorageSlot *end, int count )
+{
+	ASStorageBlock *block = calloc( 1, sizeof(ASStorageBlock) );
+	int i ;
+	ASStorageSlot *slot = first ;
+
+	if( block == NULL ) 
+		return NULL;
+	if( (block->slots = malloc( count*sizeof(ASStorageSlot*) )) == NULL ) 
+	{
+		free( block );
+		return NULL;
+	}
+	for( i = 0 ; i < count ; ++i ) 
+	{
+		block->slots[i] = slot ;
+		slot = AS_STORAGE_GetNextSlot(slot);
+	}
+	block->flags = ASStorage_MappedBlock ;
+	block->start = first ;
+	block->end = end ;
+	block->size = (CARD8*)end - (CARD8*)first ;
+	block->total_free = 0 ;
+	block->slots_count = count ;
+	block->used_count = count ;
+	block->last_used = count-1 ;
+	block->first_free = count ;
+	block->pinned = 1 ;         /* slots could not be moved, nor block shrunk */
+	block->mapping = mapping ;
+	++(mapping->blocks_count);
+#ifdef HAVE_PTHREAD
+	block->lock = safemalloc( sizeof(pthread_mutex_t) );
+	pthread_mutex_init( (pthread_mutex_t*)(block->lock), NULL );
+#endif
+	ASSTORAGE_ATOMIC_ADD( UsedMemory, sizeof(ASStorageBlock) + count*sizeof(ASStorageSlot*) );
+	return block;
+}
+
+Bool 
+map_storage_slots(ASStorage *storage, void *map_addr, size_t map_size, void *slots, int count, 
+				  int max_uncompressed_size, ASStorageID *ids )
+{
+	CARD8 *map_end = (CARD8*)map_addr + map_size ;
+	ASStorageSlot *slot = (ASStorageSlot*)slots ;
+	ASStorageMapping *mapping ;
+	int i, block_start ;
+
+	if( storage == NULL ) 
+		storage = get_default_asstorage();
+	if( storage == NULL || map_addr == NULL || slots == NULL || count <= 0 || ids == NULL ) 
+		return False;
+	if( (CARD8*)slots < (CARD8*)map_addr || 
+		(((CARD8*)slots - (CARD8*)map_addr)&(ASStorageSlot_SIZE-1)) != 0 ) 
+		return False;
+	/* everything must be verified before we let anyone see the data, 
+	 * as file could have been truncated or messed with : */
+	for( i = 0 ; i < count ; ++i ) 
+	{
+		if( (CARD8*)slot + ASStorageSlot_SIZE > map_end ) 
+			return False;
+		if( !get_flags( slot->flags, ASStorage_Used ) || 
+			get_flags( slot->flags, ASStorage_Reference ) || 
+			slot->ref_count != 0 || 
+			slot->index != (i%AS_STORAGE_MAPPED_SLOTS_MAX) || 
+			slot->size == 0 || slot->size > (CARD32)(map_end - (CARD8*)slot) || 
+			(CARD8*)slot + ASStorageSlot_FULL_SIZE(slot) > map_end ) 
+			return False;
+		if( slot->uncompressed_size > (CARD32)max_uncompressed_size || 
+			!stored_data_valid( ASStorage_Data(slot), slot->size, slot->uncompressed_size, slot->flags ) ) 
+			return False;
+		slot = AS_STORAGE_GetNextSlot(slot);
+	}
+
+	mapping = safecalloc( 1, sizeof(ASStorageMapping) );
+	mapping->addr = map_addr ;
+	mapping->size = map_size ;
+
+	slot = (ASStorageSlot*)slots ;
+	ASSTORAGE_WRLOCK(storage);
+	for( block_start = 0 ; block_start < count ; block_start += AS_STORAGE_MAPPED_SLOTS_MAX ) 
+	{
+		int block_count = min( count - block_start, AS_STORAGE_MAPPED_SLOTS_MAX );
+		ASStorageSlot *end = slot ;
+		int block_idx = get_free_block_idx( storage );
+		ASStorageBlock *block ;
+
+		for( i = 0 ; i < block_count ; ++i ) 
+			end = AS_STORAGE_GetNextSlot(end);
+		if( (block = create_mapped_block( mapping, slot, end, block_count )) == NULL ) 
+			break;
+		storage->blocks[block_idx] = block ;
+		for( i = 0 ; i < block_count ; ++i ) 
+			ids[block_start+i] = make_asstorage_id( block_idx+1, i+1 );
+		slot = end ;
+	}
+	ASSTORAGE_UNLOCK(storage);
+	if( block_start < count ) 
+	{ /* out of memory - undo what we did, leaving mapping to the caller : */
+		int done = block_start ;
+		if( done == 0 ) 
+			free( mapping );
+		else
+		{
+			mapping->addr = NULL ;	/* not ours to release */
+			for( i = 0 ; i < done ; ++i ) 
+				forget_data( storage, ids[i] );
+		}
+		return False;
+	}
+	return True;
+}
+
+int 
+print_storage_slot(ASStorage *storage, ASStorageID id)
+{
+	if( storage == NULL ) 
+		storage = get_default_asstorage();
+	
+	if( storage != NULL && id != 0 )
+	{	
+		ASStorageBlock *block = lock_storage_block( storage, id );
+		ASStorageSlot *slot = find_storage_slot( block, id );
+		int res = 0 ;
+		ASStorageID target_id = 0;
+		fprintf (stderr, "Storage ID 0x%lX-> slot %p", (unsigned long)id, slot);
+		if( slot )
+		{
+			int i ;
 			if( get_flags( slot->flags, ASStorage_Reference) )
 			{
-				ASStorageID target_id = 0;
 			 	memcpy( &target_id, ASStorage_Data(slot), sizeof( ASStorageID ));				   
 				fprintf (stderr, " : References storage ID 0x%lX\n\t>", (unsigned long)target_id);
-				if( target_id == id ) 
-				{	
-					show_error( "reference refering to self id = %lX", id );
-					return 0;
-				}
-				return print_storage_slot(storage, target_id);
-			}	 
-			fprintf( stderr, " : {0x%X, %u, %lu, %lu, %u, {", 
-					 slot->flags, slot->ref_count, (unsigned long)slot->size, (unsigned long)slot->uncompressed_size, slot->index );
+			}else
+			{	
+				fprintf( stderr, " : {0x%X, %u, %lu, %lu, %u, {", 
+						 slot->flags, slot->ref_count, (unsigned long)slot->size, (unsigned long)slot->uncompressed_size, slot->index );
 
-			for( i = 0 ; i < (int)slot->size ; ++i)
-				fprintf( stderr, "%2.2X ", ASStorage_Data(slot)[i] ) ;
-			fprintf (stderr, "}}");
-			return slot->size + ASStorageSlot_SIZE ;
+				for( i = 0 ; i < (int)slot->size ; ++i)
+					fprintf( stderr, "%2.2X ", ASStorage_Data(slot)[i] ) ;
+				fprintf (stderr, "}}");
+				res = slot->size + ASStorageSlot_SIZE ;
+			}
+		}else
+			fprintf (stderr, "\n");
+		if( block ) 
+			ASSTORAGE_UNLOCK_BLOCK(block);
+		if( target_id == id ) 
+		{	
+			show_error( "reference refering to self id = %lX", id );
+			return 0;
 		}
-		fprintf (stderr, "\n");
+		if( target_id != 0 ) 
+			return print_storage_slot(storage, target_id);
+		return res;
 	}
 	return 0;	  
 }	 
@@ -2008,6 +3375,7 @@ print_storage(ASStorage *storage)
 	int i ;
 	if( storage == NULL ) 
 		storage = get_default_asstorage();
+	ASSTORAGE_RDLOCK(storage);
 	fprintf( stderr, " Printing Storage %p : \n\tblock_count = %d;\n", storage, storage->blocks_count );
 
 	for( i = 0 ; i < storage->blocks_count ; ++i ) 
@@ -2020,6 +3388,169 @@ print_storage(ASStorage *storage)
 			fprintf( stderr, "\t\tBlock[%d].last_used = %d;\n", i, storage->blocks[i]->last_used );			   
 		}	 
 	}	 
+	ASSTORAGE_UNLOCK(storage);
+}
+
+/* Block must be locked. Slots are walked in memory order, so that we could 
+ * find out how badly free space is fragmented : */
+static void
+get_block_stats( ASStorageBlock *block, ASStorageBlockStats *bs, ASStorageCompressionStats *compression )
+{
+	ASStorageSlot *slot = block->start, *next ;
+	unsigned long free_area = 0 ;
+
+	memset( bs, 0x00, sizeof(ASStorageBlockStats));
+	bs->size = block->size ;
+	bs->free_bytes = block->total_free ;
+	bs->slots_count = block->slots_count ;
+	bs->long_searches = block->long_searches ;
+	bs->defrag_count = block->defrag_count ;
+	bs->defrag_time = block->defrag_time ;
+	while( slot < block->end ) 
+	{
+		if( slot->flags == 0 ) 
+			free_area += ASStorageSlot_FULL_SIZE(slot) ;
+		else
+		{
+			if( free_area > 0 ) 
+			{
+				++(bs->free_areas);
+				if( free_area > bs->largest_free ) 
+					bs->largest_free = free_area ;
+				free_area = 0 ;
+			}
+			++(bs->used_slots);
+			bs->used_bytes += ASStorageSlot_FULL_SIZE(slot) ;
+			if( get_flags( slot->flags, ASStorage_Reference ) ) 
+				++(bs->reference_slots);
+			else
+			{
+				int type = ASStorageStats_Uncompressed ;
+				if( get_flags( slot->flags, ASStorage_Bitmap ) ) 
+					type = ASStorageStats_Bitmap ;
+				else if( get_flags( slot->flags, ASStorage_LZCompress ) ) 
+					type = ASStorageStats_LZ ;
+				else if( get_flags( slot->flags, ASStorage_RLEDiffCompress ) ) 
+					type = ASStorageStats_RLEDiff ;
+				++(compression[type].slots);
+				compression[type].stored_bytes += slot->size ;
+				compression[type].uncompressed_bytes += slot->uncompressed_size ;
+			}
+		}
+		next = AS_STORAGE_GetNextSlot(slot);
+		if( next <= slot ) 
+			break;
+		slot = next ;
+	}
+	if( free_area > 0 ) 
+	{
+		++(bs->free_areas);
+		if( free_area > bs->largest_free ) 
+			bs->largest_free = free_area ;
+	}
+	/* that much could be stored there in a single slot : */
+	if( bs->largest_free > 0 ) 
+		bs->largest_free -= ASStorageSlot_SIZE ;
+}
+
+int 
+get_asstorage_stats( ASStorage *storage, ASStorageStats *stats, ASStorageBlockStats *blocks, int max_blocks )
+{
+	int i, count = 0 ;
+
+	if( storage == NULL ) 
+		storage = get_default_asstorage();
+	if( stats == NULL || storage == NULL ) 
+		return 0;
+	memset( stats, 0x00, sizeof(ASStorageStats));
+	stats->default_block_size = storage->default_block_size ;
+	stats->memory_used = ASSTORAGE_ATOMIC_ADD( UsedMemory, 0 );
+	ASSTORAGE_RDLOCK(storage);
+	stats->defrag_count = storage->defrag_count ;
+	stats->defrag_time = storage->defrag_time ;
+	stats->ref_conversions = storage->ref_conversions ;
+	stats->ref_relocations = storage->ref_relocations ;
+	stats->released_bytes = storage->released_bytes ;
+	stats->shrunk_bytes = storage->shrunk_bytes ;
+	for( i = 0 ; i < storage->blocks_count ; ++i ) 
+	{
+		ASStorageBlock *block = storage->blocks[i] ;
+		ASStorageBlockStats bs ;
+		if( block == NULL ) 
+			continue;
+		ASSTORAGE_LOCK_BLOCK(block);
+		get_block_stats( block, &bs, &(stats->compression[0]) );
+		ASSTORAGE_UNLOCK_BLOCK(block);
+		bs.index = i ;
+		stats->size += bs.size ;
+		stats->used_bytes += bs.used_bytes ;
+		stats->free_bytes += bs.free_bytes ;
+		if( bs.largest_free > stats->largest_free ) 
+			stats->largest_free = bs.largest_free ;
+		stats->free_areas += bs.free_areas ;
+		stats->slots_count += bs.slots_count ;
+		stats->used_slots += bs.used_slots ;
+		stats->reference_slots += bs.reference_slots ;
+		stats->long_searches += bs.long_searches ;
+		stats->defrag_count += bs.defrag_count ;
+		stats->defrag_time += bs.defrag_time ;
+		if( blocks != NULL && count < max_blocks ) 
+			blocks[count] = bs ;
+		++count ;
+	}
+	ASSTORAGE_UNLOCK(storage);
+	stats->blocks_count = count ;
+	return count;
+}
+
+#define ASSTORAGE_JSON_BLOCK_SIZE	512   /* more then enough for a line of numbers */
+
+char *
+asstorage_stats2json( ASStorageStats *stats, ASStorageBlockStats *blocks, int blocks_count )
+{
+	static const char *compression_names[ASStorageStats_CompressionTypes] = { "none", "rlediff", "lz", "bitmap" };
+	char *json, *ptr ;
+	int i ;
+
+	if( stats == NULL ) 
+		return NULL;
+	if( blocks == NULL || blocks_count < 0 ) 
+		blocks_count = 0 ;
+	json = safemalloc( (blocks_count+ASStorageStats_CompressionTypes+4)*ASSTORAGE_JSON_BLOCK_SIZE );
+	ptr = json ;
+	ptr += sprintf( ptr, "{\n  \"blocks_count\": %d,\n  \"default_block_size\": %d,\n  \"memory_used\": %lu,\n", 
+					stats->blocks_count, stats->default_block_size, stats->memory_used );
+	ptr += sprintf( ptr, "  \"size\": %lu,\n  \"used_bytes\": %lu,\n  \"free_bytes\": %lu,\n  \"largest_free\": %lu,\n  \"free_areas\": %d,\n", 
+					stats->size, stats->used_bytes, stats->free_bytes, stats->largest_free, stats->free_areas );
+	ptr += sprintf( ptr, "  \"slots_count\": %d,\n  \"used_slots\": %d,\n  \"reference_slots\": %d,\n  \"long_searches\": %d,\n", 
+					stats->slots_count, stats->used_slots, stats->reference_slots, stats->long_searches );
+	ptr += sprintf( ptr, "  \"defrag_count\": %lu,\n  \"defrag_usec\": %lu,\n  \"ref_conversions\": %lu,\n  \"ref_relocations\": %lu,\n", 
+					stats->defrag_count, stats->defrag_time, stats->ref_conversions, stats->ref_relocations );
+	ptr += sprintf( ptr, "  \"released_bytes\": %lu,\n  \"shrunk_bytes\": %lu,\n  \"compression\": {", 
+					stats->released_bytes, stats->shrunk_bytes );
+	for( i = 0 ; i < ASStorageStats_CompressionTypes ; ++i ) 
+	{
+		ASStorageCompressionStats *c = &(stats->compression[i]) ;
+		ptr += sprintf( ptr, "%s\n    \"%s\": { \"slots\": %lu, \"stored_bytes\": %lu, \"uncompressed_bytes\": %lu, \"ratio\": %.4f }", 
+						(i > 0)?",":"", compression_names[i], c->slots, c->stored_bytes, c->uncompressed_bytes, 
+						(c->uncompressed_bytes > 0)? (double)c->stored_bytes/(double)c->uncompressed_bytes : 0. );
+	}
+	ptr += sprintf( ptr, "\n  }" );
+	if( blocks_count > 0 ) 
+	{
+		ptr += sprintf( ptr, ",\n  \"blocks\": [" );
+		for( i = 0 ; i < blocks_count ; ++i ) 
+		{
+			ASStorageBlockStats *b = &(blocks[i]) ;
+			ptr += sprintf( ptr, "%s\n    { \"index\": %d, \"size\": %lu, \"used_bytes\": %lu, \"free_bytes\": %lu, \"largest_free\": %lu, \"free_areas\": %d, "
+							"\"slots_count\": %d, \"used_slots\": %d, \"reference_slots\": %d, \"long_searches\": %d, \"defrag_count\": %d, \"defrag_usec\": %lu }", 
+							(i > 0)?",":"", b->index, b->size, b->used_bytes, b->free_bytes, b->largest_free, b->free_areas, 
+							b->slots_count, b->used_slots, b->reference_slots, b->long_searches, b->defrag_count, b->defrag_time );
+		}
+		ptr += sprintf( ptr, "\n  ]" );
+	}
+	sprintf( ptr, "\n}\n" );
+	return json;
 }
 
 void 
@@ -2030,18 +3561,20 @@ forget_data(ASStorage *storage, ASStorageID id)
 	
 	if( storage != NULL && id != 0 ) 
 	{
-		ASStorageBlock *block = find_storage_block( storage, id );
+		ASStorageBlock *block = lock_storage_block( storage, id );
  		ASStorageSlot  *slot  = find_storage_slot( block, id );				
-		if( block && slot ) 
+		ASStorageID target_id = 0;
+		Bool empty = False ;
+		if( slot ) 
 		{
 			if( get_flags( slot->flags, ASStorage_Reference) )
 			{
-				ASStorageID target_id = 0;
 			 	memcpy( &target_id, ASStorage_Data(slot), sizeof( ASStorageID ));				   
-				if( target_id != id ) 
-					forget_data( storage, target_id );					
-				else
+				if( target_id == id ) 
+				{
 					show_error( "reference refering to self id = %lX", id );
+					target_id = 0 ;
+				}
 			}	 
 			LOCAL_DEBUG_OUT( "id = %lX, ref_count = %d;", id, slot->ref_count );
 			if( slot->ref_count >= 1 ) 
@@ -2049,10 +3582,15 @@ forget_data(ASStorage *storage, ASStorageID id)
 			else
 			{	
 				free_storage_slot(block, slot);
-				if( is_block_empty(block) ) 
-					free_storage_block( storage, StorageID2BlockIdx(id) );
+				empty = is_block_empty(block) ;
 			}
 		}	 
+		if( block ) 
+			ASSTORAGE_UNLOCK_BLOCK(block);
+		if( empty )
+			free_storage_block( storage, StorageID2BlockIdx(id) );
+		if( target_id != 0 ) 
+			forget_data( storage, target_id );					
 	}			  
 }
 
@@ -2066,17 +3604,17 @@ dup_data(ASStorage *storage, ASStorageID id)
 	   
 	if( storage != NULL && id != 0 )
 	{	
-		ASStorageSlot *slot = find_storage_slot( find_storage_block( storage, id ), id );
+		ASStorageBlock *block = lock_storage_block( storage, id );
+		ASStorageSlot *slot = find_storage_slot( block, id );
+		ASStorageID target_id = 0, unused_id = 0 ;
+
 		LOCAL_DEBUG_OUT( "slot = %p, slot->index = %d, index(id) = %ld", slot, slot?slot->index:-1, StorageID2SlotIdx(id) );
 		if( slot )
 		{
-			ASStorageSlot *target_slot = NULL;
-			ASStorageID target_id = id ;
 			if( !get_flags( slot->flags, ASStorage_Reference )) 
 			{	
-				ASStorageSlot *new_slot = convert_slot_to_ref( storage, id );
-				if( new_slot != NULL ) 
-					slot = new_slot;
+				ASStorageSlot *new_slot = convert_slot_to_ref( storage, block, id, &unused_id );
+				slot = (new_slot != NULL)? new_slot : block->slots[StorageID2SlotIdx(id)];
 			}
 				
 			if( get_flags( slot->flags, ASStorage_Reference )) 
@@ -2084,20 +3622,44 @@ dup_data(ASStorage *storage, ASStorageID id)
 				memcpy( &target_id, ASStorage_Data(slot), sizeof( ASStorageID ));
 				/* from now on - slot is a reference slot, so we just need to 
 			 	 * duplicate it and increase ref_count of target */
-				if( target_id != id ) 
-					target_slot = find_storage_slot( find_storage_block( storage, target_id ), target_id );
-				else
+				if( target_id == id ) 
+				{	
 					show_error( "reference refering to self id = %lX", id );
+					target_id = 0 ;
+				}
 			}else
-				target_slot = slot ; 	
-			
+			{	/* could not convert - referencing the body itself */
+				if( is_slot_mapped( block, slot ) ) 
+					slot = copy_out_mapped_slot( block, slot, slot->size );
+				if( slot ) 
+				{
+					target_id = id ;
+					++(slot->ref_count);			   
+				}
+			}
+		}
+		if( block ) 
+			ASSTORAGE_UNLOCK_BLOCK(block);
+		if( unused_id != 0 ) 
+			forget_data( storage, unused_id );
+
+		if( target_id != 0 && target_id != id ) 
+		{	/* target can't go away while id references it : */
+			ASStorageBlock *target_block = lock_storage_block( storage, target_id );
+			ASStorageSlot *target_slot = find_storage_slot( target_block, target_id );
 			LOCAL_DEBUG_OUT( "target_slot = %p, slot = %p", target_slot, slot );
-			if( target_slot == NULL ) 
-				return 0;
-			/* doing it here as store_data() may change slot pointers */
-			++(target_slot->ref_count);			   
-			new_id = store_data( storage, (CARD8*)&target_id, sizeof(ASStorageID), ASStorage_Reference, 0);
-			LOCAL_DEBUG_OUT( "new_id = 0x%lX, target_id = %lX, target->ref_count = %d", new_id, target_id, target_slot->ref_count );
+			if( target_slot )
+				++(target_slot->ref_count);			   
+			else
+				target_id = 0 ;
+			if( target_block ) 
+				ASSTORAGE_UNLOCK_BLOCK(target_block);
+		}
+		if( target_id != 0 ) 
+		{
+			new_id = store_compressed_data( storage, (CARD8*)&target_id, sizeof(ASStorageID), 
+											sizeof(ASStorageID), 0, ASStorage_Reference );
+			LOCAL_DEBUG_OUT( "new_id = 0x%lX, target_id = %lX", new_id, target_id );
 		}
 	}
 	return new_id;
@@ -2244,11 +3806,12 @@ test_data_integrity( CARD8 *a, CARD8* b, int size, ASFlagType flags )
 		Bool fail = False ;
 		
 		if( get_flags( flags, ASStorage_Bitmap ) )
-		{	
+		{	/* values equal to threshold are set - see rlediff_compress_bitmap8(). 
+			 * Fetched values are either 0 or 0xFF so it works for both of them : */
 			if( get_flags( flags, ASStorage_32Bit ) )
-				fail = ( (a[i] >  threshold8 && b32[i] <= threshold32 )||(a[i] <= threshold8 && b32[i] > threshold32));
+				fail = ( (a[i] >= threshold8)?1:0 ) != ( (b32[i] >= threshold32)?1:0 );
 			else
-				fail = ( (a[i] >  threshold8 && b[i] <= threshold8 )||(a[i] <= threshold8 && b[i] >  threshold8));
+				fail = ( (a[i] >= threshold8)?1:0 ) != ( (b[i] >= threshold8)?1:0 );
 
 		}else
 		{
@@ -2267,12 +3830,12 @@ test_data_integrity( CARD8 *a, CARD8* b, int size, ASFlagType flags )
 			int k ;
 			if( get_flags( flags, ASStorage_32Bit ) )
 			{	
-				fprintf( stderr, "\tBytes %d differ : a[%d] == 0x%2.2X, b32[%d] == 0x%8.8lX\na: ", i, i, a[i], i, b32[i] );
+				fprintf( stderr, "\tBytes %d differ : a[%d] == 0x%2.2X, b32[%d] == 0x%8.8lX\na: ", i, i, a[i], i, (unsigned long)b32[i] );
 				for( k = 0 ; k < size ; ++k ) 
 					fprintf( stderr, (k==i)?"##%8.8X## ":"%8.8X ", a[k] );
 				fprintf( stderr, "\nb: " );
 				for( k = 0 ; k < size ; ++k ) 
-					fprintf( stderr, (k==i)?"##%8.8lX## ":"%8.8lX ", b32[k] );
+					fprintf( stderr, (k==i)?"##%8.8lX## ":"%8.8lX ", (unsigned long)b32[k] );
 			
 			}else
 			{	
@@ -2327,14 +3890,12 @@ test_asstorage(Bool interactive, int all_test_count, ASFlagType test_flags )
 			speed_buffer[i] = (MY_RND32())&0x00FF ;
 		
 		{
-			START_TIME(started2);
+			clock_t started2 = clock();
 			id = store_data( storage, &speed_buffer[0], SPEED_SIZE, test_flags, 0 );
-			SHOW_TIME("RLE compression speed ", started2);
-		}
-		{
-			START_TIME(started3);
+			fprintf( stderr, "RLE compression speed time (clocks): %lu mlsec\n", (unsigned long)(((clock () - started2)*100)/CLOCKS_PER_SEC) );
+			started2 = clock();
 			fetch_data(storage, id, &speed_buffer[0], 0, SPEED_SIZE, 0, NULL);
-			SHOW_TIME("RLE de-compression speed ", started3);
+			fprintf( stderr, "RLE de-compression speed time (clocks): %lu mlsec\n", (unsigned long)(((clock () - started2)*100)/CLOCKS_PER_SEC) );
 			forget_data(storage, id );
 		}
 		free( speed_buffer );
@@ -2358,7 +3919,7 @@ test_asstorage(Bool interactive, int all_test_count, ASFlagType test_flags )
 				test_flags);
 		Tests[i].id = store_data( storage, Tests[i].data, Tests[i].size, test_flags, 0 );
 		TEST_EVAL( Tests[i].id != 0 ); 
-		fprintf(stderr, "\tstored with id = %lX...\n", Tests[i].id );
+		fprintf(stderr, "\tstored with id = %lX...\n", (unsigned long)Tests[i].id );
 
 		if( --test_count <= 0 )
 		{
@@ -2370,8 +3931,8 @@ test_asstorage(Bool interactive, int all_test_count, ASFlagType test_flags )
 		}		   
 	}	 
 
-	fprintf( stderr, "%d :memory used %d #####################################################\n", __LINE__, UsedMemory );
-	fprintf( stderr, "%d :compressed_size = %d, uncompressed_size = %d, ratio = %d %% ###########\n", __LINE__, CompressedSize, UncompressedSize, (UncompressedSize<100)?0:(CompressedSize/(UncompressedSize/100)) );
+	fprintf( stderr, "%d :memory used %lu #####################################################\n", __LINE__, (unsigned long)UsedMemory );
+	fprintf( stderr, "%d :compressed_size = %lu, uncompressed_size = %lu, ratio = %lu %% ###########\n", __LINE__, (unsigned long)CompressedSize, (unsigned long)UncompressedSize, (unsigned long)((UncompressedSize<100)?0:(CompressedSize/(UncompressedSize/100))) );
 	SHOW_TIME("Pass 1", started);
 
 	if( interactive )
@@ -2380,7 +3941,7 @@ test_asstorage(Bool interactive, int all_test_count, ASFlagType test_flags )
 	{
 		int size ;
 		int res ;
-		fprintf(stderr, "Testing fetch_data for id %lX size = %d ...", Tests[i].id, Tests[i].size);
+		fprintf(stderr, "Testing fetch_data for id %lX size = %d ...", (unsigned long)Tests[i].id, Tests[i].size);
 		size = fetch_data(storage, Tests[i].id, &(Buffer[0]), 0, Tests[i].size, 0, NULL);
 		TEST_EVAL( size == Tests[i].size ); 
 		
@@ -2394,8 +3955,8 @@ test_asstorage(Bool interactive, int all_test_count, ASFlagType test_flags )
 		{
 			int size ;
 			int res ;
-			fprintf(stderr, "Testing fetch_data32 for id %lX size = %d ...", Tests[i].id, Tests[i].size);
-			size = fetch_data32(storage, Tests[i].id, &(Buffer[0]), 0, Tests[i].size/4, 0, NULL);
+			fprintf(stderr, "Testing fetch_data32 for id %lX size = %d ...", (unsigned long)Tests[i].id, Tests[i].size);
+			size = fetch_data32(storage, Tests[i].id, (CARD32*)&(Buffer[0]), 0, Tests[i].size/4, 0, NULL);
 			TEST_EVAL( size == Tests[i].size/4 ); 
 		
 			fprintf(stderr, "Testing fetched data integrity ...");
@@ -2404,7 +3965,7 @@ test_asstorage(Bool interactive, int all_test_count, ASFlagType test_flags )
 		}	 
 	}
 
-	fprintf( stderr, "%d :memory used %d #####################################################\n", __LINE__, UsedMemory );
+	fprintf( stderr, "%d :memory used %lu #####################################################\n", __LINE__, (unsigned long)UsedMemory );
 	SHOW_TIME("Pass 2", started);
 	if( interactive )
 	   fgetc(stdin);
@@ -2414,7 +3975,7 @@ test_asstorage(Bool interactive, int all_test_count, ASFlagType test_flags )
 		int r = random();
 		if( (r&0x01) == 0 || Tests[i].id == 0 ) 
 			continue;
-		fprintf(stderr, "%d: Testing forget_data for id %lX size = %d ...\n", __LINE__, Tests[i].id, Tests[i].size);
+		fprintf(stderr, "%d: Testing forget_data for id %lX size = %d ...\n", __LINE__, (unsigned long)Tests[i].id, Tests[i].size);
 		forget_data(storage, Tests[i].id);
 		size = fetch_data(storage, Tests[i].id, &(Buffer[0]), 0, Tests[i].size, 0, NULL );
 		TEST_EVAL( size != Tests[i].size ); 
@@ -2427,7 +3988,7 @@ test_asstorage(Bool interactive, int all_test_count, ASFlagType test_flags )
 		Tests[i].data = NULL ; 
 		Tests[i].size = 0 ;
 	}	 
-	fprintf( stderr, "%d :memory used %d #####################################################\n", __LINE__, UsedMemory );
+	fprintf( stderr, "%d :memory used %lu #####################################################\n", __LINE__, (unsigned long)UsedMemory );
 	SHOW_TIME("Pass 3", started);
 	if( interactive )
 	   fgetc(stdin);
@@ -2454,7 +4015,7 @@ test_asstorage(Bool interactive, int all_test_count, ASFlagType test_flags )
 			test_count = StorageTestKinds[kind][1] ;
 		}		   
 	}	 
-	fprintf( stderr, "%d :memory used %d #####################################################\n", __LINE__, UsedMemory );
+	fprintf( stderr, "%d :memory used %lu #####################################################\n", __LINE__, (unsigned long)UsedMemory );
 	SHOW_TIME("Pass 4", started);
 	if( interactive )
 	   fgetc(stdin);
@@ -2462,7 +4023,7 @@ test_asstorage(Bool interactive, int all_test_count, ASFlagType test_flags )
 	{
 		int size ;
 		int res ;
-		fprintf(stderr, "Testing fetch_data for id %lX size = %d ...", Tests[i].id, Tests[i].size);
+		fprintf(stderr, "Testing fetch_data for id %lX size = %d ...", (unsigned long)Tests[i].id, Tests[i].size);
 		size = fetch_data(storage, Tests[i].id, &(Buffer[0]), 0, Tests[i].size, 0, NULL);
 		TEST_EVAL( size == Tests[i].size ); 
 		
@@ -2471,7 +4032,7 @@ test_asstorage(Bool interactive, int all_test_count, ASFlagType test_flags )
 		TEST_EVAL( res == 0 ); 
 	}	 
 
-	fprintf( stderr, "%d :memory used %d #####################################################\n", __LINE__, UsedMemory );
+	fprintf( stderr, "%d :memory used %lu #####################################################\n", __LINE__, (unsigned long)UsedMemory );
 	SHOW_TIME("Pass 5", started);
 	if( interactive )
 	   fgetc(stdin);
@@ -2481,7 +4042,7 @@ test_asstorage(Bool interactive, int all_test_count, ASFlagType test_flags )
 		int r = random();
 		if( (r&0x01) == 0 || Tests[i].id == 0 ) 
 			continue;
-		fprintf(stderr, "%d: Testing forget_data for id %lX size = %d ...\n", __LINE__, Tests[i].id, Tests[i].size);
+		fprintf(stderr, "%d: Testing forget_data for id %lX size = %d ...\n", __LINE__, (unsigned long)Tests[i].id, Tests[i].size);
 		forget_data(storage, Tests[i].id);
 		size = fetch_data(storage, Tests[i].id, &(Buffer[0]), 0, Tests[i].size, 0, NULL);
 		TEST_EVAL( size != Tests[i].size ); 
@@ -2495,7 +4056,7 @@ test_asstorage(Bool interactive, int all_test_count, ASFlagType test_flags )
 		Tests[i].size = 0 ;
 	}	 
 
-	fprintf( stderr, "%d :memory used %d #####################################################\n", __LINE__, UsedMemory );
+	fprintf( stderr, "%d :memory used %lu #####################################################\n", __LINE__, (unsigned long)UsedMemory );
 	SHOW_TIME("Pass 6", started);
 	if( interactive )
 		fgetc(stdin);
@@ -2520,10 +4081,10 @@ test_asstorage(Bool interactive, int all_test_count, ASFlagType test_flags )
 			if( Tests[k].id == 0 ) 
 				continue;
 	
-			fprintf(stderr, "Testing dup_data for id %lX size = %d ...\n", Tests[k].id, Tests[k].size);
+			fprintf(stderr, "Testing dup_data for id %lX size = %d ...\n", (unsigned long)Tests[k].id, Tests[k].size);
 			Tests[i].id = dup_data(storage, Tests[k].id );
 			TEST_EVAL( Tests[i].id != 0 ); 
-			fprintf(stderr, "Dupped to id %lX - Testing dupped data fetching ...\n", Tests[i].id);
+			fprintf(stderr, "Dupped to id %lX - Testing dupped data fetching ...\n", (unsigned long)Tests[i].id);
 			Tests[i].size = Tests[k].size ;
 			Tests[i].data = Tests[k].data ;
 			Tests[i].linked = True ;
@@ -2536,7 +4097,7 @@ test_asstorage(Bool interactive, int all_test_count, ASFlagType test_flags )
 	
 		}	 
 
-		fprintf( stderr, "%d :memory used %d #####################################################\n", __LINE__, UsedMemory );
+		fprintf( stderr, "%d :memory used %lu #####################################################\n", __LINE__, (unsigned long)UsedMemory );
 		if( interactive )
 	   	fgetc(stdin);
 		for( i = 0 ; i < all_test_count ; ++i ) 
@@ -2545,7 +4106,7 @@ test_asstorage(Bool interactive, int all_test_count, ASFlagType test_flags )
 			int r = random();
 			if( (r&0x01) == 0 || Tests[i].id == 0 ) 
 				continue;
-			fprintf(stderr, "%d: Testing forget_data for id %lX size = %d ...\n", __LINE__, Tests[i].id, Tests[i].size);
+			fprintf(stderr, "%d: Testing forget_data for id %lX size = %d ...\n", __LINE__, (unsigned long)Tests[i].id, Tests[i].size);
 			forget_data(storage, Tests[i].id);
 			size = fetch_data(storage, Tests[i].id, &(Buffer[0]), 0, Tests[i].size, 0, NULL);
 			TEST_EVAL( size != Tests[i].size ); 
@@ -2577,7 +4138,7 @@ test_asstorage(Bool interactive, int all_test_count, ASFlagType test_flags )
 			Tests[i].size = 0 ;
 		}	 
 	}	
-	fprintf( stderr, "%d :memory used %d #####################################################\n", __LINE__, UsedMemory );
+	fprintf( stderr, "%d :memory used %lu #####################################################\n", __LINE__, (unsigned long)UsedMemory );
 	SHOW_TIME("Pass 7", started);
 	if( interactive )
 	   fgetc(stdin);
@@ -2604,8 +4165,8 @@ test_asstorage(Bool interactive, int all_test_count, ASFlagType test_flags )
 			test_count = StorageTestKinds[kind][1] ;
 		}		   
 	}	 
-	fprintf( stderr, "%d :memory used %d #####################################################\n", __LINE__, UsedMemory );
-	fprintf( stderr, "%d :compressed_size = %d, uncompressed_size = %d, ratio = %d %% ###########\n", __LINE__, CompressedSize, UncompressedSize, (UncompressedSize<100)?0:(CompressedSize/(UncompressedSize/100)) );
+	fprintf( stderr, "%d :memory used %lu #####################################################\n", __LINE__, (unsigned long)UsedMemory );
+	fprintf( stderr, "%d :compressed_size = %lu, uncompressed_size = %lu, ratio = %lu %% ###########\n", __LINE__, (unsigned long)CompressedSize, (unsigned long)UncompressedSize, (unsigned long)((UncompressedSize<100)?0:(CompressedSize/(UncompressedSize/100))) );
 	SHOW_TIME("", started);
 	fprintf(stderr, "Testing storage destruction ...");
 	destroy_asstorage(&storage);
@@ -2643,6 +4204,526 @@ test_asstorage(Bool interactive, int all_test_count, ASFlagType test_flags )
 	return 0 ;
 }
 
+#define STORAGE_MT_SLOTS		64
+#define STORAGE_MT_SHARED		16
+#define STORAGE_MT_MAX_SIZE		4096
+
+static CARD32 
+mt_test_random( CARD32 *seed ) 
+{
+	*seed = (1664525L * (*seed)) + 1013904223L ;
+	return (*seed)>>8 ;
+}
+
+static void 
+make_storage_mt_test_data( ASStorageTest *test, CARD32 *seed, ASFlagType flags )
+{
+	int size = (mt_test_random( seed )%STORAGE_MT_MAX_SIZE)+1 ;
+	int i ;
+
+	if( get_flags( flags, ASStorage_32Bit ) ) 	
+		size = ((size/4)+1)*4 ;
+	test->size = size ;
+	test->data = safemalloc( size );
+	test->linked = False ;
+	test->id = 0 ;
+	if( get_flags( flags, ASStorage_32Bit ) )
+	{
+		CARD32 *data32 = (CARD32*)(test->data);
+		int shift = get_flags( flags, ASStorage_8BitShift )? 8 : 0 ;
+		CARD32 val = mt_test_random( seed )&0x00FF;
+		for( i = 0 ; i < size/4 ; ++i ) 
+		{	/* mix of runs and noise to exercise all the compression paths */
+			if( (mt_test_random( seed )&0x07) == 0 )
+				val = mt_test_random( seed )&0x00FF ;
+			data32[i] = val<<shift ;
+		}
+	}else
+	{
+		CARD8 val = mt_test_random( seed );
+		for( i = 0 ; i < size ; ++i ) 
+		{
+			if( (mt_test_random( seed )&0x07) == 0 )
+				val = mt_test_random( seed ) ;
+			test->data[i] = val ;
+		}
+	}
+}
+
+/* Background defragmentation test : fills storage up, forgets most of the data
+ * so that some blocks end up sparse and the rest fragmented, and runs incremental
+ * defragmentation in small steps, making sure remaining data survives relocation : */
+static int
+test_asstorage_defrag( int count, ASFlagType test_flags )
+{
+	ASStorage *storage = create_asstorage();
+	ASStorageTest *tests = safecalloc( count, sizeof(ASStorageTest) );
+	CARD32 seed = 345824357 ;
+	int i, steps = 0, kept = 0, errors = 0 ;
+	size_t used_before, used_after ;
+	ASStorageStats stats ;
+	int blocks_count, fragmented_areas ;
+
+	fprintf( stderr, "\n%d :Testing defragmentation of %d slots, flags 0x%lX @@@@@@@@@@@@@@@@@@@@@@@@@@@@\n\n", 
+			 __LINE__, count, test_flags );
+	for( i = 0 ; i < count ; ++i ) 
+	{
+		make_storage_mt_test_data( &tests[i], &seed, test_flags );
+		if( (tests[i].id = store_data( storage, tests[i].data, tests[i].size, test_flags, 0 )) == 0 )
+			++errors ;
+	}
+	for( i = 0 ; i < count ; ++i ) 
+		if( (i < count/2)? (i%16) != 0 : (i%2) != 0 ) 
+		{
+			forget_data( storage, tests[i].id );
+			tests[i].id = 0 ;
+		}else
+			++kept ;
+	used_before = UsedMemory ;
+	get_asstorage_stats( storage, &stats, NULL, 0 );
+	fragmented_areas = stats.free_areas ;
+	while( defragment_asstorage( storage, AS_STORAGE_PAGE_SIZE*4 ) )
+		if( ++steps > count ) 
+		{
+			fprintf( stderr, "\tdefragmentation does not finish\n" );
+			++errors ;
+			break;
+		}
+	used_after = UsedMemory ;
+	for( i = 0 ; i < storage->blocks_count ; ++i ) 
+		if( storage->blocks[i] != NULL && get_flags( storage->blocks[i]->flags, ASStorage_BlockFragmented ) ) 
+		{
+			fprintf( stderr, "\tblock %d is left fragmented\n", i );
+			++errors ;
+		}
+	/* at most one free area per block must remain : */
+	if( (blocks_count = get_asstorage_stats( storage, &stats, NULL, 0 )) > 0 )
+	{
+		ASStorageBlockStats *blocks = safecalloc( blocks_count, sizeof(ASStorageBlockStats));
+		char *json ;
+		get_asstorage_stats( storage, &stats, blocks, blocks_count );
+		json = asstorage_stats2json( &stats, blocks, blocks_count );
+		if( stats.free_areas > blocks_count || stats.used_slots != kept || stats.size < stats.used_bytes + stats.free_bytes ) 
+		{
+			fprintf( stderr, "\tunexpected stats after defragmentation ( %d free areas before ) :\n%s", fragmented_areas, json );
+			++errors ;
+		}
+		free( json );
+		free( blocks );
+	}
+	/* compacted and shrunk blocks must remain usable : */
+	for( i = 0 ; i < count ; ++i ) 
+		if( tests[i].id == 0 ) 
+			tests[i].id = store_data( storage, tests[i].data, tests[i].size, test_flags, 0 );
+	for( i = 0 ; i < count ; ++i ) 
+	{
+		int size = fetch_data( storage, tests[i].id, &(Buffer[0]), 0, tests[i].size, 0, NULL );
+		if( size != tests[i].size || test_data_integrity( &(Buffer[0]), tests[i].data, size, test_flags ) != 0 ) 
+		{
+			fprintf( stderr, "\tslot %d (id %lX) is broken after defragmentation\n", i, (unsigned long)tests[i].id );
+			++errors ;
+		}
+		forget_data( storage, tests[i].id );
+		free( tests[i].data );
+	}
+	for( i = 0 ; i < storage->blocks_count ; ++i ) 
+		if( storage->blocks[i] != NULL ) 
+		{
+			fprintf( stderr, "\tblock %d is not freed after all the data was forgotten\n", i );
+			++errors ;
+		}	
+	fprintf( stderr, "%d :%d slots kept, %d steps, memory used %lu -> %lu, errors = %d\n", 
+			 __LINE__, kept, steps, (unsigned long)used_before, (unsigned long)used_after, errors );
+	destroy_asstorage( &storage );
+	free( tests );
+	return (errors == 0)? 0 : 1 ;
+}
+
+/* Images sharing rows of cached ones ( see make_gradient() ) keep on 
+ * creating and forgetting references of the same size - freed slots must be 
+ * reused in place, without growing or defragmenting the block, and the block 
+ * must go away as soon as the last slot in it is forgotten : */
+static int
+test_asstorage_slot_reuse( int count )
+{
+	ASStorage *storage = create_asstorage();
+	ASStorageID *refs = safecalloc( count, sizeof(ASStorageID) );
+	ASStorageTest test ;
+	ASStorageBlock *block ;
+	CARD32 seed = 739128461 ;
+	int i, pass, last_used, used, errors = 0 ;
+
+	fprintf( stderr, "\n%d :Testing reuse of %d reference slots @@@@@@@@@@@@@@@@@@@@@@@@@@@@\n\n", 
+			 __LINE__, count );
+	make_storage_mt_test_data( &test, &seed, 0 );
+	test.id = store_data( storage, test.data, test.size, ASStorage_RLEDiffCompress, 0 );
+	block = storage->blocks[StorageID2BlockIdx(test.id)] ;
+	for( i = 0 ; i < count ; ++i ) 
+		refs[i] = dup_data( storage, test.id );
+	last_used = block->last_used ;
+	used = block->used_count ;	/* original turns into reference to its body */
+	for( pass = 0 ; pass < 8 && errors == 0 ; ++pass ) 
+	{
+		int forgotten = 0 ;
+		for( i = pass%3 ; i < count ; i += 3 ) 
+		{
+			forget_data( storage, refs[i] );
+			++forgotten ;
+		}
+		if( block->used_count != used-forgotten ) 
+		{
+			fprintf( stderr, "\tpass %d : %d slots used, expected %d\n", pass, block->used_count, used-forgotten );
+			++errors ;
+		}
+		for( i = pass%3 ; i < count ; i += 3 ) 
+			refs[i] = dup_data( storage, test.id );
+		if( block->last_used != last_used || block->used_count != used ) 
+		{
+			fprintf( stderr, "\tpass %d : freed slots not reused - last used slot %d, was %d, %d slots used\n", 
+					 pass, block->last_used, last_used, block->used_count );
+			++errors ;
+		}
+		for( i = 0 ; i < count ; ++i ) 
+		{
+			int size = fetch_data( storage, refs[i], &(Buffer[0]), 0, test.size, 0, NULL );
+			if( StorageID2BlockIdx(refs[i]) != StorageID2BlockIdx(test.id) || 
+				size != test.size || memcmp( &(Buffer[0]), test.data, size ) != 0 ) 
+			{
+				fprintf( stderr, "\tpass %d : reference %d (id %lX) is broken\n", pass, i, (unsigned long)refs[i] );
+				++errors ;
+				break;
+			}
+		}
+	}
+	for( i = 0 ; i < count ; ++i ) 
+		forget_data( storage, refs[i] );
+	forget_data( storage, test.id );
+	for( i = 0 ; i < storage->blocks_count ; ++i ) 
+		if( storage->blocks[i] != NULL ) 
+		{
+			fprintf( stderr, "\tblock %d is not freed after all the data was forgotten\n", i );
+			++errors ;
+		}	
+	fprintf( stderr, "%d :%d passes, errors = %d\n", __LINE__, pass, errors );
+	destroy_asstorage( &storage );
+	free( test.data );
+	free( refs );
+	return (errors == 0)? 0 : 1 ;
+}
+
+#ifdef HAVE_SYS_MMAN_H
+/* Slots mapped read-only must survive being duplicated and forgotten 
+ * without storage ever writing into them - any such write would crash : */
+static int 
+test_asstorage_mapped( int count )
+{
+	ASStorage *storage = create_asstorage();
+	ASStorageTest *tests = safecalloc( count, sizeof(ASStorageTest) );
+	ASStorageID *ids = safecalloc( count, sizeof(ASStorageID) );
+	ASStorageID *dups = safecalloc( count*2, sizeof(ASStorageID) );
+	CARD32 seed = 192837465 ;
+	size_t map_size = 0, used_before ;
+	CARD8 *map, *ptr ;
+	int i, k, errors = 0 ;
+
+	fprintf( stderr, "\n%d :Testing duplication of %d read-only mapped slots @@@@@@@@@@@@@@@@@@@@@@@\n\n", 
+			 __LINE__, count );
+	/* lay slots out the way they are written into image cache files : */
+	for( i = 0 ; i < count ; ++i ) 
+	{
+		ASStorageSlot slot ;
+		make_storage_mt_test_data( &tests[i], &seed, 0 );
+		tests[i].id = store_data( storage, tests[i].data, tests[i].size, ASStorage_RLEDiffCompress, 0 );
+		query_storage_slot_data( storage, tests[i].id, &slot, NULL, 0 );
+		map_size += ASStorageSlot_FULL_SIZE(&slot) ;
+	}
+	map = mmap( NULL, map_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0 );
+	if( map == MAP_FAILED ) 
+	{
+		fprintf( stderr, "\tfailed to map %lu bytes\n", (unsigned long)map_size );
+		return 1;
+	}
+	for( i = 0, ptr = map ; i < count ; ++i ) 
+	{
+		ASStorageSlot *slot = (ASStorageSlot*)ptr ;
+		query_storage_slot_data( storage, tests[i].id, slot, ASStorage_Data(slot), STORAGE_MT_MAX_SIZE );
+		slot->index = i%AS_STORAGE_MAPPED_SLOTS_MAX ;
+		ptr += ASStorageSlot_FULL_SIZE(slot) ;
+		forget_data( storage, tests[i].id );
+	}
+	mprotect( map, map_size, PROT_READ );
+	used_before = UsedMemory ;
+	if( !map_storage_slots( storage, map, map_size, map, count, STORAGE_MT_MAX_SIZE, ids ) ) 
+	{
+		fprintf( stderr, "\tfailed to map slots\n" );
+		munmap( map, map_size );
+		return 1;
+	}
+	/* first dup relocates the body, second one references it : */
+	for( i = 0 ; i < count ; ++i ) 
+	{
+		dups[i*2] = dup_data( storage, ids[i] );
+		dups[i*2+1] = dup_data( storage, ids[i] );
+	}
+	for( i = 0 ; i < count ; i += 2 ) 
+		forget_data( storage, ids[i] );
+	for( i = 0 ; i < count*2 ; ++i ) 
+	{
+		ASStorageTest *test = &tests[i/2] ;
+		int size = fetch_data( storage, dups[i], &(Buffer[0]), 0, test->size, 0, NULL );
+		if( size != test->size || memcmp( &(Buffer[0]), test->data, size ) != 0 ) 
+		{
+			fprintf( stderr, "\tduplicate %d of slot %d (id %lX) is broken\n", i%2, i/2, (unsigned long)dups[i] );
+			++errors ;
+			break;
+		}
+	}
+	for( i = 1 ; i < count ; i += 2 ) 
+		forget_data( storage, ids[i] );
+	for( i = 0 ; i < count*2 ; ++i ) 
+		forget_data( storage, dups[i] );
+	for( i = k = 0 ; i < storage->blocks_count ; ++i ) 
+		if( storage->blocks[i] != NULL ) 
+			++k ;
+	if( k > 0 ) 
+	{
+		fprintf( stderr, "\t%d blocks are not freed after all the data was forgotten\n", k );
+		++errors ;
+	}
+	if( UsedMemory > used_before ) 
+	{
+		fprintf( stderr, "\t%lu bytes are still in use\n", (unsigned long)(UsedMemory - used_before) );
+		++errors ;
+	}
+	fprintf( stderr, "%d :errors = %d\n", __LINE__, errors );
+	destroy_asstorage( &storage );
+	for( i = 0 ; i < count ; ++i ) 
+		free( tests[i].data );
+	free( tests );
+	free( ids );
+	free( dups );
+	return (errors == 0)? 0 : 1 ;
+}
+#endif
+
+#ifdef HAVE_PTHREAD
+#include <sched.h>
+/* Multithreaded stress test : each thread keeps its own set of buffers, 
+ * storing, fetching, duplicating and forgetting them at random, while 
+ * also duplicating and fetching data shared by all the threads, and 
+ * storage gets defragmented in the background : */
+typedef struct ASStorageMTTest
+{
+	ASStorage *storage ;
+	ASFlagType flags ;
+	int iterations ;
+	CARD32 seed ;
+	ASStorageTest *shared ;
+	double bytes_processed ;
+	int errors ;
+	pthread_t thread ;
+}ASStorageMTTest;
+
+static int 
+check_storage_mt_test_data( ASStorageMTTest *mt, ASStorageID id, ASStorageTest *test, CARD8 *buffer )
+{
+	int size = fetch_data( mt->storage, id, buffer, 0, test->size, 0, NULL );
+	mt->bytes_processed += size ;
+	if( size != test->size ) 
+	{
+		fprintf( stderr, "\tthread %p: fetch_data for id %lX returned %d instead of %d\n", 
+				 mt, (unsigned long)id, size, test->size );
+		return 1;
+	}
+	if( test_data_integrity( buffer, test->data, size, mt->flags ) != 0 ) 
+		return 1;
+	return 0;
+}
+
+static void *
+storage_mt_test_thread( void *arg ) 
+{
+	ASStorageMTTest *mt = (ASStorageMTTest*)arg ;
+	ASStorageTest tests[STORAGE_MT_SLOTS] ;
+	CARD8 *buffer = safemalloc( STORAGE_MT_MAX_SIZE+4 );
+	int i, k ;
+
+	memset( &tests[0], 0x00, sizeof(tests));
+	for( i = 0 ; i < mt->iterations && mt->errors == 0 ; ++i ) 
+	{
+		CARD32 r = mt_test_random( &(mt->seed) );
+		ASStorageTest *t = &tests[r%STORAGE_MT_SLOTS] ;
+		
+		if( t->id == 0 )
+		{	
+			if( (r&0x0300) == 0 ) 
+			{	/* referencing data shared with other threads : */
+				ASStorageTest *src = &(mt->shared[(r>>12)%STORAGE_MT_SHARED]) ;
+				t->id = dup_data( mt->storage, src->id );
+				t->data = src->data ;
+				t->size = src->size ;
+				t->linked = True ;
+			}else
+			{	
+				make_storage_mt_test_data( t, &(mt->seed), mt->flags );
+				t->id = store_data( mt->storage, t->data, t->size, mt->flags, 0 );
+				mt->bytes_processed += t->size ;
+			}
+			if( t->id == 0 ) 
+				++(mt->errors) ;
+		}else if( (r&0x0300) == 0 ) 
+		{
+			forget_data( mt->storage, t->id ); 
+			t->id = 0 ;
+			if( !t->linked ) 
+			{	/* data could still be in use by other slot that dupped it */
+				for( k = 0 ; k < STORAGE_MT_SLOTS ; ++k ) 
+					if( tests[k].linked && tests[k].data == t->data ) 
+						break;
+				if( k < STORAGE_MT_SLOTS ) 
+					tests[k].linked = False ;
+				else
+					free( t->data );
+			}
+			t->data = NULL ;
+			t->linked = False ;
+		}else if( (r&0x0300) == 0x0100 ) 
+		{
+			for( k = 0 ; k < STORAGE_MT_SLOTS ; ++k ) 
+				if( tests[k].id == 0 ) 
+				{
+					tests[k].id = dup_data( mt->storage, t->id ); 
+					tests[k].data = t->data ;
+					tests[k].size = t->size ;
+					tests[k].linked = True ;
+					if( tests[k].id == 0 ) 
+						++(mt->errors) ;
+					else
+						mt->errors += check_storage_mt_test_data( mt, tests[k].id, &tests[k], buffer );
+					break;
+				}
+		}else
+			mt->errors += check_storage_mt_test_data( mt, t->id, t, buffer );
+	}
+	/* cleanup */
+	for( i = 0 ; i < STORAGE_MT_SLOTS ; ++i ) 
+		if( tests[i].id != 0 ) 
+		{
+			if( mt->errors == 0 )
+				mt->errors += check_storage_mt_test_data( mt, tests[i].id, &tests[i], buffer );
+			forget_data( mt->storage, tests[i].id ); 
+			tests[i].id = 0 ;
+		}
+	for( i = 0 ; i < STORAGE_MT_SLOTS ; ++i ) 
+		if( tests[i].data != NULL ) 
+		{	/* free each of our own buffers exactly once */
+			for( k = 0 ; k < STORAGE_MT_SHARED ; ++k ) 
+				if( mt->shared[k].data == tests[i].data ) 
+					break;
+			if( k >= STORAGE_MT_SHARED ) 
+			{	
+				for( k = 0 ; k < i ; ++k ) 
+					if( tests[k].data == tests[i].data ) 
+						break;
+				if( k >= i ) 
+					free( tests[i].data );
+			}
+		}
+	free( buffer );
+	flush_default_asstorage(); /* frees this thread's compression buffers */
+	return NULL;
+}
+
+static int StorageMTDone = 0 ;
+
+static void *
+storage_mt_defrag_thread( void *arg ) 
+{
+	ASStorage *storage = (ASStorage*)arg ;
+	while( ASSTORAGE_ATOMIC_ADD( StorageMTDone, 0 ) == 0 ) 
+		if( !defragment_asstorage( storage, AS_STORAGE_PAGE_SIZE*4 ) ) 
+			sched_yield();
+	return NULL;
+}
+
+int 
+test_asstorage_threads( int threads, int iterations, ASFlagType test_flags ) 
+{
+	pthread_t defrag_thread ;
+	Bool defrag_started ;
+	ASStorage *storage ;
+	ASStorageTest shared[STORAGE_MT_SHARED] ;
+	ASStorageMTTest *mt ;
+	CARD32 seed = 345824357 ;
+	double bytes = 0 ;
+	int i, errors = 0 ;
+	struct timeval tv_start, tv_end ;
+	double elapsed ;
+
+	fprintf( stderr, "\n%d :Testing %d threads x %d iterations, flags 0x%lX @@@@@@@@@@@@@@@@@@@@@@@@@@@@\n\n", 
+			 __LINE__, threads, iterations, test_flags );
+	storage = create_asstorage();
+	for( i = 0 ; i < STORAGE_MT_SHARED ; ++i ) 
+	{
+		make_storage_mt_test_data( &shared[i], &seed, test_flags );
+		shared[i].id = store_data( storage, shared[i].data, shared[i].size, test_flags, 0 );
+	}
+
+	mt = safecalloc( threads, sizeof(ASStorageMTTest));
+	StorageMTDone = 0 ;
+	defrag_started = (pthread_create( &defrag_thread, NULL, storage_mt_defrag_thread, storage ) == 0);
+	gettimeofday( &tv_start, NULL );
+	for( i = 0 ; i < threads ; ++i ) 
+	{
+		mt[i].storage = storage ;
+		mt[i].flags = test_flags ;
+		mt[i].iterations = iterations ;
+		mt[i].seed = seed + i*7919 ;
+		mt[i].shared = &shared[0] ;
+		if( pthread_create( &(mt[i].thread), NULL, storage_mt_test_thread, &mt[i] ) != 0 )
+		{
+			fprintf( stderr, "\tfailed to start thread %d\n", i );
+			++errors ;
+			mt[i].iterations = -1 ;
+		}
+	}
+	for( i = 0 ; i < threads ; ++i ) 
+		if( mt[i].iterations >= 0 )
+		{
+			pthread_join( mt[i].thread, NULL );
+			errors += mt[i].errors ;
+			bytes += mt[i].bytes_processed ;
+		}
+	gettimeofday( &tv_end, NULL );
+	ASSTORAGE_ATOMIC_ADD( StorageMTDone, 1 );
+	if( defrag_started ) 
+		pthread_join( defrag_thread, NULL );
+	elapsed = (tv_end.tv_sec - tv_start.tv_sec) + (tv_end.tv_usec - tv_start.tv_usec)/1000000.0 ; 
+	
+	/* shared data must have survived all the dup/forget cycles : */
+	for( i = 0 ; i < STORAGE_MT_SHARED ; ++i ) 
+	{
+		int size = fetch_data( storage, shared[i].id, &(Buffer[0]), 0, shared[i].size, 0, NULL );
+		if( size != shared[i].size || test_data_integrity( &(Buffer[0]), shared[i].data, size, test_flags ) != 0 ) 
+			++errors ;
+		forget_data( storage, shared[i].id );
+		free( shared[i].data );
+	}
+	for( i = 0 ; i < storage->blocks_count ; ++i ) 
+		if( storage->blocks[i] != NULL ) 
+		{
+			fprintf( stderr, "\tblock %d is not freed after all the data was forgotten\n", i );
+			++errors ;
+		}	
+
+	fprintf( stderr, "%d :%d threads processed %.1f MB in %.3f sec - %.1f MB/sec, errors = %d\n", 
+			 __LINE__, threads, bytes/(1024*1024), elapsed, (elapsed > 0)?bytes/(1024*1024)/elapsed:0., errors );
+	destroy_asstorage(&storage);
+	free( mt );
+	return (errors == 0)? 0 : 1 ;
+}
+#endif
+
 int main(int argc, char **argv )
 {
 	Bool interactive = False ; 
@@ -2650,6 +4731,7 @@ int main(int argc, char **argv )
 	int i ;
 	int res = 0;
 	int	test_count = STORAGE_TEST_COUNT ;
+	int threads = 0 ;
 	
 	set_output_threshold( 10 );
 	
@@ -2671,6 +4753,10 @@ int main(int argc, char **argv )
 
 			fprintf( stderr, "Test count = %d(\"%s\")\n", test_count, argv[i+1] );
 			++i ;
+		}else if( i+1 < argc && strcmp(argv[i], "-t") == 0 ) 
+		{
+			threads = atoi( argv[i+1] );
+			++i ;
 		}else if( i+1 <= argc && strcmp(argv[i], "-l") == 0 ) 
 		{
 			if( freopen( argv[i+1], "w", stderr ) == NULL )
@@ -2686,11 +4772,41 @@ int main(int argc, char **argv )
 		fprintf( stderr, "imdec = %p\n", imdec );
 	}
 	fprintf(stderr, "running tests ( res = %d ) ...\n", res );	
+	if( res == 0 )
+		res = test_asstorage_defrag( min(test_count,4000), 0 );
+	if( res == 0 )
+		res = test_asstorage_defrag( min(test_count,4000), ASStorage_RLEDiffCompress );
+	if( res == 0 )
+		res = test_asstorage_defrag( min(test_count,4000), ASStorage_32Bit|ASStorage_RLEDiffCompress|ASStorage_LZCompress );
+	if( res == 0 )
+		res = test_asstorage_slot_reuse( min(test_count,1000) );
+#ifdef HAVE_SYS_MMAN_H
+	if( res == 0 )
+		res = test_asstorage_mapped( min(test_count,1000) );
+#endif
+#ifdef HAVE_PTHREAD
+	if( threads > 0 )
+	{	/* -t N : multithreaded stress test only, -c sets iterations per thread */
+		ASFlagType mt_flags[5] = { 0, ASStorage_RLEDiffCompress, 
+								   ASStorage_32Bit|ASStorage_RLEDiffCompress, 
+								   ASStorage_32Bit|ASStorage_8BitShift|ASStorage_RLEDiffCompress,
+								   ASStorage_32Bit|ASStorage_RLEDiffCompress|ASStorage_LZCompress };
+		for( i = 0 ; i < 5 && res == 0 ; ++i )
+			res = test_asstorage_threads( threads, test_count, mt_flags[i] );
+
+		stop_image_decoding( &imdec );
+		return res;
+	}
+#endif
 	if( res == 0 )
 		res = test_asstorage(interactive, test_count, 0);
 #if 1
 	if( res == 0 )
 		res = test_asstorage(interactive, test_count, ASStorage_RLEDiffCompress);
+	if( res == 0 )
+		res = test_asstorage(interactive, test_count, ASStorage_RLEDiffCompress|ASStorage_LZCompress);
+	if( res == 0 )
+		res = test_asstorage(interactive, test_count, ASStorage_32Bit|ASStorage_8BitShift|ASStorage_LZCompress);
 	if( res == 0 )
 		res = test_asstorage(interactive, test_count, ASStorage_RLEDiffCompress|ASStorage_Bitmap);
 	if( res == 0 )
@@ -2712,3 +4828,215 @@ int main(int argc, char **argv )
 }
 #endif
 
+
+/*************************************************************************/
+/* codec micro-benchmark */
+/*************************************************************************/
+#ifdef BENCH_ASSTORAGE
+#include "afterimage.h"
+
+typedef struct ASStorageBenchCase
+{
+	ASFlagType flags ;
+	const char *name ;
+}ASStorageBenchCase;
+
+static ASStorageBenchCase StorageBenchCases[] = 
+{
+	{ 0, "none" },
+	{ ASStorage_RLEDiffCompress, "RLEDiff" },
+	{ ASStorage_RLEDiffCompress|ASStorage_Bitmap, "RLEDiff|Bitmap" },
+	{ ASStorage_32Bit, "32Bit" },
+	{ ASStorage_32BitRLE, "32Bit|RLEDiff" },
+	{ ASStorage_32BitRLE|ASStorage_8BitShift, "32Bit|RLEDiff|8BitShift" },
+	{ ASStorage_32BitRLE|ASStorage_16BitShift, "32Bit|RLEDiff|16BitShift" },
+	{ ASStorage_32BitRLE|ASStorage_24BitShift, "32Bit|RLEDiff|24BitShift" },
+	{ ASStorage_32BitRLE|ASStorage_Masked, "32Bit|RLEDiff|Masked" },
+	{ ASStorage_32BitRLE|ASStorage_8BitShift|ASStorage_Masked, "32Bit|RLEDiff|8BitShift|Masked" },
+	{ ASStorage_32BitRLE|ASStorage_16BitShift|ASStorage_Masked, "32Bit|RLEDiff|16BitShift|Masked" },
+	{ ASStorage_32BitRLE|ASStorage_8BitShift|ASStorage_Bitmap, "32Bit|RLEDiff|8BitShift|Bitmap" },
+	{ ASStorage_32Bit|ASStorage_8BitShift, "32Bit|8BitShift" },
+	{ ASStorage_LZCompress, "LZ" },
+	{ ASStorage_RLEDiffCompress|ASStorage_LZCompress, "RLEDiff|LZ" },
+	{ ASStorage_32BitRLE|ASStorage_8BitShift|ASStorage_LZCompress, "32Bit|RLEDiff|LZ|8BitShift" },
+	{ 0, NULL }
+};
+
+/* scanlines resembling real images - smooth gradients, flat areas and noise */
+static void 
+make_storage_bench_line( CARD8 *data, int width, int y, ASFlagType flags, CARD32 *seed )
+{
+	int shift = get_flags( flags, ASStorage_32Bit )? ASStorage_Flags2Shift(flags) : 0 ;
+	CARD32 *data32 = (CARD32*)data ;
+	int x ;
+	for( x = 0 ; x < width ; ++x ) 
+	{
+		CARD32 v ;
+		*seed = (1664525L * (*seed)) + 1013904223L ;
+		switch( ((x>>6)+y)&0x03 ) 
+		{
+			case 0 : v = (x*255)/width ; break ;
+			case 1 : v = y ; break ;
+			case 2 : v = ((x*255)/width + ((*seed)>>29)) ; break ;
+			default : v = (*seed)>>24 ; break ;
+		}
+		v &= 0x0FF ;
+		if( get_flags( flags, ASStorage_32Bit ) )
+		{
+			v = v<<shift ;
+			if( shift > 0 )                           /* garbage below the value */
+				v |= ((*seed)>>8) & ((0x01<<shift)-1) ;
+			if( get_flags( flags, ASStorage_Masked ) && shift < 24 ) /* and above it */
+				v |= ((*seed)<<(shift+8)) & ~((0x01<<(shift+8))-1) ;
+			data32[x] = v ;
+		}else
+			data[x] = v ;
+	}
+}
+
+static double 
+storage_bench_time()
+{
+	struct timeval tv ;
+	gettimeofday( &tv, NULL );
+	return tv.tv_sec + tv.tv_usec/1000000.0 ;
+}
+
+int main(int argc, char **argv )
+{
+	static CARD32 feature_sets[] = { 0, ASIM_CPU_SSE2, ASIM_CPU_SSE2|ASIM_CPU_AVX2 };
+	static const char *feature_names[] = { "C", "SSE2", "AVX2" };
+	int width = (argc > 1)? atoi(argv[1]) : 1920 ;
+	int lines = (argc > 2)? atoi(argv[2]) : 256 ;
+	int reps = (argc > 3)? atoi(argv[3]) : 20 ;
+	CARD32 available = get_asimage_cpu_features();
+	ASStorage *storage = create_asstorage();
+	ASStorageID *ids ;
+	CARD8 *src, *ref_comp, *out8, *ref_out8 ;
+	CARD32 *out32 ;
+	int *ref_comp_size ;
+	int c, f, l, r, res = 0 ;
+
+	if( width < 1 ) width = 1 ;
+	if( lines < 1 ) lines = 1 ;
+	if( reps < 1 ) reps = 1 ;
+	src = safemalloc( width*4*lines );
+	ref_comp = safemalloc( width*4*lines );
+	ref_comp_size = safemalloc( lines*sizeof(int) );
+	ref_out8 = safemalloc( width*lines );
+	out8 = safemalloc( width );
+	out32 = safemalloc( width*sizeof(CARD32) );
+	ids = safemalloc( lines*sizeof(ASStorageID) );
+
+	fprintf( stdout, "%d x %d, %d repetitions, cpu features = 0x%X\n", width, lines, reps, available );
+	fprintf( stdout, "%-34s %-5s %6s %12s %12s %12s\n", "flags", "impl", "ratio", "store MB/s", "fetch MB/s", "fetch32 MB/s" );
+	for( c = 0 ; StorageBenchCases[c].name != NULL && res == 0 ; ++c ) 
+	{
+		ASFlagType flags = StorageBenchCases[c].flags ;
+		int line_size = get_flags( flags, ASStorage_32Bit )? width*4 : width ;
+		CARD32 threshold = get_flags( flags, ASStorage_Bitmap )? AS_STORAGE_DEFAULT_BMAP_THRESHOLD : 0x000000FF ;
+		CARD32 seed = 345824357 ;
+		double mb = (double)line_size*lines*reps/(1024*1024) ;
+
+		for( l = 0 ; l < lines ; ++l ) 
+			make_storage_bench_line( src+l*line_size, width, l, flags, &seed );
+		
+		for( f = 0 ; f < (int)(sizeof(feature_sets)/sizeof(CARD32)) ; ++f )
+		{
+			double started, store_time, fetch_time, fetch32_time ;
+			long comp_total = 0 ;
+
+			if( (feature_sets[f] & available) != feature_sets[f] )
+				continue;
+			set_asimage_cpu_features_mask( feature_sets[f] );
+			
+			/* compressed data must be the same with any implementation : */
+			for( l = 0 ; l < lines ; ++l ) 
+			{
+				ASFlagType comp_flags = flags ;
+				int comp_size = 0 ;
+				CARD8 *comp = compress_stored_data( src+l*line_size, line_size, &comp_flags, &comp_size, threshold );
+				if( f == 0 ) 
+				{
+					memcpy( ref_comp+l*width*4, comp, comp_size );
+					ref_comp_size[l] = comp_size ;
+				}else if( comp_size != ref_comp_size[l] || memcmp( ref_comp+l*width*4, comp, comp_size ) != 0 ) 
+				{
+					fprintf( stdout, "%s: %s compressed line %d differs from C code\n", 
+							 StorageBenchCases[c].name, feature_names[f], l );
+					res = 1 ;
+				}
+				comp_total += comp_size ;
+			}
+
+			started = storage_bench_time();
+			for( r = 0 ; r < reps ; ++r ) 
+			{
+				for( l = 0 ; l < lines ; ++l ) 
+					ids[l] = store_data( storage, src+l*line_size, line_size, flags, 0 );
+				if( r+1 < reps ) 
+					for( l = 0 ; l < lines ; ++l ) 
+						forget_data( storage, ids[l] );
+			}
+			store_time = storage_bench_time() - started ;
+
+			started = storage_bench_time();
+			for( r = 0 ; r < reps ; ++r ) 
+				for( l = 0 ; l < lines ; ++l ) 
+					fetch_data( storage, ids[l], out8, 0, width, 0, NULL );
+			fetch_time = storage_bench_time() - started ;
+			
+			started = storage_bench_time();
+			for( r = 0 ; r < reps ; ++r ) 
+				for( l = 0 ; l < lines ; ++l ) 
+					fetch_data32( storage, ids[l], out32, 0, width, 0, NULL );
+			fetch32_time = storage_bench_time() - started ;
+
+			for( l = 0 ; l < lines ; ++l ) 
+			{
+				int x ;
+				fetch_data32( storage, ids[l], out32, 0, width, 0, NULL );
+				fetch_data( storage, ids[l], out8, 0, width, 0, NULL );
+				for( x = 0 ; x < width ; ++x ) 
+				{	
+					if( out32[x] != out8[x] ) 
+						break;
+					if( !get_flags( flags, ASStorage_Bitmap ) )
+					{
+						CARD32 v = get_flags( flags, ASStorage_32Bit )? 
+									((CARD32*)(src+l*line_size))[x]>>ASStorage_Flags2Shift(flags) : src[l*line_size+x] ;
+						if( out8[x] != (v&0x0FF) ) 
+							break;
+					}
+				}
+				if( f == 0 ) 
+					memcpy( ref_out8+l*width, out8, width );
+				else if( memcmp( ref_out8+l*width, out8, width ) != 0 ) 
+					x = -1 ;
+				if( x != width ) 
+				{
+					fprintf( stdout, "%s: %s fetched line %d differs\n", 
+							 StorageBenchCases[c].name, feature_names[f], l );
+					res = 1 ;
+				}
+				forget_data( storage, ids[l] );
+			}
+			fprintf( stdout, "%-34s %-5s %5.1f%% %12.1f %12.1f %12.1f\n", 
+					 StorageBenchCases[c].name, feature_names[f], 
+					 (comp_total*100.0)/((double)line_size*lines), 
+					 (store_time > 0)? mb/store_time : 0., 
+					 (fetch_time > 0)? mb/fetch_time : 0., 
+					 (fetch32_time > 0)? mb/fetch32_time : 0. );
+		}
+	}
+	destroy_asstorage( &storage );
+	free( src );
+	free( ref_comp );
+	free( ref_comp_size );
+	free( ref_out8 );
+	free( out8 );
+	free( out32 );
+	free( ids );
+	return res;
+}
+#endif
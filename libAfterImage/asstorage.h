@@ -73,6 +73,8 @@ typedef struct ASStorageSlot
  */
 #define ASStorage_ZlibCompress		(0x01<<0)  /* do we really want that ? */ 
 #define ASStorage_RLEDiffCompress 	(0x01<<1)  /* RLE of difference */ 
+#define ASStorage_LZCompress	 	(0x01<<2)  /* LZ of difference - tried in addition to 
+												* RLE, and used if gives better results */ 
 
 #define ASStorage_CompressionType	(0x0F<<0)  /* allow for 16 compression schemes */
 #define ASStorage_Used				(0x01<<4)
@@ -137,6 +139,8 @@ typedef int  (*copy_data32_tinted_func_type)(CARD8*,CARD32*,int,CARD32);
 typedef struct ASStorageBlock
 {
 #define ASStorage_MonoliticBlock		(0x01<<0) /* block consists of a single batch of storage */
+#define ASStorage_BlockFragmented		(0x01<<1) /* slots were freed since block was last compacted */
+#define ASStorage_MappedBlock			(0x01<<2) /* slots live in memory mapped file - see map_storage_slots() */
  	CARD32  flags ;
 	int 	size ;
 
@@ -146,8 +150,17 @@ typedef struct ASStorageBlock
 	   in case we have lots of small slots */
 	ASStorageSlot **slots;
 	int slots_count, unused_count ;
+	int used_count ;  /* slots holding data, so we know when block is empty */
 	int first_free, last_used ;
 	int long_searches ;
+	int pinned ;      /* block must not be moved while this is not 0 */
+
+	int defrag_count ;             /* times block was compacted */
+	unsigned long defrag_time ;    /* microseconds spent compacting it */
+
+	void   *lock ;    /* block's mutex when built with threads support */
+
+	struct ASStorageMapping *mapping ;	/* memory mapped blocks share the mapping */
 
 }ASStorageBlock;
 
@@ -159,9 +172,19 @@ typedef struct ASStorage
 	ASStorageBlock **blocks ;
 	int 			blocks_count;
 
-	ASStorageDiff  *diff_buf ;
-	CARD8  *comp_buf ;
-	size_t 	comp_buf_size ; 
+	/* Guards blocks array. Compression buffers are kept per thread, 
+	 * and slots are guarded by locks of the blocks they belong to, 
+	 * so that storage could be used by many threads at once : */
+	void   *lock ;
+
+	ASFlagType compression ;  /* schemes to try in addition to requested ones */
+
+	int defrag_cursor ;       /* next block defragment_asstorage() will look at */
+
+	/* counters kept for get_asstorage_stats() : */
+	unsigned long defrag_count, defrag_time ;    /* of the blocks freed so far */
+	unsigned long ref_conversions, ref_relocations ;
+	unsigned long released_bytes, shrunk_bytes ;
 
 }ASStorage;
 
@@ -176,6 +199,10 @@ ASStorageID store_data_tinted(ASStorage *storage, CARD8 *data, int size, ASFlagT
  * available data - data will be tiled to accomodate this size, unless NotTileable is set */
 int  fetch_data(ASStorage *storage, ASStorageID id, CARD8 *buffer, int offset, int buf_size, CARD8 bitmap_value, int *original_size);
 int  fetch_data32(ASStorage *storage, ASStorageID id, CARD32 *buffer, int offset, int buf_size, CARD8 bitmap_value, int *original_size);
+/* same as fetch_data, only each byte is placed into the 8 bits at shift
+ * of the consecutive 32 bit values of buffer, leaving other bits intact -
+ * that allows for decoding of channels straight into packed ARGB32 : */
+int  fetch_data_interleaved(ASStorage *storage, ASStorageID id, CARD32 *buffer, int shift, int offset, int buf_size, CARD8 bitmap_value, int *original_size);
 int  threshold_stored_data(ASStorage *storage, ASStorageID id, unsigned int *runs, int width, unsigned int threshold);
 
 /* slot identified by id will be marked as unused */
@@ -185,6 +212,25 @@ void print_storage(ASStorage *storage);
 
 int print_storage_slot(ASStorage *storage, ASStorageID id);
 Bool query_storage_slot(ASStorage *storage, ASStorageID id, ASStorageSlot *dst );
+/* same as query_storage_slot, but also copies compressed data of the slot 
+ * into data, if it fits into data_size bytes : */
+Bool query_storage_slot_data(ASStorage *storage, ASStorageID id, ASStorageSlot *dst, CARD8 *data, int data_size );
+
+/* Memory mapped slots : 
+ * count consecutive slots starting at slots, exactly as they are laid out 
+ * in storage block (header followed by compressed data padded to 16 bytes), 
+ * are wrapped into read-only storage blocks without copying anything. 
+ * Storage never writes into that memory - slots that have to be changed, 
+ * for example when data is duplicated, are copied out first. Each slot must be marked as used, have ref_count of 0 and index equal to its 
+ * number modulo AS_STORAGE_MAPPED_SLOTS_MAX, and its data has to decompress 
+ * into no more than max_uncompressed_size bytes. map_addr/map_size is the whole
+ * memory area obtained from mmap() (or malloc() where mmap is not available) 
+ * that contains slots. On success storage takes ownership of it, releasing
+ * it once all the slots are forgotten, ids of slots are placed into ids,
+ * and True is returned. */
+#define AS_STORAGE_MAPPED_SLOTS_MAX	(AS_STORAGE_MAX_SLOTS_CNT-1)
+Bool map_storage_slots(ASStorage *storage, void *map_addr, size_t map_size, void *slots, int count, 
+					   int max_uncompressed_size, ASStorageID *ids );
 
 /* returns new ID without copying data. Data will be stored as copy-on-right. 
  * Reference count of the data will be increased. If optional dst_id is specified - 
@@ -197,6 +243,84 @@ ASStorageID dup_data(ASStorage *storage, ASStorageID src_id);
  */
 void flush_default_asstorage();
 int set_asstorage_block_size( ASStorage *storage, int new_size );
+/* compression schemes (for example ASStorage_LZCompress) that will be tried on
+ * any data stored with compression requested. Best one is used for each line. 
+ * Returns previous setting : */
+ASFlagType set_asstorage_compression( ASStorage *storage, ASFlagType compression );
+
+/* incremental compaction, meant to be called periodically while application is idle.
+ * Looks at blocks that had data freed since last time, starting where previous call 
+ * stopped, until about max_work bytes of data has been moved ( 0 means size of the 
+ * single block ). Compacted blocks have pages past their last used slot returned to the 
+ * system where madvise() is available, and sparsely used blocks get shrunk to fit their 
+ * data. NULL storage means default storage. Returns True if there is more work left.
+ * Should not be called from several threads at once : */
+Bool defragment_asstorage( ASStorage *storage, int max_work );
+
+/* Statistics of the storage, as collected by get_asstorage_stats() : */
+#define ASStorageStats_Uncompressed		0
+#define ASStorageStats_RLEDiff			1
+#define ASStorageStats_LZ				2
+#define ASStorageStats_Bitmap			3
+#define ASStorageStats_CompressionTypes	4
+
+typedef struct ASStorageCompressionStats
+{
+	unsigned long slots ;
+	unsigned long stored_bytes ;       /* size of the data as it is kept in storage */
+	unsigned long uncompressed_bytes ; /* size of the data as it was stored */
+}ASStorageCompressionStats;
+
+typedef struct ASStorageBlockStats
+{
+	int index ;
+	unsigned long size ;         /* bytes allocated for slots */
+	unsigned long used_bytes ;   /* bytes occupied by used slots, including headers */
+	unsigned long free_bytes ;
+	unsigned long largest_free ; /* largest contiguous free area */
+	int free_areas ;             /* number of free areas - 1 means not fragmented */
+	int slots_count, used_slots, reference_slots ;
+	int long_searches ;
+	int defrag_count ;
+	unsigned long defrag_time ;  /* microseconds */
+}ASStorageBlockStats;
+
+typedef struct ASStorageStats
+{
+	int blocks_count ;
+	int default_block_size ;
+	unsigned long memory_used ;  /* all of the memory allocated by storage code, in all storages */
+	/* totals for all the blocks, similar to ASStorageBlockStats : */
+	unsigned long size, used_bytes, free_bytes, largest_free ;
+	int free_areas ;
+	int slots_count, used_slots, reference_slots ;
+	int long_searches ;
+	unsigned long defrag_count ;
+	unsigned long defrag_time ;  /* microseconds */
+	ASStorageCompressionStats compression[ASStorageStats_CompressionTypes] ;
+	/* data converted into references by dup_data(), and how many times 
+	 * its body had to be moved into a different block for that : */
+	unsigned long ref_conversions, ref_relocations ;
+	/* memory given back to the system by defragment_asstorage() : */
+	unsigned long released_bytes, shrunk_bytes ;
+}ASStorageStats;
+
+/* Name of the root window property applications may publish summary of the 
+ * default storage's stats in, as JSON text : */
+#define ASSTORAGE_STATS_PROPERTY	"_AS_STORAGE_STATS"
+
+/* fills stats with totals for the storage ( default storage if NULL ), and 
+ * up to max_blocks elements of blocks array with stats of individual blocks. 
+ * Returns number of blocks in storage, that could be larger then max_blocks : */
+int get_asstorage_stats( ASStorage *storage, ASStorageStats *stats, ASStorageBlockStats *blocks, int max_blocks );
+/* formats stats as JSON object. blocks may be NULL. Returned string must be 
+ * freed by the caller : */
+char *asstorage_stats2json( ASStorageStats *stats, ASStorageBlockStats *blocks, int blocks_count );
+
+/* selects vectorized implementation of compression code best suited for the CPU.
+ * Called internally from get_asimage_cpu_features() - compressed data is the same 
+ * regardless : */
+void select_asstorage_impl( CARD32 cpu_features );
 
 
 #endif
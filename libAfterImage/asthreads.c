@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2026 Sasha Vasko <sasha at aftercode.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef _WIN32
+#include "win32/config.h"
+#else
+#include "config.h"
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#ifdef _WIN32
+# include "win32/afterbase.h"
+#else
+# include "afterbase.h"
+#endif
+#include "asthreads.h"
+
+static int __as_threads_count = 1 ;
+
+#ifdef HAVE_PTHREAD
+
+/* we mark worker threads, so that nested parallel operations
+ * would be executed sequentially : */
+static pthread_key_t  __as_worker_key ;
+static pthread_once_t __as_worker_key_once = PTHREAD_ONCE_INIT ;
+
+static void
+create_worker_key()
+{
+	pthread_key_create( &__as_worker_key, NULL );
+}
+
+static Bool
+is_worker_thread()
+{
+	pthread_once( &__as_worker_key_once, create_worker_key );
+	return (pthread_getspecific( __as_worker_key ) != NULL);
+}
+
+/* Worker threads are started on demand and are kept around waiting for
+ * the next set of jobs, so that we don't pay for thread creation on
+ * every operation. Only one set of jobs runs at a time - sets submitted
+ * concurrently by other threads get executed sequentially. */
+typedef struct ASWorkerPool
+{
+	pthread_mutex_t lock ;
+	pthread_cond_t  work_cond, done_cond ;
+	pthread_mutex_t busy ;			/* held while set of jobs is running */
+	int threads ;					/* started so far */
+
+	as_job_func_type func ;
+	void *data ;
+	int jobs_count ;
+	int next_job ;					/* next job yet to be claimed */
+	int remaining ;					/* jobs not yet completed */
+}ASWorkerPool;
+
+static ASWorkerPool __as_pool = { PTHREAD_MUTEX_INITIALIZER,
+								  PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+								  PTHREAD_MUTEX_INITIALIZER, 0, NULL, NULL, 0, 0, 0 };
+
+/* executes jobs of the current set until there is none left unclaimed,
+ * must be called with pool locked : */
+static void
+claim_pool_jobs( ASWorkerPool *pool )
+{
+	while( pool->next_job < pool->jobs_count )
+	{
+		as_job_func_type func = pool->func ;
+		void *data = pool->data ;
+		int job = pool->next_job++ ;
+		int jobs_count = pool->jobs_count ;
+
+		pthread_mutex_unlock( &(pool->lock) );
+		func( data, job, jobs_count );
+		pthread_mutex_lock( &(pool->lock) );
+		if( --(pool->remaining) == 0 )
+			pthread_cond_signal( &(pool->done_cond) );
+	}
+}
+
+static void *
+worker_thread( void *arg )
+{
+	ASWorkerPool *pool = (ASWorkerPool*)arg ;
+	pthread_setspecific( __as_worker_key, pool );
+	pthread_mutex_lock( &(pool->lock) );
+	for( ;; )
+	{
+		while( pool->next_job >= pool->jobs_count )
+			pthread_cond_wait( &(pool->work_cond), &(pool->lock) );
+		claim_pool_jobs( pool );
+	}
+	pthread_mutex_unlock( &(pool->lock) );
+	return NULL;
+}
+
+/* must be called with pool locked : */
+static void
+start_pool_threads( ASWorkerPool *pool, int threads )
+{
+	pthread_attr_t attr ;
+	pthread_t thread ;
+
+	if( threads > ASIMAGE_MAX_THREADS-1 )
+		threads = ASIMAGE_MAX_THREADS-1 ;
+	if( pool->threads >= threads )
+		return;
+	pthread_attr_init( &attr );
+	pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+	while( pool->threads < threads )
+	{
+		if( pthread_create( &thread, &attr, worker_thread, pool ) != 0 )
+			break;                     /* jobs will be done by the rest of us */
+		++(pool->threads);
+	}
+	pthread_attr_destroy( &attr );
+}
+
+static int
+get_cpu_count()
+{
+	int count = 1 ;
+#ifdef _SC_NPROCESSORS_ONLN
+	count = sysconf( _SC_NPROCESSORS_ONLN );
+#endif
+	return (count > 0) ? count : 1 ;
+}
+
+#endif
+
+/************************************************************************/
+/* Public Functions : 													*/
+/************************************************************************/
+int
+set_asimage_threads( int threads_count )
+{
+	int old_count = __as_threads_count ;
+#ifdef HAVE_PTHREAD
+	if( threads_count <= 0 )
+		threads_count = get_cpu_count();
+	if( threads_count > ASIMAGE_MAX_THREADS )
+		threads_count = ASIMAGE_MAX_THREADS ;
+	__as_threads_count = threads_count ;
+#endif
+	return old_count;
+}
+
+int
+get_asimage_threads()
+{
+#ifdef HAVE_PTHREAD
+	if( __as_threads_count > 1 && !is_worker_thread() )
+		return __as_threads_count;
+#endif
+	return 1;
+}
+
+void
+run_asimage_jobs( as_job_func_type func, void *data, int jobs_count )
+{
+	int i ;
+#ifdef HAVE_PTHREAD
+	if( func && jobs_count > 1 && !is_worker_thread() )
+		if( pthread_mutex_trylock( &(__as_pool.busy) ) == 0 )
+		{
+			ASWorkerPool *pool = &__as_pool ;
+
+			pthread_mutex_lock( &(pool->lock) );
+			start_pool_threads( pool, MIN(jobs_count,__as_threads_count)-1 );
+			pool->func = func ;
+			pool->data = data ;
+			pool->next_job = 0 ;
+			pool->jobs_count = jobs_count ;
+			pool->remaining = jobs_count ;
+			pthread_cond_broadcast( &(pool->work_cond) );
+			/* calling thread becomes a worker until all the jobs are claimed : */
+			pthread_setspecific( __as_worker_key, pool );
+			claim_pool_jobs( pool );
+			pthread_setspecific( __as_worker_key, NULL );
+			while( pool->remaining > 0 )
+				pthread_cond_wait( &(pool->done_cond), &(pool->lock) );
+			pool->func = NULL ;
+			pool->data = NULL ;
+			pthread_mutex_unlock( &(pool->lock) );
+			pthread_mutex_unlock( &(pool->busy) );
+			return;
+		}
+#endif
+	if( func )
+		for( i = 0 ; i < jobs_count ; ++i )
+			func( data, i, jobs_count );
+}
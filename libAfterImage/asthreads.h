@@ -0,0 +1,111 @@
+#ifndef _ASTHREADS_H_HEADER_INCLUDED
+#define _ASTHREADS_H_HEADER_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/****h* libAfterImage/asthreads.h
+ * NAME
+ * asthreads - Defines interface for splitting image processing between
+ * several worker threads.
+ * DESCRIPTION
+ * Some of the image transformations, such as scaling, could be split
+ * into independent horizontal bands, each processed with its own
+ * decoder and output. Functions defined here allow one to set how many
+ * threads libAfterImage is allowed to use for that, and to run set of
+ * such jobs in parallel.
+ *
+ * Parallel processing is disabled by default, and has to be enabled by
+ * application with set_asimage_threads(). If libAfterImage has been
+ * built without POSIX threads support - all the jobs are executed
+ * sequentially in the calling thread.
+ * SEE ALSO
+ * Functions :
+ *          set_asimage_threads(), get_asimage_threads(),
+ *          run_asimage_jobs()
+ *
+ * Other libAfterImage modules :
+ *          asimage.h asstorage.h transform.h
+ * AUTHOR
+ * Sasha Vasko <sasha at aftercode dot net>
+ ******************/
+
+/****d* libAfterImage/asthreads/ASIMAGE_MAX_THREADS
+ * NAME
+ * ASIMAGE_MAX_THREADS - maximum number of worker threads libAfterImage
+ * will ever use for a single operation.
+ * SOURCE
+ */
+#define ASIMAGE_MAX_THREADS		64
+/*************/
+
+/****f* libAfterImage/asthreads/as_job_func_type
+ * NAME
+ * as_job_func_type - prototype of the function executing single job.
+ * SYNOPSIS
+ * typedef void (*as_job_func_type)( void *data, int job, int jobs_count );
+ * INPUTS
+ * data       - pointer to the data shared by all the jobs in the set;
+ * job        - index of the job in the set in range of 0 to jobs_count-1;
+ * jobs_count - total number of jobs in the set.
+ *********/
+typedef void (*as_job_func_type)( void *data, int job, int jobs_count );
+
+/****f* libAfterImage/set_asimage_threads()
+ * NAME
+ * set_asimage_threads() - sets maximum number of threads libAfterImage
+ * may use for processing of a single image.
+ * SYNOPSIS
+ * int set_asimage_threads( int threads_count );
+ * INPUTS
+ * threads_count - desired number of threads. 1 disables parallel
+ *                 processing, 0 or negative value selects number of
+ *                 online CPUs.
+ * RETURN VALUE
+ * Previous setting.
+ * DESCRIPTION
+ * Result of any operation does not depend on number of threads used -
+ * output is always identical to that of sequential processing.
+ * Setting is ignored if library was built without threads support.
+ *********/
+/****f* libAfterImage/get_asimage_threads()
+ * NAME
+ * get_asimage_threads() - returns maximum number of threads
+ * libAfterImage may use for processing of a single image.
+ * SYNOPSIS
+ * int get_asimage_threads();
+ * RETURN VALUE
+ * Number of threads, 1 if parallel processing is disabled or has been
+ * requested from inside of a worker thread.
+ *********/
+int set_asimage_threads( int threads_count );
+int get_asimage_threads();
+
+/****f* libAfterImage/run_asimage_jobs()
+ * NAME
+ * run_asimage_jobs() - executes set of jobs in parallel.
+ * SYNOPSIS
+ * void run_asimage_jobs( as_job_func_type func, void *data,
+ *                        int jobs_count );
+ * INPUTS
+ * func       - function to be called for each job;
+ * data       - pointer to be passed to each call;
+ * jobs_count - number of jobs to execute.
+ * DESCRIPTION
+ * Jobs are distributed between the calling thread and a pool of worker
+ * threads, which get started on first use, up to the number set by
+ * set_asimage_threads(), and then are kept waiting for the next set of
+ * jobs. Function returns only after all the jobs are completed. If
+ * thread could not be created - its share of jobs is executed by the
+ * rest. Only one set of jobs is executed by the pool at a time - sets
+ * submitted by other threads meanwhile, as well as parallel processing
+ * requested from inside of the job, are executed sequentially.
+ *********/
+void run_asimage_jobs( as_job_func_type func, void *data, int jobs_count );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ASTHREADS_H_HEADER_INCLUDED */
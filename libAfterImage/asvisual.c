@@ -42,6 +42,11 @@
 #endif
 #include "asvisual.h"
 #include "scanline.h"
+#include "asimage.h"
+
+#ifdef ASIM_X86_SIMD_DISPATCH
+# include <immintrin.h>
+#endif
 
 #if defined(XSHMIMAGE) && !defined(X_DISPLAY_MISSING)
 # include <sys/ipc.h>
@@ -339,6 +344,9 @@ create_asvisual_for_id( Display *dpy, int screen, int default_depth, VisualID vi
     Window root = dpy?RootWindow(dpy,screen):None;
 #endif /*ifndef X_DISPLAY_MISSING */
 
+	/* select vectorized code paths before any image processing takes place */
+	get_asimage_cpu_features();
+
 	if( asv == NULL )
         asv = safecalloc( 1, sizeof(ASVisual) );
 #ifndef X_DISPLAY_MISSING
@@ -410,6 +418,7 @@ destroy_asvisual( ASVisual *asv, Bool reusable )
 #endif
 		if( asv->scratch_window )
 			XDestroyWindow( asv->dpy, asv->scratch_window );
+		flush_ximage_pool( asv );
 
 #endif /*ifndef X_DISPLAY_MISSING */
 		if( !reusable )
@@ -1191,6 +1200,10 @@ static int shm_available_mem_used = 0 ;
 
 static Bool _as_use_shm_images = False ;
 
+static Bool put_pooled_ximage( ASVisual *asv, Drawable d, GC gc, XImage *xim,
+                               int src_x, int src_y, int dest_x, int dest_y,
+                               unsigned int width, unsigned int height );
+
 void really_destroy_shm_area( char *shmaddr, int shmid )
 {
 	shmdt (shmaddr);
@@ -1445,6 +1458,8 @@ Bool ASPutXImage( ASVisual *asv, Drawable d, GC gc, XImage *xim,
 	if( xim == NULL || asv == NULL )
 		return False ;
 
+	if( put_pooled_ximage( asv, d, gc, xim, src_x, src_y, dest_x, dest_y, width, height ) )
+		return True ;
 	if( ( img_data = check_XImage_shared( xim )) != NULL )
 	{
 /*		LOCAL_DEBUG_OUT( "XSHMIMAGE> PUT_XIM : using shared memory Put = %p", xim ); */
@@ -1486,6 +1501,7 @@ XImage *ASGetXImage( ASVisual *asv, Drawable d,
 
 Bool enable_shmem_images (){return False; }
 void disable_shmem_images(){}
+Bool check_shmem_images_enabled(){return False; }
 void *check_XImage_shared( XImage *xim ) {return NULL ; }
 
 Bool ASPutXImage( ASVisual *asv, Drawable d, GC gc, XImage *xim,
@@ -1670,6 +1686,209 @@ create_visual_scratch_ximage( ASVisual *asv, unsigned int width, unsigned int he
 
 
 
+/****************************************************************************/
+/* Pool of XImages reused for drawing ASImages onto drawables :             */
+/****************************************************************************/
+/* Canvases get redrawn at the same size over and over, so instead of
+ * creating/destroying XImage (and shared memory segment) every time we keep
+ * few of them around. Shared memory images are put with send_event off, and
+ * we wait for the server to process last put before reusing the memory. */
+#define ASXIMAGE_POOL_SIZE			4
+#define ASXIMAGE_POOL_MAX_PIXELS	(4096*4096)
+
+#ifndef X_DISPLAY_MISSING
+typedef struct ASXImagePoolEntry
+{
+	ASVisual 		*asv ;
+	XImage 			*ximage ;
+#ifdef XSHMIMAGE
+	XShmSegmentInfo *segment ;
+#endif
+	unsigned long 	 put_request ;	/* serial of the last XShmPutImage */
+	Bool 			 in_use ;
+	unsigned long 	 last_used ;
+}ASXImagePoolEntry;
+
+static ASXImagePoolEntry _as_ximage_pool[ASXIMAGE_POOL_SIZE] ;
+static unsigned long _as_ximage_pool_clock = 0 ;
+
+static ASXImagePoolEntry *
+find_pooled_ximage( XImage *xim )
+{
+	int i ;
+	if( xim != NULL )
+		for( i = 0 ; i < ASXIMAGE_POOL_SIZE ; ++i )
+			if( _as_ximage_pool[i].ximage == xim )
+				return &(_as_ximage_pool[i]);
+	return NULL;
+}
+
+static void
+wait_pooled_ximage( ASXImagePoolEntry *entry )
+{
+	if( entry->put_request != 0 )
+	{
+		if( LastKnownRequestProcessed(entry->asv->dpy) < entry->put_request )
+			XSync( entry->asv->dpy, False );
+		entry->put_request = 0 ;
+	}
+}
+
+static void
+destroy_pooled_ximage( ASXImagePoolEntry *entry )
+{
+	if( entry->ximage == NULL )
+		return;
+	wait_pooled_ximage( entry );
+#ifdef XSHMIMAGE
+	if( entry->segment )
+	{
+		XShmDetach( entry->asv->dpy, entry->segment );
+		XSync( entry->asv->dpy, False );
+		really_destroy_shm_area( entry->segment->shmaddr, entry->segment->shmid );
+		free( entry->segment );
+		entry->ximage->data = NULL ;
+		entry->ximage->obdata = NULL ;
+	}
+#endif
+	XDestroyImage( entry->ximage );
+	memset( entry, 0x00, sizeof(ASXImagePoolEntry));
+}
+
+static XImage *
+create_pooled_ximage( ASXImagePoolEntry *entry, ASVisual *asv, unsigned int width, unsigned int height )
+{
+	XImage *ximage = NULL ;
+	int unit = (asv->true_depth+7)&0x0038;
+	if( unit == 24 )
+		unit = 32 ;
+#ifdef XSHMIMAGE
+	if( _as_use_shm_images && width*height > 4000 )
+	{
+		XShmSegmentInfo *shminfo = safecalloc( 1, sizeof(XShmSegmentInfo));
+		ximage = XShmCreateImage( asv->dpy, asv->visual_info.visual, asv->visual_info.depth,
+		                          ZPixmap, NULL, shminfo, width, height );
+		if( ximage != NULL )
+		{
+			shminfo->shmid = shmget( IPC_PRIVATE, ximage->bytes_per_line * ximage->height, IPC_CREAT|0666 );
+			if( shminfo->shmid == -1 )
+			{
+				XFree( ximage );
+				ximage = NULL ;
+			}else
+			{
+				shminfo->shmaddr = ximage->data = shmat( shminfo->shmid, 0, 0 );
+				shminfo->readOnly = False;
+				XShmAttach( asv->dpy, shminfo );
+				entry->segment = shminfo ;
+			}
+		}
+		if( ximage == NULL )
+			free( shminfo );
+	}
+#endif
+	if( ximage == NULL )
+	{
+		ximage = XCreateImage( asv->dpy, asv->visual_info.visual, asv->visual_info.depth, ZPixmap,
+		                       0, NULL, width, height, unit, 0 );
+		if( ximage != NULL )
+		{
+			_XInitImageFuncPtrs (ximage);
+			ximage->obdata = NULL;
+			ximage->f.destroy_image = My_XDestroyImage;
+			ximage->data = safemalloc( ximage->bytes_per_line * ximage->height );
+		}
+	}
+	if( ximage != NULL )
+	{
+		entry->asv = asv ;
+		entry->ximage = ximage ;
+	}
+	return ximage;
+}
+
+#ifdef XSHMIMAGE
+static Bool
+put_pooled_ximage( ASVisual *asv, Drawable d, GC gc, XImage *xim,
+                   int src_x, int src_y, int dest_x, int dest_y,
+				   unsigned int width, unsigned int height )
+{
+	ASXImagePoolEntry *entry = find_pooled_ximage( xim );
+	if( entry == NULL || entry->segment == NULL )
+		return False;
+	entry->put_request = NextRequest( asv->dpy );
+	return XShmPutImage( asv->dpy, d, gc, xim, src_x, src_y, dest_x, dest_y, width, height, False );
+}
+#endif
+#endif /*ifndef X_DISPLAY_MISSING */
+
+XImage *
+acquire_visual_ximage( ASVisual *asv, unsigned int width, unsigned int height )
+{
+#ifndef X_DISPLAY_MISSING
+	ASXImagePoolEntry *selected = NULL ;
+	int i ;
+
+	if( asv == NULL || asv->dpy == NULL || width == 0 || height == 0 ||
+		width*height > ASXIMAGE_POOL_MAX_PIXELS )
+		return NULL;
+	for( i = 0 ; i < ASXIMAGE_POOL_SIZE ; ++i )
+	{
+		ASXImagePoolEntry *entry = &(_as_ximage_pool[i]);
+		if( entry->in_use )
+			continue;
+		if( entry->ximage == NULL )
+		{
+			if( selected == NULL || selected->ximage != NULL )
+				selected = entry ;
+		}else if( entry->asv == asv && entry->ximage->width == (int)width && entry->ximage->height == (int)height )
+		{
+			selected = entry ;
+			break;
+		}else if( selected == NULL || (selected->ximage != NULL && selected->last_used > entry->last_used) )
+			selected = entry ;
+	}
+	if( selected == NULL )
+		return NULL;
+	if( selected->ximage == NULL || selected->asv != asv ||
+		selected->ximage->width != (int)width || selected->ximage->height != (int)height )
+	{
+		destroy_pooled_ximage( selected );
+		if( create_pooled_ximage( selected, asv, width, height ) == NULL )
+			return NULL;
+	}else
+		wait_pooled_ximage( selected );
+	selected->in_use = True ;
+	selected->last_used = ++_as_ximage_pool_clock ;
+	return selected->ximage;
+#else
+	return NULL ;
+#endif
+}
+
+void
+release_visual_ximage( XImage *xim )
+{
+#ifndef X_DISPLAY_MISSING
+	ASXImagePoolEntry *entry = find_pooled_ximage( xim );
+	if( entry )
+		entry->in_use = False ;
+#endif
+}
+
+void
+flush_ximage_pool( ASVisual *asv )
+{
+#ifndef X_DISPLAY_MISSING
+	int i ;
+	for( i = 0 ; i < ASXIMAGE_POOL_SIZE ; ++i )
+		if( _as_ximage_pool[i].ximage != NULL && !_as_ximage_pool[i].in_use &&
+			(asv == NULL || _as_ximage_pool[i].asv == asv) )
+			destroy_pooled_ximage( &(_as_ximage_pool[i]) );
+#endif
+}
+
+
 /****************************************************************************/
 /* Color manipulation functions :                                           */
 /****************************************************************************/
@@ -2007,6 +2226,167 @@ ximage2scanline_pseudo12bpp( ASVisual *asv, XImage *xim, ASScanline *sl, int y,
 }
 #endif
 
+/* packing of 4 channels into 32bpp XImage pixels : dst = (c1<<24)|(c2<<16)|(c3<<8)|c4,
+ * and straight conversion of ARGB32 pixels into the visual's 32bpp layout : */
+typedef void (*pack_ximage32_line_func)( CARD32 *dst, CARD32 *c1, CARD32 *c2, CARD32 *c3, CARD32 *c4, int width );
+typedef void (*argb2ximage32_line_func)( CARD32 *dst, ARGB32 *src, int width, Bool bgr, Bool swap_bytes );
+
+static void
+pack_ximage32_line_c( CARD32 *dst, CARD32 *c1, CARD32 *c2, CARD32 *c3, CARD32 *c4, int width )
+{
+	register int i = width ;
+	while( --i >= 0 )
+		dst[i] = (c1[i]<<24)|(c2[i]<<16)|(c3[i]<<8)|c4[i];
+}
+
+static void
+argb2ximage32_line_c( CARD32 *dst, ARGB32 *src, int width, Bool bgr, Bool swap_bytes )
+{
+	register int x = width ;
+	if( bgr )
+	{
+		while( --x >= 0 )
+		{
+			register CARD32 c = src[x] ;
+			c = (c&0xFF00FF00)|((c>>16)&0x000000FF)|((c&0x000000FF)<<16);
+			dst[x] = swap_bytes? ((c>>24)|((c>>8)&0x0000FF00)|((c<<8)&0x00FF0000)|(c<<24)) : c ;
+		}
+	}else if( swap_bytes )
+	{
+		while( --x >= 0 )
+		{
+			register CARD32 c = src[x] ;
+			dst[x] = (c>>24)|((c>>8)&0x0000FF00)|((c<<8)&0x00FF0000)|(c<<24);
+		}
+	}else
+		memcpy( dst, src, width*sizeof(CARD32) );
+}
+
+#ifdef ASIM_X86_SIMD_DISPATCH
+static void __attribute__((target("sse2")))
+pack_ximage32_line_sse2( CARD32 *dst, CARD32 *c1, CARD32 *c2, CARD32 *c3, CARD32 *c4, int width )
+{
+	int i = 0 ;
+	for( ; i+4 <= width ; i += 4 )
+	{
+		__m128i v1 = _mm_slli_epi32( _mm_loadu_si128( (__m128i*)(c1+i) ), 24 );
+		__m128i v2 = _mm_slli_epi32( _mm_loadu_si128( (__m128i*)(c2+i) ), 16 );
+		__m128i v3 = _mm_slli_epi32( _mm_loadu_si128( (__m128i*)(c3+i) ), 8 );
+		__m128i v4 = _mm_loadu_si128( (__m128i*)(c4+i) );
+		_mm_storeu_si128( (__m128i*)(dst+i), _mm_or_si128( _mm_or_si128( v1, v2 ), _mm_or_si128( v3, v4 ) ) );
+	}
+	for( ; i < width ; ++i )
+		dst[i] = (c1[i]<<24)|(c2[i]<<16)|(c3[i]<<8)|c4[i];
+}
+
+static void __attribute__((target("avx2")))
+pack_ximage32_line_avx2( CARD32 *dst, CARD32 *c1, CARD32 *c2, CARD32 *c3, CARD32 *c4, int width )
+{
+	int i = 0 ;
+	for( ; i+8 <= width ; i += 8 )
+	{
+		__m256i v1 = _mm256_slli_epi32( _mm256_loadu_si256( (__m256i*)(c1+i) ), 24 );
+		__m256i v2 = _mm256_slli_epi32( _mm256_loadu_si256( (__m256i*)(c2+i) ), 16 );
+		__m256i v3 = _mm256_slli_epi32( _mm256_loadu_si256( (__m256i*)(c3+i) ), 8 );
+		__m256i v4 = _mm256_loadu_si256( (__m256i*)(c4+i) );
+		_mm256_storeu_si256( (__m256i*)(dst+i), _mm256_or_si256( _mm256_or_si256( v1, v2 ), _mm256_or_si256( v3, v4 ) ) );
+	}
+	for( ; i < width ; ++i )
+		dst[i] = (c1[i]<<24)|(c2[i]<<16)|(c3[i]<<8)|c4[i];
+}
+
+static void __attribute__((target("sse2")))
+argb2ximage32_line_sse2( CARD32 *dst, ARGB32 *src, int width, Bool bgr, Bool swap_bytes )
+{
+	const __m128i ga_mask = _mm_set1_epi32( 0xFF00FF00 );
+	const __m128i lo_mask = _mm_set1_epi32( 0x000000FF );
+	const __m128i b1_mask = _mm_set1_epi32( 0x0000FF00 );
+	const __m128i b2_mask = _mm_set1_epi32( 0x00FF0000 );
+	int x = 0 ;
+
+	if( !bgr && !swap_bytes )
+	{
+		memcpy( dst, src, width*sizeof(CARD32) );
+		return;
+	}
+	for( ; x+4 <= width ; x += 4 )
+	{
+		__m128i c = _mm_loadu_si128( (__m128i*)(src+x) );
+		if( bgr )
+			c = _mm_or_si128( _mm_and_si128( c, ga_mask ),
+			                  _mm_or_si128( _mm_and_si128( _mm_srli_epi32( c, 16 ), lo_mask ),
+			                                _mm_slli_epi32( _mm_and_si128( c, lo_mask ), 16 ) ) );
+		if( swap_bytes )
+			c = _mm_or_si128( _mm_or_si128( _mm_srli_epi32( c, 24 ), _mm_and_si128( _mm_srli_epi32( c, 8 ), b1_mask ) ),
+			                  _mm_or_si128( _mm_and_si128( _mm_slli_epi32( c, 8 ), b2_mask ), _mm_slli_epi32( c, 24 ) ) );
+		_mm_storeu_si128( (__m128i*)(dst+x), c );
+	}
+	if( x < width )
+		argb2ximage32_line_c( dst+x, src+x, width-x, bgr, swap_bytes );
+}
+
+static void __attribute__((target("avx2")))
+argb2ximage32_line_avx2( CARD32 *dst, ARGB32 *src, int width, Bool bgr, Bool swap_bytes )
+{
+	/* any combination of BGR and byte order swaps is a single byte shuffle : */
+	static const char shuffles[3][16] =
+	{{ 2, 1, 0, 3,  6, 5, 4, 7, 10, 9, 8,11, 14,13,12,15 },	/* bgr */
+	 { 3, 2, 1, 0,  7, 6, 5, 4, 11,10, 9, 8, 15,14,13,12 },	/* swap_bytes */
+	 { 3, 0, 1, 2,  7, 4, 5, 6, 11, 8, 9,10, 15,12,13,14 }};	/* bgr + swap_bytes */
+	__m256i shuffle ;
+	int x = 0 ;
+
+	if( !bgr && !swap_bytes )
+	{
+		memcpy( dst, src, width*sizeof(CARD32) );
+		return;
+	}
+	shuffle = _mm256_broadcastsi128_si256( _mm_loadu_si128( (__m128i*)&shuffles[bgr?(swap_bytes?2:0):1][0] ) );
+	for( ; x+8 <= width ; x += 8 )
+		_mm256_storeu_si256( (__m256i*)(dst+x), _mm256_shuffle_epi8( _mm256_loadu_si256( (__m256i*)(src+x) ), shuffle ) );
+	if( x < width )
+		argb2ximage32_line_c( dst+x, src+x, width-x, bgr, swap_bytes );
+}
+#endif /* ASIM_X86_SIMD_DISPATCH */
+
+static pack_ximage32_line_func pack_ximage32_line_impl = pack_ximage32_line_c ;
+static argb2ximage32_line_func argb2ximage32_line_impl = argb2ximage32_line_c ;
+static Bool asvisual_impl_selected = False ;
+
+void
+select_asvisual_impl( CARD32 cpu_features )
+{
+	pack_ximage32_line_impl = pack_ximage32_line_c ;
+	argb2ximage32_line_impl = argb2ximage32_line_c ;
+#ifdef ASIM_X86_SIMD_DISPATCH
+	if( get_flags( cpu_features, ASIM_CPU_SSE2 ) )
+	{
+		pack_ximage32_line_impl = pack_ximage32_line_sse2 ;
+		argb2ximage32_line_impl = argb2ximage32_line_sse2 ;
+	}
+	if( get_flags( cpu_features, ASIM_CPU_AVX2 ) )
+	{
+		pack_ximage32_line_impl = pack_ximage32_line_avx2 ;
+		argb2ximage32_line_impl = argb2ximage32_line_avx2 ;
+	}
+#endif
+	asvisual_impl_selected = True ;
+}
+
+void
+argb32_line2ximage32( ASVisual *asv, CARD32 *dst, ARGB32 *src, int width )
+{
+	Bool swap_bytes ;
+#ifdef WORDS_BIGENDIAN
+	swap_bytes = !asv->msb_first ;
+#else
+	swap_bytes = asv->msb_first ;
+#endif
+	if( !asvisual_impl_selected )
+		get_asimage_cpu_features();
+	argb2ximage32_line_impl( dst, src, width, asv->BGR_mode, swap_bytes );
+}
+
 void scanline2ximage32( ASVisual *asv, XImage *xim, ASScanline *sl, int y,  register unsigned char *xim_data )
 {
 	register CARD32 *r = sl->xc1+sl->offset_x, *g = sl->xc2+sl->offset_x, *b = sl->xc3+sl->offset_x;
@@ -2015,18 +2395,16 @@ void scanline2ximage32( ASVisual *asv, XImage *xim, ASScanline *sl, int y,  regi
 	register CARD32 *src = (CARD32*)xim_data;
 /*	src += sl->offset_x ; */
 /*fprintf( stderr, "%d: ", y);*/
+	if( !asvisual_impl_selected )
+		get_asimage_cpu_features();
 #ifdef WORDS_BIGENDIAN
 	if( !asv->msb_first )
 #else
 	if( asv->msb_first )
 #endif
-		while( --i >= 0)
-		{
-			src[i] = (b[i]<<24)|(g[i]<<16)|(r[i]<<8)|a[i];
-/*			fprintf( stderr, "[%d->%8.8X %8.8X %8.8X %8.8X = %8.8X]", i, r[i], g[i], b[i], a[i], src[i]);  */
-		}
+		pack_ximage32_line_impl( src, b, g, r, a, i );
 	else
-		while( --i >= 0) src[i] = (a[i]<<24)|(r[i]<<16)|(g[i]<<8)|b[i];
+		pack_ximage32_line_impl( src, a, r, g, b, i );
 /*fprintf( stderr, "\n");*/
 #ifdef DEBUG_SL2XIMAGE
 	i = MIN((unsigned int)(xim->width),sl->width-sl->offset_x);
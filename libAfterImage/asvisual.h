@@ -322,6 +322,8 @@ void scanline2ximage15( ASVisual *asv, XImage *xim, struct ASScanline *sl, int y
 void scanline2ximage_pseudo3bpp( ASVisual *asv, XImage *xim, struct ASScanline *sl, int y,  register unsigned char *xim_data );
 void scanline2ximage_pseudo6bpp( ASVisual *asv, XImage *xim, struct ASScanline *sl, int y,  register unsigned char *xim_data );
 void scanline2ximage_pseudo12bpp( ASVisual *asv, XImage *xim, struct ASScanline *sl, int y,  register unsigned char *xim_data );
+/* converts line of ARGB32 pixels into the pixel layout of scanline2ximage32() : */
+void argb32_line2ximage32( ASVisual *asv, CARD32 *dst, ARGB32 *src, int width );
 
 /****f* libAfterImage/query_screen_visual()
  * NAME
@@ -652,6 +654,42 @@ XImage* create_visual_scratch_ximage( ASVisual *asv,
 	                          unsigned int width, unsigned int height,
 							  unsigned int depth );
 
+/****f* libAfterImage/acquire_visual_ximage()
+ * NAME
+ * acquire_visual_ximage()
+ * NAME
+ * release_visual_ximage()
+ * NAME
+ * flush_ximage_pool()
+ * SYNOPSIS
+ * XImage* acquire_visual_ximage( ASVisual *asv,
+ *                                unsigned int width, unsigned int height );
+ * void release_visual_ximage( XImage *xim );
+ * void flush_ximage_pool( ASVisual *asv );
+ * INPUTS
+ * asv            - pointer to the valid ASVisual structure.
+ * width, height  - size of the XImage.
+ * xim            - XImage previously returned by acquire_visual_ximage().
+ * RETURN VALUE
+ * acquire_visual_ximage() returns pointer to the XImage of the visual's
+ * depth owned by the pool, or NULL if pool is exhausted or image is
+ * too big.
+ * DESCRIPTION
+ * Small pool of XImages that are reused for repeated drawing of images
+ * of the same size, such as canvas contents. When shared memory images
+ * are enabled pooled XImages are backed by XShm segments and
+ * ASPutXImage()/put_ximage() uploads them without copying. Pool waits
+ * for the X server to finish reading the previous upload before handing
+ * the same XImage out again. Pooled XImages must not be destroyed -
+ * release_visual_ximage() should be used instead.
+ * flush_ximage_pool() destroys all unused pooled XImages of the visual,
+ * or of all visuals if asv is NULL. It is called from destroy_asvisual().
+ *********/
+XImage* acquire_visual_ximage( ASVisual *asv,
+	                           unsigned int width, unsigned int height );
+void release_visual_ximage( XImage *xim );
+void flush_ximage_pool( ASVisual *asv );
+
 #define ASSHM_SAVED_MAX	(256*1024)
 
 #ifdef XSHMIMAGE
@@ -671,6 +709,10 @@ XImage * ASGetXImage( ASVisual *asv, Drawable d,
                   int x, int y, unsigned int width, unsigned int height,
 				  unsigned long plane_mask );
 
+/* selects vectorized implementation of XImage packing best suited for the CPU.
+ * Called internally from get_asimage_cpu_features() : */
+void select_asvisual_impl( CARD32 cpu_features );
+
 
 #ifdef __cplusplus
 }
@@ -30,6 +30,7 @@
 #endif
 
 #include <ctype.h>
+#include <string.h>
 #ifdef _WIN32
 # include "win32/afterbase.h"
 #else
@@ -38,6 +39,11 @@
 #include "asvisual.h"
 #include "scanline.h"
 #include "blender.h"
+#include "asimage.h"
+
+#ifdef ASIM_X86_SIMD_DISPATCH
+#include <immintrin.h>
+#endif
 
 /*********************************************************************************/
 /* colorspace conversion functions : 											 */
@@ -301,30 +307,57 @@ hls2rgb (CARD32 hue, CARD32 luminance, CARD32 saturation, CARD32 *red, CARD32 *g
 /* scanline blending 													 */
 /*************************************************************************/
 
+/* Merging methods that have vectorized implementations are dispatched
+ * at runtime via these pointers. Plain C versions are always available
+ * and vectorized versions must produce exactly the same output : */
+static merge_scanlines_func alphablend_impl = NULL ;
+static merge_scanlines_func allanon_impl = NULL ;
+static merge_scanlines_func tint_impl = NULL ;
+static merge_scanlines_func add_impl = NULL ;
+static merge_scanlines_func sub_impl = NULL ;
+static merge_scanlines_func diff_impl = NULL ;
+static merge_scanlines_func darken_impl = NULL ;
+static merge_scanlines_func lighten_impl = NULL ;
+static merge_scanlines_func screen_impl = NULL ;
+static merge_scanlines_func overlay_impl = NULL ;
+
+/* same for packed ARGB32 scanlines : */
+static merge_packed_scanlines_func alphablend_packed_impl = NULL ;
+static merge_packed_scanlines_func allanon_packed_impl = NULL ;
+static merge_packed_scanlines_func tint_packed_impl = NULL ;
+static merge_packed_scanlines_func add_packed_impl = NULL ;
+static merge_packed_scanlines_func sub_packed_impl = NULL ;
+static merge_packed_scanlines_func diff_packed_impl = NULL ;
+static merge_packed_scanlines_func darken_packed_impl = NULL ;
+static merge_packed_scanlines_func lighten_packed_impl = NULL ;
+static merge_packed_scanlines_func screen_packed_impl = NULL ;
+
 typedef struct merge_scanlines_func_desc {
     char *name ;
 	int name_len ;
 	merge_scanlines_func func;
 	char *short_desc;
+	merge_scanlines_func *impl;        /* NULL if not dispatched at runtime */
+	merge_packed_scanlines_func *packed_impl; /* NULL if needs 24.8 precision */
 }merge_scanlines_func_desc;
 
 merge_scanlines_func_desc std_merge_scanlines_func_list[] =
 {
-  { "add", 3, add_scanlines, "color addition with saturation" },
-  { "alphablend", 10, alphablend_scanlines, "alpha-blending" },
-  { "allanon", 7, allanon_scanlines, "color values averaging" },
-  { "colorize", 8, colorize_scanlines, "hue and saturate bottom image same as top image" },
-  { "darken", 6, darken_scanlines, "use lowest color value from both images" },
-  { "diff", 4, diff_scanlines, "use absolute value of the color difference between two images" },
-  { "dissipate", 9, dissipate_scanlines, "randomly alpha-blend images"},
-  { "hue", 3, hue_scanlines, "hue bottom image same as top image"  },
-  { "lighten", 7, lighten_scanlines, "use highest color value from both images" },
-  { "overlay", 7, overlay_scanlines, "some weird image overlaying(see GIMP)" },
-  { "saturate", 8, saturate_scanlines, "saturate bottom image same as top image"},
-  { "screen", 6, screen_scanlines, "another weird image overlaying(see GIMP)" },
-  { "sub", 3, sub_scanlines, "color substraction with saturation" },
-  { "tint", 4, tint_scanlines, "tinting image with image" },
-  { "value", 5, value_scanlines, "value bottom image same as top image" },
+  { "add", 3, add_scanlines, "color addition with saturation", &add_impl, &add_packed_impl },
+  { "alphablend", 10, alphablend_scanlines, "alpha-blending", &alphablend_impl, &alphablend_packed_impl },
+  { "allanon", 7, allanon_scanlines, "color values averaging", &allanon_impl, &allanon_packed_impl },
+  { "colorize", 8, colorize_scanlines, "hue and saturate bottom image same as top image", NULL, NULL },
+  { "darken", 6, darken_scanlines, "use lowest color value from both images", &darken_impl, &darken_packed_impl },
+  { "diff", 4, diff_scanlines, "use absolute value of the color difference between two images", &diff_impl, &diff_packed_impl },
+  { "dissipate", 9, dissipate_scanlines, "randomly alpha-blend images", NULL, NULL },
+  { "hue", 3, hue_scanlines, "hue bottom image same as top image", NULL, NULL },
+  { "lighten", 7, lighten_scanlines, "use highest color value from both images", &lighten_impl, &lighten_packed_impl },
+  { "overlay", 7, overlay_scanlines, "some weird image overlaying(see GIMP)", &overlay_impl, NULL },
+  { "saturate", 8, saturate_scanlines, "saturate bottom image same as top image", NULL, NULL },
+  { "screen", 6, screen_scanlines, "another weird image overlaying(see GIMP)", &screen_impl, &screen_packed_impl },
+  { "sub", 3, sub_scanlines, "color substraction with saturation", &sub_impl, &sub_packed_impl },
+  { "tint", 4, tint_scanlines, "tinting image with image", &tint_impl, &tint_packed_impl },
+  { "value", 5, value_scanlines, "value bottom image same as top image", NULL, NULL },
   { NULL, 0, NULL }
 };
 
@@ -336,12 +369,18 @@ blend_scanlines_name2func( const char *name )
 	if( name == NULL )
 		return NULL ;
     while( isspace((int)*name) ) ++name;
+	if( alphablend_impl == NULL )
+		get_asimage_cpu_features();
 	do
 	{
 		if( name[0] == std_merge_scanlines_func_list[i].name[0] )
 			if( mystrncasecmp( name, std_merge_scanlines_func_list[i].name,
 			                   std_merge_scanlines_func_list[i].name_len ) == 0 )
+			{
+				if( std_merge_scanlines_func_list[i].impl )
+					return *(std_merge_scanlines_func_list[i].impl) ;
 				return std_merge_scanlines_func_list[i].func ;
+			}
 
 	}while( std_merge_scanlines_func_list[++i].name != NULL );
 
@@ -349,6 +388,25 @@ blend_scanlines_name2func( const char *name )
 
 }
 
+merge_packed_scanlines_func
+blend_scanlines_func2packed( merge_scanlines_func func )
+{
+	register int i = 0;
+
+	if( func == NULL )
+		return NULL ;
+	if( alphablend_impl == NULL )
+		get_asimage_cpu_features();
+	do
+	{
+		merge_scanlines_func_desc *desc = &(std_merge_scanlines_func_list[i]);
+		if( desc->func == func || (desc->impl && *(desc->impl) == func) )
+			return desc->packed_impl ? *(desc->packed_impl) : NULL ;
+	}while( std_merge_scanlines_func_list[++i].name != NULL );
+
+	return NULL ;
+}
+
 void
 list_scanline_merging(FILE* stream, const char *format)
 {
@@ -361,8 +419,8 @@ list_scanline_merging(FILE* stream, const char *format)
 	}while( std_merge_scanlines_func_list[++i].name != NULL );
 }
 
-#define BLEND_SCANLINES_HEADER \
-	register int i = -1, max_i = bottom->width ; \
+#define BLEND_SCANLINES_RANGE \
+	register int max_i = bottom->width ; \
 	register CARD32 *ta = top->alpha, *tr = top->red, *tg = top->green, *tb = top->blue; \
 	register CARD32 *ba = bottom->alpha, *br = bottom->red, *bg = bottom->green, *bb = bottom->blue; \
 	if( offset < 0 ){ \
@@ -375,14 +433,21 @@ list_scanline_merging(FILE* stream, const char *format)
 			max_i -= offset ; }	\
 		if( (int)(top->width) < max_i )	max_i = top->width ; \
 	}
-
-
-
-void
-alphablend_scanlines( ASScanline *bottom, ASScanline *top, int offset )
+#define BLEND_SCANLINES_HEADER \
+	register int i = -1 ; \
+	BLEND_SCANLINES_RANGE
+
+/* spans are the actual per-pixel code, shared between plain C
+ * implementation and the tails of vectorized implementations : */
+#define BLEND_SPAN_PARAMS \
+	CARD32 *ba, CARD32 *br, CARD32 *bg, CARD32 *bb, \
+	CARD32 *ta, CARD32 *tr, CARD32 *tg, CARD32 *tb, int i, int max_i
+#define BLEND_SPAN_ARGS	ba, br, bg, bb, ta, tr, tg, tb
+
+static inline void
+alphablend_span( BLEND_SPAN_PARAMS )
 {
-	BLEND_SCANLINES_HEADER
-	while( ++i < max_i )
+	for( ; i < max_i ; ++i )
 	{
 		int a = ta[i] ;
 		int ca ;
@@ -397,45 +462,19 @@ alphablend_scanlines( ASScanline *bottom, ASScanline *top, int offset )
 		{
 			a = (a>>8) ;
 			ca = 255-a;
-#if 0 /*ndef HAVE_MMX*/
-/* MMX implementaion of alpha-blending below turns out to be 
-   30% slower then the original integer math implementation under it 
-   I'm probably stupid or something.  
- */
-			__m64	va  = _mm_set_pi16 (ca, a, ca, a);
-			__m64	vd  = _mm_set_pi16 (br[i],tr[i],ba[i],ta[i]);
-
-			/* b=(b*ca + t*a)>>8 */
-			vd = _mm_srli_pi16( vd, 8 );
-			vd = _mm_madd_pi16( va, vd );
-			ba[i] = _mm_cvtsi64_si32( vd );
-			vd = _mm_srli_si64( vd, 32 );
-			br[i] = _mm_cvtsi64_si32( vd );
-			
-			vd = _mm_set_pi16 (bb[i],tb[i],bg[i],tg[i]);
-			vd = _mm_srli_pi16( vd, 8 );
-			vd = _mm_madd_pi16( va, vd );
-			bg[i] = _mm_cvtsi64_si32( vd );
-			vd = _mm_srli_si64( vd, 32 );
-			bb[i] = _mm_cvtsi64_si32( vd );
-			_mm_empty();
-#else
 			ba[i] = ((ba[i]*ca)>>8)+ta[i] ;
 			br[i] = (br[i]*ca+tr[i]*a)>>8 ;
 			bg[i] = (bg[i]*ca+tg[i]*a)>>8 ;
 			bb[i] = (bb[i]*ca+tb[i]*a)>>8 ;
-#endif	
 		}
 	}
-	
 /*	fputc( '\n', stderr );*/
 }
 
-void    /* this one was first implemented on XImages by allanon :) - mode 131  */
-allanon_scanlines( ASScanline *bottom, ASScanline *top, int offset )
+static inline void    /* this one was first implemented on XImages by allanon :) - mode 131  */
+allanon_span( BLEND_SPAN_PARAMS )
 {
-	BLEND_SCANLINES_HEADER
-	while( ++i < max_i )
+	for( ; i < max_i ; ++i )
 	{
 		if( ta[i] != 0 )
 		{
@@ -447,11 +486,10 @@ allanon_scanlines( ASScanline *bottom, ASScanline *top, int offset )
 	}
 }
 
-void
-tint_scanlines( ASScanline *bottom, ASScanline *top, int offset )
+static inline void
+tint_span( BLEND_SPAN_PARAMS )
 {
-	BLEND_SCANLINES_HEADER
-	while( ++i < max_i )
+	for( ; i < max_i ; ++i )
 	{
 		if( ta[i] != 0 )
 		{
@@ -462,11 +500,10 @@ tint_scanlines( ASScanline *bottom, ASScanline *top, int offset )
 	}
 }
 
-void    /* addition with saturation : */
-add_scanlines( ASScanline *bottom, ASScanline *top, int offset )
+static inline void    /* addition with saturation : */
+add_span( BLEND_SPAN_PARAMS )
 {
-	BLEND_SCANLINES_HEADER
-	while( ++i < max_i )
+	for( ; i < max_i ; ++i )
 		if( ta[i] )
 		{
 			if( ta[i] > ba[i] )
@@ -486,11 +523,10 @@ add_scanlines( ASScanline *bottom, ASScanline *top, int offset )
 		}
 }
 
-void    /* substruction with saturation : */
-sub_scanlines( ASScanline *bottom, ASScanline *top, int offset )
+static inline void    /* substruction with saturation : */
+sub_span( BLEND_SPAN_PARAMS )
 {
-	BLEND_SCANLINES_HEADER
-	while( ++i < max_i )
+	for( ; i < max_i ; ++i )
 		if( ta[i] )
 		{
 			int res ;
@@ -505,11 +541,10 @@ sub_scanlines( ASScanline *bottom, ASScanline *top, int offset )
 		}
 }
 
-void    /* absolute pixel value difference : */
-diff_scanlines( ASScanline *bottom, ASScanline *top, int offset )
+static inline void    /* absolute pixel value difference : */
+diff_span( BLEND_SPAN_PARAMS )
 {
-	BLEND_SCANLINES_HEADER
-	while( ++i < max_i )
+	for( ; i < max_i ; ++i )
 	{
 		if( ta[i] )
 		{
@@ -526,11 +561,10 @@ diff_scanlines( ASScanline *bottom, ASScanline *top, int offset )
 	}
 }
 
-void    /* darkest of the two makes it in : */
-darken_scanlines( ASScanline *bottom, ASScanline *top, int offset )
+static inline void    /* darkest of the two makes it in : */
+darken_span( BLEND_SPAN_PARAMS )
 {
-	BLEND_SCANLINES_HEADER
-	while( ++i < max_i )
+	for( ; i < max_i ; ++i )
 		if( ta[i] )
 		{
 			if( ta[i] < ba[i] )
@@ -544,11 +578,10 @@ darken_scanlines( ASScanline *bottom, ASScanline *top, int offset )
 		}
 }
 
-void    /* lightest of the two makes it in : */
-lighten_scanlines( ASScanline *bottom, ASScanline *top, int offset )
+static inline void    /* lightest of the two makes it in : */
+lighten_span( BLEND_SPAN_PARAMS )
 {
-	BLEND_SCANLINES_HEADER
-	while( ++i < max_i )
+	for( ; i < max_i ; ++i )
 		if( ta[i] )
 		{
 			if( ta[i] > ba[i] )
@@ -562,15 +595,14 @@ lighten_scanlines( ASScanline *bottom, ASScanline *top, int offset )
 		}
 }
 
-void    /* guess what this one does - I could not :) */
-screen_scanlines( ASScanline *bottom, ASScanline *top, int offset )
+static inline void    /* guess what this one does - I could not :) */
+screen_span( BLEND_SPAN_PARAMS )
 {
-	BLEND_SCANLINES_HEADER
 #define DO_SCREEN_VALUE(b,t) \
 			res1 = 0x0000FFFF - (int)b[i] ; res2 = 0x0000FFFF - (int)t[i] ;\
 			res1 = 0x0000FFFF - ((res1*res2)>>16); b[i] = res1 < 0 ? 0 : res1
 
-	while( ++i < max_i )
+	for( ; i < max_i ; ++i )
 		if( ta[i] )
 		{
 			int res1 ;
@@ -585,17 +617,16 @@ screen_scanlines( ASScanline *bottom, ASScanline *top, int offset )
 		}
 }
 
-void    /* somehow overlays bottom with top : */
-overlay_scanlines( ASScanline *bottom, ASScanline *top, int offset )
+static inline void    /* somehow overlays bottom with top : */
+overlay_span( BLEND_SPAN_PARAMS )
 {
-	BLEND_SCANLINES_HEADER
 #define DO_OVERLAY_VALUE(b,t) \
 				tmp_screen = 0x0000FFFF - (((0x0000FFFF - (int)b[i]) * (0x0000FFFF - (int)t[i])) >> 16); \
 				tmp_mult   = (b[i] * t[i]) >> 16; \
 				res = (b[i] * tmp_screen + (0x0000FFFF - (int)b[i]) * tmp_mult) >> 16; \
 				b[i] = res < 0 ? 0 : res
 
-	while( ++i < max_i )
+	for( ; i < max_i ; ++i )
 		if( ta[i] )
 		{
 			int tmp_screen, tmp_mult, res ;
@@ -607,6 +638,693 @@ overlay_scanlines( ASScanline *bottom, ASScanline *top, int offset )
 		}
 }
 
+/* plain C implementations : */
+#define DEFINE_BLEND_SCANLINES_C(op) \
+static void op##_scanlines_c( ASScanline *bottom, ASScanline *top, int offset ) \
+{ \
+	BLEND_SCANLINES_RANGE \
+	op##_span( BLEND_SPAN_ARGS, 0, max_i ); \
+}
+
+DEFINE_BLEND_SCANLINES_C(alphablend)
+DEFINE_BLEND_SCANLINES_C(allanon)
+DEFINE_BLEND_SCANLINES_C(tint)
+DEFINE_BLEND_SCANLINES_C(add)
+DEFINE_BLEND_SCANLINES_C(sub)
+DEFINE_BLEND_SCANLINES_C(diff)
+DEFINE_BLEND_SCANLINES_C(darken)
+DEFINE_BLEND_SCANLINES_C(lighten)
+DEFINE_BLEND_SCANLINES_C(screen)
+DEFINE_BLEND_SCANLINES_C(overlay)
+
+#ifdef ASIM_X86_SIMD_DISPATCH
+/*************************************************************************/
+/* vectorized implementations :                                          */
+/* Each one is written in terms of V_* primitives, that get defined      */
+/* separately for SSE2 (4 pixels at a time) and AVX2 (8 pixels), and     */
+/* then processes the remainder of the scanline using C code above.      */
+/* All arithmetic is done on 32 bit lanes and wraps around exactly       */
+/* the same way as C code does.                                          */
+/*************************************************************************/
+
+#define V_LOAD_ALL(i) \
+	V_T vta = V_LOAD(ta+(i)), vtr = V_LOAD(tr+(i)), vtg = V_LOAD(tg+(i)), vtb = V_LOAD(tb+(i)); \
+	V_T vba = V_LOAD(ba+(i)), vbr = V_LOAD(br+(i)), vbg = V_LOAD(bg+(i)), vbb = V_LOAD(bb+(i)); \
+	V_T vmask = V_NOT(V_CMPEQ(vta, V_ZERO))
+
+#define V_STORE_RGB(i) \
+	V_STORE(br+(i), V_SEL(vmask, vbr, V_LOAD(br+(i)))); \
+	V_STORE(bg+(i), V_SEL(vmask, vbg, V_LOAD(bg+(i)))); \
+	V_STORE(bb+(i), V_SEL(vmask, vbb, V_LOAD(bb+(i))))
+
+#define V_STORE_ALL(i) \
+	V_STORE(ba+(i), V_SEL(vmask, vba, V_LOAD(ba+(i)))); \
+	V_STORE_RGB(i)
+
+#define alphablend_VEC(i) \
+	do{	V_T va = V_LOAD(ta+(i)); \
+		V_T vfull = V_CMPGT(va, V_SET1(0x0000FEFF)); \
+		V_T vpart = V_ANDNOT(vfull, V_CMPGT(va, V_SET1(0x000000FF))); \
+		V_T va8 = V_SRLI(va, 8), vca = V_SUB(V_SET1(255), va8); \
+		V_T vb ; \
+		vb = V_LOAD(ba+(i)); \
+		vb = V_SEL(vpart, V_ADD(V_SRLI(V_MULLO(vb, vca), 8), va), vb); \
+		V_STORE(ba+(i), V_SEL(vfull, V_SET1(0x0000FF00), vb)); \
+		vb = V_LOAD(br+(i)); \
+		vb = V_SEL(vpart, V_SRLI(V_ADD(V_MULLO(vb, vca), V_MULLO(V_LOAD(tr+(i)), va8)), 8), vb); \
+		V_STORE(br+(i), V_SEL(vfull, V_LOAD(tr+(i)), vb)); \
+		vb = V_LOAD(bg+(i)); \
+		vb = V_SEL(vpart, V_SRLI(V_ADD(V_MULLO(vb, vca), V_MULLO(V_LOAD(tg+(i)), va8)), 8), vb); \
+		V_STORE(bg+(i), V_SEL(vfull, V_LOAD(tg+(i)), vb)); \
+		vb = V_LOAD(bb+(i)); \
+		vb = V_SEL(vpart, V_SRLI(V_ADD(V_MULLO(vb, vca), V_MULLO(V_LOAD(tb+(i)), va8)), 8), vb); \
+		V_STORE(bb+(i), V_SEL(vfull, V_LOAD(tb+(i)), vb)); \
+	}while(0)
+
+#define allanon_VEC(i) \
+	do{	V_LOAD_ALL(i); \
+		vbr = V_SRLI(V_ADD(vbr, vtr), 1); \
+		vbg = V_SRLI(V_ADD(vbg, vtg), 1); \
+		vbb = V_SRLI(V_ADD(vbb, vtb), 1); \
+		vba = V_SRLI(V_ADD(vba, vta), 1); \
+		V_STORE_ALL(i); \
+	}while(0)
+
+#define tint_VEC(i) \
+	do{	V_LOAD_ALL(i); \
+		vbr = V_SRLI(V_MULLO(vbr, V_SRLI(vtr, 1)), 15); \
+		vbg = V_SRLI(V_MULLO(vbg, V_SRLI(vtg, 1)), 15); \
+		vbb = V_SRLI(V_MULLO(vbb, V_SRLI(vtb, 1)), 15); \
+		(void)vba; \
+		V_STORE_RGB(i); \
+	}while(0)
+
+#define add_VEC(i) \
+	do{	V_T vmax = V_SET1(0x0000FFFF); \
+		V_LOAD_ALL(i); \
+		vbr = V_MINU(V_ADD(vbr, vtr), vmax); \
+		vbg = V_MINU(V_ADD(vbg, vtg), vmax); \
+		vbb = V_MINU(V_ADD(vbb, vtb), vmax); \
+		vba = V_MINU(V_ADD(V_MAXU(vba, vta), vta), vmax); \
+		V_STORE_ALL(i); \
+	}while(0)
+
+#define sub_VEC(i) \
+	do{	V_LOAD_ALL(i); \
+		vba = V_MAXU(vba, vta); \
+		vbr = V_CLAMP0(V_SUB(vbr, vtr)); \
+		vbg = V_CLAMP0(V_SUB(vbg, vtg)); \
+		vbb = V_CLAMP0(V_SUB(vbb, vtb)); \
+		V_STORE_ALL(i); \
+	}while(0)
+
+#define diff_VEC(i) \
+	do{	V_LOAD_ALL(i); \
+		vbr = V_ABS(V_SUB(vbr, vtr)); \
+		vbg = V_ABS(V_SUB(vbg, vtg)); \
+		vbb = V_ABS(V_SUB(vbb, vtb)); \
+		vba = V_MAXU(vba, vta); \
+		V_STORE_ALL(i); \
+	}while(0)
+
+#define darken_VEC(i) \
+	do{	V_LOAD_ALL(i); \
+		vba = V_MINU(vba, vta); \
+		vbr = V_MINU(vbr, vtr); \
+		vbg = V_MINU(vbg, vtg); \
+		vbb = V_MINU(vbb, vtb); \
+		V_STORE_ALL(i); \
+	}while(0)
+
+#define lighten_VEC(i) \
+	do{	V_LOAD_ALL(i); \
+		vba = V_MAXU(vba, vta); \
+		vbr = V_MAXU(vbr, vtr); \
+		vbg = V_MAXU(vbg, vtg); \
+		vbb = V_MAXU(vbb, vtb); \
+		V_STORE_ALL(i); \
+	}while(0)
+
+#define V_SCREEN_VALUE(b,t) \
+	V_CLAMP0(V_SUB(vmax, V_SRAI(V_MULLO(V_SUB(vmax,(b)), V_SUB(vmax,(t))), 16)))
+
+#define screen_VEC(i) \
+	do{	V_T vmax = V_SET1(0x0000FFFF); \
+		V_LOAD_ALL(i); \
+		vbr = V_SCREEN_VALUE(vbr, vtr); \
+		vbg = V_SCREEN_VALUE(vbg, vtg); \
+		vbb = V_SCREEN_VALUE(vbb, vtb); \
+		vba = V_MAXU(vba, vta); \
+		V_STORE_ALL(i); \
+	}while(0)
+
+#define V_OVERLAY_VALUE(b,t) \
+	do{	V_T vscreen = V_SUB(vmax, V_SRAI(V_MULLO(V_SUB(vmax,(b)), V_SUB(vmax,(t))), 16)); \
+		V_T vmult = V_SRLI(V_MULLO((b),(t)), 16); \
+		(b) = V_SRLI(V_ADD(V_MULLO((b), vscreen), V_MULLO(V_SUB(vmax,(b)), vmult)), 16); \
+	}while(0)
+
+#define overlay_VEC(i) \
+	do{	V_T vmax = V_SET1(0x0000FFFF); \
+		V_LOAD_ALL(i); \
+		V_OVERLAY_VALUE(vbr, vtr); \
+		V_OVERLAY_VALUE(vbg, vtg); \
+		V_OVERLAY_VALUE(vbb, vtb); \
+		vba = V_MAXU(vba, vta); \
+		V_STORE_ALL(i); \
+	}while(0)
+
+#define DEFINE_BLEND_SCANLINES_VEC(op,suffix,width) \
+static V_ATTR void op##_scanlines_##suffix( ASScanline *bottom, ASScanline *top, int offset ) \
+{ \
+	register int i ; \
+	BLEND_SCANLINES_RANGE \
+	for( i = 0 ; i+(width) <= max_i ; i += (width) ) \
+		op##_VEC(i); \
+	op##_span( BLEND_SPAN_ARGS, i, max_i ); \
+}
+
+/************************** SSE2 primitives : ****************************/
+#define V_ATTR	__attribute__((target("sse2")))
+
+static inline V_ATTR __m128i
+mullo_epi32_sse2( __m128i a, __m128i b )
+{
+	__m128i even = _mm_mul_epu32( a, b );
+	__m128i odd = _mm_mul_epu32( _mm_srli_epi64( a, 32 ), _mm_srli_epi64( b, 32 ) );
+	return _mm_unpacklo_epi32( _mm_shuffle_epi32( even, _MM_SHUFFLE(0,0,2,0) ),
+							   _mm_shuffle_epi32( odd, _MM_SHUFFLE(0,0,2,0) ) );
+}
+
+static inline V_ATTR __m128i
+sel_sse2( __m128i mask, __m128i a, __m128i b )
+{
+	return _mm_or_si128( _mm_and_si128( mask, a ), _mm_andnot_si128( mask, b ) );
+}
+
+/* unsigned comparison : a > b */
+static inline V_ATTR __m128i
+cmpgtu_sse2( __m128i a, __m128i b )
+{
+	__m128i sign = _mm_set1_epi32( 0x80000000 );
+	return _mm_cmpgt_epi32( _mm_xor_si128( a, sign ), _mm_xor_si128( b, sign ) );
+}
+
+#define V_T				__m128i
+#define V_LOAD(p)		_mm_loadu_si128((__m128i*)(p))
+#define V_STORE(p,v)	_mm_storeu_si128((__m128i*)(p),(v))
+#define V_SET1(x)		_mm_set1_epi32(x)
+#define V_ZERO			_mm_setzero_si128()
+#define V_ADD			_mm_add_epi32
+#define V_SUB			_mm_sub_epi32
+#define V_MULLO			mullo_epi32_sse2
+#define V_SRLI			_mm_srli_epi32
+#define V_SRAI			_mm_srai_epi32
+#define V_ANDNOT		_mm_andnot_si128
+#define V_NOT(a)		_mm_xor_si128((a), _mm_set1_epi32(-1))
+#define V_CMPEQ			_mm_cmpeq_epi32
+#define V_CMPGT			_mm_cmpgt_epi32
+#define V_SEL			sel_sse2
+#define V_MINU(a,b)		sel_sse2(cmpgtu_sse2((a),(b)),(b),(a))
+#define V_MAXU(a,b)		sel_sse2(cmpgtu_sse2((b),(a)),(b),(a))
+#define V_CLAMP0(a)		_mm_andnot_si128(_mm_srai_epi32((a),31),(a))
+#define V_ABS(a)		_mm_sub_epi32(_mm_xor_si128((a),_mm_srai_epi32((a),31)),_mm_srai_epi32((a),31))
+
+DEFINE_BLEND_SCANLINES_VEC(alphablend,sse2,4)
+DEFINE_BLEND_SCANLINES_VEC(allanon,sse2,4)
+DEFINE_BLEND_SCANLINES_VEC(tint,sse2,4)
+DEFINE_BLEND_SCANLINES_VEC(add,sse2,4)
+DEFINE_BLEND_SCANLINES_VEC(sub,sse2,4)
+DEFINE_BLEND_SCANLINES_VEC(diff,sse2,4)
+DEFINE_BLEND_SCANLINES_VEC(darken,sse2,4)
+DEFINE_BLEND_SCANLINES_VEC(lighten,sse2,4)
+DEFINE_BLEND_SCANLINES_VEC(screen,sse2,4)
+DEFINE_BLEND_SCANLINES_VEC(overlay,sse2,4)
+
+#undef V_ATTR
+#undef V_T
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_ZERO
+#undef V_ADD
+#undef V_SUB
+#undef V_MULLO
+#undef V_SRLI
+#undef V_SRAI
+#undef V_ANDNOT
+#undef V_NOT
+#undef V_CMPEQ
+#undef V_CMPGT
+#undef V_SEL
+#undef V_MINU
+#undef V_MAXU
+#undef V_CLAMP0
+#undef V_ABS
+
+/************************** AVX2 primitives : ****************************/
+#define V_ATTR	__attribute__((target("avx2")))
+
+#define V_T				__m256i
+#define V_LOAD(p)		_mm256_loadu_si256((__m256i*)(p))
+#define V_STORE(p,v)	_mm256_storeu_si256((__m256i*)(p),(v))
+#define V_SET1(x)		_mm256_set1_epi32(x)
+#define V_ZERO			_mm256_setzero_si256()
+#define V_ADD			_mm256_add_epi32
+#define V_SUB			_mm256_sub_epi32
+#define V_MULLO			_mm256_mullo_epi32
+#define V_SRLI			_mm256_srli_epi32
+#define V_SRAI			_mm256_srai_epi32
+#define V_ANDNOT		_mm256_andnot_si256
+#define V_NOT(a)		_mm256_xor_si256((a), _mm256_set1_epi32(-1))
+#define V_CMPEQ			_mm256_cmpeq_epi32
+#define V_CMPGT			_mm256_cmpgt_epi32
+#define V_SEL(m,a,b)	_mm256_blendv_epi8((b),(a),(m))
+#define V_MINU			_mm256_min_epu32
+#define V_MAXU			_mm256_max_epu32
+#define V_CLAMP0(a)		_mm256_max_epi32((a),_mm256_setzero_si256())
+#define V_ABS			_mm256_abs_epi32
+
+DEFINE_BLEND_SCANLINES_VEC(alphablend,avx2,8)
+DEFINE_BLEND_SCANLINES_VEC(allanon,avx2,8)
+DEFINE_BLEND_SCANLINES_VEC(tint,avx2,8)
+DEFINE_BLEND_SCANLINES_VEC(add,avx2,8)
+DEFINE_BLEND_SCANLINES_VEC(sub,avx2,8)
+DEFINE_BLEND_SCANLINES_VEC(diff,avx2,8)
+DEFINE_BLEND_SCANLINES_VEC(darken,avx2,8)
+DEFINE_BLEND_SCANLINES_VEC(lighten,avx2,8)
+DEFINE_BLEND_SCANLINES_VEC(screen,avx2,8)
+DEFINE_BLEND_SCANLINES_VEC(overlay,avx2,8)
+
+#undef V_ATTR
+#undef V_T
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_ZERO
+#undef V_ADD
+#undef V_SUB
+#undef V_MULLO
+#undef V_SRLI
+#undef V_SRAI
+#undef V_ANDNOT
+#undef V_NOT
+#undef V_CMPEQ
+#undef V_CMPGT
+#undef V_SEL
+#undef V_MINU
+#undef V_MAXU
+#undef V_CLAMP0
+#undef V_ABS
+
+#endif /* ASIM_X86_SIMD_DISPATCH */
+
+
+/*************************************************************************/
+/* packed ARGB32 scanline blending :                                     */
+/* Same methods applied to 8 bit per channel data packed into ARGB32.    */
+/* Only methods that do not need extra precision are implemented here.   */
+/*************************************************************************/
+#define BLEND_PACKED_HEADER \
+	register int i = 0, max_i = bottom->width ; \
+	register ARGB32 *b = bottom->argb, *t = top->argb ; \
+	if( offset < 0 ){ \
+		offset = -offset ; \
+		t += offset ; \
+		if( (int)top->width-offset < max_i )	max_i = (int)(top->width)-offset ; \
+	}else{ \
+		if( offset > 0 ){ \
+			b += offset ; \
+			max_i -= offset ; }	\
+		if( (int)(top->width) < max_i )	max_i = top->width ; \
+	}
+
+#define PACKED_CHAN(c,chan)		(((c)>>((chan)<<3))&0x00FF)
+
+#define BLEND_PACKED_SPAN_PARAMS	ARGB32 *b, ARGB32 *t, int i, int max_i
+
+static inline void
+alphablend_packed_span( BLEND_PACKED_SPAN_PARAMS )
+{
+	for( ; i < max_i ; ++i )
+	{
+		register CARD32 a = t[i]>>24 ;
+		if( a == 0x00FF )
+			b[i] = t[i] ;
+		else if( a != 0 )
+		{/* red and blue are done at once, as are alpha and green : */
+			CARD32 ca = 255-a, bc = b[i], tc = t[i] ;
+			CARD32 rb = (((bc&0x00FF00FF)*ca + (tc&0x00FF00FF)*a)>>8)&0x00FF00FF ;
+			CARD32 ag = ((bc>>8)&0x00FF00FF)*ca + ((tc>>8)&0x00FF00FF)*a ;
+			b[i] = ((((bc>>24)*ca)>>8)+a)<<24 | (ag&0x0000FF00) | rb ;
+		}
+	}
+}
+
+static inline void
+allanon_packed_span( BLEND_PACKED_SPAN_PARAMS )
+{
+	for( ; i < max_i ; ++i )
+		if( t[i]&0xFF000000 )
+			b[i] = ((b[i]>>1)&0x7F7F7F7F) + ((t[i]>>1)&0x7F7F7F7F) + (b[i]&t[i]&0x01010101) ;
+}
+
+static inline void
+tint_packed_span( BLEND_PACKED_SPAN_PARAMS )
+{
+	for( ; i < max_i ; ++i )
+		if( t[i]&0xFF000000 )
+		{
+			register CARD32 bc = b[i], tc = t[i] ;
+			b[i] = (bc&0xFF000000)|
+				   (((PACKED_CHAN(bc,2)*PACKED_CHAN(tc,2))>>8)<<16)|
+				   (((PACKED_CHAN(bc,1)*PACKED_CHAN(tc,1))>>8)<<8)|
+				    ((PACKED_CHAN(bc,0)*PACKED_CHAN(tc,0))>>8) ;
+		}
+}
+
+/* per channel operations with alpha handled separately : */
+#define DEFINE_BLEND_PACKED_SPAN(op,alpha_expr,color_expr) \
+static inline void \
+op##_packed_span( BLEND_PACKED_SPAN_PARAMS ) \
+{ \
+	for( ; i < max_i ; ++i ) \
+		if( t[i]&0xFF000000 ) \
+		{ \
+			register int bv, tv, chan ; \
+			register CARD32 res ; \
+			bv = b[i]>>24 ; tv = t[i]>>24 ; \
+			res = (CARD32)(alpha_expr)<<24 ; \
+			for( chan = 0 ; chan < 3 ; ++chan ) \
+			{ \
+				bv = PACKED_CHAN(b[i],chan); tv = PACKED_CHAN(t[i],chan); \
+				res |= (CARD32)(color_expr)<<(chan<<3) ; \
+			} \
+			b[i] = res ; \
+		} \
+}
+
+#define PACKED_MAX(x,y)	((x)>(y)?(x):(y))
+#define PACKED_MIN(x,y)	((x)<(y)?(x):(y))
+
+DEFINE_BLEND_PACKED_SPAN(add, PACKED_MIN(PACKED_MAX(bv,tv)+tv,255), PACKED_MIN(bv+tv,255))
+DEFINE_BLEND_PACKED_SPAN(sub, PACKED_MAX(bv,tv), PACKED_MAX(bv-tv,0))
+DEFINE_BLEND_PACKED_SPAN(diff, PACKED_MAX(bv,tv), (bv>tv)?bv-tv:tv-bv)
+DEFINE_BLEND_PACKED_SPAN(darken, PACKED_MIN(bv,tv), PACKED_MIN(bv,tv))
+DEFINE_BLEND_PACKED_SPAN(lighten, PACKED_MAX(bv,tv), PACKED_MAX(bv,tv))
+/* that is exactly what screen_span() does to 8 bit values : */
+#define PACKED_SCREEN(bv,tv) \
+	((0x0000FFFF - (int)((((CARD32)(255-(bv))<<8|0x00FF)*((CARD32)(255-(tv))<<8|0x00FF))>>16))>>8)
+DEFINE_BLEND_PACKED_SPAN(screen, PACKED_MAX(bv,tv), PACKED_SCREEN(bv,tv))
+
+#define DEFINE_BLEND_PACKED_C(op) \
+static void op##_packed_c( ASPackedScanline *bottom, ASPackedScanline *top, int offset ) \
+{ \
+	BLEND_PACKED_HEADER \
+	op##_packed_span( b, t, i, max_i ); \
+}
+
+DEFINE_BLEND_PACKED_C(alphablend)
+DEFINE_BLEND_PACKED_C(allanon)
+DEFINE_BLEND_PACKED_C(tint)
+DEFINE_BLEND_PACKED_C(add)
+DEFINE_BLEND_PACKED_C(sub)
+DEFINE_BLEND_PACKED_C(diff)
+DEFINE_BLEND_PACKED_C(darken)
+DEFINE_BLEND_PACKED_C(lighten)
+DEFINE_BLEND_PACKED_C(screen)
+
+#ifdef ASIM_X86_SIMD_DISPATCH
+/* Vectorized versions work on whole pixels using P_* primitives, defined
+ * for SSE2 (4 pixels at a time) and AVX2 (8 pixels). Methods that need
+ * multiplication are done in 16 bit lanes, by unpacking each half of the
+ * register - since AVX2 unpacks and packs within 128 bit lanes, order of
+ * pixels is preserved. Pixels with zero alpha in top are left intact, as
+ * in C code above. Output is exactly the same as that of C code. */
+#define add_PACKED_VEC		vr = P_ADDS8( P_SEL( amask, P_MAX8( vb, vt ), vb ), vt )
+#define sub_PACKED_VEC		vr = P_SEL( amask, P_MAX8( vb, vt ), P_SUBS8( vb, vt ) )
+#define diff_PACKED_VEC		vr = P_SEL( amask, P_MAX8( vb, vt ), P_OR( P_SUBS8( vb, vt ), P_SUBS8( vt, vb ) ) )
+#define darken_PACKED_VEC	vr = P_MIN8( vb, vt )
+#define lighten_PACKED_VEC	vr = P_MAX8( vb, vt )
+/* pavgb rounds up - we need it to round down : */
+#define allanon_PACKED_VEC	vr = P_SUB8( P_AVG8( vb, vt ), P_AND( P_XOR( vb, vt ), P_SET1_8( 1 ) ) )
+#define tint_PACKED_VEC \
+	vr = P_SEL( amask, vb, P_PACKUS16( \
+			P_SRLI16( P_MULLO16( P_UNPACKLO8( vb, vzero ), P_UNPACKLO8( vt, vzero ) ), 8 ), \
+			P_SRLI16( P_MULLO16( P_UNPACKHI8( vb, vzero ), P_UNPACKHI8( vt, vzero ) ), 8 ) ) )
+/* 0xFFFF-(v<<8) is simply inverted v<<8, and mulhi gives us >>16 : */
+#define screen_PACKED_VEC \
+	do{	P_T vones = P_SET1_8( -1 ) ; \
+		vr = P_XOR( vones, P_PACKUS16( \
+			P_SRLI16( P_MULHI16( P_XOR( P_UNPACKLO8( vzero, vb ), vones ), P_XOR( P_UNPACKLO8( vzero, vt ), vones ) ), 8 ), \
+			P_SRLI16( P_MULHI16( P_XOR( P_UNPACKHI8( vzero, vb ), vones ), P_XOR( P_UNPACKHI8( vzero, vt ), vones ) ), 8 ) ) ); \
+		vr = P_SEL( amask, P_MAX8( vb, vt ), vr ); \
+	}while(0)
+
+/* alpha-blending of 2 pixels in 16 bit lanes : color values are
+ * (b*ca+t*a)>>8, while alpha is ((b*ca)>>8)+a */
+#define ALPHABLEND_PACKED_HALF(vb16,vt16,va16,vca16) \
+	P_SEL( valpha16, P_ADD16( P_SRLI16( P_MULLO16( vb16, vca16 ), 8 ), vt16 ), \
+			P_SRLI16( P_ADD16( P_MULLO16( vb16, vca16 ), P_MULLO16( vt16, va16 ) ), 8 ) )
+
+#define alphablend_PACKED_VEC \
+	do{	P_T va = P_SRLI32( vt, 24 ), va16, vca16 ; \
+		P_T valpha16 = P_SET1_64( 0xFFFF000000000000LL ) ; \
+		va16 = P_OR( va, P_SLLI32( va, 16 ) ); \
+		vca16 = P_SUB16( P_SET1_16( 255 ), va16 ); \
+		vr = P_PACKUS16( \
+				ALPHABLEND_PACKED_HALF( P_UNPACKLO8( vb, vzero ), P_UNPACKLO8( vt, vzero ), \
+										P_UNPACKLO32( va16, va16 ), P_UNPACKLO32( vca16, vca16 ) ), \
+				ALPHABLEND_PACKED_HALF( P_UNPACKHI8( vb, vzero ), P_UNPACKHI8( vt, vzero ), \
+										P_UNPACKHI32( va16, va16 ), P_UNPACKHI32( vca16, vca16 ) ) ); \
+		vr = P_SEL( P_CMPEQ32( va, P_SET1_32( 0x00FF ) ), vt, vr ); \
+	}while(0)
+
+#define DEFINE_BLEND_PACKED_VEC(op,suffix,width) \
+static P_ATTR void op##_packed_##suffix( ASPackedScanline *bottom, ASPackedScanline *top, int offset ) \
+{ \
+	P_T amask = P_SET1_32( 0xFF000000 ), vzero = P_ZERO ; \
+	BLEND_PACKED_HEADER \
+	for( ; i+(width) <= max_i ; i += (width) ) \
+	{ \
+		P_T vb = P_LOAD(b+i), vt = P_LOAD(t+i), vr ; \
+		P_T vskip = P_CMPEQ32( P_AND( vt, amask ), vzero ); \
+		op##_PACKED_VEC ; \
+		P_STORE( b+i, P_SEL( vskip, vb, vr ) ); \
+	} \
+	op##_packed_span( b, t, i, max_i ); \
+}
+
+#define DEFINE_BLEND_PACKED_ALL_VEC(suffix,width) \
+	DEFINE_BLEND_PACKED_VEC(alphablend,suffix,width) \
+	DEFINE_BLEND_PACKED_VEC(allanon,suffix,width) \
+	DEFINE_BLEND_PACKED_VEC(tint,suffix,width) \
+	DEFINE_BLEND_PACKED_VEC(add,suffix,width) \
+	DEFINE_BLEND_PACKED_VEC(sub,suffix,width) \
+	DEFINE_BLEND_PACKED_VEC(diff,suffix,width) \
+	DEFINE_BLEND_PACKED_VEC(darken,suffix,width) \
+	DEFINE_BLEND_PACKED_VEC(lighten,suffix,width) \
+	DEFINE_BLEND_PACKED_VEC(screen,suffix,width)
+
+/************************** SSE2 primitives : ****************************/
+#define P_ATTR			__attribute__((target("sse2")))
+#define P_T				__m128i
+#define P_LOAD(p)		_mm_loadu_si128((__m128i*)(p))
+#define P_STORE(p,v)	_mm_storeu_si128((__m128i*)(p),(v))
+#define P_ZERO			_mm_setzero_si128()
+#define P_SET1_8		_mm_set1_epi8
+#define P_SET1_16		_mm_set1_epi16
+#define P_SET1_32		_mm_set1_epi32
+#define P_SET1_64		_mm_set1_epi64x
+#define P_AND			_mm_and_si128
+#define P_OR			_mm_or_si128
+#define P_XOR			_mm_xor_si128
+#define P_SEL(m,a,b)	_mm_or_si128( _mm_and_si128( (m), (a) ), _mm_andnot_si128( (m), (b) ) )
+#define P_CMPEQ32		_mm_cmpeq_epi32
+#define P_ADDS8			_mm_adds_epu8
+#define P_SUBS8			_mm_subs_epu8
+#define P_SUB8			_mm_sub_epi8
+#define P_MAX8			_mm_max_epu8
+#define P_MIN8			_mm_min_epu8
+#define P_AVG8			_mm_avg_epu8
+#define P_ADD16			_mm_add_epi16
+#define P_SUB16			_mm_sub_epi16
+#define P_MULLO16		_mm_mullo_epi16
+#define P_MULHI16		_mm_mulhi_epu16
+#define P_SRLI16		_mm_srli_epi16
+#define P_SRLI32		_mm_srli_epi32
+#define P_SLLI32		_mm_slli_epi32
+#define P_UNPACKLO8		_mm_unpacklo_epi8
+#define P_UNPACKHI8		_mm_unpackhi_epi8
+#define P_UNPACKLO32	_mm_unpacklo_epi32
+#define P_UNPACKHI32	_mm_unpackhi_epi32
+#define P_PACKUS16		_mm_packus_epi16
+
+DEFINE_BLEND_PACKED_ALL_VEC(sse2,4)
+
+#undef P_ATTR
+#undef P_T
+#undef P_LOAD
+#undef P_STORE
+#undef P_ZERO
+#undef P_SET1_8
+#undef P_SET1_16
+#undef P_SET1_32
+#undef P_SET1_64
+#undef P_AND
+#undef P_OR
+#undef P_XOR
+#undef P_SEL
+#undef P_CMPEQ32
+#undef P_ADDS8
+#undef P_SUBS8
+#undef P_SUB8
+#undef P_MAX8
+#undef P_MIN8
+#undef P_AVG8
+#undef P_ADD16
+#undef P_SUB16
+#undef P_MULLO16
+#undef P_MULHI16
+#undef P_SRLI16
+#undef P_SRLI32
+#undef P_SLLI32
+#undef P_UNPACKLO8
+#undef P_UNPACKHI8
+#undef P_UNPACKLO32
+#undef P_UNPACKHI32
+#undef P_PACKUS16
+
+/************************** AVX2 primitives : ****************************/
+#define P_ATTR			__attribute__((target("avx2")))
+#define P_T				__m256i
+#define P_LOAD(p)		_mm256_loadu_si256((__m256i*)(p))
+#define P_STORE(p,v)	_mm256_storeu_si256((__m256i*)(p),(v))
+#define P_ZERO			_mm256_setzero_si256()
+#define P_SET1_8		_mm256_set1_epi8
+#define P_SET1_16		_mm256_set1_epi16
+#define P_SET1_32		_mm256_set1_epi32
+#define P_SET1_64		_mm256_set1_epi64x
+#define P_AND			_mm256_and_si256
+#define P_OR			_mm256_or_si256
+#define P_XOR			_mm256_xor_si256
+#define P_SEL(m,a,b)	_mm256_blendv_epi8((b),(a),(m))
+#define P_CMPEQ32		_mm256_cmpeq_epi32
+#define P_ADDS8			_mm256_adds_epu8
+#define P_SUBS8			_mm256_subs_epu8
+#define P_SUB8			_mm256_sub_epi8
+#define P_MAX8			_mm256_max_epu8
+#define P_MIN8			_mm256_min_epu8
+#define P_AVG8			_mm256_avg_epu8
+#define P_ADD16			_mm256_add_epi16
+#define P_SUB16			_mm256_sub_epi16
+#define P_MULLO16		_mm256_mullo_epi16
+#define P_MULHI16		_mm256_mulhi_epu16
+#define P_SRLI16		_mm256_srli_epi16
+#define P_SRLI32		_mm256_srli_epi32
+#define P_SLLI32		_mm256_slli_epi32
+#define P_UNPACKLO8		_mm256_unpacklo_epi8
+#define P_UNPACKHI8		_mm256_unpackhi_epi8
+#define P_UNPACKLO32	_mm256_unpacklo_epi32
+#define P_UNPACKHI32	_mm256_unpackhi_epi32
+#define P_PACKUS16		_mm256_packus_epi16
+
+DEFINE_BLEND_PACKED_ALL_VEC(avx2,8)
+
+#undef P_ATTR
+#undef P_T
+#undef P_LOAD
+#undef P_STORE
+#undef P_ZERO
+#undef P_SET1_8
+#undef P_SET1_16
+#undef P_SET1_32
+#undef P_SET1_64
+#undef P_AND
+#undef P_OR
+#undef P_XOR
+#undef P_SEL
+#undef P_CMPEQ32
+#undef P_ADDS8
+#undef P_SUBS8
+#undef P_SUB8
+#undef P_MAX8
+#undef P_MIN8
+#undef P_AVG8
+#undef P_ADD16
+#undef P_SUB16
+#undef P_MULLO16
+#undef P_MULHI16
+#undef P_SRLI16
+#undef P_SRLI32
+#undef P_SLLI32
+#undef P_UNPACKLO8
+#undef P_UNPACKHI8
+#undef P_UNPACKLO32
+#undef P_UNPACKHI32
+#undef P_PACKUS16
+#endif /* ASIM_X86_SIMD_DISPATCH */
+
+#ifdef ASIM_X86_SIMD_DISPATCH
+#define SELECT_BLEND_IMPL(op) \
+	do{	if( get_flags( cpu_features, ASIM_CPU_AVX2 ) )		op##_impl = op##_scanlines_avx2 ; \
+		else if( get_flags( cpu_features, ASIM_CPU_SSE2 ) )	op##_impl = op##_scanlines_sse2 ; \
+		else op##_impl = op##_scanlines_c ; }while(0)
+#define SELECT_BLEND_PACKED_IMPL(op) \
+	do{	if( get_flags( cpu_features, ASIM_CPU_AVX2 ) )		op##_packed_impl = op##_packed_avx2 ; \
+		else if( get_flags( cpu_features, ASIM_CPU_SSE2 ) )	op##_packed_impl = op##_packed_sse2 ; \
+		else op##_packed_impl = op##_packed_c ; }while(0)
+#else
+#define SELECT_BLEND_IMPL(op)	do{ op##_impl = op##_scanlines_c ; }while(0)
+#define SELECT_BLEND_PACKED_IMPL(op)	do{ op##_packed_impl = op##_packed_c ; }while(0)
+#endif
+
+void
+select_blend_scanlines_impl( CARD32 cpu_features )
+{
+	SELECT_BLEND_IMPL(alphablend);
+	SELECT_BLEND_IMPL(allanon);
+	SELECT_BLEND_IMPL(tint);
+	SELECT_BLEND_IMPL(add);
+	SELECT_BLEND_IMPL(sub);
+	SELECT_BLEND_IMPL(diff);
+	SELECT_BLEND_IMPL(darken);
+	SELECT_BLEND_IMPL(lighten);
+	SELECT_BLEND_IMPL(screen);
+	SELECT_BLEND_IMPL(overlay);
+
+	SELECT_BLEND_PACKED_IMPL(alphablend);
+	SELECT_BLEND_PACKED_IMPL(allanon);
+	SELECT_BLEND_PACKED_IMPL(add);
+	SELECT_BLEND_PACKED_IMPL(sub);
+	SELECT_BLEND_PACKED_IMPL(diff);
+	SELECT_BLEND_PACKED_IMPL(darken);
+	SELECT_BLEND_PACKED_IMPL(lighten);
+	SELECT_BLEND_PACKED_IMPL(tint);
+	SELECT_BLEND_PACKED_IMPL(screen);
+}
+
+/* public entry points - these are what gets stored in ASImageLayer
+ * by most of the code, so they have to use the best implementation : */
+#define DEFINE_BLEND_SCANLINES_DISPATCH(op) \
+void op##_scanlines( ASScanline *bottom, ASScanline *top, int offset ) \
+{ \
+	if( op##_impl == NULL ) \
+		get_asimage_cpu_features(); \
+	op##_impl( bottom, top, offset ); \
+}
+
+DEFINE_BLEND_SCANLINES_DISPATCH(alphablend)
+DEFINE_BLEND_SCANLINES_DISPATCH(allanon)
+DEFINE_BLEND_SCANLINES_DISPATCH(tint)
+DEFINE_BLEND_SCANLINES_DISPATCH(add)
+DEFINE_BLEND_SCANLINES_DISPATCH(sub)
+DEFINE_BLEND_SCANLINES_DISPATCH(diff)
+DEFINE_BLEND_SCANLINES_DISPATCH(darken)
+DEFINE_BLEND_SCANLINES_DISPATCH(lighten)
+DEFINE_BLEND_SCANLINES_DISPATCH(screen)
+DEFINE_BLEND_SCANLINES_DISPATCH(overlay)
+
 void
 hue_scanlines( ASScanline *bottom, ASScanline *top, int offset )
 {
@@ -727,3 +1445,244 @@ dissipate_scanlines( ASScanline *bottom, ASScanline *top, int offset )
 /* The end !!!! 																 */
 /*********************************************************************************/
 
+
+#ifdef TEST_BLENDER
+/* Verifies that vectorized merging functions produce exactly the same
+ * output as plain C code, and prints out their relative speed.
+ * Usage: test_blender [width [repetitions]] */
+#include <time.h>
+
+static CARD32 rnd32_seed = 345824357;
+#define MY_RND32() (rnd32_seed = (1664525L*rnd32_seed)+1013904223L)
+
+static CARD32
+test_channel_value( int kind )
+{
+	static CARD32 edges[] = { 0, 0x000000FF, 0x00000100, 0x00007FFF, 0x0000FEFF, 0x0000FF00, 0x0000FFFF };
+	CARD32 r = MY_RND32();
+	if( kind == 0 && (r&0x0F) == 0 )
+		return edges[(r>>4)%(sizeof(edges)/sizeof(CARD32))];
+	return (r>>8)&0x0000FFFF ;
+}
+
+static void
+fill_test_scanline( ASScanline *sl )
+{
+	int i ;
+	for( i = 0 ; i < (int)sl->width ; ++i )
+	{
+		sl->alpha[i] = test_channel_value(0);
+		sl->red[i] = test_channel_value(1);
+		sl->green[i] = test_channel_value(1);
+		sl->blue[i] = test_channel_value(1);
+	}
+}
+
+static Bool
+compare_test_scanlines( ASScanline *sl1, ASScanline *sl2 )
+{
+	int i ;
+	for( i = 0 ; i < (int)sl1->width ; ++i )
+		if( sl1->alpha[i] != sl2->alpha[i] || sl1->red[i] != sl2->red[i] ||
+			sl1->green[i] != sl2->green[i] || sl1->blue[i] != sl2->blue[i] )
+		{
+			fprintf( stderr, "pixel %d differs : %8.8X.%8.8X.%8.8X.%8.8X vs. %8.8X.%8.8X.%8.8X.%8.8X\n", i,
+					 sl1->alpha[i], sl1->red[i], sl1->green[i], sl1->blue[i],
+					 sl2->alpha[i], sl2->red[i], sl2->green[i], sl2->blue[i] );
+			return False;
+		}
+	return True;
+}
+
+static void
+copy_test_scanline( ASScanline *dst, ASScanline *src )
+{
+	memcpy( dst->alpha, src->alpha, src->width*sizeof(CARD32) );
+	memcpy( dst->red, src->red, src->width*sizeof(CARD32) );
+	memcpy( dst->green, src->green, src->width*sizeof(CARD32) );
+	memcpy( dst->blue, src->blue, src->width*sizeof(CARD32) );
+}
+
+static void
+fill_test_packed_scanline( ASPackedScanline *psl )
+{
+	int i ;
+	for( i = 0 ; i < (int)psl->width ; ++i )
+	{
+		CARD32 a = test_channel_value(0)>>8 ;
+		if( (MY_RND32()&0x300) == 0 )
+			a = (a&0x01)?0xFF:0 ;
+		psl->argb[i] = MAKE_ARGB32( a, test_channel_value(1)>>8, test_channel_value(1)>>8, test_channel_value(1)>>8 );
+	}
+}
+
+/* packed methods must match planar ones on 8 bit data within 1, and
+ * vectorized packed methods must match plain C exactly : */
+static int
+test_packed_blending( int width, int reps, CARD32 available )
+{
+	ASPackedScanline *bottom, *top, *control, *test ;
+	ASScanline *pbottom, *ptop ;
+	int res = 0, i, offset, w, x, chan ;
+
+	bottom = prepare_packed_scanline( width, NULL );
+	top = prepare_packed_scanline( width, NULL );
+	control = prepare_packed_scanline( width, NULL );
+	test = prepare_packed_scanline( width, NULL );
+	pbottom = prepare_scanline( width, 8, NULL, False );
+	ptop = prepare_scanline( width, 8, NULL, False );
+	fill_test_packed_scanline( bottom );
+	fill_test_packed_scanline( top );
+
+	for( i = 0 ; res == 0 && std_merge_scanlines_func_list[i].name != NULL ; ++i )
+	{
+		merge_packed_scanlines_func func, func_c ;
+		merge_scanlines_func planar_c ;
+		if( std_merge_scanlines_func_list[i].packed_impl == NULL )
+			continue;
+		set_asimage_cpu_features_mask( 0 );
+		func_c = *(std_merge_scanlines_func_list[i].packed_impl) ;
+		planar_c = *(std_merge_scanlines_func_list[i].impl) ;
+		set_asimage_cpu_features_mask( available );
+		func = *(std_merge_scanlines_func_list[i].packed_impl) ;
+		fprintf( stderr, "Testing packed \"%s\" ...", std_merge_scanlines_func_list[i].name );
+		for( w = 1 ; res == 0 && w <= width && w <= 67 ; ++w )
+			for( offset = -17 ; res == 0 && offset <= 17 ; ++offset )
+			{
+				control->width = test->width = bottom->width = pbottom->width = w ;
+				memcpy( control->argb, bottom->argb, w*sizeof(ARGB32) );
+				memcpy( test->argb, bottom->argb, w*sizeof(ARGB32) );
+				func_c( control, top, offset );
+				func( test, top, offset );
+				for( x = 0 ; x < w ; ++x )
+				{
+					for( chan = 0 ; chan < IC_NUM_CHANNELS ; ++chan )
+					{
+						pbottom->channels[chan][x] = ARGB32_CHAN8(bottom->argb[x],chan)<<8 ;
+						ptop->channels[chan][x] = ARGB32_CHAN8(top->argb[x],chan)<<8 ;
+					}
+					if( control->argb[x] != test->argb[x] )
+					{
+						fprintf( stderr, "pixel %d differs : %8.8X vs. %8.8X, width = %d, offset = %d ",
+								 x, control->argb[x], test->argb[x], w, offset );
+						res = 1 ;
+					}
+				}
+				for( ; x < width ; ++x )
+					for( chan = 0 ; chan < IC_NUM_CHANNELS ; ++chan )
+						ptop->channels[chan][x] = ARGB32_CHAN8(top->argb[x],chan)<<8 ;
+				planar_c( pbottom, ptop, offset );
+				for( x = 0 ; res == 0 && x < w ; ++x )
+					for( chan = 0 ; chan < IC_NUM_CHANNELS ; ++chan )
+					{
+						int v = pbottom->channels[chan][x]>>8 ;
+						if( v > 255 ) /* planar screen overflows on dark colors */
+							continue;
+						if( v - (int)ARGB32_CHAN8(control->argb[x],chan) > 1 ||
+							(int)ARGB32_CHAN8(control->argb[x],chan) - v > 1 )
+						{
+							fprintf( stderr, "pixel %d channel %d differs from planar : %2.2X vs. %2.2X, width = %d, offset = %d ",
+									 x, chan, ARGB32_CHAN8(control->argb[x],chan), v, w, offset );
+							res = 1 ;
+							break;
+						}
+					}
+			}
+		control->width = test->width = bottom->width = pbottom->width = width ;
+		if( res == 0 )
+		{
+			merge_scanlines_func planar = *(std_merge_scanlines_func_list[i].impl) ;
+			clock_t started = clock();
+			for( w = 0 ; w < reps ; ++w )
+				planar( pbottom, ptop, 0 );
+			fprintf( stderr, "planar: %lu ms, ", (unsigned long)((clock() - started)*1000/CLOCKS_PER_SEC) );
+			started = clock();
+			for( w = 0 ; w < reps ; ++w )
+				func( test, top, 0 );
+			fprintf( stderr, "packed: %lu ms ... ", (unsigned long)((clock() - started)*1000/CLOCKS_PER_SEC) );
+		}
+		fprintf( stderr, "%s\n", res?"failed":"success." );
+	}
+	free_packed_scanline( bottom, False );
+	free_packed_scanline( top, False );
+	free_packed_scanline( control, False );
+	free_packed_scanline( test, False );
+	free_scanline( pbottom, False );
+	free_scanline( ptop, False );
+	return res;
+}
+
+int main(int argc, char **argv )
+{
+	static CARD32 feature_sets[] = { ASIM_CPU_SSE2, ASIM_CPU_SSE2|ASIM_CPU_AVX2 };
+	int width = (argc > 1)? atoi(argv[1]) : 1920 ;
+	int reps = (argc > 2)? atoi(argv[2]) : 2000 ;
+	int res = 0, f, i, offset, w ;
+	ASScanline *bottom, *top, *control, *test ;
+	CARD32 available = get_asimage_cpu_features();
+
+	if( width < 1 )
+		width = 1 ;
+	bottom = prepare_scanline( width, 0, NULL, False );
+	top = prepare_scanline( width, 0, NULL, False );
+	control = prepare_scanline( width, 0, NULL, False );
+	test = prepare_scanline( width, 0, NULL, False );
+	fill_test_scanline( bottom );
+	fill_test_scanline( top );
+	fprintf( stderr, "cpu features = 0x%X\n", available );
+
+	for( f = 0 ; f < (int)(sizeof(feature_sets)/sizeof(CARD32)) ; ++f )
+	{
+		if( (feature_sets[f] & available) != feature_sets[f] )
+			continue;
+		for( i = 0 ; std_merge_scanlines_func_list[i].name != NULL ; ++i )
+		{
+			merge_scanlines_func func, func_c ;
+			if( std_merge_scanlines_func_list[i].impl == NULL )
+				continue;
+			set_asimage_cpu_features_mask( 0 );
+			func_c = *(std_merge_scanlines_func_list[i].impl) ;
+			set_asimage_cpu_features_mask( feature_sets[f] );
+			func = *(std_merge_scanlines_func_list[i].impl) ;
+			fprintf( stderr, "Testing \"%s\" with features 0x%X ...", std_merge_scanlines_func_list[i].name, feature_sets[f] );
+			/* all the tails and offsets : */
+			for( w = 1 ; w <= width && w <= 67 ; ++w )
+				for( offset = -17 ; offset <= 17 ; ++offset )
+				{
+					control->width = test->width = bottom->width = w ;
+					copy_test_scanline( control, bottom );
+					copy_test_scanline( test, bottom );
+					func_c( control, top, offset );
+					func( test, top, offset );
+					if( !compare_test_scanlines( control, test ) )
+					{
+						fprintf( stderr, "width = %d, offset = %d ", w, offset );
+						res = 1;
+						w = width ;
+						break;
+					}
+				}
+			control->width = test->width = bottom->width = width ;
+			if( res == 0 )
+			{
+				clock_t started = clock();
+				for( w = 0 ; w < reps ; ++w )
+					func_c( control, top, 0 );
+				fprintf( stderr, "C: %lu ms, ", (unsigned long)((clock() - started)*1000/CLOCKS_PER_SEC) );
+				started = clock();
+				for( w = 0 ; w < reps ; ++w )
+					func( test, top, 0 );
+				fprintf( stderr, "vectorized: %lu ms ... ", (unsigned long)((clock() - started)*1000/CLOCKS_PER_SEC) );
+			}
+			fprintf( stderr, "%s\n", res?"failed":"success." );
+			if( res )
+				return res;
+		}
+	}
+	free_scanline( bottom, False );
+	free_scanline( top, False );
+	free_scanline( control, False );
+	free_scanline( test, False );
+	return test_packed_blending( width, reps, available );
+}
+#endif
@@ -40,9 +40,12 @@ extern "C" {
 
 
 struct ASScanline;
+struct ASPackedScanline;
 
 /* it produces  bottom = bottom <merge> top */
 typedef void (*merge_scanlines_func)( struct ASScanline *bottom, struct ASScanline *top, int offset);
+/* same on 8 bit per channel data packed into ARGB32 */
+typedef void (*merge_packed_scanlines_func)( struct ASPackedScanline *bottom, struct ASPackedScanline *top, int offset);
 
 /****d* libAfterImage/colorspace
  * NAME
@@ -287,10 +290,47 @@ void dissipate_scanlines( struct ASScanline *bottom, struct ASScanline *top, int
  * blending/merging methods onto the supplied stream, in supplied format.
  * Format must include 2 string specs, like so : "%s - %s" where first
  * one will be substituted to short method name, and second - description
+ * Returned function is the fastest implementation of the method
+ * available on the host CPU - see get_asimage_cpu_features().
  ****************/
 merge_scanlines_func blend_scanlines_name2func( const char *name );
 void list_scanline_merging(FILE* stream, const char *format);
 
+/****f* libAfterImage/blend_scanlines_func2packed()
+ * NAME
+ * blend_scanlines_func2packed()
+ * SYNOPSIS
+ * merge_packed_scanlines_func
+ *      blend_scanlines_func2packed( merge_scanlines_func func );
+ * INPUTS
+ * func - one of the merging functions listed above.
+ * RETURN VALUE
+ * Function implementing the same merging method on ASPackedScanlines,
+ * or NULL if method needs the precision of 24.8 format.
+ * DESCRIPTION
+ * Packed implementations exist for alphablend, allanon, tint, add, sub,
+ * diff, darken, lighten and screen methods. Results may differ from
+ * those of ASScanline methods by 1 in the lowest bit, due to lower
+ * precision of intermediate values. merge_layers() uses it to decide if
+ * layers could be composed in packed format.
+ ****************/
+merge_packed_scanlines_func blend_scanlines_func2packed( merge_scanlines_func func );
+
+/****f* libAfterImage/select_blend_scanlines_impl()
+ * NAME
+ * select_blend_scanlines_impl()
+ * SYNOPSIS
+ * void select_blend_scanlines_impl( CARD32 cpu_features );
+ * INPUTS
+ * cpu_features - set of ASIM_CPU_ flags available on the host.
+ * DESCRIPTION
+ * Selects implementation of each merging method that is going to be
+ * used by public functions such as alphablend_scanlines(). This is
+ * called internally from get_asimage_cpu_features() and should not be
+ * used directly by applications.
+ ****************/
+void select_blend_scanlines_impl( CARD32 cpu_features );
+
 #ifdef __cplusplus
 }
 #endif
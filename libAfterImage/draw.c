@@ -749,105 +749,554 @@ ctx_draw_bezier( ASDrawContext *ctx, int x0, int y0, int x1, int y1, int x2, int
 		free( bstack );
 }
 
+/*************************************************************************
+ * Flood fill :
+ * span based, with an explicit stack of spans yet to be expanded and a 
+ * bitmap of pixels that are still to be filled. Row of the bitmap is built 
+ * on first visit, testing pixels against the range and packing results 32 
+ * at a time, and runs are then found scanning bitmap a word at a time. 
+ * Span is removed from the bitmap as soon as it is found, so that each span 
+ * is pushed only once, and fill terminates regardless of the value it 
+ * writes into the canvas.
+ *************************************************************************/
 typedef struct ASScanlinePart
 {
 	int y ;
 	int x0, x1;
+	int dir ;						   /* row of the parent span is y-dir */
+	int parent_x0, parent_x1 ;
 }ASScanlinePart;
 
+typedef struct ASFloodFillState
+{
+	ASDrawContext *ctx ;
+	CARD32 *canvas ;
+	int cw, ch ;
+	CARD32 min_val, range ;
+	int row_words ;
+	CARD32 *bits ;					   /* 1 - pixel is in range and not filled yet */
+	CARD8 *word_ready ;				   /* bitmap words are built on first use */
+	ASScanlinePart *stack ;
+	int stack_size, stack_used ;
+}ASFloodFillState;
+
+#define FILL_WORD_BITS		32
+#define FILL_WORD_SHIFT		5
+#define FILL_WORD_MASK		0xFFFFFFFF
+
+static inline int
+lowest_bit_set( CARD32 w )
+{
+#ifdef __GNUC__
+	return __builtin_ctz( (unsigned int)w );
+#else
+	int i = 0 ;
+	while( (w&0x01) == 0 ) 
+	{
+		w = w>>1 ;
+		++i ;
+	}
+	return i;
+#endif
+}
+
+static inline int
+highest_bit_set( CARD32 w )
+{
+#ifdef __GNUC__
+	return 31 - __builtin_clz( (unsigned int)w );
+#else
+	int i = 31 ;
+	while( (w&0x80000000) == 0 ) 
+	{
+		w = w<<1 ;
+		--i ;
+	}
+	return i;
+#endif
+}
+
+static CARD32
+build_fill_word( ASFloodFillState *st, int y, int w )
+{
+	int i = y*st->row_words + w ;
+	CARD32 *data = st->canvas + y*st->cw ;
+	CARD32 min_val = st->min_val, range = st->range ;
+	int x = w<<FILL_WORD_SHIFT, end = min( x + FILL_WORD_BITS, st->cw ), bit = 0 ;
+	CARD32 mask = 0 ;
+	/* single unsigned compare checks both ends of the range */
+	for( ; x < end ; ++x ) 
+		mask |= (CARD32)((CARD32)(data[x] - min_val) <= range)<<(bit++) ;
+	st->word_ready[i] = 1 ;
+	return (st->bits[i] = mask);
+}
+
+#define FILL_WORD(st,y,w)	((st)->word_ready[(y)*(st)->row_words+(w)]? \
+							 (st)->bits[(y)*(st)->row_words+(w)]:build_fill_word(st,y,w))
+
+/* first set bit in [x, x_last], or -1 */
+static inline int
+next_set_bit( ASFloodFillState *st, int y, int x, int x_last )
+{
+	int w = x>>FILL_WORD_SHIFT ;
+	CARD32 word = FILL_WORD(st,y,w) & ((CARD32)FILL_WORD_MASK<<(x&(FILL_WORD_BITS-1))) ;
+	while( word == 0 ) 
+	{
+		if( (++w)<<FILL_WORD_SHIFT > x_last ) 
+			return -1;
+		word = FILL_WORD(st,y,w) ;
+	}
+	x = (w<<FILL_WORD_SHIFT) + lowest_bit_set( word );
+	return (x <= x_last)? x : -1;
+}
+
+/* first clear bit at or after x, or canvas width */
+static inline int
+next_clear_bit( ASFloodFillState *st, int y, int x )
+{
+	int w = x>>FILL_WORD_SHIFT ;
+	CARD32 word = (~FILL_WORD(st,y,w)) & ((CARD32)FILL_WORD_MASK<<(x&(FILL_WORD_BITS-1))) & FILL_WORD_MASK ;
+	while( word == 0 ) 
+	{
+		if( (++w)<<FILL_WORD_SHIFT >= st->cw ) 
+			return st->cw;
+		word = (~FILL_WORD(st,y,w)) & FILL_WORD_MASK ;
+	}
+	x = (w<<FILL_WORD_SHIFT) + lowest_bit_set( word );
+	return (x < st->cw)? x : st->cw;
+}
+
+/* last clear bit at or before x, or -1 */
+static inline int
+prev_clear_bit( ASFloodFillState *st, int y, int x )
+{
+	int w = x>>FILL_WORD_SHIFT ;
+	CARD32 word = (~FILL_WORD(st,y,w)) & ((CARD32)FILL_WORD_MASK>>((FILL_WORD_BITS-1)-(x&(FILL_WORD_BITS-1)))) ;
+	while( word == 0 ) 
+	{
+		if( --w < 0 ) 
+			return -1;
+		word = (~FILL_WORD(st,y,w)) & FILL_WORD_MASK ;
+	}
+	return (w<<FILL_WORD_SHIFT) + highest_bit_set( word );
+}
+
+/* words covering [x0, x1] must have been built already */
+static inline void
+clear_bits( CARD32 *bits, int x0, int x1 )
+{
+	int w0 = x0>>FILL_WORD_SHIFT, w1 = x1>>FILL_WORD_SHIFT ;
+	CARD32 head = ~((CARD32)FILL_WORD_MASK<<(x0&(FILL_WORD_BITS-1))) ;
+	CARD32 tail = ~((CARD32)FILL_WORD_MASK>>((FILL_WORD_BITS-1)-(x1&(FILL_WORD_BITS-1)))) ;
+	if( w0 == w1 ) 
+		bits[w0] &= head|tail ;
+	else
+	{
+		bits[w0] &= head ;
+		while( ++w0 < w1 ) 
+			bits[w0] = 0 ;
+		bits[w1] &= tail ;
+	}
+}
+
+/* fills every run of row y that overlaps [x0, x1], and pushes it on the stack */
+static void
+flood_fill_spans( ASFloodFillState *st, int y, int x0, int x1, int dir )
+{
+	int x = x0 ;
+	while( x <= x1 && (x = next_set_bit( st, y, x, x1 )) >= 0 ) 
+	{
+		int from = prev_clear_bit( st, y, x ) + 1 ;
+		int to = next_clear_bit( st, y, x ) - 1 ;
+		clear_bits( st->bits + y*st->row_words, from, to );
+		LOCAL_DEBUG_OUT( "(%d,%d,%d)", from, y, to );
+		CTX_FILL_HLINE( st->ctx, from, y, to, 255 );
+		if( st->stack_used >= st->stack_size ) 
+		{
+			st->stack_size = (st->stack_size == 0)? 2048/sizeof(ASScanlinePart) : st->stack_size*2 ;
+			st->stack = realloc( st->stack, st->stack_size*sizeof(ASScanlinePart));
+		}
+		st->stack[st->stack_used].x0 = from ;
+		st->stack[st->stack_used].y = y ;
+		st->stack[st->stack_used].x1 = to ;
+		st->stack[st->stack_used].dir = dir ;
+		st->stack[st->stack_used].parent_x0 = x0 ;
+		st->stack[st->stack_used].parent_x1 = x1 ;
+		++(st->stack_used) ;
+		x = to + 2 ;
+	}
+}
 
 static void 
 ctx_flood_fill( ASDrawContext *ctx, int x_from, int y, int x_to, CARD32 min_val, CARD32 max_val  )
 {
-	int ch = ctx->canvas_height ;
-	int cw = ctx->canvas_width ;
-	
-	ASScanlinePart *sstack = NULL ;
-	int sstack_size = 0, sstack_used = 0 ;
-	CARD32 *canvas = CTX_SELECT_CANVAS(ctx);
+	ASFloodFillState st ;
 	
 	LOCAL_DEBUG_OUT( "(%d,%d,%d)", x_from, y, x_to );
-#define ADD_ScanlinePart(X0,Y0,X1)	\
-	do{ \
-		if( ((X0)>=0 || (X1)>=0 ) && ((X0)<cw||(X1)<cw) && \
-			 (Y0)>=0 && (Y0)<ch ){ \
-			while( sstack_used >= sstack_size ) { \
-				sstack_size += 2048/sizeof(ASScanlinePart); \
-				sstack = realloc( sstack, sstack_size*sizeof(ASScanlinePart)); \
-			} \
-			LOCAL_DEBUG_OUT( "(%d,%d,%d)", X0, Y0, X1 ); \
-			sstack[sstack_used].x0=X0; \
-			sstack[sstack_used].y=Y0; \
-			sstack[sstack_used].x1=X1; \
-			++sstack_used ; \
-		} \
-	}while(0)
+	if( x_from < 0 ) 
+		x_from = 0 ;
+	if( x_to >= ctx->canvas_width ) 
+		x_to = ctx->canvas_width - 1 ;
+	if( x_from > x_to || y < 0 || y >= ctx->canvas_height || min_val > max_val ) 
+		return;
+
+	memset( &st, 0x00, sizeof(st));
+	st.ctx = ctx ;
+	st.canvas = CTX_SELECT_CANVAS(ctx);
+	st.cw = ctx->canvas_width ;
+	st.ch = ctx->canvas_height ;
+	st.min_val = min_val ; 
+	st.range = max_val - min_val ;
+	st.row_words = (st.cw + FILL_WORD_BITS - 1)>>FILL_WORD_SHIFT ;
+	st.bits = safemalloc( st.row_words*st.ch*sizeof(CARD32) );
+	st.word_ready = safecalloc( st.row_words*st.ch, 1 );
 
-	ADD_ScanlinePart(x_from,y,x_to);
+	flood_fill_spans( &st, y, x_from, x_to, 0 );
 
-	while( sstack_used > 0 )
+	while( st.stack_used > 0 )
 	{
-		--sstack_used ; 
-		x_from = sstack[sstack_used].x0 ; 
-		x_to = sstack[sstack_used].x1 ; 
-		y = sstack[sstack_used].y ; 
-		if( x_from <  0 )
-			x_from = 0 ; 
-		if( x_to >= cw ) 
-			x_to = cw - 1 ; 
-		if( x_from <= x_to ) 
-		{	
-			/* here we have to check for lines below and above */
+		ASScanlinePart *part = &(st.stack[--st.stack_used]) ;
+		int x0 = part->x0, x1 = part->x1, dir = part->dir ; 
+		int px0 = part->parent_x0, px1 = part->parent_x1 ;
+		y = part->y ;
+		if( dir == 0 ) 
+		{	/* seed span */
 			if( y > 0 ) 
-			{
-				CARD32 *data = canvas + (y-1)*cw ; 
-				int xc = x_from ; 
+				flood_fill_spans( &st, y-1, x0, x1, -1 );
+			if( y < st.ch-1 ) 
+				flood_fill_spans( &st, y+1, x0, x1, 1 );
+			continue;
+		}
+		if( y+dir >= 0 && y+dir < st.ch ) 
+			flood_fill_spans( &st, y+dir, x0, x1, dir );
+		/* row we came from needs checking only where we stick out past the parent */
+		if( x0 < px0 ) 
+			flood_fill_spans( &st, y-dir, x0, px0-1, -dir );
+		if( x1 > px1 ) 
+			flood_fill_spans( &st, y-dir, px1+1, x1, -dir );
+	}	 
+	if( st.stack ) 
+		free( st.stack );
+	free( st.word_ready );
+	free( st.bits );
+}
 
-				while( xc <= x_to ) 
-				{	
-					if( data[xc] <= max_val && data[xc] >= min_val ) 
-					{	
-						int x0 = xc, x1 = xc ; 
-						while( x0 >= 0 && data[x0] <= max_val && data[x0]  >= min_val ) --x0;
-						++x0 ;
-						while( x1 < cw && data[x1] <= max_val && data[x1]  >= min_val ) ++x1;
-						--x1 ; 
-					
-						ADD_ScanlinePart(x0,y-1,x1);					
-						LOCAL_DEBUG_OUT( "x = %d, y = %d, data[x] = 0x%X, x0 = %d, x1 = %d", xc, y-1, data[xc], x0, x1 );
-						while( xc <= x_to && xc <= x1+1 ) ++xc ; 
-					}else
-						++xc ;
-				}
-			}	 
-			if( y < ch-1 ) 
+/*************************************************************************
+ * Polygon filling :
+ * path primitives record the outline as a list of edges in 24.8 fixed 
+ * point, and asim_apply_path() rasterizes it one scanline at a time.
+ * Every cell crossed by an edge accumulates signed vertical cover and the 
+ * area to the left of the edge, so that sweeping along the scanline gives 
+ * exact coverage of each pixel, and the winding number for the fill rule.
+ *************************************************************************/
+#define POLY_ONE		(0x01<<SUPERSAMPLING_BITS)
+#define POLY_HALF		(POLY_ONE>>1)
+
+int asim_sqrt( double sval );
+
+static void
+ctx_add_edge( ASDrawContext *ctx, int x0, int y0, int x1, int y1 )
+{
+	ASDrawEdge *e ;
+	if( y0 == y1 || !get_flags( ctx->flags, ASDrawCTX_UsingScratch ) ) 
+		return;
+	if( ctx->edges_num >= ctx->edges_allocated ) 
+	{
+		ctx->edges_allocated = ctx->edges_allocated == 0 ? 256 : ctx->edges_allocated*2 ;
+		ctx->edges = realloc( ctx->edges, ctx->edges_allocated*sizeof(ASDrawEdge));
+	}	 
+	e = &(ctx->edges[ctx->edges_num++]);
+	/* pixel centers are at integer coordinates, while pixel cells of the 
+	 * rasterizer span from x to x+1 : */
+	x0 += POLY_HALF ; 
+	y0 += POLY_HALF ; 
+	x1 += POLY_HALF ; 
+	y1 += POLY_HALF ; 
+	if( y0 < y1 ) 
+	{
+		e->x0 = x0 ; e->y0 = y0 ; 
+		e->x1 = x1 ; e->y1 = y1 ; 
+		e->dir = 1 ;
+	}else
+	{
+		e->x0 = x1 ; e->y0 = y1 ; 
+		e->x1 = x0 ; e->y1 = y0 ; 
+		e->dir = -1 ;
+	}		
+}
+
+static void
+ctx_close_subpath( ASDrawContext *ctx )
+{
+	ctx_add_edge( ctx, ctx->curr_x<<8, ctx->curr_y<<8, ctx->subpath_x<<8, ctx->subpath_y<<8 );
+}
+
+static void
+ctx_add_bezier_edges( ASDrawContext *ctx, int x0, int y0, int x1, int y1, int x2, int y2, int x3, int y3 )
+{
+	/* flattening error is below 1/8 of a pixel when n^2 > 6*|second difference| : */
+	int ddx = max( abs(x0 - 2*x1 + x2), abs(x1 - 2*x2 + x3) );
+	int ddy = max( abs(y0 - 2*y1 + y2), abs(y1 - 2*y2 + y3) );
+	int n = asim_sqrt( 6.*(double)max(ddx,ddy)/(double)POLY_ONE ) + 1 ;
+	int i, last_x = x0, last_y = y0 ;
+
+	if( !get_flags( ctx->flags, ASDrawCTX_UsingScratch ) ) 
+		return;
+	if( n > 1024 ) 
+		n = 1024 ; 
+	for( i = 1 ; i < n ; ++i ) 
+	{
+		double t = (double)i/(double)n ;
+		double mt = 1. - t ;
+		double a = mt*mt*mt, b = 3.*mt*mt*t, c = 3.*mt*t*t, d = t*t*t ;
+		int x = (int)(a*x0 + b*x1 + c*x2 + d*x3) ;
+		int y = (int)(a*y0 + b*y1 + c*y2 + d*y3) ;
+		ctx_add_edge( ctx, last_x, last_y, x, y );
+		last_x = x ; 
+		last_y = y ;
+	}	 
+	ctx_add_edge( ctx, last_x, last_y, x3, y3 );
+}
+
+static void
+ctx_add_ellips_edges( ASDrawContext *ctx, int x, int y, int rx, int ry )
+{
+	/* inscribed polygon, with sides short enough to stay within 1/8 of a pixel 
+	 * from the curve : r*a*a/8 < 1/8 */
+	double r = max( rx, ry );
+	double a, ca, sa, c = 1., s = 0. ;
+	int n = 8, i, last_x, last_y ;
+
+	if( !get_flags( ctx->flags, ASDrawCTX_UsingScratch ) ) 
+		return;
+	while( n < 0x00010000 && r*(6.2831853/n)*(6.2831853/n) > 1. ) 
+		n = n<<1 ;
+	a = 6.283185307179586/n ;
+	ca = 1. - a*a/2. + a*a*a*a/24. ;
+	sa = a - a*a*a/6. + a*a*a*a*a/120. ;
+	x = x<<8 ; 
+	y = y<<8 ; 
+	rx = rx<<8 ; 
+	ry = ry<<8 ; 
+	last_x = x + rx ;
+	last_y = y ; 
+	for( i = 1 ; i < n ; ++i ) 
+	{
+		double tmp = c*ca - s*sa ;
+		int px, py ;
+		s = s*ca + c*sa ;
+		c = tmp ; 
+		px = x + (int)(c*rx) ;
+		py = y + (int)(s*ry) ; 
+		ctx_add_edge( ctx, last_x, last_y, px, py );
+		last_x = px ; 
+		last_y = py ; 
+	}
+	ctx_add_edge( ctx, last_x, last_y, x + rx, y );
+}
+
+static void
+poly_add_line( int *cover, int *area, int x0, int y0, int x1, int y1 )
+{
+	int cx = x0>>SUPERSAMPLING_BITS, cx1 = x1>>SUPERSAMPLING_BITS ;
+	int x = x0, y = y0, base ;
+
+	if( cx != cx1 ) 
+	{
+		Long64_t dx = x1 - x0, dy = y1 - y0 ;
+		int step = (x1 > x0)? 1 : -1 ;
+		while( cx != cx1 ) 
+		{
+			int xb = (step > 0)? (cx+1)<<SUPERSAMPLING_BITS : cx<<SUPERSAMPLING_BITS ;
+			int yb = y0 + (int)(((Long64_t)(xb - x0)*dy)/dx) ;
+			base = cx<<SUPERSAMPLING_BITS ;
+			cover[cx] += yb - y ;
+			area[cx] += (yb - y)*((x - base) + (xb - base)) ;
+			x = xb ; 
+			y = yb ; 
+			cx += step ;
+		}
+	}
+	base = cx<<SUPERSAMPLING_BITS ;
+	cover[cx] += y1 - y ;
+	area[cx] += (y1 - y)*((x - base) + (x1 - base)) ;
+}
+
+/* x is relative to the canvas, y is relative to the top of the scanline : */
+static void
+poly_add_clipped_line( int *cover, int *area, int cw8, int x0, int y0, int x1, int y1 )
+{
+	if( y0 == y1 ) 
+		return;
+	/* parts left of the canvas are projected onto its left edge, 
+	 * parts right of it do not affect any pixels : */
+	if( (x0 < 0 && x1 > 0) || (x0 > 0 && x1 < 0) ) 
+	{
+		int ym = y0 + (int)(((Long64_t)(-x0)*(y1-y0))/(x1-x0)) ;
+		poly_add_clipped_line( cover, area, cw8, x0, y0, 0, ym );
+		poly_add_clipped_line( cover, area, cw8, 0, ym, x1, y1 );
+	}else if( (x0 < cw8 && x1 > cw8) || (x0 > cw8 && x1 < cw8) ) 
+	{
+		int ym = y0 + (int)(((Long64_t)(cw8-x0)*(y1-y0))/(x1-x0)) ;
+		poly_add_clipped_line( cover, area, cw8, x0, y0, cw8, ym );
+		poly_add_clipped_line( cover, area, cw8, cw8, ym, x1, y1 );
+	}else if( x0 <= 0 && x1 <= 0 ) 
+		poly_add_line( cover, area, 0, y0, 0, y1 );
+	else if( x0 < cw8 || x1 < cw8 )
+		poly_add_line( cover, area, x0, y0, x1, y1 );
+}
+
+typedef struct ASPolyRange
+{
+	int x0, x1 ;
+}ASPolyRange;
+
+static int 
+compare_edges_y0( const void *a, const void *b )
+{
+	return ((ASDrawEdge*)a)->y0 - ((ASDrawEdge*)b)->y0 ;
+}
+
+static inline CARD32 
+poly_coverage( int acc, int area, Bool even_odd ) 
+{
+	int v = acc*(POLY_ONE<<1) - area ;
+	if( v < 0 ) 
+		v = -v ;
+	v = v>>(SUPERSAMPLING_BITS+1) ;
+	if( even_odd ) 
+	{
+		v &= (POLY_ONE<<1)-1 ;
+		if( v > POLY_ONE ) 
+			v = (POLY_ONE<<1) - v ;
+	}else if( v > POLY_ONE ) 
+		v = POLY_ONE ;
+	return v - (v>>SUPERSAMPLING_BITS) ;
+}
+
+static void
+ctx_fill_polygon( ASDrawContext *ctx )
+{
+	int cw = ctx->canvas_width, cw8 = ctx->canvas_width<<SUPERSAMPLING_BITS ;
+	int edges_num = ctx->edges_num ;
+	ASDrawEdge *edges = ctx->edges ;
+	ASDrawEdge **active ;
+	ASPolyRange *ranges ;
+	int active_num = 0, next = 0 ;
+	int *cover, *area ;
+	int i, y, y_end = 0 ;
+	Bool even_odd = get_flags( ctx->flags, ASDrawCTX_FillEvenOdd );
+
+	if( edges_num <= 0 ) 
+		return;
+	qsort( edges, edges_num, sizeof(ASDrawEdge), compare_edges_y0 );
+	for( i = 0 ; i < edges_num ; ++i ) 
+		if( edges[i].y1 > y_end ) 
+			y_end = edges[i].y1 ;
+	y_end = (y_end + POLY_ONE - 1)>>SUPERSAMPLING_BITS ;
+	if( y_end > ctx->canvas_height ) 
+		y_end = ctx->canvas_height ;
+	y = edges[0].y0>>SUPERSAMPLING_BITS ;
+	if( y < 0 ) 
+		y = 0 ;
+
+	active = safemalloc( edges_num*sizeof(ASDrawEdge*) );
+	ranges = safemalloc( edges_num*sizeof(ASPolyRange) );
+	/* one extra cell collects edges right at the right edge of the canvas */
+	cover = safecalloc( cw+1, sizeof(int) );
+	area = safecalloc( cw+1, sizeof(int) );
+
+	for( ; y < y_end ; ++y ) 
+	{
+		int row_top = y<<SUPERSAMPLING_BITS ;
+		int row_bottom = row_top + POLY_ONE ;
+		int ranges_num = 0 ;
+
+		while( next < edges_num && edges[next].y0 < row_bottom ) 
+			active[active_num++] = &(edges[next++]) ;
+
+		for( i = 0 ; i < active_num ; ) 
+		{
+			ASDrawEdge *e = active[i] ;
+			int yt, yb, xt, xb, cx0, cx1, k ;
+			if( e->y1 <= row_top ) 
 			{
-				CARD32 *data = canvas + (y+1)*cw ; 
-				int xc = x_from ; 
+				active[i] = active[--active_num] ;
+				continue;
+			}
+			yt = max( e->y0, row_top ); 
+			yb = min( e->y1, row_bottom ); 
+			xt = e->x0 + (int)(((Long64_t)(yt - e->y0)*(e->x1 - e->x0))/(e->y1 - e->y0)) ;
+			xb = e->x0 + (int)(((Long64_t)(yb - e->y0)*(e->x1 - e->x0))/(e->y1 - e->y0)) ;
+			if( e->dir > 0 ) 
+				poly_add_clipped_line( cover, area, cw8, xt, yt - row_top, xb, yb - row_top );
+			else
+				poly_add_clipped_line( cover, area, cw8, xb, yb - row_top, xt, yt - row_top );
+
+			/* remember cells we've touched, sorted by their start : */
+			cx0 = min( xt, xb )>>SUPERSAMPLING_BITS ;
+			cx0 = (cx0 < 0)? 0 : ((cx0 > cw)? cw : cx0) ;
+			cx1 = max( xt, xb )>>SUPERSAMPLING_BITS ;
+			cx1 = (cx1 < 0)? 0 : ((cx1 > cw)? cw : cx1) ;
+			for( k = ranges_num++ ; k > 0 && ranges[k-1].x0 > cx0 ; --k ) 
+				ranges[k] = ranges[k-1] ;
+			ranges[k].x0 = cx0 ; 
+			ranges[k].x1 = cx1 ; 
+			++i ;
+		}	 
+		
+		if( ranges_num > 0 ) 
+		{
+			int acc = 0, x = ranges[0].x0, run_start = x ; 
+			CARD32 run_val = 0, ratio ;
+#define POLY_PUT_RUN(from,val) \
+	do{ if( (val) != run_val ){ \
+			if( run_val ) CTX_FILL_HLINE( ctx, run_start, y, (from)-1, run_val ); \
+			run_start = (from) ; run_val = (val) ; } \
+	}while(0)
 
-				while( xc <= x_to ) 
+			for( i = 0 ; i < ranges_num ; ++i ) 
+			{
+				int x1 = ranges[i].x1 ;
+				if( x1 < x ) 
+					continue;
+				/* coverage stays the same in between the cells touched by edges */
+				if( ranges[i].x0 > x ) 
 				{	
-					if( data[xc] <= max_val && data[xc] >= min_val ) 
-					{	
-						int x0 = xc, x1 = xc ; 
-						while( x0 >= 0 && data[x0] <= max_val && data[x0]  >= min_val ) --x0;
-						++x0 ;
-						while( x1 < cw && data[x1] <= max_val && data[x1]  >= min_val ) ++x1;
-						--x1 ; 
-						LOCAL_DEBUG_OUT( "x = %d, y = %d, data[x] = 0x%X, x0 = %d, x1 = %d", xc, y+1, data[xc], x0, x1 );
-						ADD_ScanlinePart(x0,y+1,x1);					
-						while( xc <= x_to && xc <= x1+1 ) ++xc ; 
-					}else
-						++xc ;
+					ratio = poly_coverage( acc, 0, even_odd );
+					POLY_PUT_RUN( x, ratio );
+					x = ranges[i].x0 ;
 				}
-			}	 
- 			CTX_FILL_HLINE(ctx,x_from,y,x_to,255);		
-		}
-	}	 
-	if( sstack ) 
-		free( sstack );
-	
-	
+				while( i+1 < ranges_num && ranges[i+1].x0 <= x1+1 ) 
+				{
+					if( ranges[++i].x1 > x1 ) 
+						x1 = ranges[i].x1 ;
+				}
+				if( x1 >= cw ) 
+					x1 = cw-1 ;
+				for( ; x <= x1 ; ++x ) 
+				{
+					acc += cover[x] ;
+					ratio = poly_coverage( acc, area[x], even_odd );
+					POLY_PUT_RUN( x, ratio );
+					cover[x] = area[x] = 0 ;
+				}
+			}
+			if( x < cw ) 
+			{	
+				ratio = poly_coverage( acc, 0, even_odd );
+				POLY_PUT_RUN( x, ratio );
+			}
+			if( run_val ) 
+				CTX_FILL_HLINE( ctx, run_start, y, cw-1, run_val );
+#undef POLY_PUT_RUN
+			cover[cw] = area[cw] = 0 ;
+		}	
+	}
+	free( area );
+	free( cover );
+	free( ranges );
+	free( active );
 }
 
 /*************************************************************************
@@ -924,6 +1373,8 @@ destroy_asdraw_context( ASDrawContext *ctx )
 			free( ctx->canvas );	 
 		if( ctx->scratch_canvas ) 
 			free( ctx->scratch_canvas );	 
+		if( ctx->edges ) 
+			free( ctx->edges );	 
 		free( ctx );
 	}	 
 }	   
@@ -1002,6 +1453,23 @@ asim_start_path( ASDrawContext *ctx )
 	}else
 		ctx->scratch_canvas	 = safecalloc(  ctx->canvas_width*ctx->canvas_height, sizeof(CARD32));
 	set_flags( ctx->flags, ASDrawCTX_UsingScratch );
+	ctx->edges_num = 0 ;
+	ctx->subpath_x = ctx->curr_x ; 
+	ctx->subpath_y = ctx->curr_y ; 
+	return True;
+}
+
+Bool
+asim_set_fill_rule( ASDrawContext *ctx, int rule ) 
+{
+	if( ctx == NULL ) 
+		return False;
+	if( rule == ASDrawFill_EvenOdd ) 
+		set_flags( ctx->flags, ASDrawCTX_FillEvenOdd );
+	else if( rule == ASDrawFill_NonZero ) 
+		clear_flags( ctx->flags, ASDrawCTX_FillEvenOdd );
+	else
+		return False;
 	return True;
 }
 
@@ -1017,10 +1485,17 @@ asim_apply_path( ASDrawContext *ctx, int start_x, int start_y, Bool fill, int fi
 	LOCAL_DEBUG_CALLER_OUT( "start_x = %d, start_y = %d, fill = %d, fill_start_x = %d, fill_start_y = %d",
 							start_x, start_y, fill, fill_start_x, fill_start_y );
 
-	/* TODO : contour tracing functionality : */
 	if( fill ) 
-		asim_flood_fill( ctx, fill_start_x, fill_start_y, 0, fill_threshold==0?CTX_DEFAULT_FILL_THRESHOLD:fill_threshold );	
-
+	{	
+		/* paths that recorded their outline are filled analytically, 
+		 * seed point is only needed for flood fill of everything else */
+		ctx_close_subpath( ctx );
+		if( ctx->edges_num > 0 ) 
+			ctx_fill_polygon( ctx );
+		else
+			asim_flood_fill( ctx, fill_start_x, fill_start_y, 0, fill_threshold==0?CTX_DEFAULT_FILL_THRESHOLD:fill_threshold );	
+	}
+	ctx->edges_num = 0 ;
 	clear_flags( ctx->flags, ASDrawCTX_UsingScratch );	 
 
 	/* actually applying scratch : */
@@ -1100,7 +1575,9 @@ asim_line_to_generic( ASDrawContext *ctx, int dst_x, int dst_y, void (*func)(ASD
 		int cw = ctx->canvas_width ; 
 		int ch = ctx->canvas_height ; 
 		
-		asim_move_to( ctx, dst_x, dst_y );	 				   
+		ctx_add_edge( ctx, from_x<<8, from_y<<8, to_x<<8, to_y<<8 );
+		ctx->curr_x = dst_x ; 	
+		ctx->curr_y = dst_y ; 
 
 		if( to_y == from_y ) 
 		{
@@ -1154,8 +1631,9 @@ asim_move_to( ASDrawContext *ctx, int dst_x, int dst_y )
 {
 	if( ctx ) 
 	{
-		ctx->curr_x = dst_x ; 	
-		ctx->curr_y = dst_y ; 
+		ctx_close_subpath( ctx );
+		ctx->curr_x = ctx->subpath_x = dst_x ; 	
+		ctx->curr_y = ctx->subpath_y = dst_y ; 
 	}		 
 }
 	   
@@ -1184,7 +1662,9 @@ asim_cube_bezier( ASDrawContext *ctx, int x1, int y1, int x2, int y2, int x3, in
 		if (get_flags (ctx->flags, ASDrawCTX_CanvasIsARGB))
 			path_started = asim_start_path (ctx);
 	
-		asim_move_to( ctx, x3, y3 );
+		ctx->curr_x = x3 ; 	
+		ctx->curr_y = y3 ; 
+		ctx_add_bezier_edges( ctx, x0<<8, y0<<8, x1<<8, y1<<8, x2<<8, y2<<8, x3<<8, y3<<8 );
 		ctx_draw_bezier( ctx, x0<<8, y0<<8, x1<<8, y1<<8, x2<<8, y2<<8, x3<<8, y3<<8 );
 	
 		if (path_started)
@@ -1308,6 +1788,8 @@ asim_straight_ellips( ASDrawContext *ctx, int x, int y, int rx, int ry, Bool fil
 
 		asim_start_path( ctx );
 		asim_move_to( ctx, x+rx, y );
+		if( fill ) 
+			ctx_add_ellips_edges( ctx, x, y, rx, ry );
 		LOCAL_DEBUG_OUT( "x = %d, y = %d, rx = %d, ry = %d", x, y, rx, ry );
 /* if no 64 bit integers - then tough luck - have to resort to beziers */
 #ifndef HAVE_LONG_LONG						   
@@ -1452,6 +1934,11 @@ asim_ellips( ASDrawContext *ctx, int x, int y, int rx, int ry, int angle, Bool f
 
 		asim_start_path( ctx );
 		asim_move_to( ctx, x0>>8, y0>>8 );
+		if( fill ) 
+		{
+			ctx_add_bezier_edges( ctx, x0, y0, x1down, y1down, x2down, y2down, x3, y3 );
+			ctx_add_bezier_edges( ctx, x3, y3, x2up, y2up, x1up, y1up, x0, y0 );
+		}
 		ctx_draw_bezier( ctx, x0, y0, x1down, y1down, x2down, y2down, x3, y3 );
 		ctx_draw_bezier( ctx, x3, y3, x2up, y2up, x1up, y1up, x0, y0 );
 		asim_apply_path( ctx, x0>>8, y0>>8, fill, x, y, CTX_ELLIPS_FILL_THRESHOLD );
@@ -1728,17 +2215,9 @@ asim_flood_fill( ASDrawContext *ctx, int x, int y, CARD32 min_val, CARD32 max_va
 {
 	if( ctx && x >= 0 && x < ctx->canvas_width && y >= 0 && y < ctx->canvas_height )
 	{
-		int x0 = x, x1 = x ; 
-		int cw = ctx->canvas_width ;
-		CARD32 *data = CTX_SELECT_CANVAS(ctx) + y*cw ; 
-		while( x0 >= 0 && data[x0] <= max_val && data[x0]  >= min_val ) --x0;
-		++x0 ;
-		while( x1 < cw && data[x1] <= max_val && data[x1]  >= min_val ) ++x1;
-		--x1 ; 
-		LOCAL_DEBUG_OUT( "x = %d, y = %d, data[x] = 0x%X, x0 = %d, x1 = %d", x, y, data[x], x0, x1 );
-		
-		if( x0 <= x1 ) 
-			ctx_flood_fill( ctx, x0, y, x1, min_val, max_val );			
+		LOCAL_DEBUG_OUT( "x = %d, y = %d, data[x] = 0x%X", x, y, CTX_SELECT_CANVAS(ctx)[y*ctx->canvas_width+x] );
+		/* seed's own run is found the same way as all the others */
+		ctx_flood_fill( ctx, x, y, x, min_val, max_val );			
 	}		   
 }	 
 
@@ -1763,6 +2242,7 @@ asim_rectangle( ASDrawContext *ctx, int x, int y, int width, int height )
 /*********************************************************************************/
 
 #ifdef TEST_ASDRAW
+#include <time.h>
 #include "afterimage.h"
 
 /*************************************/
@@ -1835,6 +2315,71 @@ ASImage *TASImage_DrawCircle(ASVisual *asv, ASImage *fImage, Int_t x, Int_t y, I
 /* testing code for ROOT from CERN   */
 /*************************************/
 
+/* flood fill throughput on large synthetic shapes : */
+#define FILL_TEST_WIDTH		3840
+#define FILL_TEST_HEIGHT	2160
+
+static void
+time_flood_fill( const char *name, ASDrawContext *ctx, int x, int y )
+{
+	clock_t started = clock();
+	long filled = 0 ;
+	int i ;
+	double msec ;
+
+	asim_flood_fill( ctx, x, y, 0, CTX_DEFAULT_FILL_THRESHOLD );
+	msec = (double)(clock() - started)*1000./CLOCKS_PER_SEC ;
+	for( i = 0 ; i < ctx->canvas_width*ctx->canvas_height ; ++i ) 
+		if( ctx->canvas[i] == 255 ) 
+			++filled ;
+	fprintf( stderr, "flood fill %-12s: %8ld pixels in %7.2f msec (%.1f Mpixels/sec)\n", 
+			 name, filled, msec, msec > 0. ? filled/(msec*1000.) : 0. );
+}
+
+static void
+test_flood_fill_speed()
+{
+	ASDrawContext *ctx ;
+	int x, y, i ;
+	CARD32 seed = 345824357 ;
+
+	/* whole canvas */
+	ctx = create_asdraw_context( FILL_TEST_WIDTH, FILL_TEST_HEIGHT );
+	time_flood_fill( "open", ctx, FILL_TEST_WIDTH/2, FILL_TEST_HEIGHT/2 );
+	destroy_asdraw_context( ctx );
+
+	/* narrow vertical corridors, connected alternately at the top and bottom */
+	ctx = create_asdraw_context( FILL_TEST_WIDTH, FILL_TEST_HEIGHT );
+	for( x = 8 ; x < FILL_TEST_WIDTH ; x += 8 ) 
+		for( y = ((x/8)&1)?0:20 ; y < (((x/8)&1)?FILL_TEST_HEIGHT-20:FILL_TEST_HEIGHT) ; ++y ) 
+			ctx->canvas[y*FILL_TEST_WIDTH+x] = 200 ;
+	time_flood_fill( "corridors", ctx, 2, 2 );
+	destroy_asdraw_context( ctx );
+
+	/* concentric rings with breaks in them */
+	ctx = create_asdraw_context( FILL_TEST_WIDTH, FILL_TEST_HEIGHT );
+	asim_set_brush( ctx, 1 );
+	for( i = 20 ; i < FILL_TEST_WIDTH/2 ; i += 20 ) 
+		asim_circle( ctx, FILL_TEST_WIDTH/2, FILL_TEST_HEIGHT/2, i, False );
+	for( x = 0 ; x < FILL_TEST_WIDTH ; ++x ) 
+		for( y = FILL_TEST_HEIGHT/2 - 3 ; y <= FILL_TEST_HEIGHT/2 + 3 ; ++y ) 
+			ctx->canvas[y*FILL_TEST_WIDTH+x] = 0 ;
+	time_flood_fill( "rings", ctx, FILL_TEST_WIDTH/2, FILL_TEST_HEIGHT/2 );
+	destroy_asdraw_context( ctx );
+
+	/* porous region - 20% of pixels are walls */
+	ctx = create_asdraw_context( FILL_TEST_WIDTH, FILL_TEST_HEIGHT );
+	for( i = 0 ; i < FILL_TEST_WIDTH*FILL_TEST_HEIGHT ; ++i ) 
+	{
+		seed = seed*1664525 + 1013904223 ;
+		if( ((seed>>16)%100) < 20 ) 
+			ctx->canvas[i] = 200 ;
+	}
+	ctx->canvas[(FILL_TEST_HEIGHT/2)*FILL_TEST_WIDTH+FILL_TEST_WIDTH/2] = 0 ;
+	time_flood_fill( "porous", ctx, FILL_TEST_WIDTH/2, FILL_TEST_HEIGHT/2 );
+	destroy_asdraw_context( ctx );
+}
+
 int main(int argc, char **argv )
 {
 	ASVisual *asv ;
@@ -1851,6 +2396,8 @@ int main(int argc, char **argv )
 	
 	set_output_threshold( 10 );
 
+	test_flood_fill_speed();
+
 #ifndef X_DISPLAY_MISSING
 	dpy = XOpenDisplay(NULL);
 	screen = DefaultScreen(dpy);
@@ -1984,6 +2531,22 @@ int main(int argc, char **argv )
 	asim_circle( ctx, 705, 275, 90, True );
 //	asim_circle( ctx, 100, 100, 90, True );
 
+	/* polygon fill with both fill rules : */
+	for( i = 0 ; i < 2 ; ++i )
+	{
+		int sx = 20 + i*200 ;
+		asim_set_fill_rule( ctx, i == 0 ? ASDrawFill_NonZero : ASDrawFill_EvenOdd );
+		asim_start_path( ctx );
+		asim_move_to( ctx, sx+90, 600 );
+		asim_line_to_aa( ctx, sx+143, 780 );
+		asim_line_to_aa( ctx, sx, 665 );
+		asim_line_to_aa( ctx, sx+180, 665 );
+		asim_line_to_aa( ctx, sx+37, 780 );
+		asim_line_to_aa( ctx, sx+90, 600 );
+		asim_apply_path( ctx, 0, 0, True, 0, 0, 0 );
+	}
+	asim_set_fill_rule( ctx, ASDrawFill_NonZero );
+
 	asim_circle( ctx, -40000, 500, 40500, False );
 	asim_circle( ctx, -10000, 500, 10499, False );
 
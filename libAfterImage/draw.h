@@ -9,11 +9,20 @@ typedef struct ASDrawTool
 	CARD32  *matrix ;
 }ASDrawTool;
 
+/* polygon edge accumulated while the path is open, in 24.8 fixed point : */
+typedef struct ASDrawEdge
+{
+	int x0, y0 ;
+	int x1, y1 ;					   /* y0 < y1 always */
+	int dir ;						   /* +1 going down, -1 going up */
+}ASDrawEdge;
+
 typedef struct ASDrawContext
 {
 #define ASDrawCTX_UsingScratch	(0x01<<0)	
 #define ASDrawCTX_CanvasIsARGB	(0x01<<1)
 #define ASDrawCTX_ToolIsARGB	(0x01<<2)
+#define ASDrawCTX_FillEvenOdd	(0x01<<3)
 	ASFlagType flags ;
 
 	ASDrawTool *tool ;
@@ -26,10 +35,18 @@ typedef struct ASDrawContext
 
 	void (*apply_tool_func)( struct ASDrawContext *ctx, int curr_x, int curr_y, CARD32 ratio );
 	void (*fill_hline_func)( struct ASDrawContext *ctx, int x_from, int y, int x_to, CARD32 ratio );
+
+	/* outline of the current path, used by asim_apply_path() to fill it : */
+	ASDrawEdge *edges ;
+	int edges_num, edges_allocated ;
+	int subpath_x, subpath_y ;		   /* start of the current subpath */
 }ASDrawContext;
 
 #define AS_DRAW_BRUSHES	3
 
+#define ASDrawFill_NonZero		0
+#define ASDrawFill_EvenOdd		1
+
 ASDrawContext *create_asdraw_context( unsigned int width, unsigned int height );
 Bool apply_asdraw_context( ASImage *im, ASDrawContext *ctx, ASFlagType filter );
 void destroy_asdraw_context( ASDrawContext *ctx );
@@ -40,6 +57,7 @@ Bool asim_set_custom_brush_colored( ASDrawContext *ctx, ASDrawTool *brush);
 
 Bool asim_start_path( ASDrawContext *ctx );
 Bool asim_apply_path( ASDrawContext *ctx, int start_x, int start_y, Bool fill, int fill_start_x, int fill_start_y, CARD8 fill_threshold );
+Bool asim_set_fill_rule( ASDrawContext *ctx, int rule );
 
 void asim_move_to( ASDrawContext *ctx, int dst_x, int dst_y );
 void asim_line_to( ASDrawContext *ctx, int dst_x, int dst_y );
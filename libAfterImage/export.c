@@ -32,6 +32,12 @@
 # else
 #  include <png.h>
 # endif
+/* for deflating groups of lines ourselves : */
+# ifndef HAVE_ZLIB_H
+#  include "zlib/zlib.h"
+# else
+#  include <zlib.h>
+# endif
 #else
 #include <setjmp.h>
 # ifdef HAVE_JPEG
@@ -105,6 +111,7 @@
 #endif
 
 #include "asimage.h"
+#include "asstorage.h"
 #include "imencdec.h"
 #include "xcf.h"
 #include "xpm.h"
@@ -112,6 +119,7 @@
 #include "import.h"
 #include "export.h"
 #include "ascmap.h"
+#include "asthreads.h"
 //#include "bmp.h"
 
 
@@ -134,7 +142,12 @@ as_image_writer_func as_image_file_writers[ASIT_Unknown] =
 	ASImage2tiff,
 	NULL,
 	NULL,
-	NULL
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	ASImage2asim
 };
 
 Bool
@@ -192,6 +205,90 @@ open_writeable_image_file( const char *path )
 	return fp ;
 }
 
+#if defined(HAVE_PNG) || defined(HAVE_JPEG)
+/* collects encoded data into chunks of ASIMAGE_EXPORT_CHUNK_SIZE, for
+ * the streaming export : */
+typedef struct ASExportSink
+{
+	asimage_export_sink func ;
+	void *data ;
+	CARD8 *chunk ;
+	size_t used ;
+	Bool failed ;						/* sink refused data - the rest is discarded */
+}ASExportSink;
+
+static void
+init_export_sink( ASExportSink *sink, asimage_export_sink func, void *data )
+{
+	sink->func = func ;
+	sink->data = data ;
+	sink->chunk = safemalloc( ASIMAGE_EXPORT_CHUNK_SIZE );
+	sink->used = 0 ;
+	sink->failed = False ;
+}
+
+static void
+emit_export_chunk( ASExportSink *sink, const CARD8 *chunk, size_t length )
+{
+	if( !sink->failed && length > 0 )
+		if( !sink->func( sink->data, chunk, length ) )
+			sink->failed = True ;
+}
+
+static void
+write_export_sink( ASExportSink *sink, const CARD8 *data, size_t length )
+{
+	while( length > 0 )
+	{
+		size_t to_copy = ASIMAGE_EXPORT_CHUNK_SIZE - sink->used ;
+		if( to_copy > length )
+			to_copy = length ;
+		memcpy( sink->chunk+sink->used, data, to_copy );
+		sink->used += to_copy ;
+		data += to_copy ;
+		length -= to_copy ;
+		if( sink->used == ASIMAGE_EXPORT_CHUNK_SIZE )
+		{
+			emit_export_chunk( sink, sink->chunk, sink->used );
+			sink->used = 0 ;
+		}
+	}
+}
+
+/* returns False if any of the data has been refused */
+static Bool
+finish_export_sink( ASExportSink *sink )
+{
+	emit_export_chunk( sink, sink->chunk, sink->used );
+	sink->used = 0 ;
+	free( sink->chunk );
+	sink->chunk = NULL ;
+	return !sink->failed ;
+}
+
+/* Plain forward loops, so that compiler could vectorize them : */
+static void
+pack_rgb_row( CARD8 *row, CARD32 *r, CARD32 *g, CARD32 *b, CARD32 *a, int width )
+{
+	register int i ;
+	if( a )
+		for( i = 0 ; i < width ; ++i )
+		{
+			row[i*4]   = r[i] ;
+			row[i*4+1] = g[i] ;
+			row[i*4+2] = b[i] ;
+			row[i*4+3] = a[i] ;
+		}
+	else
+		for( i = 0 ; i < width ; ++i )
+		{
+			row[i*3]   = r[i] ;
+			row[i*3+1] = g[i] ;
+			row[i*3+2] = b[i] ;
+		}
+}
+#endif
+
 void
 scanline2raw( register CARD8 *row, ASScanline *buf, CARD8 *gamma_table, unsigned int width, Bool grayscale, Bool do_alpha )
 {
@@ -289,7 +386,8 @@ ASImage2xpm ( ASImage *im, const char *path, ASImageExportParams *params )
 	if ((outfile = open_writeable_image_file( path )) == NULL)
 		return False;
 
-    mapped_im = colormap_asimage( im, &cmap, params->xpm.max_colors, params->xpm.dither, params->xpm.opaque_threshold );
+    mapped_im = colormap_asimage_ext( im, &cmap, params->xpm.max_colors, params->xpm.dither, params->xpm.opaque_threshold,
+                                      get_flags( params->xpm.flags, EXPORT_MEDIAN_CUT )?ASCMAP_MEDIAN_CUT:0 );
 	if( !get_flags( params->xpm.flags, EXPORT_ALPHA) )
 		cmap.has_opaque = False ;
 	else
@@ -367,7 +465,8 @@ ASImage2xpmRawBuff ( ASImage *im, CARD8 **buffer, int *size, ASImageExportParams
       params = &defaults ;
    }
 
-    mapped_im = colormap_asimage( im, &cmap, params->xpm.max_colors, params->xpm.dither, params->xpm.opaque_threshold );
+    mapped_im = colormap_asimage_ext( im, &cmap, params->xpm.max_colors, params->xpm.dither, params->xpm.opaque_threshold,
+                                      get_flags( params->xpm.flags, EXPORT_MEDIAN_CUT )?ASCMAP_MEDIAN_CUT:0 );
 	if (mapped_im == NULL)
 		return False;
 	if( !get_flags( params->xpm.flags, EXPORT_ALPHA) )
@@ -473,6 +572,272 @@ ASImage2xpm ( ASImage *im, const char *path,  ASImageExportParams *params )
 
 /***********************************************************************************/
 #ifdef HAVE_PNG		/* PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG */
+/* PNG's normalized graylevel : */
+static void
+pack_png_row( CARD8 *row, CARD32 *r, CARD32 *g, CARD32 *b, CARD32 *a, int width, Bool grayscale )
+{
+	register int i ;
+	if( !grayscale )
+		pack_rgb_row( row, r, g, b, a, width );
+	else if( a )
+		for( i = 0 ; i < width ; ++i )
+		{
+			row[i*2]   = (57*r[i]+181*g[i]+18*b[i])/256 ;
+			row[i*2+1] = a[i] ;
+		}
+	else
+		for( i = 0 ; i < width ; ++i )
+			row[i] = (57*r[i]+181*g[i]+18*b[i])/256 ;
+}
+
+/***********************************************************************************/
+/* Deflating groups of lines in parallel :                                          */
+/* each group is deflated into its own raw deflate stream, ending on byte boundary  */
+/* with Z_SYNC_FLUSH, so that streams could be simply joined together, under single */
+/* zlib header and checksum.                                                        */
+#define PNG_GROUP_BYTES		(512*1024)
+#define PNG_GROUP_MIN_LINES	16
+
+#ifdef Z_FIXED
+#define PNG_MAX_STRATEGY	Z_FIXED
+#else
+#define PNG_MAX_STRATEGY	Z_RLE
+#endif
+
+typedef struct ASPngLinesGroup
+{
+	int start, end ;
+	CARD8 *out ;					/* deflated lines */
+	size_t out_size, out_allocated ;
+	uLong adler ;
+	uLong raw_size ;
+	Bool failed ;
+}ASPngLinesGroup;
+
+typedef struct ASPngLinesJob
+{
+	ASVisual *asv ;
+	ASImage *im ;
+	Bool grayscale, has_alpha ;
+	int bpp ;
+	int level, strategy ;
+	ASPngLinesGroup *groups ;
+}ASPngLinesJob;
+
+static inline int
+png_paeth( int a, int b, int c )
+{
+	int p = a + b - c ;
+	int pa = p > a ? p - a : a - p ;
+	int pb = p > b ? p - b : b - p ;
+	int pc = p > c ? p - c : c - p ;
+	return (pa <= pb && pa <= pc) ? a : ((pb <= pc) ? b : c) ;
+}
+
+#define PNG_FILTER_SUM(v)	do{ int fv = (signed char)(v) ; sum += (fv < 0)?-fv:fv; }while(0)
+
+/* Picks filter with smallest sum of absolute values, same as libpng does by
+ * default. Result is stored in out with filter type first. */
+static void
+filter_png_row( CARD8 *out, CARD8 *row, CARD8 *prev, int rowbytes, int bpp )
+{
+	unsigned long sums[5] ;
+	unsigned long sum ;
+	int i, best = 0 ;
+
+	for( sum = 0, i = 0 ; i < rowbytes ; ++i ) PNG_FILTER_SUM(row[i]);
+	sums[0] = sum ;
+	for( sum = 0, i = 0 ; i < rowbytes ; ++i ) PNG_FILTER_SUM(row[i] - ((i >= bpp)?row[i-bpp]:0));
+	sums[1] = sum ;
+	for( sum = 0, i = 0 ; i < rowbytes ; ++i ) PNG_FILTER_SUM(row[i] - prev[i]);
+	sums[2] = sum ;
+	for( sum = 0, i = 0 ; i < rowbytes ; ++i ) PNG_FILTER_SUM(row[i] - ((((i >= bpp)?row[i-bpp]:0) + prev[i])>>1));
+	sums[3] = sum ;
+	for( sum = 0, i = 0 ; i < rowbytes ; ++i )
+		PNG_FILTER_SUM(row[i] - ((i >= bpp)?png_paeth( row[i-bpp], prev[i], prev[i-bpp] ):prev[i]));
+	sums[4] = sum ;
+	for( i = 1 ; i < 5 ; ++i )
+		if( sums[i] < sums[best] )
+			best = i ;
+
+	out[0] = best ;
+	++out ;
+	switch( best )
+	{
+		case 0 : memcpy( out, row, rowbytes ); break;
+		case 1 : for( i = 0 ; i < rowbytes ; ++i ) out[i] = row[i] - ((i >= bpp)?row[i-bpp]:0); break;
+		case 2 : for( i = 0 ; i < rowbytes ; ++i ) out[i] = row[i] - prev[i]; break;
+		case 3 : for( i = 0 ; i < rowbytes ; ++i ) out[i] = row[i] - ((((i >= bpp)?row[i-bpp]:0) + prev[i])>>1); break;
+		case 4 :
+			for( i = 0 ; i < rowbytes ; ++i )
+				out[i] = row[i] - ((i >= bpp)?png_paeth( row[i-bpp], prev[i], prev[i-bpp] ):prev[i]);
+			break;
+	}
+}
+
+static void
+deflate_png_lines_job( void *data, int job, int jobs_count )
+{
+	ASPngLinesJob *lj = (ASPngLinesJob*)data ;
+	ASPngLinesGroup *group = &(lj->groups[job]);
+	ASImage *im = lj->im ;
+	int rowbytes = im->width*lj->bpp ;
+	int first = (group->start > 0)?group->start-1:0 ;
+	CARD8 *prev, *row, *filtered ;
+	ASImageDecoder *imdec ;
+	z_stream zs ;
+	int y ;
+
+	group->failed = True ;
+	if((imdec = start_image_decoding( lj->asv, im, lj->has_alpha?SCL_DO_ALL:(SCL_DO_GREEN|SCL_DO_BLUE|SCL_DO_RED),
+									  0, first, im->width, group->end-first, NULL)) == NULL )
+		return;
+	memset( &zs, 0x00, sizeof(zs));
+	if( deflateInit2( &zs, lj->level, Z_DEFLATED, -MAX_WBITS, 8, lj->strategy ) != Z_OK )
+	{
+		stop_image_decoding( &imdec );
+		return;
+	}
+
+	prev = safecalloc( rowbytes, 1 );
+	row = safemalloc( rowbytes );
+	filtered = safemalloc( rowbytes+1 );
+	group->out_allocated = deflateBound( &zs, (uLong)(rowbytes+1)*(group->end-group->start) )+6 ;
+	group->out = safemalloc( group->out_allocated );
+	group->out_size = 0 ;
+	group->adler = adler32( 0L, Z_NULL, 0 );
+	group->raw_size = 0 ;
+
+	if( first < group->start )
+	{
+		imdec->decode_image_scanline( imdec );
+		pack_png_row( prev, imdec->buffer.red, imdec->buffer.green, imdec->buffer.blue,
+					  lj->has_alpha?imdec->buffer.alpha:NULL, im->width, lj->grayscale );
+	}
+	for( y = group->start ; y < group->end ; ++y )
+	{
+		CARD8 *tmp ;
+		int err ;
+		imdec->decode_image_scanline( imdec );
+		pack_png_row( row, imdec->buffer.red, imdec->buffer.green, imdec->buffer.blue,
+					  lj->has_alpha?imdec->buffer.alpha:NULL, im->width, lj->grayscale );
+		filter_png_row( filtered, row, prev, rowbytes, lj->bpp );
+		group->adler = adler32( group->adler, filtered, rowbytes+1 );
+		group->raw_size += rowbytes+1 ;
+
+		zs.next_in = filtered ;
+		zs.avail_in = rowbytes+1 ;
+		do
+		{
+			if( group->out_size + 64 > group->out_allocated )
+			{
+				group->out_allocated += (group->out_allocated>>1)+64 ;
+				group->out = realloc( group->out, group->out_allocated );
+			}
+			zs.next_out = group->out + group->out_size ;
+			zs.avail_out = group->out_allocated - group->out_size - 4 ; /* room for checksum */
+			err = deflate( &zs, (y < group->end-1)?Z_NO_FLUSH:((group->end < (int)im->height)?Z_SYNC_FLUSH:Z_FINISH) );
+			group->out_size = zs.next_out - group->out ;
+		}while( err == Z_OK && (zs.avail_in > 0 || zs.avail_out == 0) );
+		if( err != Z_OK && err != Z_STREAM_END && err != Z_BUF_ERROR )
+			break;
+		tmp = prev ;
+		prev = row ;
+		row = tmp ;
+	}
+	if( y == group->end )
+		group->failed = False ;
+
+	deflateEnd( &zs );
+	free( filtered );
+	free( row );
+	free( prev );
+	stop_image_decoding( &imdec );
+}
+
+static int
+png_zlib_header( int level )
+{
+	int flevel = ( level < 0 || level == 6 )?2:((level < 2)?0:((level < 6)?1:3)) ;
+	int header = (0x78<<8)|(flevel<<6) ;
+	return header + 31 - (header%31) ;
+}
+
+/* Returns False if image should be written by libpng sequentially,
+ * otherwise writes out IDAT and IEND chunks. */
+static Bool
+write_png_lines_parallel( png_structp png_ptr, ASImage *im, Bool grayscale, Bool has_alpha, int level, int strategy, Bool *success )
+{
+	int threads = get_asimage_threads();
+	ASPngLinesJob lj ;
+	int rowbytes, lines, groups_count, i, k ;
+	uLong adler = 1 ;
+	CARD8 header[2] ;
+	int header_val = png_zlib_header( level );
+
+	if( threads <= 1 )
+		return False;
+
+	memset( &lj, 0x00, sizeof(lj));
+	lj.bpp = (grayscale?1:3)+(has_alpha?1:0) ;
+	rowbytes = im->width*lj.bpp ;
+	lines = MAX(PNG_GROUP_MIN_LINES, PNG_GROUP_BYTES/(rowbytes+1)) ;
+	groups_count = (im->height+lines-1)/lines ;
+	if( groups_count <= 1 )
+		return False;
+
+	lj.asv = get_default_asvisual();
+	lj.im = im ;
+	lj.grayscale = grayscale ;
+	lj.has_alpha = has_alpha ;
+	lj.level = level ;
+	lj.strategy = strategy ;
+	lj.groups = safecalloc( threads, sizeof(ASPngLinesGroup));
+
+	header[0] = (header_val>>8)&0x00FF ;
+	header[1] = header_val&0x00FF ;
+	*success = True ;
+	/* only as many groups as there are threads are kept in memory at a time : */
+	for( k = 0 ; k < groups_count && *success ; k += threads )
+	{
+		int count = MIN(threads, groups_count-k);
+		for( i = 0 ; i < count ; ++i )
+		{
+			lj.groups[i].start = (k+i)*lines ;
+			lj.groups[i].end = MIN((k+i+1)*lines, (int)im->height) ;
+		}
+		run_asimage_jobs( deflate_png_lines_job, &lj, count );
+		for( i = 0 ; i < count ; ++i )
+		{
+			ASPngLinesGroup *group = &(lj.groups[i]);
+			if( *success && !group->failed )
+			{
+				adler = adler32_combine( adler, group->adler, group->raw_size );
+				if( k+i == 0 )
+					png_write_chunk( png_ptr, (png_bytep)"IDAT", header, 2 );
+				if( k+i == groups_count-1 )
+				{
+					CARD8 *tail = group->out + group->out_size ;
+					tail[0] = (adler>>24)&0x00FF ;
+					tail[1] = (adler>>16)&0x00FF ;
+					tail[2] = (adler>>8)&0x00FF ;
+					tail[3] = adler&0x00FF ;
+					group->out_size += 4 ;
+				}
+				png_write_chunk( png_ptr, (png_bytep)"IDAT", group->out, group->out_size );
+			}else
+				*success = False ;
+			if( group->out )
+				free( group->out );
+			memset( group, 0x00, sizeof(ASPngLinesGroup));
+		}
+	}
+	if( *success )
+		png_write_chunk( png_ptr, (png_bytep)"IEND", NULL, 0 );
+	free( lj.groups );
+	return True;
+}
+
 static Bool
 ASImage2png_int ( ASImage *im, void *data, png_rw_ptr write_fn, png_flush_ptr flush_fn, register ASImageExportParams *params )
 {
@@ -482,13 +847,14 @@ ASImage2png_int ( ASImage *im, void *data, png_rw_ptr write_fn, png_flush_ptr fl
 	int y ;
 	Bool has_alpha;
 	Bool grayscale;
-	int compression;
+	int compression, strategy ;
+	int level = Z_DEFAULT_COMPRESSION ;
+	Bool success = True ;
 	ASImageDecoder *imdec ;
-	CARD32 *r, *g, *b, *a ;
 	png_color_16 back_color ;
 
 	START_TIME(started);
-	static const ASPngExportParams defaults = { ASIT_Png, EXPORT_ALPHA, -1 };
+	static const ASPngExportParams defaults = { ASIT_Png, EXPORT_ALPHA, -1, 0 };
 
 	png_ptr = png_create_write_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
     if ( png_ptr != NULL )
@@ -503,14 +869,19 @@ ASImage2png_int ( ASImage *im, void *data, png_rw_ptr write_fn, png_flush_ptr fl
 	if( params == NULL )
 	{
 		compression = defaults.compression ;
+		strategy = defaults.strategy ;
 		grayscale = get_flags(defaults.flags, EXPORT_GRAYSCALE );
 		has_alpha = get_flags(defaults.flags, EXPORT_ALPHA );
 	}else
 	{
 		compression = params->png.compression ;
+		strategy = params->png.strategy ;
 		grayscale = get_flags(params->png.flags, EXPORT_GRAYSCALE );
 		has_alpha = get_flags(params->png.flags, EXPORT_ALPHA );
 	}
+	/* callers written before strategy was added may leave garbage in it : */
+	if( strategy < Z_DEFAULT_STRATEGY || strategy > PNG_MAX_STRATEGY )
+		strategy = Z_DEFAULT_STRATEGY ;
 
 	/* lets see if we have alpha channel indeed : */
 	if( has_alpha )
@@ -545,7 +916,12 @@ ASImage2png_int ( ASImage *im, void *data, png_rw_ptr write_fn, png_flush_ptr fl
 	}	 
 
 	if( compression > 0 )
-		png_set_compression_level(png_ptr,MIN(compression,99)/10);
+	{
+		level = MIN(compression,99)/10 ;
+		png_set_compression_level(png_ptr,level);
+	}
+	if( strategy > 0 )
+		png_set_compression_strategy(png_ptr,strategy);
 
 	png_set_IHDR(png_ptr, info_ptr, im->width, im->height, 8,
 		         grayscale ? (has_alpha?PNG_COLOR_TYPE_GRAY_ALPHA:PNG_COLOR_TYPE_GRAY):
@@ -565,74 +941,24 @@ ASImage2png_int ( ASImage *im, void *data, png_rw_ptr write_fn, png_flush_ptr fl
 	/* starting writing the file : writing info first */
 	png_write_info(png_ptr, info_ptr);
 
-	r = imdec->buffer.red ;
-	g = imdec->buffer.green ;
-	b = imdec->buffer.blue ;
-	a = imdec->buffer.alpha ;
-
-	if( grayscale )
-	{
-		row_pointer = safemalloc( im->width*(has_alpha?2:1));
-		for ( y = 0 ; y < (int)im->height ; y++ )
-		{
-			register int i = im->width;
-			CARD8   *ptr = (CARD8*)row_pointer;
-
-			imdec->decode_image_scanline( imdec );
-			if( has_alpha )
-			{
-				while( --i >= 0 ) /* normalized graylevel computing :  */
-				{
-                    ptr[(i<<1)] = (57*r[i]+181*g[i]+18*b[i])/256 ;
-					ptr[(i<<1)+1] = a[i] ;
-				}
-			}else
-				while( --i >= 0 ) /* normalized graylevel computing :  */
-                    ptr[i] = (57*r[i]+181*g[i]+18*b[i])/256 ;
-			png_write_rows(png_ptr, &row_pointer, 1);
-		}
-	}else
+	if( !write_png_lines_parallel( png_ptr, im, grayscale, has_alpha, level, strategy, &success ) )
 	{
-/*		fprintf( stderr, "saving : %s\n", path );*/
-		row_pointer = safecalloc( im->width * (has_alpha?4:3), 1 );
+		row_pointer = safemalloc( im->width * (grayscale?1:3) + (has_alpha?im->width:0) );
 		for (y = 0; y < (int)im->height; y++)
 		{
-			register int i = im->width;
-			CARD8   *ptr = (CARD8*)(row_pointer+(i-1)*(has_alpha?4:3)) ;
 			imdec->decode_image_scanline( imdec );
-			if( has_alpha )
-			{
-				while( --i >= 0 )
-				{
-					/* 0 is red, 1 is green, 2 is blue, 3 is alpha */
-		            ptr[0] = r[i] ;
-					ptr[1] = g[i] ;
-					ptr[2] = b[i] ;
-					ptr[3] = a[i] ;
-					ptr-=4;
-					/*fprintf( stderr, "#%2.2X%2.2X%2.2X%2.2X ", imbuf.alpha[i], imbuf.red[i], imbuf.green[i], imbuf.blue[i] );*/
-				}
-			}else
-				while( --i >= 0 )
-				{
-					ptr[0] = r[i] ;
-					ptr[1] = g[i] ;
-					ptr[2] = b[i] ;
-					ptr-=3;
-					/*fprintf( stderr, "#%FFX%2.2X%2.2X%2.2X ", imbuf.red[i], imbuf.green[i], imbuf.blue[i] );*/
-				}
-			/*fprintf( stderr, "\n");*/
+			pack_png_row( row_pointer, imdec->buffer.red, imdec->buffer.green, imdec->buffer.blue,
+						  has_alpha?imdec->buffer.alpha:NULL, im->width, grayscale );
 			png_write_rows(png_ptr, &row_pointer, 1);
 		}
+		png_write_end(png_ptr, info_ptr);
+		free( row_pointer );
 	}
-
-	png_write_end(png_ptr, info_ptr);
 	png_destroy_write_struct(&png_ptr, &info_ptr);
-	free( row_pointer );
 	stop_image_decoding( &imdec );
 
 	SHOW_TIME("image writing", started);
-	return True ;
+	return success ;
 }
 
 Bool
@@ -707,6 +1033,26 @@ ASImage2PNGBuff( ASImage *im, CARD8 **buffer, int *size, ASImageExportParams *pa
 	return False;
 }
 
+static void
+asim_png_write_sink(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+	write_export_sink( (ASExportSink*) png_get_io_ptr(png_ptr), data, length );
+}
+
+Bool
+ASImage2PNGStream( ASImage *im, asimage_export_sink sink, void *data, ASImageExportParams *params )
+{
+	ASExportSink int_sink ;
+	Bool res ;
+
+	if( im == NULL || sink == NULL )
+		return False;
+
+	init_export_sink( &int_sink, sink, data );
+	res = ASImage2png_int ( im, &int_sink, (png_rw_ptr)asim_png_write_sink, (png_flush_ptr)asim_png_flush_data, params );
+	return finish_export_sink( &int_sink ) && res ;
+}
+
 
 #else 			/* PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG */
 Bool
@@ -726,6 +1072,12 @@ ASImage2PNGBuff( ASImage *im, CARD8 **buffer, int *size, ASImageExportParams *pa
 	return False;
 }
 
+Bool
+ASImage2PNGStream( ASImage *im, asimage_export_sink sink, void *data, ASImageExportParams *params )
+{
+	return False;
+}
+
 
 #endif 			/* PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG */
 /***********************************************************************************/
@@ -733,16 +1085,49 @@ ASImage2PNGBuff( ASImage *im, CARD8 **buffer, int *size, ASImageExportParams *pa
 
 /***********************************************************************************/
 #ifdef HAVE_JPEG     /* JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG */
-Bool
-ASImage2jpeg( ASImage *im, const char *path,  ASImageExportParams *params )
+/* libjpeg destination writing into export sink's chunk directly : */
+typedef struct ASJpegSinkDest
+{
+	struct jpeg_destination_mgr pub ;
+	ASExportSink *sink ;
+}ASJpegSinkDest;
+
+static void
+asim_jpeg_init_sink( j_compress_ptr cinfo )
+{
+	ASJpegSinkDest *dest = (ASJpegSinkDest*)cinfo->dest ;
+	dest->pub.next_output_byte = dest->sink->chunk ;
+	dest->pub.free_in_buffer = ASIMAGE_EXPORT_CHUNK_SIZE ;
+}
+
+static boolean
+asim_jpeg_empty_sink( j_compress_ptr cinfo )
+{
+	ASJpegSinkDest *dest = (ASJpegSinkDest*)cinfo->dest ;
+	emit_export_chunk( dest->sink, dest->sink->chunk, ASIMAGE_EXPORT_CHUNK_SIZE );
+	dest->pub.next_output_byte = dest->sink->chunk ;
+	dest->pub.free_in_buffer = ASIMAGE_EXPORT_CHUNK_SIZE ;
+	return TRUE;
+}
+
+static void
+asim_jpeg_term_sink( j_compress_ptr cinfo )
+{
+	ASJpegSinkDest *dest = (ASJpegSinkDest*)cinfo->dest ;
+	dest->sink->used = ASIMAGE_EXPORT_CHUNK_SIZE - dest->pub.free_in_buffer ;
+}
+
+/* writes either into outfile or into sink : */
+static Bool
+ASImage2jpeg_int( ASImage *im, FILE *outfile, ASExportSink *sink, ASImageExportParams *params )
 {
 	/* This struct contains the JPEG decompression parameters and pointers to
 	 * working space (which is allocated as needed by the JPEG library).
 	 */
 	struct jpeg_compress_struct cinfo;
 	struct jpeg_error_mgr jerr;
+	ASJpegSinkDest sink_dest ;
 	/* More stuff */
-	FILE 		 *outfile;		/* target file */
     JSAMPROW      row_pointer[1];/* pointer to JSAMPLE row[s] */
 	int 		  y;
 	static const ASJpegExportParams defaultsJpeg = { ASIT_Jpeg, 0, -1 };
@@ -752,25 +1137,17 @@ ASImage2jpeg( ASImage *im, const char *path,  ASImageExportParams *params )
 	CARD32 *r, *g, *b ;
 	START_TIME(started);
 
-	if( im == NULL )
-		return False;
-
 	if( params == NULL ) {
            defaults.type = defaultsJpeg.type;
            defaults.jpeg = defaultsJpeg;
            params = &defaults ;
         }
 
-	if ((outfile = open_writeable_image_file( path )) == NULL)
-		return False;
-
 	if((imdec = start_image_decoding( NULL /* default visual */ , im,
 		                              (SCL_DO_GREEN|SCL_DO_BLUE|SCL_DO_RED),
 									  0, 0, im->width, 0, NULL)) == NULL )
 	{
 		LOCAL_DEBUG_OUT( "failed to start image decoding%s", "");
-		if (outfile != stdout)
-			fclose(outfile);
 		return False;
 	}
 
@@ -794,7 +1171,17 @@ ASImage2jpeg( ASImage *im, const char *path,  ASImageExportParams *params )
 	* VERY IMPORTANT: use "b" option to fopen() if you are on a machine that
 	* requires it in order to write binary files.
 	*/
-	jpeg_stdio_dest(&cinfo, outfile);
+	if( sink == NULL )
+		jpeg_stdio_dest(&cinfo, outfile);
+	else
+	{	/* or directly into sink's chunks to avoid extra copy : */
+		memset( &sink_dest, 0x00, sizeof(sink_dest));
+		sink_dest.pub.init_destination = asim_jpeg_init_sink ;
+		sink_dest.pub.empty_output_buffer = asim_jpeg_empty_sink ;
+		sink_dest.pub.term_destination = asim_jpeg_term_sink ;
+		sink_dest.sink = sink ;
+		cinfo.dest = &sink_dest.pub ;
+	}
 
 	/* Step 3: set parameters for compression */
 	cinfo.image_width  = im->width; 	/* image width and height, in pixels */
@@ -828,10 +1215,10 @@ ASImage2jpeg( ASImage *im, const char *path,  ASImageExportParams *params )
 		row_pointer[0] = safemalloc( im->width );
 		for (y = 0; y < (int)im->height; y++)
 		{
-			register int i = im->width;
+			register int i ;
 			CARD8   *ptr = (CARD8*)row_pointer[0];
 			imdec->decode_image_scanline( imdec );
-			while( --i >= 0 ) /* normalized graylevel computing :  */
+			for( i = 0 ; i < (int)im->width ; ++i ) /* normalized graylevel computing :  */
 				ptr[i] = (54*r[i]+183*g[i]+19*b[i])/256 ;
 			(void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
 		}
@@ -840,18 +1227,10 @@ ASImage2jpeg( ASImage *im, const char *path,  ASImageExportParams *params )
 		row_pointer[0] = safemalloc( im->width * 3 );
 		for (y = 0; y < (int)im->height; y++)
 		{
-			register int i = (int)im->width;
-			CARD8   *ptr = (CARD8*)(row_pointer[0]+(i-1)*3) ;
 LOCAL_DEBUG_OUT( "decoding  row %d", y );
 			imdec->decode_image_scanline( imdec );
 LOCAL_DEBUG_OUT( "building  row %d", y );
-			while( --i >= 0 )
-			{
-				ptr[0] = r[i] ;
-				ptr[1] = g[i] ;
-				ptr[2] = b[i] ;
-				ptr-=3;
-			}
+			pack_rgb_row( (CARD8*)row_pointer[0], r, g, b, NULL, im->width );
 LOCAL_DEBUG_OUT( "writing  row %d", y );
 			(void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
 		}
@@ -866,13 +1245,44 @@ LOCAL_DEBUG_OUT( "done writing image%s","" );
 	free( row_pointer[0] );
 	
 	stop_image_decoding( &imdec );
-	if (outfile != stdout)
-		fclose(outfile);
 
 	SHOW_TIME("image export",started);
-	LOCAL_DEBUG_OUT("done writing JPEG image \"%s\"", path);
 	return True ;
 }
+
+Bool
+ASImage2jpeg( ASImage *im, const char *path,  ASImageExportParams *params )
+{
+	FILE *outfile;
+	Bool res ;
+
+	if( im == NULL )
+		return False;
+
+	if ((outfile = open_writeable_image_file( path )) == NULL)
+		return False;
+
+	res = ASImage2jpeg_int( im, outfile, NULL, params );
+
+	if (outfile != stdout)
+		fclose(outfile);
+	LOCAL_DEBUG_OUT("done writing JPEG image \"%s\"", path);
+	return res;
+}
+
+Bool
+ASImage2JPEGStream( ASImage *im, asimage_export_sink sink, void *data, ASImageExportParams *params )
+{
+	ASExportSink int_sink ;
+	Bool res ;
+
+	if( im == NULL || sink == NULL )
+		return False;
+
+	init_export_sink( &int_sink, sink, data );
+	res = ASImage2jpeg_int( im, NULL, &int_sink, params );
+	return finish_export_sink( &int_sink ) && res ;
+}
 #else 			/* JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG */
 
 Bool
@@ -882,6 +1292,12 @@ ASImage2jpeg( ASImage *im, const char *path,  ASImageExportParams *params )
 	return False;
 }
 
+Bool
+ASImage2JPEGStream( ASImage *im, asimage_export_sink sink, void *data, ASImageExportParams *params )
+{
+	return False;
+}
+
 #endif 			/* JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG */
 /***********************************************************************************/
 
@@ -968,7 +1384,8 @@ Bool ASImage2gif( ASImage *im, const char *path,  ASImageExportParams *params )
            params = &defaults ;
         }
 
-	mapped_im = colormap_asimage( im, &cmap, 255, params->gif.dither, params->gif.opaque_threshold );
+	mapped_im = colormap_asimage_ext( im, &cmap, 255, params->gif.dither, params->gif.opaque_threshold,
+	                                  get_flags( params->gif.flags, EXPORT_MEDIAN_CUT )?ASCMAP_MEDIAN_CUT:0 );
 
 	if( get_flags( params->gif.flags, EXPORT_ALPHA) &&
 		get_flags( get_asimage_chanmask(im), SCL_DO_ALPHA) )
@@ -1287,3 +1704,106 @@ ASImage2tiff( ASImage *im, const char *path, ASImageExportParams *params )
 	return False ;
 }
 #endif			/* TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF */
+
+/***********************************************************************************/
+/* ASIM - our own native format : lines are written out exactly as they are kept   */
+/* in ASStorage, so that they could be mmapped and used in place when loaded.      */
+Bool
+ASImage2asim( ASImage *im, const char *path, ASImageExportParams *params )
+{
+	static ASAsimExportParams defaults = { ASIT_ASImage, 0, NULL, 0, 0, 0., 0, 0 };
+	ASAsimExportParams *p = params? &(params->asim) : &defaults ;
+	ASImFileHeader hdr ;
+	ASStorageSlot slot ;
+	CARD32 *index ;
+	CARD8 *data = NULL ;
+	size_t path_len, index_size ;
+	unsigned int offset, max_size = 0 ;
+	int chan, y, k = 0 ;
+	FILE *outfile ;
+	Bool success ;
+	static const CARD8 pad[ASStorageSlot_SIZE] = {0} ;
+	START_TIME(started);
+
+	if( im == NULL )
+		return False;
+	path_len = (p->src_path != NULL)? strlen(p->src_path) : 0 ;
+	index_size = IC_NUM_CHANNELS*im->height*sizeof(CARD32) ;
+
+	memset( &hdr, 0x00, sizeof(hdr) );
+	hdr.magic = ASIM_FILE_MAGIC ;
+	hdr.version = ASIM_FILE_VERSION ;
+	hdr.byte_order = ASIM_FILE_BYTE_ORDER ;
+	hdr.width = im->width ;
+	hdr.height = im->height ;
+	hdr.back_color = im->back_color ;
+	hdr.anim_delay = p->anim_delay ;
+	hdr.anim_repeats = p->anim_repeats ;
+	hdr.path_len = path_len ;
+	hdr.src_mtime_lo = (CARD32)p->src_mtime ;
+	hdr.src_mtime_hi = (CARD32)(((CARD64)p->src_mtime)>>32) ;
+	hdr.src_size_lo = (CARD32)p->src_size ;
+	hdr.src_size_hi = (CARD32)(((CARD64)p->src_size)>>32) ;
+	hdr.src_gamma = (CARD32)(p->src_gamma*1000.) ;
+	hdr.index_offset = sizeof(hdr) + ASIM_PADDED_PATH_LEN(path_len) ;
+	hdr.slots_offset = (hdr.index_offset + index_size + ASStorageSlot_SIZE-1)&~(ASStorageSlot_SIZE-1) ;
+
+	/* first pass - layout of the slots : */
+	index = safecalloc( IC_NUM_CHANNELS*im->height, sizeof(CARD32) );
+	offset = hdr.slots_offset ;
+	for( chan = 0 ; chan < IC_NUM_CHANNELS ; ++chan )
+		for( y = 0 ; y < (int)im->height ; ++y )
+			if( im->channels[chan][y] != 0 && query_storage_slot( NULL, im->channels[chan][y], &slot ) )
+			{
+				index[chan*im->height+y] = offset ;
+				offset += ASStorageSlot_FULL_SIZE(&slot) ;
+				if( slot.size > max_size )
+					max_size = slot.size ;
+				set_flags( hdr.channels, 0x01<<chan );
+				++(hdr.slots_count);
+			}
+	hdr.slots_size = offset - hdr.slots_offset ;
+
+	if ((outfile = open_writeable_image_file( path )) == NULL)
+	{
+		free( index );
+		return False;
+	}
+	success = ( fwrite( &hdr, sizeof(hdr), 1, outfile ) == 1 &&
+				fwrite( p->src_path, 1, path_len, outfile ) == path_len &&
+				fwrite( pad, 1, ASIM_PADDED_PATH_LEN(path_len)-path_len, outfile ) == ASIM_PADDED_PATH_LEN(path_len)-path_len &&
+				fwrite( index, 1, index_size, outfile ) == index_size &&
+				fwrite( pad, 1, hdr.slots_offset-(hdr.index_offset+index_size), outfile ) == hdr.slots_offset-(hdr.index_offset+index_size) );
+
+	/* second pass - slots themselves, with only headers adjusted : */
+	data = safemalloc( max_size+1 );
+	for( chan = 0 ; chan < IC_NUM_CHANNELS && success ; ++chan )
+		for( y = 0 ; y < (int)im->height && success ; ++y )
+			if( index[chan*im->height+y] != 0 )
+			{
+				int padding ;
+				if( !query_storage_slot_data( NULL, im->channels[chan][y], &slot, data, max_size ) )
+				{
+					success = False ;
+					break;
+				}
+				slot.ref_count = 0 ;
+				slot.index = k%AS_STORAGE_MAPPED_SLOTS_MAX ;
+				slot.reserved = 0 ;
+				padding = ASStorageSlot_USABLE_SIZE(&slot) - slot.size ;
+				success = ( fwrite( &slot, ASStorageSlot_SIZE, 1, outfile ) == 1 &&
+							fwrite( data, 1, slot.size, outfile ) == slot.size &&
+							fwrite( pad, 1, padding, outfile ) == padding );
+				++k ;
+			}
+	free( data );
+	free( index );
+	if( outfile != stdout )
+	{
+		if( fclose( outfile ) != 0 )
+			success = False ;
+	}else
+		fflush( outfile );
+	SHOW_TIME("image export",started);
+	return success;
+}
@@ -14,6 +14,7 @@ extern "C" {
  *          ASPngExportParams
  *          ASJpegExportParams
  *          ASGifExportParams
+ *          ASAsimExportParams
  *          ASImageExportParams
  *
  * Functions :
@@ -34,6 +35,9 @@ extern "C" {
  * NAME
  * EXPORT_APPEND - if format allows multiple images - image will be 
  * appended
+ * NAME
+ * EXPORT_MEDIAN_CUT - use median cut quantization for formats with
+ * colormaps (XPM and GIF) - see colormap_asimage_ext().
  * FUNCTION
  * Some common flags that could be used while writing images into
  * different file formats.
@@ -43,6 +47,7 @@ extern "C" {
 #define EXPORT_ALPHA				(0x01<<1)
 #define EXPORT_APPEND				(0x01<<3)  /* adds subimage  */
 #define EXPORT_ANIMATION_REPEATS	(0x01<<4)  /* number of loops to repeat GIF animation */
+#define EXPORT_MEDIAN_CUT			(0x01<<5)
 /*****/
 
 /****s* libAfterImage/ASXpmExportParams
@@ -62,6 +67,12 @@ typedef struct
 /****s* libAfterImage/ASPngExportParams
  * NAME
  * ASPngExportParams - parameters for export into PNG file.
+ * DESCRIPTION
+ * compression of 0 to 99 selects zlib level of compression/10, negative
+ * value - zlib default. strategy is passed to zlib as is, and could be
+ * Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE, Z_FIXED, or 0 for
+ * Z_DEFAULT_STRATEGY. Any other value is treated as 0 - still, it is
+ * best to memset() params to 0 before setting any of the fields.
  * SOURCE
  */
 typedef struct
@@ -69,6 +80,7 @@ typedef struct
 	ASImageFileTypes type;
 	ASFlagType flags ;
 	int compression ;
+	int strategy ;
 }ASPngExportParams ;
 /*******/
 /****s* libAfterImage/ASJpegExportParams
@@ -122,6 +134,25 @@ typedef struct
 	int opaque_threshold ;
 }ASTiffExportParams ;
 /*******/
+/****s* libAfterImage/ASAsimExportParams
+ * NAME
+ * ASAsimExportParams - parameters for export into native ASIM file.
+ * DESCRIPTION
+ * Source file information is optional, and is used to validate cached
+ * copy of the image - see set_asimage_cache_dir().
+ * SOURCE
+ */
+typedef struct
+{
+	ASImageFileTypes type;
+	ASFlagType flags ;
+	const char *src_path ;
+	time_t src_mtime ;
+	off_t  src_size ;
+	double src_gamma ;
+	int anim_delay, anim_repeats ;
+}ASAsimExportParams ;
+/*******/
 /****s* libAfterImage/ASImageExportParams
  * NAME
  * ASImageExportParams - union of structures holding parameters for
@@ -140,6 +171,7 @@ typedef union ASImageExportParams
 	ASJpegExportParams jpeg;
 	ASGifExportParams  gif;
 	ASTiffExportParams tiff;
+	ASAsimExportParams asim;
 }ASImageExportParams;
 /******/
 
@@ -189,6 +221,43 @@ ASImage2PNGBuff( ASImage *im, CARD8 **buffer, int *size, ASImageExportParams *pa
 Bool
 ASImage2xpmRawBuff( ASImage *im, CARD8 **buffer, int *size, ASImageExportParams *params );
 
+/****f* libAfterImage/export/ASImage2PNGStream()
+ * NAME
+ * ASImage2PNGStream() - writes PNG image through the caller's sink.
+ * NAME
+ * ASImage2JPEGStream() - writes JPEG image through the caller's sink.
+ * SYNOPSIS
+ * typedef Bool (*asimage_export_sink)( void *data, const CARD8 *chunk,
+ *                                      size_t length );
+ * Bool ASImage2PNGStream( ASImage *im, asimage_export_sink sink,
+ *                         void *data, ASImageExportParams *params );
+ * Bool ASImage2JPEGStream( ASImage *im, asimage_export_sink sink,
+ *                          void *data, ASImageExportParams *params );
+ * INPUTS
+ * im			- Image to write out.
+ * sink         - function receiving encoded data. Should return False
+ *                to abort export.
+ * data         - pointer passed to sink as is.
+ * params       - same as for ASImage2file().
+ * RETURN VALUE
+ * True on success. False - failure, or if sink returned False.
+ * DESCRIPTION
+ * Encoded data is passed to sink in chunks of ASIMAGE_EXPORT_CHUNK_SIZE
+ * bytes, except for the last one, which could be shorter. Image is
+ * encoded line by line, so neither full size copy of pixels nor of the
+ * file is ever kept in memory.
+ * When set_asimage_threads() allows it, PNG image is split into groups
+ * of lines, deflated by several threads at once, and resulting streams
+ * are joined into one. Memory used for that is limited to one group of
+ * lines per thread. Such file is slightly bigger, but decodes into the
+ * same pixels.
+ *********/
+#define ASIMAGE_EXPORT_CHUNK_SIZE	(64*1024)
+typedef Bool (*asimage_export_sink)( void *data, const CARD8 *chunk, size_t length );
+
+Bool ASImage2PNGStream( ASImage *im, asimage_export_sink sink, void *data, ASImageExportParams *params );
+Bool ASImage2JPEGStream( ASImage *im, asimage_export_sink sink, void *data, ASImageExportParams *params );
+
 
 Bool ASImage2xpm ( ASImage *im, const char *path, ASImageExportParams *params );
 Bool ASImage2png ( ASImage *im, const char *path, ASImageExportParams *params );
@@ -199,6 +268,7 @@ Bool ASImage2bmp ( ASImage *im, const char *path, ASImageExportParams *params );
 Bool ASImage2ico ( ASImage *im, const char *path, ASImageExportParams *params );
 Bool ASImage2gif ( ASImage *im, const char *path, ASImageExportParams *params );
 Bool ASImage2tiff( ASImage *im, const char *path, ASImageExportParams *params );
+Bool ASImage2asim( ASImage *im, const char *path, ASImageExportParams *params );
 
 #ifdef __cplusplus
 }
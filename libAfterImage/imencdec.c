@@ -85,20 +85,26 @@ void encode_image_scanline_xim( ASImageOutput *imout, ASScanline *to_store );
 void encode_image_scanline_mask_xim( ASImageOutput *imout, ASScanline *to_store );
 void encode_image_scanline_argb32( ASImageOutput *imout, ASScanline *to_store );
 
+void encode_image_packed_scanline_asim( ASImageOutput *imout, ASPackedScanline *to_store );
+void encode_image_packed_scanline_xim( ASImageOutput *imout, ASPackedScanline *to_store );
+void encode_image_packed_scanline_argb32( ASImageOutput *imout, ASPackedScanline *to_store );
+void encode_image_packed_scanline_unpack( ASImageOutput *imout, ASPackedScanline *to_store );
+
 static struct ASImageFormatHandlers
 {
 	Bool (*check_create_asim_format)( ASVisual *asv, ASImage *im, ASAltImFormats format );
 	void (*encode_image_scanline)( ASImageOutput *imout, ASScanline *to_store );
+	void (*encode_image_packed_scanline)( ASImageOutput *imout, ASPackedScanline *to_store );
 }asimage_format_handlers[ASA_Formats] =
 {
-	{ NULL, encode_image_scanline_asim },
-	{ create_image_xim, encode_image_scanline_xim },
-	{ create_image_xim, encode_image_scanline_mask_xim },
-	{ create_image_xim, encode_image_scanline_xim },
-	{ create_image_xim, encode_image_scanline_mask_xim },
-	{ create_image_xim, encode_image_scanline_xim },
-	{ create_image_argb32, encode_image_scanline_argb32 },
-	{ NULL, NULL }                             /* vector of doubles */
+	{ NULL, encode_image_scanline_asim, encode_image_packed_scanline_asim },
+	{ create_image_xim, encode_image_scanline_xim, encode_image_packed_scanline_xim },
+	{ create_image_xim, encode_image_scanline_mask_xim, encode_image_packed_scanline_unpack },
+	{ create_image_xim, encode_image_scanline_xim, encode_image_packed_scanline_xim },
+	{ create_image_xim, encode_image_scanline_mask_xim, encode_image_packed_scanline_unpack },
+	{ create_image_xim, encode_image_scanline_xim, encode_image_packed_scanline_unpack },
+	{ create_image_argb32, encode_image_scanline_argb32, encode_image_packed_scanline_argb32 },
+	{ NULL, NULL, NULL }                       /* vector of doubles */
 };
 
 
@@ -526,6 +532,7 @@ start_image_output( ASVisual *asv, ASImage *im, ASAltImFormats format,
 
 	imout->out_format = format ;
 	imout->encode_image_scanline = asimage_format_handlers[format].encode_image_scanline;
+	imout->encode_image_packed_scanline = asimage_format_handlers[format].encode_image_packed_scanline;
 
 	prepare_scanline( im->width, 0, &(imout->buffer[0]), asv->BGR_mode);
 	prepare_scanline( im->width, 0, &(imout->buffer[1]), asv->BGR_mode);
@@ -929,6 +936,90 @@ decode_asscanline_ximage( ASImageDecoder *imdec, unsigned int skip, int y )
 	set_flags( scl->flags,imdec->filter);
 }
 
+/***********************************************************************/
+/* Packed decoding :                                                   */
+static inline void
+fill_argb32_lane( ARGB32 *argb, int chan, ARGB32 color, int start, int end )
+{
+	register CARD8 *lane = (CARD8*)argb ;
+	register CARD8 v = ARGB32_CHAN8(color,chan);
+	register int i ;
+#ifdef WORDS_BIGENDIAN
+	lane += 3-chan ;
+#else
+	lane += chan ;
+#endif
+	for( i = start ; i < end ; ++i )
+		lane[i<<2] = v ;
+}
+
+void
+decode_image_packed_scanline( ASImageDecoder *imdec, ASPackedScanline *scl )
+{
+	int y = imdec->next_line ;
+	ASImage *im = imdec->im ;
+	int width = MIN(scl->width, imdec->buffer.width);
+	ARGB32 *argb = scl->argb ;
+	register int i ;
+
+	if( imdec->decode_image_scanline != decode_image_scanline_normal ||
+		(imdec->decode_asscanline != decode_asscanline_native &&
+		 imdec->decode_asscanline != decode_asscanline_argb32) )
+	{/* bevels and XImages are only implemented for planar scanlines : */
+		imdec->decode_image_scanline( imdec );
+		pack_scanline( &(imdec->buffer), scl );
+		return;
+	}
+
+	scl->back_color = imdec->back_color ;
+	if( y - imdec->offset_y >= imdec->out_height )
+	{
+		for( i = 0 ; i < (int)scl->width ; ++i )
+			argb[i] = imdec->back_color ;
+		scl->flags = 0 ;
+		return ;
+	}
+	if( im == NULL )
+	{/* solid color : */
+		for( i = 0 ; i < (int)scl->width ; ++i )
+			argb[i] = imdec->back_color ;
+		scl->flags = SCL_DO_ALL ;
+		++(imdec->next_line);
+		return ;
+	}
+
+	y %= im->height;
+	if( imdec->decode_asscanline == decode_asscanline_argb32 )
+	{
+		ARGB32 *row = im->alt.argb32 + y*im->width ;
+		int x = imdec->offset_x, count ;
+		for( i = 0 ; i < width ; i += count )
+		{
+			count = MIN( width-i, (int)im->width - x );
+			memcpy( argb+i, row+x, count*sizeof(ARGB32) );
+			x = 0 ;
+		}
+		for( i = 0 ; i < IC_NUM_CHANNELS ; ++i )
+			if( !get_flags( imdec->filter, 0x01<<i ) )
+				fill_argb32_lane( argb, i, imdec->back_color, 0, width );
+	}else
+	{
+		for( i = 0 ; i < IC_NUM_CHANNELS ; ++i )
+		{
+			int count = 0 ;
+			if( get_flags( imdec->filter, 0x01<<i ) )
+				count = fetch_data_interleaved( NULL, im->channels[i][y], argb, i<<3,
+												imdec->offset_x, width, 0, NULL);
+			if( count < width )
+				fill_argb32_lane( argb, i, imdec->back_color, count, width );
+		}
+	}
+	for( i = width ; i < (int)scl->width ; ++i )
+		argb[i] = imdec->back_color ;
+	scl->flags = SCL_DO_ALL ;
+	++(imdec->next_line);
+}
+
 /***********************************************************************/
 /* High level drivers :                                                */
 void                                           /* normal (unbeveled) */
@@ -1464,6 +1555,105 @@ encode_image_scanline_argb32( ASImageOutput *imout, ASScanline *to_store )
 	}
 }
 
+/* packed encoders : */
+static inline void
+tile_asim_line( ASImageOutput *imout, int line )
+{
+	int range = (imout->tiling_range ? imout->tiling_range:imout->im->height);
+	int max_i = MIN((int)imout->im->height,line+range), min_i = MAX(0,line-range) ;
+	int step =  imout->bottom_to_top*imout->tiling_step;
+	register int i, color ;
+
+	for( color = 0 ; color < IC_NUM_CHANNELS ; color++ )
+		for( i = line+step ; i < max_i && i >= min_i ; i+=step )
+			asimage_dup_line( imout->im, color, line, i, imout->im->width );
+}
+
+void
+encode_image_packed_scanline_asim( ASImageOutput *imout, ASPackedScanline *to_store )
+{
+	if( to_store->width < imout->im->width )
+	{
+		encode_image_packed_scanline_unpack( imout, to_store );
+		return;
+	}
+	if( imout->next_line < (int)imout->im->height && imout->next_line >= 0 )
+	{
+		asimage_add_line_bgra( imout->im, to_store->argb, imout->next_line );
+		if( imout->tiling_step > 0 )
+			tile_asim_line( imout, imout->next_line );
+	}
+	imout->next_line += imout->bottom_to_top;
+}
+
+void
+encode_image_packed_scanline_xim( ASImageOutput *imout, ASPackedScanline *to_store )
+{
+#ifndef X_DISPLAY_MISSING
+	register XImage *xim = imout->im->alt.ximage ;
+	if( xim->bits_per_pixel != 32 || (xim->depth != 24 && xim->depth != 32) ||
+		to_store->width < (unsigned int)xim->width )
+	{/* only pixel layout of scanline2ximage32() is supported : */
+		encode_image_packed_scanline_unpack( imout, to_store );
+		return;
+	}
+	if( imout->next_line < xim->height && imout->next_line >= 0 )
+	{
+		argb32_line2ximage32( imout->asv, (CARD32*)(xim->data+imout->next_line*xim->bytes_per_line),
+		                      to_store->argb, xim->width );
+		if( imout->tiling_step > 0 )
+			tile_ximage_line( xim, imout->next_line,
+			                  imout->bottom_to_top*imout->tiling_step,
+							  (imout->tiling_range ? imout->tiling_range:imout->im->height) );
+		imout->next_line += imout->bottom_to_top;
+	}
+#endif
+}
+
+void
+encode_image_packed_scanline_argb32( ASImageOutput *imout, ASPackedScanline *to_store )
+{
+	register ARGB32 *data = imout->im->alt.argb32 ;
+	if( imout->next_line < (int)imout->im->height && imout->next_line >= 0 )
+	{
+		int width = imout->im->width ;
+		register int x = MIN(width,(int)to_store->width);
+
+		data += width*imout->next_line ;
+		memcpy( data, to_store->argb, x*sizeof(ARGB32) );
+		for( ; x < width ; ++x )
+			data[x] = to_store->back_color ;
+
+		if( imout->tiling_step > 0 )
+			tile_argb32_line( imout->im->alt.argb32, imout->next_line,
+			                  imout->bottom_to_top*imout->tiling_step,
+							  imout->im->width, imout->im->height,
+							  (imout->tiling_range ? imout->tiling_range:imout->im->height));
+		imout->next_line += imout->bottom_to_top;
+	}
+}
+
+/* everything else is done via planar encoder : */
+void
+encode_image_packed_scanline_unpack( ASImageOutput *imout, ASPackedScanline *to_store )
+{
+	unpack_scanline( to_store, imout->available );
+	imout->encode_image_scanline( imout, imout->available );
+}
+
+void
+output_image_packed_scanline( ASImageOutput *imout, ASPackedScanline *to_store )
+{
+	if( imout == NULL || to_store == NULL )
+		return;
+	if( to_store->flags == 0 )
+	{/* that way ASImage lines gets erased or filled the usual way : */
+		imout->available->flags = 0 ;
+		imout->available->back_color = to_store->back_color ;
+		imout->encode_image_scanline( imout, imout->available );
+	}else
+		imout->encode_image_packed_scanline( imout, to_store );
+}
 
 void
 output_image_line_top( ASImageOutput *imout, ASScanline *new_line, int ratio )
@@ -35,11 +35,12 @@ extern "C" {
  *   Decoding
  *          start_image_decoding(), stop_image_decoding(),
  *          asimage_decode_line (), set_decoder_shift(),
- *          set_decoder_back_color()
+ *          set_decoder_back_color(), decode_image_packed_scanline()
  *
  *   Output :
  *          start_image_output(), set_image_output_back_color(),
- *          toggle_image_output_direction(), stop_image_output()
+ *          toggle_image_output_direction(), stop_image_output(),
+ *          output_image_packed_scanline()
  *
  * Other libAfterImage modules :
  *          ascmap.h asfont.h asimage.h asvisual.h blender.h export.h
@@ -261,6 +262,8 @@ typedef void (*encode_image_scanline_func)( struct ASImageOutput *imout,
 											struct ASScanline *to_store );
 typedef void (*output_image_scanline_func)( struct ASImageOutput *,
 											struct ASScanline *, int );
+typedef void (*encode_image_packed_scanline_func)( struct ASImageOutput *imout,
+											struct ASPackedScanline *to_store );
 
 typedef struct ASImageOutput
 {
@@ -291,6 +294,8 @@ typedef struct ASImageOutput
 	encode_image_scanline_func
 		encode_image_scanline ;  /* low level interface - 
 								  * encoding only */
+	encode_image_packed_scanline_func
+		encode_image_packed_scanline ;  /* same for ASPackedScanline */
 
 	/* internal data members : */
 	struct ASScanline 		 buffer[2], *used, *available;
@@ -418,6 +423,27 @@ void set_decoder_shift( ASImageDecoder *imdec, int shift );
 void set_decoder_back_color( ASImageDecoder *imdec, ARGB32 back_color );
 void stop_image_decoding( ASImageDecoder **pimdec );
 
+/****f* libAfterImage/asimage/decode_image_packed_scanline()
+ * NAME
+ * decode_image_packed_scanline() - decodes next scanline into packed
+ * ARGB32 format.
+ * SYNOPSIS
+ * void decode_image_packed_scanline( ASImageDecoder *imdec,
+ *                                    ASPackedScanline *scl );
+ * INPUTS
+ * imdec   - pointer to structure, previously created by
+ *           start_image_decoding.
+ * scl     - scanline to store decoded data in. Should be at least as
+ *           wide as imdec->buffer.
+ * DESCRIPTION
+ * Alternative to decode_image_scanline() method, that decodes next
+ * scanline of the image straight into ASPackedScanline, without going
+ * through planar buffer. Beveled and XImage backed images are still
+ * decoded into buffer first, and then packed. Decoder's shift is
+ * ignored, as packed data always has 8 bit per channel.
+ *******/
+void decode_image_packed_scanline( ASImageDecoder *imdec, struct ASPackedScanline *scl );
+
 /****f* libAfterImage/asimage/start_image_output()
  * NAME
  * start_image_output() - initializes output structure
@@ -496,6 +522,27 @@ void set_image_output_back_color( ASImageOutput *imout, ARGB32 back_color );
 void toggle_image_output_direction( ASImageOutput *imout );
 void stop_image_output( ASImageOutput **pimout );
 
+/****f* libAfterImage/asimage/output_image_packed_scanline()
+ * NAME
+ * output_image_packed_scanline() - writes out ASPackedScanline.
+ * SYNOPSIS
+ * void output_image_packed_scanline( ASImageOutput *imout,
+ *                                    ASPackedScanline *to_store );
+ * INPUTS
+ * imout    - ASImageOutput structure, previously created with
+ *            start_image_output();
+ * to_store - scanline to be written into next line of the image.
+ * DESCRIPTION
+ * Packed data does not need any quantization, so scanline is passed
+ * straight to the encoder, with tiling and direction of output
+ * handled same way as by output_image_scanline() method. ASImage,
+ * ARGB32 and 32bpp XImage outputs store packed data directly, other
+ * formats unpack it first. Empty scanlines are handled same as empty
+ * ASScanlines are. Should not be mixed with output_image_scanline() on
+ * the same ASImageOutput, unless shift of 0 was used to create it.
+ *********/
+void output_image_packed_scanline( ASImageOutput *imout, struct ASPackedScanline *to_store );
+
 #ifdef __cplusplus
 }
 #endif
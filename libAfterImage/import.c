@@ -81,6 +81,13 @@
 #endif
 #include <string.h>
 #include <ctype.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 /* <setjmp.h> is used for the optional error recovery mechanism */
 
 #ifdef const
@@ -114,6 +121,7 @@
 #endif
 
 #include "asimage.h"
+#include "asstorage.h"
 #include "imencdec.h"
 #include "scanline.h"
 #include "ximage.h"
@@ -121,6 +129,7 @@
 #include "xpm.h"
 #include "ungif.h"
 #include "import.h"
+#include "export.h"
 #include "asimagexml.h"
 #include "transform.h"
 
@@ -129,6 +138,12 @@
 /* High level interface : 														   */
 static char *locate_image_file( const char *file, char **paths );
 static ASImageFileTypes	check_image_type( const char *realfilename );
+static Bool is_asimage_cacheable( const char *realfilename, ASImageFileTypes file_type, ASImageImportParams *iparams, struct stat *src_st );
+/* decoded copy only pays off for images that are big or slow to decode : */
+#define ASIMAGE_CACHE_MIN_PIXELS		(256*256)
+#define ASIMAGE_CACHE_MIN_DECODE_MSEC	20
+static ASImage *load_asimage_from_cache( const char *realfilename, struct stat *src_st, ASImageImportParams *iparams );
+static Bool save_asimage_to_cache( const char *realfilename, struct stat *src_st, ASImageImportParams *iparams, ASImage *im );
 
 as_image_loader_func as_image_file_loaders[ASIT_Unknown] =
 {
@@ -151,7 +166,8 @@ as_image_loader_func as_image_file_loaders[ASIT_Unknown] =
 	tga2ASImage,
 	NULL,
 	NULL,
-	NULL
+	NULL,
+	asim2ASImage
 };
 
 const char *as_image_file_type_names[ASIT_Unknown+1] =
@@ -176,6 +192,7 @@ const char *as_image_file_type_names[ASIT_Unknown+1] =
 	"PCX",
 	"HTML",
 	"XML",
+	"libAfterImage native",
 	"Unknown"
 };
 
@@ -265,9 +282,28 @@ file2ASImage_extra( const char *file, ASImageImportParams *iparams )
 		else if( as_image_file_loaders[file_type] )
 		{
 			char *g_var = getenv( "SCREEN_GAMMA" );
+			struct stat src_st ;
+			Bool cacheable ;
 			if( g_var != NULL )
 				iparams->gamma = atof(g_var);
-			im = as_image_file_loaders[file_type](realfilename, iparams);
+			cacheable = is_asimage_cacheable( realfilename, file_type, iparams, &src_st );
+			if( cacheable )
+				im = load_asimage_from_cache( realfilename, &src_st, iparams );
+			if( im == NULL )
+			{
+				struct timeval start, end ;
+				if( cacheable )
+					gettimeofday( &start, NULL );
+				im = as_image_file_loaders[file_type](realfilename, iparams);
+				if( im != NULL && cacheable )
+				{
+					long msec ;
+					gettimeofday( &end, NULL );
+					msec = (end.tv_sec - start.tv_sec)*1000 + (end.tv_usec - start.tv_usec)/1000 ;
+					if( im->width*im->height >= ASIMAGE_CACHE_MIN_PIXELS || msec >= ASIMAGE_CACHE_MIN_DECODE_MSEC )
+						save_asimage_to_cache( realfilename, &src_st, iparams, im );
+				}
+			}
 		}else
 			show_error( "Support for the format of image file \"%s\" has not been implemented yet.", realfilename );
 		/* returned image must not be tracked by any ImageManager yet !!! */
@@ -287,6 +323,16 @@ file2ASImage_extra( const char *file, ASImageImportParams *iparams )
 			}
 		}
 
+		if( im != NULL )
+		{
+			struct stat st ;
+			if( stat( realfilename, &st ) == 0 )
+			{
+				im->src_mtime = st.st_mtime ;
+				im->src_size = st.st_size ;
+			}
+		}
+
 #ifndef NO_DEBUG_OUTPUT
 		if( im != NULL ) 
 			show_progress( "image loaded from \"%s\"", realfilename );
@@ -450,23 +496,66 @@ get_asimage_file_type( ASImageManager* imageman, const char *file )
 }
 
 
+Bool
+stat_image_file_in_path( const char *file, char **search_path, time_t *mtime, size_t *size )
+{
+	ASImageImportParams iparams ;
+	char *realfilename ;
+	struct stat st ;
+	Bool found = False ;
+
+	init_asimage_import_params( &iparams );
+	iparams.search_path = search_path ;
+	set_flags(iparams.flags, AS_IMPORT_IGNORE_IF_MISSING);
+	if (check_compressed_file_type (file))
+		set_flags(iparams.flags, AS_IMPORT_SKIP_COMPRESSED);
+	if( (realfilename = locate_image_file_in_path( file, &iparams )) != NULL )
+	{
+		if( (found = (stat( realfilename, &st ) == 0)) )
+		{
+			*mtime = st.st_mtime ;
+			*size = st.st_size ;
+		}
+		free( realfilename );
+	}
+	return found;
+}
+
+/* True if file image was loaded from has been changed or removed since : */
+static Bool
+asimage_source_changed( ASImage *im, char **search_path )
+{
+	time_t mtime ;
+	size_t size ;
+	if( !stat_image_file_in_path( im->name, search_path, &mtime, &size ) )
+		return True;
+	return ( mtime != im->src_mtime || size != im->src_size );
+}
+
 static ASImage *
 get_asimage_int( ASImageManager* imageman, const char *file, ASFlagType what, unsigned int compression, int quiet, int path)
 {
 	ASImage *im = NULL ;
 	if( imageman && file )
+	{
+		char *tmp_search_path[MAX_SEARCH_PATHS+1];
+		char **search_path = &(imageman->search_path[0]);
+		if (path >= 0 && path < MAX_SEARCH_PATHS)
+		{
+			int i;
+			for (i = 1 ; i < MAX_SEARCH_PATHS+1 ; ++i)
+				tmp_search_path[i] = NULL;
+			tmp_search_path[0] = imageman->search_path[path];
+			search_path = &(tmp_search_path[0]);
+		}
+		/* unreferenced image kept in cache may be out of date : */
+		if( (im = query_asimage( imageman, file )) != NULL && im->ref_count <= 0 &&
+			get_flags( im->flags, ASIM_NAME_IS_FILENAME ) && asimage_source_changed( im, search_path ) )
+			remove_hash_item( imageman->image_hash, AS_HASHABLE((char*)file), NULL, True );
+
 		if( (im = fetch_asimage(imageman, file )) == NULL )
 		{
-			if (path < 0 || path >=MAX_SEARCH_PATHS)
-				im = load_image_from_path( file, &(imageman->search_path[0]), imageman->gamma, quiet);
-			else {
-				char *tmp_search_path[MAX_SEARCH_PATHS+1];				
-				int i;
-				for (i = 1 ; i < MAX_SEARCH_PATHS+1 ; ++i)
-					tmp_search_path[i] = NULL;
-				tmp_search_path[0] = imageman->search_path[path];
-				im = load_image_from_path( file, &(tmp_search_path[0]), imageman->gamma, quiet);
-			}
+			im = load_image_from_path( file, search_path, imageman->gamma, quiet);
 			
 			if( im )
 			{
@@ -475,6 +564,7 @@ get_asimage_int( ASImageManager* imageman, const char *file, ASFlagType what, un
 			}
 				
 		}
+	}
 	return im;
 }
 
@@ -505,6 +595,36 @@ calculate_proportions( int src_w, int src_h, int *pdst_w, int *pdst_h )
 	if( pdst_h ) *pdst_h = dst_h ; 
 }
 
+/*************************************************************************/
+/* Persistent thumbnail cache :                                          */
+/*************************************************************************/
+/* Thumbnails are stored in the cache directory as <hash>-<W>x<H>-<flags>.astn
+ * files, where hash is computed from the full path of the source image, and
+ * WxH and flags are those requested (actuall thumbnail could be smaller if
+ * proportional). Files are header, source path and rows of ARGB32 pixels,
+ * so they can be mmapped and fed into ASImage without any decoding.
+ * Thumbnail is valid only while source file's mtime and size are the same.
+ * Files are written into temporary file first and then renamed in place,
+ * so concurrent readers never see partially written thumbnail. */
+#define AS_THUMBNAIL_MAGIC		0x4E545341	/* "ASTN" in native byte order */
+#define AS_THUMBNAIL_VERSION	1
+
+typedef struct ASThumbnailHeader
+{
+	CARD32 magic ;
+	CARD32 version ;
+	CARD32 width, height ;
+	CARD32 path_len ;			/* source path follows header, padded to 4 bytes */
+	CARD32 back_color ;
+	CARD32 src_mtime_lo, src_mtime_hi ;
+	CARD32 src_size_lo, src_size_hi ;
+	CARD32 reserved[2] ;
+}ASThumbnailHeader;
+
+#define AS_THUMBNAIL_PADDED_PATH_LEN(len)	(((len)+4)&0xFFFFFFFC)
+/* distinguishes get_asimage_list() previews from get_thumbnail_asimage() ones : */
+#define AS_THUMBNAIL_LIST_PREVIEW			(0x01U<<31)
+
 static char* thumbnail_dir = NULL;
 /* exported */ void set_asimage_thumbnails_cache_dir(const char* p_thumbnail_dir)
 {
@@ -533,44 +653,217 @@ static char* get_thumbnail_dir()
 	return thumbnail_dir;
 }
 
-static char* get_thumbnail_image_path(const char * file, ASImageImportParams *iparams, int * need_save)
+/* two independent 32-bit FNV-1a style hashes of the path - full path is 
+ * stored in the file and checked anyway : */
+char *
+make_cache_file_name( const char *cache_dir, const char *src_path, const char *suffix )
+{
+	CARD32 h1 = 0x811C9DC5, h2 = 0x01000193 ;
+	const unsigned char *ptr = (const unsigned char*)src_path ;
+	char *filename ;
+
+	for( ; *ptr ; ++ptr )
+	{
+		h1 = (h1 ^ *ptr) * 0x01000193 ;
+		h2 = (h2 ^ *ptr) * 0x0100019B ;
+	}
+	filename = safemalloc( strlen(cache_dir)+1+16+strlen(suffix)+1 );
+	sprintf( filename, "%s/%8.8lx%8.8lx%s", cache_dir, (unsigned long)h1, (unsigned long)h2, suffix );
+	return filename;
+}
+
+Bool
+write_cache_file( const char *filename, write_cache_file_func write_func, void *data )
+{
+	char *tmpname = safemalloc( strlen(filename)+32 );
+	Bool success ;
+
+	/* other processes may be reading the old one, or writing their own : */
+	sprintf( tmpname, "%s.%d.tmp", filename, (int)getpid() );
+	success = write_func( tmpname, data );
+	if( success )
+		success = ( rename( tmpname, filename ) == 0 );
+	if( !success )
+		unlink( tmpname );
+	free( tmpname );
+	return success;
+}
+
+static char *
+make_thumbnail_cache_filename( const char *realfilename, int width, int height, ASFlagType flags )
 {
 	char *th_dir = get_thumbnail_dir();
-	*need_save = 0;
-	if (!th_dir || !*th_dir)
-		return NULL;
+	char suffix[48] ;
 
-	static char result[2048];
-	char * realfilename = locate_image_file_in_path( file, iparams );
-	if (!realfilename)
+	if( th_dir == NULL || th_dir[0] == '\0' || realfilename == NULL )
 		return NULL;
+	sprintf( suffix, "-%dx%d-%lx.astn", width, height, (unsigned long)flags );
+	return make_cache_file_name( th_dir, realfilename, suffix );
+}
 
-	struct stat rbuf;
-	if (stat(realfilename, &rbuf) == -1)
+static ASImage *
+load_thumbnail_from_cache_int( const char *realfilename, time_t src_mtime, off_t src_size,
+                               int width, int height, ASFlagType flags, unsigned int compression )
+{
+	char *filename = make_thumbnail_cache_filename( realfilename, width, height, flags );
+	ASImage *im = NULL ;
+	ASThumbnailHeader *hdr ;
+	struct stat st ;
+	CARD8 *data = NULL ;
+	size_t path_len = realfilename? strlen(realfilename) : 0 ;
+	int fd ;
+
+	if( filename == NULL )
+		return NULL;
+	fd = open( filename, O_RDONLY );
+	free( filename );
+	if( fd < 0 )
+		return NULL;
+	if( fstat( fd, &st ) == 0 && st.st_size >= (off_t)sizeof(ASThumbnailHeader) )
 	{
-		DEBUG_OUT("image file %s does not exist", realfilename);
+#ifdef HAVE_SYS_MMAN_H
+		data = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+		if( data == MAP_FAILED )
+			data = NULL ;
+#else
+		if( (data = malloc( st.st_size )) != NULL )
+			if( read( fd, data, st.st_size ) != st.st_size )
+			{
+				free( data );
+				data = NULL ;
+			}
+#endif
+	}
+	close( fd );
+	if( data == NULL )
 		return NULL;
+
+	hdr = (ASThumbnailHeader*)data ;
+	if( hdr->magic == AS_THUMBNAIL_MAGIC && hdr->version == AS_THUMBNAIL_VERSION &&
+		hdr->width > 0 && hdr->width <= MAX_IMPORT_IMAGE_SIZE &&
+		hdr->height > 0 && hdr->height <= MAX_IMPORT_IMAGE_SIZE &&
+		hdr->path_len == path_len &&
+		hdr->src_mtime_lo == (CARD32)src_mtime && hdr->src_mtime_hi == (CARD32)(((CARD64)src_mtime)>>32) &&
+		hdr->src_size_lo == (CARD32)src_size && hdr->src_size_hi == (CARD32)(((CARD64)src_size)>>32) &&
+		(off_t)(sizeof(ASThumbnailHeader) + AS_THUMBNAIL_PADDED_PATH_LEN(path_len) + hdr->width*hdr->height*sizeof(ARGB32)) == st.st_size &&
+		memcmp( data+sizeof(ASThumbnailHeader), realfilename, path_len ) == 0 )
+	{
+		CARD32 *row = (CARD32*)(data + sizeof(ASThumbnailHeader) + AS_THUMBNAIL_PADDED_PATH_LEN(path_len));
+		unsigned int y ;
+		im = create_asimage( hdr->width, hdr->height, compression );
+		im->back_color = hdr->back_color ;
+		for( y = 0 ; y < hdr->height ; ++y, row += hdr->width )
+			asimage_add_line_bgra( im, row, y );
+		LOCAL_DEBUG_OUT( "thumbnail of \"%s\" %dx%d loaded from cache", realfilename, hdr->width, hdr->height );
 	}
+#ifdef HAVE_SYS_MMAN_H
+	munmap( data, st.st_size );
+#else
+	free( data );
+#endif
+	return im;
+}
+
+typedef struct ASThumbnailWriteData
+{
+	ASThumbnailHeader *hdr ;
+	const char *realfilename ;
+	ASImage *im ;
+}ASThumbnailWriteData;
 
-	if (snprintf(result, sizeof(result), "%s/%s-%dx%d.png", th_dir, realfilename,
-							    iparams->height, iparams->width) >= sizeof(result))
+static Bool
+write_thumbnail_file( const char *tmpname, void *data )
+{
+	ASThumbnailWriteData *wd = (ASThumbnailWriteData*)data ;
+	ASImage *im = wd->im ;
+	size_t path_len = wd->hdr->path_len ;
+	ASImageDecoder *imdec ;
+	ARGB32 *row ;
+	FILE *fp ;
+	Bool success = False ;
+	unsigned int x, y ;
+
+	if( (fp = fopen( tmpname, "wb" )) != NULL )
 	{
-		DEBUG_OUT("thumbnail path too long for file %s", file);
-		return NULL;
+		static const char pad[4] = {0, 0, 0, 0};
+		success = ( fwrite( wd->hdr, sizeof(ASThumbnailHeader), 1, fp ) == 1 &&
+		            fwrite( wd->realfilename, 1, path_len, fp ) == path_len &&
+		            fwrite( pad, 1, AS_THUMBNAIL_PADDED_PATH_LEN(path_len)-path_len, fp ) == AS_THUMBNAIL_PADDED_PATH_LEN(path_len)-path_len );
+		if( success &&
+			(imdec = start_image_decoding( NULL, im, SCL_DO_ALL, 0, 0, im->width, 0, NULL)) != NULL )
+		{
+			row = safemalloc( im->width*sizeof(ARGB32) );
+			for( y = 0 ; y < im->height && success ; ++y )
+			{
+				ASScanline *buf = &(imdec->buffer);
+				imdec->decode_image_scanline( imdec );
+				for( x = 0 ; x < im->width ; ++x )
+					row[x] = MAKE_ARGB32( buf->alpha[x], buf->red[x], buf->green[x], buf->blue[x] );
+				success = ( fwrite( row, sizeof(ARGB32), im->width, fp ) == im->width );
+			}
+			free( row );
+			stop_image_decoding( &imdec );
+		}else
+			success = False ;
+		if( fclose( fp ) != 0 )
+			success = False ;
 	}
+	return success;
+}
 
-	char *tmp;
-	for(tmp = result + strlen(th_dir) + 1; *tmp; ++tmp)
-		if (*tmp == '/') *tmp = '_';
+static Bool
+save_thumbnail_to_cache_int( const char *realfilename, time_t src_mtime, off_t src_size,
+                             int width, int height, ASFlagType flags, ASImage *im )
+{
+	char *filename = make_thumbnail_cache_filename( realfilename, width, height, flags );
+	ASThumbnailHeader hdr ;
+	ASThumbnailWriteData wd ;
+	Bool success ;
 
-	struct stat thbuf;
-	if (stat(result, &thbuf) == -1)
-		thbuf.st_ctime = 0;
+	if( filename == NULL || im == NULL )
+	{
+		if( filename )
+			free( filename );
+		return False;
+	}
+	memset( &hdr, 0x00, sizeof(hdr));
+	hdr.magic = AS_THUMBNAIL_MAGIC ;
+	hdr.version = AS_THUMBNAIL_VERSION ;
+	hdr.width = im->width ;
+	hdr.height = im->height ;
+	hdr.path_len = strlen( realfilename );
+	hdr.back_color = im->back_color ;
+	hdr.src_mtime_lo = (CARD32)src_mtime ;
+	hdr.src_mtime_hi = (CARD32)(((CARD64)src_mtime)>>32) ;
+	hdr.src_size_lo = (CARD32)src_size ;
+	hdr.src_size_hi = (CARD32)(((CARD64)src_size)>>32) ;
+
+	wd.hdr = &hdr ;
+	wd.realfilename = realfilename ;
+	wd.im = im ;
+	success = write_cache_file( filename, write_thumbnail_file, &wd );
+	LOCAL_DEBUG_OUT( "thumbnail of \"%s\" saved to \"%s\" : %s", realfilename, filename, success?"success":"failure" );
+	free( filename );
+	return success;
+}
 
-	*need_save = rbuf.st_ctime > thbuf.st_ctime;
-	return result;
+ASImage *
+load_thumbnail_from_cache( const char *realfilename, int width, int height, ASFlagType flags, unsigned int compression )
+{
+	struct stat st ;
+	if( realfilename == NULL || get_thumbnail_dir() == NULL || stat( realfilename, &st ) != 0 )
+		return NULL;
+	return load_thumbnail_from_cache_int( realfilename, st.st_mtime, st.st_size, width, height, flags, compression );
 }
 
+Bool
+save_thumbnail_to_cache( const char *realfilename, int width, int height, ASFlagType flags, ASImage *im )
+{
+	struct stat st ;
+	if( realfilename == NULL || get_thumbnail_dir() == NULL || stat( realfilename, &st ) != 0 )
+		return False;
+	return save_thumbnail_to_cache_int( realfilename, st.st_mtime, st.st_size, width, height, flags, im );
+}
 
 void print_asimage_func (ASHashableValue value);
 ASImage *
@@ -634,6 +927,8 @@ get_thumbnail_asimage( ASImageManager* imageman, const char *file, int thumb_wid
 		{
 			ASImage *tmp = NULL; 
 			ASImageImportParams iparams ;
+			char *realfilename ;
+			Bool save_thumbnail = True ;
 
 			init_asimage_import_params( &iparams );
 			iparams.gamma = imageman->gamma ;
@@ -647,17 +942,13 @@ get_thumbnail_asimage( ASImageManager* imageman, const char *file, int thumb_wid
 			if( get_flags( flags, AS_THUMBNAIL_DONT_ENLARGE ) )
 				iparams.flags |= AS_IMPORT_FAST ; 
 
-			int save_thumbnail = 0;
-			char * thumbfile = get_thumbnail_image_path(file, &iparams, &save_thumbnail);
-			if (thumbfile) thumbfile = strdup(thumbfile);
-			if (!save_thumbnail && thumbfile)
-				tmp = file2ASImage_extra( thumbfile, &iparams );
-			LOCAL_DEBUG_OUT("Thumbnail path: %s --> %s, %d , %p", file, thumbfile, save_thumbnail, tmp);
-			if (!tmp)
-			{
+			realfilename = locate_image_file_in_path( file, &iparams );
+			/* thumbnail cache is keyed on requested size and flags : */
+			if( realfilename && (tmp = load_thumbnail_from_cache( realfilename, iparams.width, iparams.height, flags, 100 )) != NULL )
+				save_thumbnail = False ;
+			else
 				tmp = file2ASImage_extra( file, &iparams );
-				save_thumbnail = 1;
-			}
+			LOCAL_DEBUG_OUT("Thumbnail of %s --> %s, %d , %p", file, realfilename, save_thumbnail, tmp);
 			if( tmp ) 
 			{
 				im = tmp ; 
@@ -692,21 +983,12 @@ get_thumbnail_asimage( ASImageManager* imageman, const char *file, int thumb_wid
 				
 				if( im != tmp ) 
 					destroy_asimage( &tmp );
-				if (save_thumbnail && thumbfile)
-				{
-					LOCAL_DEBUG_OUT("Saving thumbnail to file %s", thumbfile);
-					save_asimage_to_file(thumbfile,
-							     im,
-							     "png",
-							     NULL,
-							     NULL,
-							     0,
-							     1
-							     );
-				}
+				if( save_thumbnail && realfilename && im )
+					save_thumbnail_to_cache( realfilename, iparams.width, iparams.height, flags, im );
 			}
 
-			if (thumbfile) free(thumbfile);	
+			if( realfilename )
+				free( realfilename );
 		}
 								 
 	}
@@ -884,7 +1166,19 @@ direntry2ASImageListEntry( const char *fname, const char *fullname,
 	if( curr->type != ASIT_Unknown && data->preview_type != 0 )
 	{
 		ASImageImportParams iparams = {0} ;
-		ASImage *im = as_image_file_loaders[file_type](fullname, &iparams);
+		ASFlagType cache_key = data->preview_type|AS_THUMBNAIL_LIST_PREVIEW ;
+		ASImage *im = NULL ;
+
+		if( get_thumbnail_dir() != NULL )
+			im = load_thumbnail_from_cache_int( fullname, stat_info->st_mtime, stat_info->st_size,
+			                                    data->preview_width, data->preview_height, cache_key,
+												data->preview_compression );
+		if( im != NULL )
+		{
+			curr->preview = im ;
+			return True;
+		}
+		im = as_image_file_loaders[file_type](fullname, &iparams);
 		if( im )
 		{
 			int scale_width = im->width ;
@@ -895,14 +1189,14 @@ direntry2ASImageListEntry( const char *fname, const char *fullname,
 			if( data->preview_width > 0 )
 			{
 				if( get_flags( data->preview_type, SCALE_PREVIEW_H ) )
-					scale_width = data->preview_width ;
+					scale_width = tile_width = data->preview_width ;
 				else
 					tile_width = data->preview_width ;
 			}
 			if( data->preview_height > 0 )
 			{
 				if( get_flags( data->preview_type, SCALE_PREVIEW_V ) )
-					scale_height = data->preview_height ;
+					scale_height = tile_height = data->preview_height ;
 				else
 					tile_height = data->preview_height ;
 			}
@@ -924,6 +1218,9 @@ direntry2ASImageListEntry( const char *fname, const char *fullname,
 					im = tmp ;
 				}
 			}
+			if( get_thumbnail_dir() != NULL )
+				save_thumbnail_to_cache_int( fullname, stat_info->st_mtime, stat_info->st_size,
+				                             data->preview_width, data->preview_height, cache_key, im );
 		}
 
 		curr->preview = im ;
@@ -1117,6 +1414,8 @@ check_image_type( const char *realfilename )
 		{
 			if( (CARD8)head[0] == 0xff && (CARD8)head[1] == 0xd8 && (CARD8)head[2] == 0xff)
 				type = ASIT_Jpeg;
+			else if( strncmp( &(head[0]), "ASIM", 4 ) == 0 || strncmp( &(head[0]), "MISA", 4 ) == 0 )
+				type = ASIT_ASImage;
 			else if (strstr ((char *)&(head[0]), "XPM") != NULL)
 				type =  ASIT_Xpm;
 			else if (head[1] == 'P' && head[2] == 'N' && head[3] == 'G')
@@ -1359,8 +1658,82 @@ apply_gamma( register CARD8* raw, register CARD8 *gamma_table, unsigned int widt
 	}
 }
 
+/***********************************************************************************/
+/* Some formats can be decoded at 1/2, 1/4 or 1/8 of the size at the fraction of  *
+ * the cost of full decoding (JPEG via IDCT scaling, interlaced PNG by reading    *
+ * only first Adam7 passes). We pick the largest such reduction that still keeps  *
+ * the image at least as large as requested, so that the final scaling down to    *
+ * the exact size done by the caller does not loose any quality :                 */
+#if defined(HAVE_PNG) || defined(HAVE_JPEG)
+static int
+get_import_reduction( ASImageImportParams *params, unsigned int src_width, unsigned int src_height )
+{
+	int w, h ;
+	unsigned int ratio ;
+
+	if( params == NULL || src_width == 0 || src_height == 0 ||
+		get_flags( params->flags, AS_IMPORT_SCALED_BOTH ) != AS_IMPORT_SCALED_BOTH )
+		return 1;
+
+	w = params->width ;
+	h = params->height ;
+	if( w <= 0 )
+	{
+		if( h <= 0 )
+			return 1;
+		w = ((long)src_width * h)/src_height ;
+	}else if( h <= 0 )
+		h = ((long)src_height * w)/src_width ;
+	if( w <= 0 ) w = 1 ;
+	if( h <= 0 ) h = 1 ;
+
+	ratio = src_width/w ;
+	if( ratio > src_height/h )
+		ratio = src_height/h ;
+
+	if( ratio >= 8 )
+		return 8;
+	if( ratio >= 4 )
+		return 4;
+	if( ratio >= 2 )
+		return 2;
+	return 1;
+}
+#endif
+
 /***********************************************************************************/
 #ifdef HAVE_PNG		/* PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG */
+/* Adam7 passes 1, 1-3 and 1-5 together contain exactly every 8th, 4th and
+ * 2nd pixel of every 8th, 4th and 2nd row, so interlaced image could be
+ * loaded at reduced size without inflating remaining passes : */
+static const int png_adam7_x0[7] = {0, 4, 0, 2, 0, 1, 0};
+static const int png_adam7_dx[7] = {8, 8, 4, 4, 2, 2, 1};
+static const int png_adam7_y0[7] = {0, 0, 4, 0, 2, 0, 1};
+static const int png_adam7_dy[7] = {8, 8, 8, 4, 4, 2, 2};
+
+static void
+read_png_reduced( png_structp png_ptr, png_bytep *row_pointers, png_bytep pass_row,
+				  png_uint_32 width, png_uint_32 height, int pixel_bytes, int reduction )
+{
+	int pass, passes = (reduction == 8)?1:((reduction == 4)?3:5);
+	for( pass = 0 ; pass < passes ; ++pass )
+	{
+		png_uint_32 pass_width, pass_height, r, c ;
+		if( width <= (png_uint_32)png_adam7_x0[pass] || height <= (png_uint_32)png_adam7_y0[pass] )
+			continue;	/* libpng skips empty passes */
+		pass_width = (width - png_adam7_x0[pass] + png_adam7_dx[pass] - 1)/png_adam7_dx[pass] ;
+		pass_height = (height - png_adam7_y0[pass] + png_adam7_dy[pass] - 1)/png_adam7_dy[pass] ;
+		for( r = 0 ; r < pass_height ; ++r )
+		{
+			png_bytep dst = row_pointers[(png_adam7_y0[pass] + r*png_adam7_dy[pass])/reduction] ;
+			png_read_row( png_ptr, pass_row, NULL );
+			for( c = 0 ; c < pass_width ; ++c )
+				memcpy( dst + ((png_adam7_x0[pass] + c*png_adam7_dx[pass])/reduction)*pixel_bytes,
+						pass_row + c*pixel_bytes, pixel_bytes );
+		}
+	}
+}
+
 ASImage *
 png2ASImage_int( void *data, png_rw_ptr read_fn, ASImageImportParams *params )
 {
@@ -1377,6 +1750,8 @@ png2ASImage_int( void *data, png_rw_ptr read_fn, ASImageImportParams *params )
 	png_bytep     *row_pointers, row;
 	unsigned int  y;
 	size_t		  row_bytes, offset ;
+	png_uint_32   full_width = 0, full_height = 0 ;
+	int           reduction = 1, pixel_bytes = 0 ;
 	static ASImage 	 *im = NULL ;
 	int old_storage_block_size;
 	START_TIME(started);
@@ -1482,6 +1857,21 @@ png2ASImage_int( void *data, png_rw_ptr read_fn, ASImageImportParams *params )
 				png_read_update_info (png_ptr, info_ptr);
 
 				png_get_IHDR (png_ptr, info_ptr, &width, &height, &bit_depth, &color_type, &interlace_type, NULL, NULL);
+				row_bytes = png_get_rowbytes (png_ptr, info_ptr);
+
+				if( interlace_type == PNG_INTERLACE_ADAM7 && bit_depth == 8 && upscaled_gray == NULL )
+				{
+					reduction = get_import_reduction( params, width, height );
+					if( reduction > 1 )
+					{
+						pixel_bytes = row_bytes/width ;
+						full_width = width ;
+						full_height = height ;
+						width = (width + reduction - 1)/reduction ;
+						height = (height + reduction - 1)/reduction ;
+						row_bytes = width * pixel_bytes ;
+					}
+				}
 
 				im = create_asimage( width, height, params->compression );
 				do_alpha = ((color_type & PNG_COLOR_MASK_ALPHA) != 0 );
@@ -1496,7 +1886,6 @@ png2ASImage_int( void *data, png_rw_ptr read_fn, ASImageImportParams *params )
 				else
 					prepare_scanline( im->width, 0, &buf, False );
 
-				row_bytes = png_get_rowbytes (png_ptr, info_ptr);
 				/* allocating big chunk of memory at once, to enable mmap
 				 * that will release memory to system right after free() */
 				row_pointers = safemalloc( height * sizeof( png_bytep ) + row_bytes * height );
@@ -1504,8 +1893,14 @@ png2ASImage_int( void *data, png_rw_ptr read_fn, ASImageImportParams *params )
 				for (offset = 0, y = 0; y < height; y++, offset += row_bytes)
 					row_pointers[y] = row + offset;
 
-				/* The easiest way to read the image: */
-				png_read_image (png_ptr, row_pointers);
+				if( reduction > 1 )
+				{
+					/* libpng may write whole row width even though pass is narrower */
+					png_bytep pass_row = safemalloc( full_width * pixel_bytes );
+					read_png_reduced( png_ptr, row_pointers, pass_row, full_width, full_height, pixel_bytes, reduction );
+					free( pass_row );
+				}else /* The easiest way to read the image: */
+					png_read_image (png_ptr, row_pointers);
 
 				old_storage_block_size = set_asstorage_block_size( NULL, width*height*3/2 );
 				for (y = 0; y < height; y++)
@@ -1586,8 +1981,10 @@ png2ASImage_int( void *data, png_rw_ptr read_fn, ASImageImportParams *params )
 				free (row_pointers);
 				if( do_alpha || !grayscale ) 
 					free_scanline(&buf, True);
-				/* read rest of file, and get additional chunks in info_ptr - REQUIRED */
-				png_read_end (png_ptr, info_ptr);
+				/* read rest of file, and get additional chunks in info_ptr - REQUIRED,
+				 * unless we've stopped early, skipping last interlace passes */
+				if( reduction <= 1 )
+					png_read_end (png_ptr, info_ptr);
 		  	}
 		}
 		/* clean up after the read, and free any memory allocated - REQUIRED */
@@ -1744,42 +2141,10 @@ jpeg2ASImage( const char * path, ASImageImportParams *params )
 	cinfo.quantize_colors = FALSE;		       /* we don't want no stinking colormaps ! */
 	cinfo.output_gamma = params->gamma;
 	
-	if( get_flags( params->flags, AS_IMPORT_SCALED_BOTH ) == AS_IMPORT_SCALED_BOTH )
-	{
-		int w = params->width ; 
-		int h = params->height ;
-		int ratio ; 
-
-		if( w == 0 )
-		{
-			if( h == 0 ) 
-			{
-				w = cinfo.image_width ; 
-				h = cinfo.image_height ; 
-			}else
-				w = (cinfo.image_width * h)/cinfo.image_height ;
-		}else if( h == 0 )
-			h = (cinfo.image_height * w)/cinfo.image_width ;
-		
-		ratio = cinfo.image_height/h ; 
-		if( ratio > (int)cinfo.image_width/w )
-			ratio = cinfo.image_width/w ; 
-		
-		cinfo.scale_num = 1 ; 
-		/* only supported values are 1, 2, 4, and 8 */
-		cinfo.scale_denom = 1 ; 
-		if( ratio >= 2 ) 
-		{
-			if( ratio >= 4 ) 
-			{
-				if( ratio >= 8 ) 
-					cinfo.scale_denom = 8 ; 
-				else
-					cinfo.scale_denom = 4 ; 
-			}else
-				cinfo.scale_denom = 2 ; 
-		}
-	}
+	/* let IDCT do most of downscaling for us - that is much cheaper then
+	 * decoding at full size and scaling it afterwards */
+	cinfo.scale_num = 1 ;
+	cinfo.scale_denom = get_import_reduction( params, cinfo.image_width, cinfo.image_height );
 	
 	if( get_flags( params->flags, AS_IMPORT_FAST ) )
 	{/* this does not really makes much of a difference */
@@ -2472,6 +2837,50 @@ tiff2ASImage( const char * path, ASImageImportParams *params )
 #endif			/* TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF */
 
 
+/* Documents loaded by xml2ASImage() are kept compiled, so that the same
+ * document requested at another size only recomputes what depends on the
+ * size. Most recently used first. Images memoized by all of them together
+ * are limited to MAX_XML_PROGRAMS_CACHE_SIZE bytes : */
+#define MAX_XML_PROGRAMS_KEPT		8
+#define MAX_XML_PROGRAMS_CACHE_SIZE	(16*1024*1024)
+
+typedef struct ASXmlProgramFile
+{
+	char *path ;
+	time_t mtime ;
+	off_t size ;
+	ASImageXMLProgram *prog ;
+}ASXmlProgramFile;
+
+static ASXmlProgramFile _as_xml_programs[MAX_XML_PROGRAMS_KEPT] ;
+static int _as_xml_programs_num = 0 ;
+
+static void
+destroy_xml_program_file( ASXmlProgramFile *pf )
+{
+	if( pf->path )
+		free( pf->path );
+	destroy_asimage_xml_program( pf->prog );
+	memset( pf, 0x00, sizeof(ASXmlProgramFile));
+}
+
+/* less recently used documents lose their memoized images first : */
+static void
+trim_xml_programs_cache()
+{
+	size_t used = 0 ;
+	int i ;
+	for( i = 0 ; i < _as_xml_programs_num ; ++i )
+	{
+		ASImageXMLCacheStats stats ;
+		get_asimage_xml_cache_stats( _as_xml_programs[i].prog, &stats );
+		if( used + stats.used > MAX_XML_PROGRAMS_CACHE_SIZE )
+			flush_asimage_xml_cache( _as_xml_programs[i].prog );
+		else
+			used += stats.used ;
+	}
+}
+
 static ASImage *
 load_xml2ASImage( ASImageManager *imman, const char *path, unsigned int compression, int width, int height )
 {
@@ -2479,17 +2888,58 @@ load_xml2ASImage( ASImageManager *imman, const char *path, unsigned int compress
 	char *slash, *curr_path = NULL ;
 	char *doc_str = NULL ;
 	ASImage *im = NULL ;
+	ASXmlProgramFile pf ;
+	struct stat st ;
+	Bool stat_ok = (stat( path, &st ) == 0) ;
+	int i ;
 
 	memset( &fake_asv, 0x00, sizeof(ASVisual) );
+	memset( &pf, 0x00, sizeof(ASXmlProgramFile) );
 	if( (slash = strrchr( path, '/' )) != NULL )
 		curr_path = mystrndup( path, slash-path );
 
-	if((doc_str = load_file(path)) == NULL )
-		show_error( "unable to load file \"%s\" file is either too big or is not readable.\n", path );
-	else
+	for( i = 0 ; i < _as_xml_programs_num ; ++i )
+		if( strcmp( _as_xml_programs[i].path, path ) == 0 )
+		{/* taken out of the list while in use, so that documents it
+		  * includes could not push it out : */
+			pf = _as_xml_programs[i] ;
+			--_as_xml_programs_num ;
+			memmove( &_as_xml_programs[i], &_as_xml_programs[i+1], (_as_xml_programs_num-i)*sizeof(ASXmlProgramFile));
+			if( !stat_ok || pf.mtime != st.st_mtime || pf.size != st.st_size )
+				destroy_xml_program_file( &pf );
+			break;
+		}
+
+	if( pf.prog == NULL )
 	{
-		im = compose_asimage_xml_at_size(&fake_asv, imman, NULL, doc_str, 0, 0, None, curr_path, width, height);
-		free( doc_str );
+		if((doc_str = load_file(path)) == NULL )
+			show_error( "unable to load file \"%s\" file is either too big or is not readable.\n", path );
+		else
+		{
+			pf.prog = compile_asimage_xml( doc_str );
+			free( doc_str );
+			if( stat_ok )
+			{
+				pf.path = mystrdup( path );
+				pf.mtime = st.st_mtime ;
+				pf.size = st.st_size ;
+			}
+		}
+	}
+
+	if( pf.prog )
+	{
+		im = compose_asimage_xml_compiled(&fake_asv, imman, NULL, pf.prog, 0, 0, None, curr_path, width, height);
+		if( pf.path )
+		{
+			if( _as_xml_programs_num >= MAX_XML_PROGRAMS_KEPT )
+				destroy_xml_program_file( &_as_xml_programs[--_as_xml_programs_num] );
+			memmove( &_as_xml_programs[1], &_as_xml_programs[0], _as_xml_programs_num*sizeof(ASXmlProgramFile));
+			_as_xml_programs[0] = pf ;
+			++_as_xml_programs_num ;
+			trim_xml_programs_cache();
+		}else
+			destroy_xml_program_file( &pf );
 	}
 
 	if( curr_path )
@@ -2919,3 +3369,380 @@ argb2ASImage( const char *path, ASImageImportParams *params )
 	return im ;
 }
 
+/***********************************************************************************/
+/* ASIM - our own native format. Compressed lines are mapped straight into the     */
+/* storage, and memory pages are shared by all the processes using the same file : */
+static Bool
+asim_header_valid( ASImFileHeader *hdr, size_t size )
+{
+	CARD64 index_end ;
+	if( hdr->magic != ASIM_FILE_MAGIC || hdr->version != ASIM_FILE_VERSION ||
+		hdr->byte_order != ASIM_FILE_BYTE_ORDER ||
+		hdr->width == 0 || hdr->width > MAX_IMPORT_IMAGE_SIZE ||
+		hdr->height == 0 || hdr->height > MAX_IMPORT_IMAGE_SIZE ||
+		hdr->path_len > size ||
+		hdr->index_offset != sizeof(ASImFileHeader) + ASIM_PADDED_PATH_LEN(hdr->path_len) ||
+		(hdr->slots_offset&(ASStorageSlot_SIZE-1)) != 0 ||
+		hdr->slots_count > IC_NUM_CHANNELS*hdr->height )
+		return False;
+	index_end = (CARD64)hdr->index_offset + (CARD64)IC_NUM_CHANNELS*hdr->height*sizeof(CARD32) ;
+	return ( index_end <= hdr->slots_offset &&
+			 (CARD64)hdr->slots_offset + hdr->slots_size == (CARD64)size );
+}
+
+/* if src is not NULL - file is only used if it was made out of the same source : */
+static ASImage *
+map_asim_file( const char *path, ASImFileHeader *src, const char *src_path, ASImageImportParams *params )
+{
+	ASImage *im = NULL ;
+	ASImFileHeader *hdr ;
+	struct stat st ;
+	CARD8 *data = NULL ;
+	size_t size = 0 ;
+	int fd ;
+
+	if( (fd = open( path, O_RDONLY )) < 0 )
+		return NULL;
+	if( fstat( fd, &st ) == 0 && st.st_size >= (off_t)sizeof(ASImFileHeader) )
+	{
+		size = st.st_size ;
+#ifdef HAVE_SYS_MMAN_H
+		/* storage copies slots out of the mapping before changing them : */
+		data = mmap( NULL, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		if( data == MAP_FAILED )
+			data = NULL ;
+#else
+		if( (data = malloc( size )) != NULL )
+			if( read( fd, data, size ) != (ssize_t)size )
+			{
+				free( data );
+				data = NULL ;
+			}
+#endif
+	}
+	close( fd );
+	if( data == NULL )
+		return NULL;
+
+	hdr = (ASImFileHeader*)data ;
+	if( asim_header_valid( hdr, size ) &&
+		(src == NULL ||
+		 (hdr->path_len == src->path_len &&
+		  hdr->src_mtime_lo == src->src_mtime_lo && hdr->src_mtime_hi == src->src_mtime_hi &&
+		  hdr->src_size_lo == src->src_size_lo && hdr->src_size_hi == src->src_size_hi &&
+		  hdr->src_gamma == src->src_gamma &&
+		  memcmp( data+sizeof(ASImFileHeader), src_path, src->path_len ) == 0)) )
+	{
+		CARD32 *index = (CARD32*)(data + hdr->index_offset) ;
+		ASStorageID *ids = safemalloc( (hdr->slots_count+1)*sizeof(ASStorageID) );
+		size_t expected = hdr->slots_offset ;
+		unsigned int i, k = 0 ;
+		Bool valid = True ;
+
+		/* slots must follow each other in the order of the index : */
+		for( i = 0 ; i < IC_NUM_CHANNELS*hdr->height && valid ; ++i )
+			if( index[i] != 0 )
+			{
+				ASStorageSlot *slot = (ASStorageSlot*)(data+expected) ;
+				if( index[i] != expected || expected + ASStorageSlot_SIZE > size ||
+					ASStorageSlot_FULL_SIZE(slot) > size - expected )
+					valid = False ;
+				else
+				{
+					expected += ASStorageSlot_FULL_SIZE(slot) ;
+					++k ;
+				}
+			}
+		if( valid && k == hdr->slots_count && expected == size &&
+			(k == 0 || map_storage_slots( NULL, data, size, data+hdr->slots_offset, k, hdr->width, ids )) )
+		{
+			im = create_asimage( hdr->width, hdr->height, params?params->compression:100 );
+			im->back_color = hdr->back_color ;
+			for( i = 0, k = 0 ; i < IC_NUM_CHANNELS*hdr->height ; ++i )
+				if( index[i] != 0 )
+					im->channels[i/hdr->height][i%hdr->height] = ids[k++] ;
+			if( params )
+			{
+				params->return_animation_delay = hdr->anim_delay ;
+				params->return_animation_repeats = hdr->anim_repeats ;
+			}
+			if( k > 0 )
+				data = NULL ;	/* storage owns it now */
+		}
+		free( ids );
+	}
+	if( data != NULL )
+	{
+#ifdef HAVE_SYS_MMAN_H
+		munmap( data, size );
+#else
+		free( data );
+#endif
+	}
+	return im;
+}
+
+ASImage *
+asim2ASImage( const char *path, ASImageImportParams *params )
+{
+	ASImage *im = map_asim_file( path, NULL, NULL, params );
+	if( im == NULL )
+		show_error( "unable to load file \"%s\" - file is corrupted or was written on different platform.\n", path );
+	return im;
+}
+
+/* cache file's mtime is its last use, but we don't need it to be exact : */
+#define ASIMAGE_CACHE_TOUCH_INTERVAL	600
+/* leftovers of writers that died : */
+#define ASIMAGE_CACHE_TMP_MAX_AGE		3600
+
+static char* asimage_cache_dir = NULL;
+static size_t asimage_cache_budget = ASIMAGE_CACHE_DEFAULT_BUDGET ;
+
+size_t set_asimage_cache_budget( size_t budget )
+{
+	size_t old_budget = asimage_cache_budget ;
+	asimage_cache_budget = budget ;
+	return old_budget;
+}
+
+void set_asimage_cache_dir( const char *dir )
+{
+	struct stat stbuf;
+	if( asimage_cache_dir && dir && !strcmp( asimage_cache_dir, dir ) )
+		return;
+
+	if( asimage_cache_dir )
+	{
+		free( asimage_cache_dir );
+		asimage_cache_dir = NULL;
+	}
+	if( dir && stat( dir, &stbuf ) == 0 && S_ISDIR( stbuf.st_mode ) )
+		asimage_cache_dir = mystrdup( dir );
+}
+
+static char *
+make_asimage_cache_filename( const char *realfilename, double gamma )
+{
+	char suffix[32] ;
+
+	sprintf( suffix, "-%lu.asim", (unsigned long)(CARD32)(gamma*1000.) );
+	return make_cache_file_name( asimage_cache_dir, realfilename, suffix );
+}
+
+static Bool
+is_asimage_cacheable( const char *realfilename, ASImageFileTypes file_type, ASImageImportParams *iparams, struct stat *src_st )
+{
+	if( asimage_cache_dir == NULL )
+		return False;
+	/* only what does not depend on anything but the file itself : */
+	switch( file_type )
+	{
+		case ASIT_XMLScript :
+		case ASIT_SVG :
+		case ASIT_HTML :
+		case ASIT_XML :
+		case ASIT_ASImage :
+		case ASIT_Unknown :
+			return False;
+		default :
+			break;
+	}
+	if( asimage_cache_budget == 0 ||
+		get_flags( iparams->flags, AS_IMPORT_RESIZED|AS_IMPORT_SCALED_BOTH ) ||
+		iparams->subimage != 0 || iparams->gamma_table != NULL )
+		return False;
+	return ( stat( realfilename, src_st ) == 0 && S_ISREG( src_st->st_mode ) );
+}
+
+static void
+make_asimage_cache_header( ASImFileHeader *hdr, const char *realfilename, struct stat *src_st, double gamma )
+{
+	memset( hdr, 0x00, sizeof(ASImFileHeader) );
+	hdr->path_len = strlen( realfilename );
+	hdr->src_mtime_lo = (CARD32)src_st->st_mtime ;
+	hdr->src_mtime_hi = (CARD32)(((CARD64)src_st->st_mtime)>>32) ;
+	hdr->src_size_lo = (CARD32)src_st->st_size ;
+	hdr->src_size_hi = (CARD32)(((CARD64)src_st->st_size)>>32) ;
+	hdr->src_gamma = (CARD32)(gamma*1000.) ;
+}
+
+static ASImage *
+load_asimage_from_cache( const char *realfilename, struct stat *src_st, ASImageImportParams *iparams )
+{
+	char *filename = make_asimage_cache_filename( realfilename, iparams->gamma );
+	ASImFileHeader src ;
+	ASImage *im ;
+
+	make_asimage_cache_header( &src, realfilename, src_st, iparams->gamma );
+	im = map_asim_file( filename, &src, realfilename, iparams );
+	LOCAL_DEBUG_OUT( "\"%s\" loaded from cache \"%s\" : %p", realfilename, filename, im );
+	if( im != NULL )
+	{	/* pruning drops least recently used files first : */
+		struct stat st ;
+		time_t now = time(NULL);
+		if( stat( filename, &st ) == 0 && st.st_mtime + ASIMAGE_CACHE_TOUCH_INTERVAL < now )
+			utimes( filename, NULL );
+	}
+	free( filename );
+	return im;
+}
+
+#ifndef _WIN32
+typedef struct ASImageCacheFile
+{
+	char   *filename ;
+	off_t   size ;
+	time_t  mtime ;
+}ASImageCacheFile;
+
+typedef struct ASImageCacheScan
+{
+	ASImageCacheFile *files ;
+	int count, allocated ;
+	CARD64 total_size ;
+	time_t now ;
+}ASImageCacheScan;
+
+static int
+asimage_cache_filter( const char *d_name )
+{
+	int len = strlen( d_name );
+	return ( (len > 5 && strcmp( d_name+len-5, ".asim" ) == 0) ||
+			 (len > 4 && strcmp( d_name+len-4, ".tmp" ) == 0) );
+}
+
+/* cache file is stale if its source was removed or changed since : */
+static Bool
+is_asimage_cache_file_stale( const char *fullname )
+{
+	ASImFileHeader hdr ;
+	char path[PATH_MAX+1] ;
+	struct stat src_st ;
+	Bool stale = True ;
+	int fd = open( fullname, O_RDONLY );
+
+	if( fd < 0 )
+		return False;
+	if( read( fd, &hdr, sizeof(hdr) ) == sizeof(hdr) &&
+		hdr.magic == ASIM_FILE_MAGIC && hdr.path_len > 0 && hdr.path_len <= PATH_MAX &&
+		read( fd, path, hdr.path_len ) == (ssize_t)hdr.path_len )
+	{
+		path[hdr.path_len] = '\0' ;
+		stale = ( stat( path, &src_st ) != 0 ||
+				  hdr.src_mtime_lo != (CARD32)src_st.st_mtime ||
+				  hdr.src_mtime_hi != (CARD32)(((CARD64)src_st.st_mtime)>>32) ||
+				  hdr.src_size_lo != (CARD32)src_st.st_size ||
+				  hdr.src_size_hi != (CARD32)(((CARD64)src_st.st_size)>>32) );
+	}
+	close( fd );
+	return stale;
+}
+
+static Bool
+asimage_cache_direntry( const char *fname, const char *fullname, struct stat *stat_info, void *aux_data )
+{
+	ASImageCacheScan *scan = (ASImageCacheScan*)aux_data ;
+	int len = strlen( fname );
+
+	if( !S_ISREG( stat_info->st_mode ) )
+		return False;
+	if( strcmp( fname+len-4, ".tmp" ) == 0 )
+	{
+		if( stat_info->st_mtime + ASIMAGE_CACHE_TMP_MAX_AGE < scan->now )
+			unlink( fullname );
+		return False;
+	}
+	if( is_asimage_cache_file_stale( fullname ) )
+	{
+		unlink( fullname );
+		return False;
+	}
+	if( scan->count >= scan->allocated )
+	{
+		scan->allocated += 64 ;
+		scan->files = realloc( scan->files, scan->allocated*sizeof(ASImageCacheFile) );
+	}
+	scan->files[scan->count].filename = mystrdup( fullname );
+	scan->files[scan->count].size = stat_info->st_size ;
+	scan->files[scan->count].mtime = stat_info->st_mtime ;
+	++(scan->count);
+	scan->total_size += stat_info->st_size ;
+	return True;
+}
+
+static int
+compare_asimage_cache_files( const void *a, const void *b )
+{
+	const ASImageCacheFile *fa = (const ASImageCacheFile*)a ;
+	const ASImageCacheFile *fb = (const ASImageCacheFile*)b ;
+	return ( fa->mtime < fb->mtime )? -1 : (( fa->mtime > fb->mtime )? 1 : 0);
+}
+
+/* removes stale files, and then least recently used ones, 
+ * until whats left fits into asimage_cache_budget : */
+static void
+prune_asimage_cache()
+{
+	ASImageCacheScan scan ;
+	int i ;
+
+	memset( &scan, 0x00, sizeof(scan) );
+	scan.now = time(NULL);
+	my_scandir_ext( asimage_cache_dir, asimage_cache_filter, asimage_cache_direntry, &scan );
+	if( scan.total_size > asimage_cache_budget )
+	{
+		qsort( scan.files, scan.count, sizeof(ASImageCacheFile), compare_asimage_cache_files );
+		for( i = 0 ; i < scan.count && scan.total_size > asimage_cache_budget ; ++i )
+			if( unlink( scan.files[i].filename ) == 0 )
+				scan.total_size -= scan.files[i].size ;
+	}
+	LOCAL_DEBUG_OUT( "%d files, %lu bytes left in cache", scan.count, (unsigned long)scan.total_size );
+	for( i = 0 ; i < scan.count ; ++i )
+		free( scan.files[i].filename );
+	if( scan.files )
+		free( scan.files );
+}
+#endif
+
+typedef struct ASImageCacheWriteData
+{
+	ASImage *im ;
+	ASImageExportParams *params ;
+}ASImageCacheWriteData;
+
+static Bool
+write_asimage_cache_file( const char *tmpname, void *data )
+{
+	ASImageCacheWriteData *wd = (ASImageCacheWriteData*)data ;
+	return ASImage2asim( wd->im, tmpname, wd->params );
+}
+
+static Bool
+save_asimage_to_cache( const char *realfilename, struct stat *src_st, ASImageImportParams *iparams, ASImage *im )
+{
+	char *filename = make_asimage_cache_filename( realfilename, iparams->gamma );
+	ASImageExportParams params ;
+	ASImageCacheWriteData wd ;
+	Bool success ;
+
+	memset( &params, 0x00, sizeof(params) );
+	params.asim.type = ASIT_ASImage ;
+	params.asim.src_path = realfilename ;
+	params.asim.src_mtime = src_st->st_mtime ;
+	params.asim.src_size = src_st->st_size ;
+	params.asim.src_gamma = iparams->gamma ;
+	params.asim.anim_delay = iparams->return_animation_delay ;
+	params.asim.anim_repeats = iparams->return_animation_repeats ;
+	wd.im = im ;
+	wd.params = &params ;
+	success = write_cache_file( filename, write_asimage_cache_file, &wd );
+	LOCAL_DEBUG_OUT( "\"%s\" saved to cache \"%s\" : %d", realfilename, filename, success );
+	free( filename );
+#ifndef _WIN32
+	if( success )
+		prune_asimage_cache();
+#endif
+	return success;
+}
+
@@ -62,10 +62,54 @@ typedef enum
 	ASIT_Pcx,
 	ASIT_HTML,
 	ASIT_XML,
+	ASIT_ASImage,		/* libAfterImage's own memory mappable format */
 	ASIT_Unknown
 }ASImageFileTypes;
 /*************/
 
+/****s* libAfterImage/ASImFileHeader
+ * NAME
+ * ASImFileHeader - header of the libAfterImage's native image file.
+ * DESCRIPTION
+ * Native files hold ASImage exactly as it is kept in memory - compressed
+ * lines of each channel, stored as ASStorage slots. Header is followed
+ * by the source path (if any, padded to 4 bytes), then by the index of
+ * line offsets - CARD32 offset of the slot from the beginning of the file
+ * for each line of each channel (0 for empty line), channel by channel.
+ * Slots follow at slots_offset, which is aligned on 16 bytes, in the same
+ * order as lines in the index. Such file could be mmapped and its slots
+ * used as storage directly, without decompressing or copying anything.
+ * Data is kept in native byte order of the machine that wrote the file,
+ * as it is meant to be used for caching, not for interchange.
+ * SOURCE
+ */
+#define ASIM_FILE_MAGIC			0x4D495341	/* "ASIM" */
+#define ASIM_FILE_VERSION		1
+#define ASIM_FILE_BYTE_ORDER	0x01020304
+
+typedef struct ASImFileHeader
+{
+	CARD32 magic ;
+	CARD32 version ;
+	CARD32 byte_order ;
+	CARD32 width, height ;
+	CARD32 back_color ;
+	CARD32 channels ;			/* bit set for each channel with lines stored */
+	CARD32 slots_count ;
+	CARD32 index_offset ;
+	CARD32 slots_offset ;
+	CARD32 slots_size ;
+	CARD32 anim_delay, anim_repeats ;
+	/* image source, when file is used as the cache of some other image : */
+	CARD32 path_len ;
+	CARD32 src_mtime_lo, src_mtime_hi ;
+	CARD32 src_size_lo, src_size_hi ;
+	CARD32 src_gamma ;			/* gamma*1000 source has been loaded with */
+	CARD32 reserved[3] ;
+}ASImFileHeader;
+#define ASIM_PADDED_PATH_LEN(len)	(((len)+3)&0xFFFFFFFC)
+/*************/
+
 /****s* libAfterImage/ASImageListEntry
  * NAME
  * ASImageListEntry - entry in linked list of images loaded from single 
@@ -121,6 +165,13 @@ typedef struct ASImageListEntry
 #define AS_IMPORT_SKIP_COMPRESSED			(0x01<<15)
 #define AS_IMPORT_IGNORE_IF_MISSING		(0x01<<16)
 
+/* When both AS_IMPORT_SCALED_H and AS_IMPORT_SCALED_V are set, width and
+ * height of ASImageImportParams specify target size of the image (zero or
+ * negative value means proportional to the other one). JPEG and interlaced
+ * PNG loaders will then decode image at 1/2, 1/4 or 1/8 of its size,
+ * whichever is the smallest that is still no smaller then target size.
+ * Caller is expected to scale result to the exact size afterwards. */
+
 
 typedef struct ASImageImportParams
 {
@@ -157,6 +208,7 @@ ASImage *tga2ASImage ( const char * path, ASImageImportParams *params );
 ASImage *svg2ASImage ( const char * path, ASImageImportParams *params );
 ASImage *convert_argb2ASImage( ASVisual *asv, int width, int height, ARGB32 *argb, CARD8 *gamma_table );
 ASImage *argb2ASImage( const char *path, ASImageImportParams *params );
+ASImage *asim2ASImage( const char *path, ASImageImportParams *params );
 
 
 /****f* libAfterImage/import/file2ASImage()
@@ -219,11 +271,17 @@ ASImage *argb2ASImage( const char *path, ASImageImportParams *params );
  * file2ASImage()
  *********/
 ASImage *file2ASImage( const char *file, ASFlagType what, double gamma, unsigned int compression, ... );
+void init_asimage_import_params( ASImageImportParams *iparams );
 ASImage *file2ASImage_extra( const char *file, ASImageImportParams *params );
 ASImage *get_asimage( ASImageManager* imageman, const char *file, ASFlagType what, unsigned int compression );
 ASImage *get_asimage_quiet( ASImageManager* imageman, const char *file, ASFlagType what, unsigned int compression);
 /* ASImage *get_asimage_extra( ASImageManager* imageman, const char *file, ASImageImportParams *params );*/
 ASImageFileTypes get_asimage_file_type( ASImageManager* imageman, const char *file );
+/* returns full path of the file file2ASImage_extra() would load, to be free()'d : */
+char *locate_image_file_in_path( const char *file, ASImageImportParams *iparams );
+/* modification time and size of the file get_asimage() would load from
+ * search_path, False if there is no such file : */
+Bool stat_image_file_in_path( const char *file, char **search_path, time_t *mtime, size_t *size );
 
 #define AS_THUMBNAIL_PROPORTIONAL 		(0x01<<0)
 #define AS_THUMBNAIL_DONT_ENLARGE 		(0x01<<1)
@@ -232,6 +290,84 @@ ASImage *get_thumbnail_asimage( ASImageManager* imageman, const char *file, int
 
 ASImageFileTypes check_asimage_file_type( const char *realfilename );
 
+/****f* libAfterImage/import/set_asimage_thumbnails_cache_dir()
+ * NAME
+ * set_asimage_thumbnails_cache_dir() - enables persistent thumbnail cache.
+ * NAME
+ * load_thumbnail_from_cache()
+ * NAME
+ * save_thumbnail_to_cache()
+ * SYNOPSIS
+ * void set_asimage_thumbnails_cache_dir( const char *dir );
+ * ASImage *load_thumbnail_from_cache( const char *realfilename,
+ *                                     int width, int height,
+ *                                     ASFlagType flags,
+ *                                     unsigned int compression );
+ * Bool save_thumbnail_to_cache( const char *realfilename,
+ *                               int width, int height,
+ *                               ASFlagType flags, ASImage *im );
+ * INPUTS
+ * dir           - existing directory to keep thumbnails in, or NULL to
+ *                 disable the cache.
+ * realfilename  - full path to the source image file.
+ * width, height - requested size of the thumbnail.
+ * flags         - AS_THUMBNAIL_ flags used to produce the thumbnail.
+ * compression   - compression of the ASImage to create.
+ * im            - thumbnail image to store.
+ * DESCRIPTION
+ * Thumbnails produced by get_thumbnail_asimage() and previews produced
+ * by get_asimage_list() are saved into the cache directory, keyed on the
+ * source file path, requested size and flags, so that subsequent
+ * sessions do not have to decode full size images again. Cached
+ * thumbnail is only used while source file's modification time and size
+ * stay the same. Cache files contain raw ARGB32 pixels and are mmapped
+ * when read. They are written into temporary file and renamed in place,
+ * so it is safe for several processes to share the cache directory.
+ *********/
+void set_asimage_thumbnails_cache_dir( const char *dir );
+ASImage *load_thumbnail_from_cache( const char *realfilename, int width, int height, ASFlagType flags, unsigned int compression );
+Bool save_thumbnail_to_cache( const char *realfilename, int width, int height, ASFlagType flags, ASImage *im );
+
+/****f* libAfterImage/import/set_asimage_cache_dir()
+ * NAME
+ * set_asimage_cache_dir() - enables automatic cache of loaded images.
+ * SYNOPSIS
+ * void set_asimage_cache_dir( const char *dir );
+ * INPUTS
+ * dir           - existing directory to keep cached images in, or NULL to
+ *                 disable the cache.
+ * DESCRIPTION
+ * Once cache directory is set, every raster image loaded by
+ * file2ASImage_extra() at its original size is also written into cache
+ * directory in native ASIM format (see ASImFileHeader), keyed on source
+ * file's path and gamma. Next time the same file is requested, while
+ * its modification time and size remain the same, image is mapped from
+ * the cache file instead of being decoded, sharing memory pages with
+ * all the other processes using the same image.
+ * Only images of at least 256x256 pixels, or taking at least 20ms to
+ * decode, are cached. Total size of cache directory is kept under the
+ * budget set with set_asimage_cache_budget().
+ *********/
+void set_asimage_cache_dir( const char *dir );
+
+/****f* libAfterImage/import/set_asimage_cache_budget()
+ * NAME
+ * set_asimage_cache_budget() - limits disk space used by image cache.
+ * SYNOPSIS
+ * size_t set_asimage_cache_budget( size_t budget );
+ * INPUTS
+ * budget        - number of bytes, 0 disables the cache.
+ * RETURN VALUE
+ * Previous budget. Default is ASIMAGE_CACHE_DEFAULT_BUDGET (64MB).
+ * DESCRIPTION
+ * Every time new image is written into the directory set with
+ * set_asimage_cache_dir(), files made out of source images that were
+ * since removed or modified are deleted, and then least recently used
+ * files are deleted, until all the rest fits into the budget.
+ *********/
+#define ASIMAGE_CACHE_DEFAULT_BUDGET	(64*1024*1024)
+size_t set_asimage_cache_budget( size_t budget );
+
 
 Bool reload_asimage_manager( ASImageManager *imman );
 
@@ -111,6 +111,109 @@ free_scanline( ASScanline *sl, Bool reusable )
 	}
 }
 
+/* ********************* ASPackedScanline ******************************/
+ASPackedScanline*
+prepare_packed_scanline( unsigned int width, ASPackedScanline *reusable_memory )
+{
+	register ASPackedScanline *psl = reusable_memory ;
+
+	if( psl == NULL )
+		psl = safecalloc( 1, sizeof( ASPackedScanline ) );
+	else
+		memset( psl, 0x00, sizeof(ASPackedScanline));
+
+	if( width == 0 ) width = 1 ;
+	psl->width = width ;
+	/* padding to the multiply of 8 pixels allows for vectorized code
+	 * to not bother with the tails : */
+	psl->buffer = safecalloc (1, ((width+7)&(~7))*sizeof(ARGB32)+16);
+	if( psl->buffer == NULL )
+	{
+		if( psl != reusable_memory )
+			free( psl );
+		return NULL;
+	}
+	psl->argb = (ARGB32*)((((long)psl->buffer+15)>>4)*16);
+	psl->back_color = ARGB32_DEFAULT_BACK_COLOR;
+	return psl;
+}
+
+void
+free_packed_scanline( ASPackedScanline *psl, Bool reusable )
+{
+	if( psl )
+	{
+		if( psl->buffer )
+			free( psl->buffer );
+		if( !reusable )
+			free( psl );
+	}
+}
+
+/* blenders treat pixels with any non-zero alpha as visible, so we should
+ * not let alpha round down to zero : */
+#define PACK_ALPHA(v,shift)	(((v)>>(shift)) == 0 && (v) != 0 ? 1 : ((v)>>(shift)))
+
+void
+pack_scanline( ASScanline *src, ASPackedScanline *dst )
+{
+	register int i ;
+	int width = MIN(src->width,dst->width);
+	int shift = src->shift ;
+	register ARGB32 *argb = dst->argb ;
+	ARGB32 fill = src->back_color ;
+	register CARD32 *a = src->alpha, *r = src->red, *g = src->green, *b = src->blue ;
+
+	if( get_flags( src->flags, SCL_DO_ALL ) != SCL_DO_ALL )
+	{
+		ARGB32 mask = 0 ;
+		for( i = 0 ; i < IC_NUM_CHANNELS ; ++i )
+			if( !get_flags( src->flags, 0x01<<i ) )
+				mask |= MAKE_ARGB32_CHAN8(0x00FF,i);
+		fill &= mask ;
+		for( i = 0 ; i < width ; ++i )
+		{
+			register CARD32 c = fill ;
+			if( get_flags( src->flags, SCL_DO_ALPHA ) ) c |= PACK_ALPHA(a[i],shift)<<24 ;
+			if( get_flags( src->flags, SCL_DO_RED ) )   c |= (r[i]>>shift)<<16 ;
+			if( get_flags( src->flags, SCL_DO_GREEN ) ) c |= (g[i]>>shift)<<8 ;
+			if( get_flags( src->flags, SCL_DO_BLUE ) )  c |= (b[i]>>shift) ;
+			argb[i] = c ;
+		}
+	}else if( shift )
+	{
+		for( i = 0 ; i < width ; ++i )
+			argb[i] = MAKE_ARGB32( PACK_ALPHA(a[i],shift), r[i]>>shift, g[i]>>shift, b[i]>>shift );
+	}else
+		for( i = 0 ; i < width ; ++i )
+			argb[i] = MAKE_ARGB32( a[i], r[i], g[i], b[i] );
+	for( ; i < (int)dst->width ; ++i )
+		argb[i] = src->back_color ;
+	dst->back_color = src->back_color ;
+	dst->flags = (src->flags&SCL_DO_ALL)?SCL_DO_ALL:0 ;
+}
+
+void
+unpack_scanline( ASPackedScanline *src, ASScanline *dst )
+{
+	register int i ;
+	int width = MIN(src->width,dst->width);
+	register ARGB32 *argb = src->argb ;
+	register CARD32 *a = dst->alpha, *r = dst->red, *g = dst->green, *b = dst->blue ;
+
+	for( i = 0 ; i < width ; ++i )
+	{
+		register ARGB32 c = argb[i] ;
+		a[i] = ARGB32_ALPHA8(c);
+		r[i] = ARGB32_RED8(c);
+		g[i] = ARGB32_GREEN8(c);
+		b[i] = ARGB32_BLUE8(c);
+	}
+	dst->shift = 0 ;
+	dst->back_color = src->back_color ;
+	dst->flags = (dst->flags&(~SCL_DO_ALL))|src->flags ;
+}
+
 /* demosaicing */
 void
 destroy_asim_strip (ASIMStrip **pstrip)
@@ -15,12 +15,16 @@ extern "C" {
  * dithering of 16 bit data into standard 8-bit image.
  * SEE ALSO
  * Structures:
- *  	    ASScanline
+ *  	    ASScanline, ASPackedScanline
  *
  * Functions :
  *   ASScanline handling:
  *  	    prepare_scanline(), free_scanline()
  *
+ *   ASPackedScanline handling:
+ *  	    prepare_packed_scanline(), free_packed_scanline(),
+ *  	    pack_scanline(), unpack_scanline()
+ *
  * Other libAfterImage modules :
  *          asvisual.h imencdec.h asimage.h blender.h
  * AUTHOR
@@ -78,6 +82,31 @@ typedef struct ASScanline
 }ASScanline;
 /*******************/
 
+/****s* libAfterImage/ASPackedScanline
+ * NAME
+ * ASPackedScanline - structure to hold contents of the single scanline
+ * in packed ARGB32 format.
+ * DESCRIPTION
+ * ASPackedScanline holds 8 bit per channel data of the single scanline,
+ * with all 4 channels of each pixel packed into one ARGB32 value. That
+ * takes 4 times less memory then ASScanline, and is used for
+ * compositing when extra precision of 24.8 format is not needed.
+ * Scanline with flags of 0 is empty - all of its pixels are of
+ * back_color. Pixel data is aligned by 16 byte boundary.
+ * SEE ALSO
+ * ASScanline, merge_layers()
+ * SOURCE
+ */
+typedef struct ASPackedScanline
+{
+	CARD32	 	   flags ;   /* SCL_DO_ALL or 0 if scanline is empty */
+	void          *buffer ;
+	ARGB32        *argb ;
+	ARGB32         back_color;
+	unsigned int   width ;
+}ASPackedScanline;
+/*******************/
+
 #define ASIM_DEMOSAIC_DEFAULT_STRIP_SIZE 	5
 
 typedef struct ASIMStrip
@@ -146,6 +175,45 @@ ASScanline* prepare_scanline( unsigned int width, unsigned int shift,
 	                          ASScanline *reusable_memory, Bool BGR_mode);
 void       free_scanline( ASScanline *sl, Bool reusable );
 
+/****f* libAfterImage/prepare_packed_scanline()
+ * NAME
+ * prepare_packed_scanline()
+ * NAME
+ * free_packed_scanline()
+ * SYNOPSIS
+ * ASPackedScanline *prepare_packed_scanline( unsigned int width,
+ *                                  ASPackedScanline *reusable_memory );
+ * void free_packed_scanline( ASPackedScanline *psl, Bool reusable );
+ * INPUTS
+ * width           - width of the scanline.
+ * reusable_memory - preallocated object.
+ * DESCRIPTION
+ * Same as prepare_scanline() and free_scanline(), only for
+ * ASPackedScanline.
+ *********/
+/****f* libAfterImage/pack_scanline()
+ * NAME
+ * pack_scanline()
+ * NAME
+ * unpack_scanline()
+ * SYNOPSIS
+ * void pack_scanline  ( ASScanline *src, ASPackedScanline *dst );
+ * void unpack_scanline( ASPackedScanline *src, ASScanline *dst );
+ * INPUTS
+ * src - scanline to convert;
+ * dst - scanline to store result in.
+ * DESCRIPTION
+ * pack_scanline() converts planar ASScanline into ARGB32 pixels, taking
+ * its shift into account, and filling channels that are not set in
+ * its flags with back_color. unpack_scanline() does the reverse, and
+ * produces unshifted ASScanline with all the channels set.
+ *********/
+ASPackedScanline* prepare_packed_scanline( unsigned int width,
+										   ASPackedScanline *reusable_memory );
+void       free_packed_scanline( ASPackedScanline *psl, Bool reusable );
+void 	   pack_scanline( ASScanline *src, ASPackedScanline *dst );
+void 	   unpack_scanline( ASPackedScanline *src, ASScanline *dst );
+
 /* Scanline strips */
 void destroy_asim_strip (ASIMStrip **pstrip);
 ASIMStrip *create_asim_strip(unsigned int size, unsigned int width, int shift, int bgr);
@@ -68,6 +68,14 @@
 #include "asimage.h"
 #include "imencdec.h"
 #include "transform.h"
+#include "asthreads.h"
+
+#ifdef ASIM_X86_SIMD_DISPATCH
+#include <immintrin.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 ASVisual __transform_fake_asv = {0};
 
@@ -485,6 +493,198 @@ make_component_gradient16( register CARD32 *data, CARD16 from, CARD16 to, CARD8
 	}
 }
 
+/* Error diffusion above makes every pixel depend on the previous one, so 
+ * the only thing we can do in parallel is to interpolate all 4 channels at 
+ * once - results are the same as those of make_component_gradient16 : */
+typedef void (*make_gradient_segment_func)( ASScanline *scl, int offset, ARGB32 from, ARGB32 to, ARGB32 seed, int len, ASFlagType filter );
+/* fills width pixels with period values repeated over and over : */
+typedef void (*fill_dither_pattern_func)( CARD32 *dst, CARD32 *pattern, int period, int width );
+/* dst[k] = src[index[k]] : */
+typedef void (*gather_dither_line_func)( CARD32 *dst, CARD32 *src, int *index, int width );
+
+static void
+make_gradient_segment_c( ASScanline *scl, int offset, ARGB32 from, ARGB32 to, ARGB32 seed, int len, ASFlagType filter )
+{
+	int color ;
+	for( color = 0 ; color < IC_NUM_CHANNELS ; ++color )
+		if( get_flags( filter, 0x01<<color ) )
+		{
+			LOCAL_DEBUG_OUT("channel %d from #%4.4lX to #%4.4lX, ofset = %d, step = %d",
+ 								color, ARGB32_CHAN8(from,color)<<8, ARGB32_CHAN8(to,color)<<8, offset, len );
+			make_component_gradient16( scl->channels[color]+offset,
+									   (CARD16)(ARGB32_CHAN8(from,color)<<8),
+									   (CARD16)(ARGB32_CHAN8(to,color)<<8),
+									   (CARD8)ARGB32_CHAN8(seed,color),
+									   len);
+		}
+}
+
+static void
+fill_dither_pattern_c( CARD32 *dst, CARD32 *pattern, int period, int width )
+{
+	int line ;
+	for( line = 0 ; line  < period ; line++ )
+	{
+		register int x ;
+		register CARD32 d = pattern[line] ;
+		for( x = line ; x < width ; x+=period )
+			dst[x] = d ;
+	}
+}
+
+static void
+gather_dither_line_c( CARD32 *dst, CARD32 *src, int *index, int width )
+{
+	register int k ;
+	for( k = 0 ; k < width ; ++k )
+		dst[k] = src[index[k]] ;
+}
+
+#ifdef ASIM_X86_SIMD_DISPATCH
+/* 12 is divisible by any count of dither lines we may have : */
+#define DITHER_PATTERN_SPAN		12
+
+static void __attribute__((target("sse2")))
+make_gradient_segment_sse2( ASScanline *scl, int offset, ARGB32 from, ARGB32 to, ARGB32 seed, int len, ASFlagType filter )
+{
+	int start[IC_NUM_CHANNELS], incr[IC_NUM_CHANNELS] ;
+	int color, i = 0 ;
+	__m128i curr, step, low_mask = _mm_set1_epi32( 0x00FF );
+
+	for( color = 0 ; color < IC_NUM_CHANNELS ; ++color )
+	{ /* same setup as in make_component_gradient16 - all values fit in 25 bits */
+		long from16 = ARGB32_CHAN8(from,color)<<8 ;
+		long seed16 = ARGB32_CHAN8(seed,color)<<8 ;
+		long c_incr = (((long)ARGB32_CHAN8(to,color)<<16)-(from16<<8))/len ;
+		start[color] = (from16<<8) + ((seed16 > c_incr)?c_incr:seed16) ;
+		incr[color] = c_incr ;
+	}
+	curr = _mm_loadu_si128( (__m128i*)&start[0] );
+	step = _mm_loadu_si128( (__m128i*)&incr[0] );
+#define GRADIENT_SEGMENT_STEP(v) 	do{ v = _mm_srai_epi32( curr, 8 ); 		curr = _mm_add_epi32( curr, _mm_add_epi32( _mm_srli_epi32( _mm_and_si128( curr, low_mask ), 1 ), step ) ); }while(0)
+	for( ; i+4 <= len ; i += 4 )
+	{
+		__m128i v0, v1, v2, v3, t0, t1, t2, t3, chan[IC_NUM_CHANNELS] ;
+		GRADIENT_SEGMENT_STEP(v0);
+		GRADIENT_SEGMENT_STEP(v1);
+		GRADIENT_SEGMENT_STEP(v2);
+		GRADIENT_SEGMENT_STEP(v3);
+		/* transposing 4 pixels of 4 channels into 4 channels of 4 pixels : */
+		t0 = _mm_unpacklo_epi32( v0, v1 );
+		t1 = _mm_unpacklo_epi32( v2, v3 );
+		t2 = _mm_unpackhi_epi32( v0, v1 );
+		t3 = _mm_unpackhi_epi32( v2, v3 );
+		chan[0] = _mm_unpacklo_epi64( t0, t1 );
+		chan[1] = _mm_unpackhi_epi64( t0, t1 );
+		chan[2] = _mm_unpacklo_epi64( t2, t3 );
+		chan[3] = _mm_unpackhi_epi64( t2, t3 );
+		for( color = 0 ; color < IC_NUM_CHANNELS ; ++color )
+			if( get_flags( filter, 0x01<<color ) )
+				_mm_storeu_si128( (__m128i*)(scl->channels[color]+offset+i), chan[color] );
+	}
+#undef GRADIENT_SEGMENT_STEP
+	if( i < len )
+	{
+		_mm_storeu_si128( (__m128i*)&start[0], curr );
+		for( color = 0 ; color < IC_NUM_CHANNELS ; ++color )
+			if( get_flags( filter, 0x01<<color ) )
+			{
+				register CARD32 *data = scl->channels[color]+offset ;
+				register int c = start[color], k ;
+				for( k = i ; k < len ; ++k )
+				{
+					data[k] = c>>8;
+					c += ((c&0x00FF)>>1)+incr[color] ;
+				}
+			}
+	}
+}
+
+static void __attribute__((target("sse2")))
+fill_dither_pattern_sse2( CARD32 *dst, CARD32 *pattern, int period, int width )
+{
+	CARD32 span[DITHER_PATTERN_SPAN] ;
+	__m128i v0, v1, v2 ;
+	int x = 0, k ;
+
+	for( k = 0 ; k < DITHER_PATTERN_SPAN ; ++k )
+		span[k] = pattern[k%period] ;
+	v0 = _mm_loadu_si128( (__m128i*)&span[0] );
+	v1 = _mm_loadu_si128( (__m128i*)&span[4] );
+	v2 = _mm_loadu_si128( (__m128i*)&span[8] );
+	for( ; x+DITHER_PATTERN_SPAN <= width ; x += DITHER_PATTERN_SPAN )
+	{
+		_mm_storeu_si128( (__m128i*)(dst+x), v0 );
+		_mm_storeu_si128( (__m128i*)(dst+x+4), v1 );
+		_mm_storeu_si128( (__m128i*)(dst+x+8), v2 );
+	}
+	for( k = 0 ; x < width ; ++x, ++k )
+		dst[x] = span[k] ;
+}
+
+static void __attribute__((target("avx2")))
+fill_dither_pattern_avx2( CARD32 *dst, CARD32 *pattern, int period, int width )
+{
+	CARD32 span[DITHER_PATTERN_SPAN*2] ;
+	__m256i v0, v1, v2 ;
+	int x = 0, k ;
+
+	for( k = 0 ; k < DITHER_PATTERN_SPAN*2 ; ++k )
+		span[k] = pattern[k%period] ;
+	v0 = _mm256_loadu_si256( (__m256i*)&span[0] );
+	v1 = _mm256_loadu_si256( (__m256i*)&span[8] );
+	v2 = _mm256_loadu_si256( (__m256i*)&span[16] );
+	for( ; x+DITHER_PATTERN_SPAN*2 <= width ; x += DITHER_PATTERN_SPAN*2 )
+	{
+		_mm256_storeu_si256( (__m256i*)(dst+x), v0 );
+		_mm256_storeu_si256( (__m256i*)(dst+x+8), v1 );
+		_mm256_storeu_si256( (__m256i*)(dst+x+16), v2 );
+	}
+	for( k = 0 ; x < width ; ++x, ++k )
+		dst[x] = span[k] ;
+}
+
+static void __attribute__((target("avx2")))
+gather_dither_line_avx2( CARD32 *dst, CARD32 *src, int *index, int width )
+{
+	int k = 0 ;
+	for( ; k+8 <= width ; k += 8 )
+	{
+		__m256i idx = _mm256_loadu_si256( (__m256i*)(index+k) );
+		_mm256_storeu_si256( (__m256i*)(dst+k), _mm256_i32gather_epi32( (const int*)src, idx, 4 ) );
+	}
+	for( ; k < width ; ++k )
+		dst[k] = src[index[k]] ;
+}
+#undef DITHER_PATTERN_SPAN
+#endif /* ASIM_X86_SIMD_DISPATCH */
+
+static make_gradient_segment_func make_gradient_segment_impl = make_gradient_segment_c ;
+static fill_dither_pattern_func fill_dither_pattern_impl = fill_dither_pattern_c ;
+static gather_dither_line_func gather_dither_line_impl = gather_dither_line_c ;
+static Bool gradient_impl_selected = False ;
+
+void
+select_gradient_impl( CARD32 cpu_features )
+{
+	make_gradient_segment_impl = make_gradient_segment_c ;
+	fill_dither_pattern_impl = fill_dither_pattern_c ;
+	gather_dither_line_impl = gather_dither_line_c ;
+#ifdef ASIM_X86_SIMD_DISPATCH
+	if( get_flags( cpu_features, ASIM_CPU_SSE2 ) )
+	{
+		make_gradient_segment_impl = make_gradient_segment_sse2 ;
+		fill_dither_pattern_impl = fill_dither_pattern_sse2 ;
+	}
+	if( get_flags( cpu_features, ASIM_CPU_AVX2 ) )
+	{
+		fill_dither_pattern_impl = fill_dither_pattern_avx2 ;
+		gather_dither_line_impl = gather_dither_line_avx2 ;
+	}
+#endif
+	gradient_impl_selected = True ;
+}
+
 
 static inline void
 copytintpad_scanline( ASScanline *src, ASScanline *dst, int offset, ARGB32 tint )
@@ -555,6 +755,67 @@ copytintpad_scanline( ASScanline *src, ASScanline *dst, int offset, ARGB32 tint
 	}
 }
 
+/* tinting of packed scanlines - same as above, only background treats
+ * anything above 0x7F as no tint at all : */
+static inline void
+tint_packed_scanline( register ARGB32 *data, int len, ARGB32 tint, Bool background )
+{
+	register int i ;
+	CARD32 ratio[IC_NUM_CHANNELS] ;
+	int chan ;
+	Bool identity = True ;
+
+	for( chan = 0 ; chan < IC_NUM_CHANNELS ; ++chan )
+	{
+		ratio[chan] = ARGB32_CHAN8(tint,chan)<<1 ;
+		if( background && ratio[chan] >= 254 )
+			ratio[chan] = 256 ;
+		if( ratio[chan] != 256 )
+			identity = False ;
+	}
+	if( identity )
+		return;
+	for( i = 0 ; i < len ; ++i )
+	{
+		register CARD32 c = data[i], res = 0 ;
+		for( chan = 0 ; chan < IC_NUM_CHANNELS ; ++chan )
+		{
+			register CARD32 v = ARGB32_CHAN8(c,chan)*ratio[chan] ;
+			/* blenders skip pixels with zero alpha, so it must not turn
+			 * to zero when it would not in 16 bit planar scanline : */
+			if( chan == IC_ALPHA && v > 0 && v < 0x0100 )
+				v = 0x0100 ;
+			v >>= 8 ;
+			res |= MAKE_ARGB32_CHAN8((v > 0x00FF)?0x00FF:v,chan);
+		}
+		data[i] = res ;
+	}
+}
+
+static inline void
+copytintpad_packed_scanline( ASPackedScanline *src, ASPackedScanline *dst, int offset, ARGB32 tint )
+{
+	register ARGB32 *pdst = dst->argb ;
+	int copy_width = 0, dst_offset = 0, src_offset = 0;
+	register int i ;
+
+	if( offset < 0 )
+		src_offset = -offset ;
+	else
+		dst_offset = MIN(offset,(int)dst->width) ;
+	if( src_offset < (int)src->width )
+		copy_width = MIN( (int)src->width-src_offset, (int)dst->width-dst_offset );
+
+	for( i = 0 ; i < dst_offset ; ++i )
+		pdst[i] = 0;
+	pdst += dst_offset ;
+	memcpy( pdst, src->argb+src_offset, copy_width*sizeof(ARGB32) );
+	tint_packed_scanline( pdst, copy_width, tint, True );
+	for( i = copy_width ; i < (int)dst->width-dst_offset ; ++i )
+		pdst[i] = 0;
+	dst->flags = SCL_DO_ALL ;
+}
+
 /* **********************************************************************************************/
 /* drawing gradient on scanline :  															   */
 /* **********************************************************************************************/
@@ -568,6 +829,8 @@ make_gradient_scanline( ASScanline *scl, ASGradient *grad, ASFlagType filter, AR
 		int last_idx = 0;
 		double last_offset = 0., *offsets = grad->offset ;
 		int *used = safecalloc(max_i+1, sizeof(int));
+		if( !gradient_impl_selected )
+			get_asimage_cpu_features();
 		/* lets find the color of the very first point : */
 		for( i = 0 ; i <= max_i ; ++i )
 			if( offsets[i] <= 0. )
@@ -609,18 +872,7 @@ make_gradient_scanline( ASScanline *scl, ASGradient *grad, ASFlagType filter, AR
 				step = (int)scl->width-offset ;
 			if( step > 0 )
 			{
-				int color ;
-				for( color = 0 ; color < IC_NUM_CHANNELS ; ++color )
-					if( get_flags( filter, 0x01<<color ) )
-					{
-						LOCAL_DEBUG_OUT("channel %d from #%4.4lX to #%4.4lX, ofset = %d, step = %d",
-	 	 									color, ARGB32_CHAN8(last_color,color)<<8, ARGB32_CHAN8(grad->color[new_idx],color)<<8, offset, step );
-						make_component_gradient16( scl->channels[color]+offset,
-												   (CARD16)(ARGB32_CHAN8(last_color,color)<<8),
-												   (CARD16)(ARGB32_CHAN8(grad->color[new_idx],color)<<8),
-												   (CARD8)ARGB32_CHAN8(seed,color),
-												   step);
-					}
+				make_gradient_segment_impl( scl, offset, last_color, grad->color[new_idx], seed, step, filter );
 				offset += step ;
 			}
 			last_offset = offsets[new_idx];
@@ -713,17 +965,20 @@ make_scales( int from_size, int to_size, int tail )
 }
 
 /* *******************************************************************/
-void
-scale_image_down( ASImageDecoder *imdec, ASImageOutput *imout, int h_ratio, int *scales_h, int* scales_v)
+/* Scaling of the range of lines. Lines are counted in terms of scales_v 
+ * indexes, which allows us to split image into independent bands, each 
+ * processed with its own decoder and output : */
+static void
+scale_image_down_lines( ASImageDecoder *imdec, ASImageOutput *imout, int h_ratio, int *scales_h, int* scales_v, 
+						int start_k, int end_k )
 {
 	ASScanline dst_line, total ;
-	int k = -1;
-	int max_k 	 = imout->im->height,
-		line_len = MIN(imout->im->width, imdec->out_width);
+	int k = start_k-1;
+	int line_len = MIN(imout->im->width, imdec->out_width);
 
 	prepare_scanline( imout->im->width, QUANT_ERR_BITS, &dst_line, imout->asv->BGR_mode );
 	prepare_scanline( imout->im->width, QUANT_ERR_BITS, &total, imout->asv->BGR_mode );
-	while( ++k < max_k )
+	while( ++k < end_k )
 	{
 		int reps = scales_v[k] ;
 		imdec->decode_image_scanline( imdec );
@@ -744,11 +999,16 @@ scale_image_down( ASImageDecoder *imdec, ASImageOutput *imout, int h_ratio, int
 	free_scanline(&total, True);
 }
 
-void
-scale_image_up( ASImageDecoder *imdec, ASImageOutput *imout, int h_ratio, int *scales_h, int* scales_v)
+/* Interpolation at step i uses source lines i-1, i, i+1 and i+2. Decoder 
+ * must be positioned at the line start_i-1 for any start_i > 0. Last step 
+ * uses stale 4th line left over from the step before, so the last range 
+ * must start at least 2 steps before max_i. */
+static void
+scale_image_up_lines( ASImageDecoder *imdec, ASImageOutput *imout, int h_ratio, int *scales_h, int* scales_v, 
+					  int start_i, int end_i, int max_i )
 {
 	ASScanline src_lines[4], *c1, *c2, *c3, *c4 = NULL;
-	int i = 0, max_i,
+	int i = 0,
 		line_len = MIN(imout->im->width, imdec->out_width),
 		out_width = imout->im->width;
 	ASScanline step ;
@@ -759,22 +1019,34 @@ scale_image_up( ASImageDecoder *imdec, ASImageOutput *imout, int h_ratio, int *s
 	prepare_scanline( out_width, 0, &(src_lines[3]), imout->asv->BGR_mode);
 	prepare_scanline( out_width, QUANT_ERR_BITS, &step, imout->asv->BGR_mode );
 
-/*	set_component(src_lines[0].red,0x00000000,0,out_width*3); */
-	imdec->decode_image_scanline( imdec );
-	src_lines[1].flags = imdec->buffer.flags ;
-	CHOOSE_SCANLINE_FUNC(h_ratio,imdec->buffer,src_lines[1],scales_h,line_len);
+	if( start_i == 0 ) 
+	{
+/*		set_component(src_lines[0].red,0x00000000,0,out_width*3); */
+		imdec->decode_image_scanline( imdec );
+		src_lines[1].flags = imdec->buffer.flags ;
+		CHOOSE_SCANLINE_FUNC(h_ratio,imdec->buffer,src_lines[1],scales_h,line_len);
 
-	step.flags = src_lines[0].flags = src_lines[1].flags ;
+		step.flags = src_lines[0].flags = src_lines[1].flags ;
 
-	SCANLINE_FUNC(copy_component,src_lines[1],src_lines[0],0,out_width);
+		SCANLINE_FUNC(copy_component,src_lines[1],src_lines[0],0,out_width);
 
-	imdec->decode_image_scanline( imdec );
-	src_lines[2].flags = imdec->buffer.flags ;
-	CHOOSE_SCANLINE_FUNC(h_ratio,imdec->buffer,src_lines[2],scales_h,line_len);
+		imdec->decode_image_scanline( imdec );
+		src_lines[2].flags = imdec->buffer.flags ;
+		CHOOSE_SCANLINE_FUNC(h_ratio,imdec->buffer,src_lines[2],scales_h,line_len);
+	}else
+	{	
+		for( i = 0 ; i < 3 ; ++i ) 
+		{
+			c1 = &(src_lines[(start_i+i)&0x03]);
+			imdec->decode_image_scanline( imdec );
+			c1->flags = imdec->buffer.flags ;
+			CHOOSE_SCANLINE_FUNC(h_ratio,imdec->buffer,*c1,scales_h,line_len);
+		}	 
+		step.flags = src_lines[start_i&0x03].flags ;
+	}
 
-	i = 0 ;
-	max_i = imdec->out_height-1 ;
-	LOCAL_DEBUG_OUT( "i = %d, max_i = %d", i, max_i );
+	i = start_i ;
+	LOCAL_DEBUG_OUT( "i = %d, end_i = %d, max_i = %d", i, end_i, max_i );
 	do
 	{
 		int S = scales_v[i] ;
@@ -818,8 +1090,9 @@ scale_image_up( ASImageDecoder *imdec, ASImageOutput *imout, int h_ratio, int *s
                 }
             }
         }
-	}while( ++i < max_i );
-    imout->output_image_scanline( imout, c3, 1);
+	}while( ++i < end_i );
+	if( end_i >= max_i ) 
+	    imout->output_image_scanline( imout, c3, 1);
 	free_scanline(&step, True);
 	free_scanline(&(src_lines[3]), True);
 	free_scanline(&(src_lines[2]), True);
@@ -827,19 +1100,20 @@ scale_image_up( ASImageDecoder *imdec, ASImageOutput *imout, int h_ratio, int *s
 	free_scanline(&(src_lines[0]), True);
 }
 
-void
-scale_image_up_dumb( ASImageDecoder *imdec, ASImageOutput *imout, int h_ratio, int *scales_h, int* scales_v)
+static void
+scale_image_up_dumb_lines( ASImageDecoder *imdec, ASImageOutput *imout, int h_ratio, int *scales_h, int* scales_v, 
+						   int start_y, int end_y )
 {
 	ASScanline src_line;
 	int	line_len = MIN(imout->im->width, imdec->out_width);
 	int	out_width = imout->im->width;
-	int y = 0 ;
+	int y = start_y ;
 
 	prepare_scanline( out_width, QUANT_ERR_BITS, &src_line, imout->asv->BGR_mode );
 
 	imout->tiling_step = 1 ;
-	LOCAL_DEBUG_OUT( "imdec->next_line = %d, imdec->out_height = %d", imdec->next_line, imdec->out_height );
-	while( y < (int)imdec->out_height )
+	LOCAL_DEBUG_OUT( "imdec->next_line = %d, start_y = %d, end_y = %d", imdec->next_line, start_y, end_y );
+	while( y < end_y )
 	{
 		imdec->decode_image_scanline( imdec );
 		src_line.flags = imdec->buffer.flags ;
@@ -853,6 +1127,149 @@ scale_image_up_dumb( ASImageDecoder *imdec, ASImageOutput *imout, int h_ratio, i
 	free_scanline(&src_line, True);
 }
 
+void
+scale_image_down( ASImageDecoder *imdec, ASImageOutput *imout, int h_ratio, int *scales_h, int* scales_v)
+{
+	scale_image_down_lines( imdec, imout, h_ratio, scales_h, scales_v, 0, imout->im->height );
+}
+
+void
+scale_image_up( ASImageDecoder *imdec, ASImageOutput *imout, int h_ratio, int *scales_h, int* scales_v)
+{
+	int max_i = imdec->out_height-1 ;
+	scale_image_up_lines( imdec, imout, h_ratio, scales_h, scales_v, 0, max_i, max_i );
+}
+
+void
+scale_image_up_dumb( ASImageDecoder *imdec, ASImageOutput *imout, int h_ratio, int *scales_h, int* scales_v)
+{
+	scale_image_up_dumb_lines( imdec, imout, h_ratio, scales_h, scales_v, 0, imdec->out_height );
+}
+
+/* *******************************************************************/
+/* Parallel scaling - destination is split into horizontal bands,   */
+/* each having its own decoder and output : 	                    */
+/* *******************************************************************/
+#define SCALE_BAND_MIN_LINES	32   /* don't bother spawning threads for less */
+
+typedef enum
+{
+	ASScale_Down = 0,
+	ASScale_UpDumb,
+	ASScale_Up
+}ASScaleType;
+
+typedef struct ASScaleBand
+{
+	ASImageDecoder *imdec ;
+	ASImageOutput  *imout ;
+	int start, end ;
+}ASScaleBand;
+
+typedef struct ASScaleJob
+{
+	ASScaleType type ;
+	int h_ratio ;
+	int *scales_h, *scales_v ;
+	int max_i ;
+	ASScaleBand *bands ;
+}ASScaleJob;
+
+static void
+scale_band_job( void *data, int job, int jobs_count )
+{
+	ASScaleJob *sj = (ASScaleJob*)data ;
+	ASScaleBand *band = &(sj->bands[job]);
+
+	if( sj->type == ASScale_Down )
+		scale_image_down_lines( band->imdec, band->imout, sj->h_ratio, sj->scales_h, sj->scales_v, band->start, band->end );
+	else if( sj->type == ASScale_UpDumb )
+		scale_image_up_dumb_lines( band->imdec, band->imout, sj->h_ratio, sj->scales_h, sj->scales_v, band->start, band->end );
+	else
+		scale_image_up_lines( band->imdec, band->imout, sj->h_ratio, sj->scales_h, sj->scales_v, band->start, band->end, sj->max_i );
+}
+
+/* Returns False if image should be scaled sequentially. First band reuses 
+ * caller's decoder and output, all others get their own. Top quality 
+ * output carries dithering error from line to line - so it cannot be 
+ * split without changing the result. */
+static Bool
+scale_image_in_bands( ASVisual *asv, ASImage *src, int clip_x, int clip_y, int clip_width, int clip_height,
+					  ASImageDecoder *imdec, ASImageOutput *imout, ASScaleType type, 
+					  int h_ratio, int *scales_h, int* scales_v )
+{
+	int threads = get_asimage_threads();
+	int total, bands_count, i, k ;
+	int src_start = 0, out_start = 0, sum = 0 ;
+	ASScaleJob sj ;
+	Bool success = True ;
+
+	if( threads <= 1 || imout->quality == ASIMAGE_QUALITY_TOP )
+		return False;
+
+	if( type == ASScale_Down )
+		total = imout->im->height ;
+	else if( type == ASScale_UpDumb )
+		total = imdec->out_height ;
+	else
+		total = imdec->out_height-1 ;
+	
+	bands_count = MIN(threads, total/SCALE_BAND_MIN_LINES);
+	if( bands_count <= 1 )
+		return False;
+
+	sj.type = type ;
+	sj.h_ratio = h_ratio ;
+	sj.scales_h = scales_h ;
+	sj.scales_v = scales_v ;
+	sj.max_i = total ;
+	sj.bands = safecalloc( bands_count, sizeof(ASScaleBand));
+	
+	sj.bands[0].imdec = imdec ; 
+	sj.bands[0].imout = imout ; 
+	for( i = 0, k = 0 ; i < bands_count ; ++i ) 
+	{
+		ASScaleBand *band = &(sj.bands[i]);
+		band->start = (total*i)/bands_count ;
+		band->end = (total*(i+1))/bands_count ;
+		if( i == 0 ) 
+			continue;
+		/* sum of scales preceding the band : */
+		for( ; k < band->start ; ++k ) 
+			sum += scales_v[k] ;
+		if( type == ASScale_Down ) 
+		{
+			src_start = sum ;
+			out_start = band->start ;
+		}else
+		{
+			src_start = (type == ASScale_Up)? band->start-1 : band->start ;
+			out_start = sum ;
+		}
+		band->imdec = start_image_decoding( asv, src, SCL_DO_ALL, clip_x, clip_y+src_start, 
+											clip_width, clip_height-src_start, NULL);
+		band->imout = start_image_output( asv, imout->im, imout->out_format, imout->buffer_shift, imout->quality );
+		if( band->imdec == NULL || band->imout == NULL )
+		{
+			success = False ; 
+			break;
+		}
+		band->imout->next_line = out_start ;
+	}
+
+	if( success ) 
+		run_asimage_jobs( scale_band_job, &sj, bands_count );
+
+	for( i = 1 ; i < bands_count ; ++i ) 
+	{
+		if( sj.bands[i].imout ) 
+			stop_image_output( &(sj.bands[i].imout) );
+		if( sj.bands[i].imdec ) 
+			stop_image_decoding( &(sj.bands[i].imdec) );
+	}
+	free( sj.bands );
+	return success;
+}
 
 static inline ASImage *
 create_destination_image( unsigned int width, unsigned int height, ASAltImFormats format, 
@@ -929,10 +1346,17 @@ scale_asimage( ASVisual *asv, ASImage *src, int to_width, int to_height,
 	}else
 	{
 		if( to_height <= src->height ) 					   /* scaling down */
-			scale_image_down( imdec, imout, h_ratio, scales_h, scales_v );
-		else if( quality == ASIMAGE_QUALITY_POOR || src->height <= 3 ) 
-			scale_image_up_dumb( imdec, imout, h_ratio, scales_h, scales_v );
-		else
+		{
+			if( !scale_image_in_bands( asv, src, 0, 0, src->width, src->height, imdec, imout, 
+									   ASScale_Down, h_ratio, scales_h, scales_v ) )
+				scale_image_down( imdec, imout, h_ratio, scales_h, scales_v );
+		}else if( quality == ASIMAGE_QUALITY_POOR || src->height <= 3 ) 
+		{
+			if( !scale_image_in_bands( asv, src, 0, 0, src->width, src->height, imdec, imout, 
+									   ASScale_UpDumb, h_ratio, scales_h, scales_v ) )
+				scale_image_up_dumb( imdec, imout, h_ratio, scales_h, scales_v );
+		}else if( !scale_image_in_bands( asv, src, 0, 0, src->width, src->height, imdec, imout, 
+										 ASScale_Up, h_ratio, scales_h, scales_v ) )
 			scale_image_up( imdec, imout, h_ratio, scales_h, scales_v );
 		stop_image_output( &imout );
 	}
@@ -1009,10 +1433,17 @@ scale_asimage2( ASVisual *asv, ASImage *src,
 	}else
 	{
 		if( to_height <= clip_height ) 					   /* scaling down */
-			scale_image_down( imdec, imout, h_ratio, scales_h, scales_v );
-		else if( quality == ASIMAGE_QUALITY_POOR || clip_height <= 3 ) 
-			scale_image_up_dumb( imdec, imout, h_ratio, scales_h, scales_v );
-		else
+		{
+			if( !scale_image_in_bands( asv, src, clip_x, clip_y, clip_width, clip_height, imdec, imout, 
+									   ASScale_Down, h_ratio, scales_h, scales_v ) )
+				scale_image_down( imdec, imout, h_ratio, scales_h, scales_v );
+		}else if( quality == ASIMAGE_QUALITY_POOR || clip_height <= 3 ) 
+		{
+			if( !scale_image_in_bands( asv, src, clip_x, clip_y, clip_width, clip_height, imdec, imout, 
+									   ASScale_UpDumb, h_ratio, scales_h, scales_v ) )
+				scale_image_up_dumb( imdec, imout, h_ratio, scales_h, scales_v );
+		}else if( !scale_image_in_bands( asv, src, clip_x, clip_y, clip_width, clip_height, imdec, imout, 
+										 ASScale_Up, h_ratio, scales_h, scales_v ) )
 			scale_image_up( imdec, imout, h_ratio, scales_h, scales_v );
 		stop_image_output( &imout );
 	}
@@ -1085,6 +1516,310 @@ LOCAL_DEBUG_OUT("tiling actually...%s", "");
 	return dst;
 }
 
+/* When caller asks for fast (or poor) quality output, 24.8 precision is
+ * not worth the trouble, so unless some of the layers has to be merged
+ * with the method only available for planar scanlines, we do it all in
+ * packed ARGB32 format, which is 4 times less data to move around.
+ * Results differ from planar composition in the least significant bits,
+ * so default and better quality output is always composed planar.
+ * Layers tinted brighter than original have values that do not fit into
+ * 8 bits, and have to go planar as well : */
+static merge_packed_scanlines_func *
+get_packed_merge_funcs( ASImageDecoder **imdecs, ASImageLayer *layers, int count, int quality )
+{
+	merge_packed_scanlines_func *funcs ;
+	ASImageLayer *pcurr = layers[0].next?layers[0].next:&(layers[1]) ;
+	int i ;
+
+	if( quality > ASIMAGE_QUALITY_FAST )
+		return NULL;
+	funcs = safecalloc( count, sizeof(merge_packed_scanlines_func) );
+	for( i = 1 ; i < count ; ++i )
+	{
+		if( imdecs[i] )
+			if( (pcurr->tint&0x80808080) != 0 ||
+				(funcs[i] = blend_scanlines_func2packed( pcurr->merge_scanlines )) == NULL )
+			{
+				free( funcs );
+				return NULL;
+			}
+		pcurr = (pcurr->next!=NULL)?pcurr->next:pcurr+1 ;
+	}
+	return funcs;
+}
+
+static ASImageDecoder *
+start_layer_decoding( ASVisual *asv, ASImageLayer *layer, Bool background )
+{
+	ASImageDecoder *imdec = start_image_decoding(asv, layer->im, SCL_DO_ALL,
+				                                 layer->clip_x, layer->clip_y,
+												 layer->clip_width, layer->clip_height,
+												 layer->bevel);
+	if( imdec )
+	{
+		if( layer->bevel_width != 0 && layer->bevel_height != 0 )
+			set_decoder_bevel_geom( imdec,
+			                        layer->bevel_x, layer->bevel_y,
+									layer->bevel_width, layer->bevel_height );
+		if( layer->tint == 0 && !background )
+			set_decoder_shift( imdec, 8 );
+		if( layer->im == NULL )
+			set_decoder_back_color( imdec, layer->solid_color );
+	}
+	return imdec;
+}
+
+/* positions decoders of all the layers so that next decoded line is the
+ * one that goes into destination line y : */
+static void
+seek_layers_decoding( ASImageDecoder **imdecs, ASImageLayer *layers, int count, int y )
+{
+	ASImageLayer *pcurr = layers ;
+	int i ;
+	for( i = 0 ; i < count ; ++i )
+	{
+		if( imdecs[i] && pcurr->dst_y < y  )
+			imdecs[i]->next_line = imdecs[i]->offset_y + (y - pcurr->dst_y) ;
+		pcurr = (pcurr->next!=NULL)?pcurr->next:pcurr+1 ;
+	}
+}
+
+/* Both of the following compose destination lines from start_y to end_y,
+ * lines outside of min_y - max_y range are left empty : */
+static void
+merge_packed_layers( ASImageOutput *imout, ASImageDecoder **imdecs,
+					 ASImageLayer *layers, int count,
+					 merge_packed_scanlines_func *merge_funcs, int dst_width,
+					 int min_y, int max_y, int start_y, int end_y )
+{
+	ASPackedScanline dst_line, *buffers ;
+	ASImageLayer *pcurr ;
+	ARGB32 bg_tint = (layers[0].tint==0)?0x7F7F7F7F:layers[0].tint ;
+	int bg_bottom = layers[0].dst_y+layers[0].clip_height+imdecs[0]->bevel_v_addon ;
+	int i, y ;
+
+	prepare_packed_scanline( dst_width, &dst_line );
+	buffers = safecalloc( count, sizeof(ASPackedScanline) );
+	for( i = 0 ; i < count ; ++i )
+		if( imdecs[i] )
+			prepare_packed_scanline( imdecs[i]->buffer.width, &(buffers[i]) );
+
+	dst_line.back_color = imdecs[0]->back_color ;
+	dst_line.flags = 0 ;
+	for( y = start_y ; y < min_y && y < end_y ; ++y  )
+		output_image_packed_scanline( imout, &dst_line );
+	for( ; y < max_y && y < end_y ; ++y  )
+	{
+		if( layers[0].dst_y <= y && bg_bottom > y )
+			decode_image_packed_scanline( imdecs[0], &(buffers[0]) );
+		else
+		{
+			for( i = 0 ; i < (int)buffers[0].width ; ++i )
+				buffers[0].argb[i] = imdecs[0]->back_color ;
+		}
+		copytintpad_packed_scanline( &(buffers[0]), &dst_line, layers[0].dst_x, bg_tint );
+		pcurr = layers[0].next?layers[0].next:&(layers[1]) ;
+		for( i = 1 ; i < count ; i++ )
+		{
+			if( imdecs[i] && pcurr->dst_y <= y &&
+				pcurr->dst_y+(int)pcurr->clip_height+(int)imdecs[i]->bevel_v_addon > y )
+			{
+				register ASPackedScanline *b = &(buffers[i]);
+				decode_image_packed_scanline( imdecs[i], b );
+				if( pcurr->tint != 0 )
+					tint_packed_scanline( b->argb, b->width, pcurr->tint, False );
+				merge_funcs[i]( &dst_line, b, pcurr->dst_x );
+			}
+			pcurr = (pcurr->next!=NULL)?pcurr->next:pcurr+1 ;
+		}
+		output_image_packed_scanline( imout, &dst_line );
+	}
+	dst_line.flags = 0 ;
+	for( ; y < end_y ; y++  )
+		output_image_packed_scanline( imout, &dst_line );
+
+	for( i = 0 ; i < count ; ++i )
+		free_packed_scanline( &(buffers[i]), True );
+	free( buffers );
+	free_packed_scanline( &dst_line, True );
+}
+
+static void
+merge_planar_layers( ASImageOutput *imout, ASImageDecoder **imdecs,
+					 ASImageLayer *layers, int count, int dst_width,
+					 int min_y, int max_y, int start_y, int end_y )
+{
+	ASScanline dst_line ;
+	ASImageLayer *pcurr ;
+	int bg_tint = (layers[0].tint==0)?0x7F7F7F7F:layers[0].tint ;
+	int bg_bottom = layers[0].dst_y+layers[0].clip_height+imdecs[0]->bevel_v_addon ;
+	int i, y ;
+
+	prepare_scanline( dst_width, QUANT_ERR_BITS, &dst_line, imout->asv->BGR_mode );
+	dst_line.back_color = imdecs[0]->back_color ;
+	dst_line.flags = 0 ;
+	for( y = start_y ; y < min_y && y < end_y ; ++y  )
+		imout->output_image_scanline( imout, &dst_line, 1);
+	dst_line.flags = SCL_DO_ALL ;
+	for( ; y < max_y && y < end_y ; ++y  )
+	{
+		if( layers[0].dst_y <= y && bg_bottom > y )
+			imdecs[0]->decode_image_scanline( imdecs[0] );
+		else
+		{
+			imdecs[0]->buffer.back_color = imdecs[0]->back_color ;
+			imdecs[0]->buffer.flags = 0 ;
+		}
+		copytintpad_scanline( &(imdecs[0]->buffer), &dst_line, layers[0].dst_x, bg_tint );
+		pcurr = layers[0].next?layers[0].next:&(layers[1]) ;
+		for( i = 1 ; i < count ; i++ )
+		{
+			if( imdecs[i] && pcurr->dst_y <= y &&
+				pcurr->dst_y+(int)pcurr->clip_height+(int)imdecs[i]->bevel_v_addon > y )
+			{
+				register ASScanline *b = &(imdecs[i]->buffer);
+				CARD32 tint = pcurr->tint ;
+				imdecs[i]->decode_image_scanline( imdecs[i] );
+				if( tint != 0 )
+				{
+					tint_component_mod( b->red,   (CARD16)(ARGB32_RED8(tint)<<1),   b->width );
+					tint_component_mod( b->green, (CARD16)(ARGB32_GREEN8(tint)<<1), b->width );
+  				   	tint_component_mod( b->blue,  (CARD16)(ARGB32_BLUE8(tint)<<1),  b->width );
+				  	tint_component_mod( b->alpha, (CARD16)(ARGB32_ALPHA8(tint)<<1), b->width );
+				}
+				pcurr->merge_scanlines( &dst_line, b, pcurr->dst_x );
+			}
+			pcurr = (pcurr->next!=NULL)?pcurr->next:pcurr+1 ;
+		}
+		imout->output_image_scanline( imout, &dst_line, 1);
+	}
+	dst_line.back_color = imdecs[0]->back_color ;
+	dst_line.flags = 0 ;
+	for( ; y < end_y ; y++  )
+		imout->output_image_scanline( imout, &dst_line, 1);
+	free_scanline( &dst_line, True );
+}
+
+/* *******************************************************************/
+/* Parallel merging - destination is split into horizontal bands,   */
+/* each having its own set of decoders and output, while layers and */
+/* merging functions are shared : 								    */
+/* *******************************************************************/
+#define MERGE_BAND_MIN_LINES	32   /* don't bother spawning threads for less */
+
+typedef struct ASMergeBand
+{
+	ASImageDecoder **imdecs ;
+	ASImageOutput  *imout ;
+	int start, end ;
+}ASMergeBand;
+
+typedef struct ASMergeJob
+{
+	ASImageLayer *layers ;
+	int count ;
+	merge_packed_scanlines_func *packed_funcs ;
+	int dst_width ;
+	int min_y, max_y ;
+	ASMergeBand *bands ;
+}ASMergeJob;
+
+static void
+merge_band_job( void *data, int job, int jobs_count )
+{
+	ASMergeJob *mj = (ASMergeJob*)data ;
+	ASMergeBand *band = &(mj->bands[job]);
+
+	if( mj->packed_funcs )
+		merge_packed_layers( band->imout, band->imdecs, mj->layers, mj->count, mj->packed_funcs,
+							 mj->dst_width, mj->min_y, mj->max_y, band->start, band->end );
+	else
+		merge_planar_layers( band->imout, band->imdecs, mj->layers, mj->count,
+							 mj->dst_width, mj->min_y, mj->max_y, band->start, band->end );
+}
+
+/* Returns False if layers should be merged sequentially. First band
+ * reuses caller's decoders and output, all others get their own.
+ * Caller's decoders must be already positioned at min_y. Output must not
+ * be tiled, as that would write into other bands - we simply compose
+ * everything up to the bottom of the destination instead. */
+static Bool
+merge_layers_in_bands( ASVisual *asv, ASImageLayer *layers, int count,
+					   ASImageDecoder **imdecs, ASImageOutput *imout,
+					   merge_packed_scanlines_func *packed_funcs,
+					   int dst_width, int dst_height, int min_y, int max_y )
+{
+	int threads = get_asimage_threads();
+	int bands_count, i, k ;
+	ASMergeJob mj ;
+	Bool success = True ;
+
+	if( threads <= 1 || imout->quality == ASIMAGE_QUALITY_TOP )
+		return False;
+
+	/* only lines that actually have layers in them are worth splitting : */
+	bands_count = MIN(threads, (max_y-min_y)/MERGE_BAND_MIN_LINES);
+	if( bands_count <= 1 )
+		return False;
+
+	mj.layers = layers ;
+	mj.count = count ;
+	mj.packed_funcs = packed_funcs ;
+	mj.dst_width = dst_width ;
+	mj.min_y = min_y ;
+	mj.max_y = max_y ;
+	mj.bands = safecalloc( bands_count, sizeof(ASMergeBand));
+
+	for( i = 0 ; i < bands_count ; ++i )
+	{
+		ASMergeBand *band = &(mj.bands[i]);
+		ASImageLayer *pcurr = layers ;
+
+		band->start = (i == 0)? 0 : min_y + ((max_y-min_y)*i)/bands_count ;
+		band->end = (i == bands_count-1)? dst_height : min_y + ((max_y-min_y)*(i+1))/bands_count ;
+		if( i == 0 )
+		{
+			band->imdecs = imdecs ;
+			band->imout = imout ;
+			continue;
+		}
+		band->imdecs = safecalloc( count, sizeof(ASImageDecoder*));
+		for( k = 0 ; k < count ; ++k )
+		{
+			if( imdecs[k] )
+				if( (band->imdecs[k] = start_layer_decoding( asv, pcurr, (k == 0) )) == NULL )
+					success = False ;
+			pcurr = (pcurr->next!=NULL)?pcurr->next:pcurr+1 ;
+		}
+		band->imout = start_image_output( asv, imout->im, imout->out_format, imout->buffer_shift, imout->quality );
+		if( !success || band->imout == NULL )
+		{
+			success = False ;
+			break;
+		}
+		seek_layers_decoding( band->imdecs, layers, count, band->start );
+		band->imout->next_line = band->start ;
+	}
+
+	if( success )
+		run_asimage_jobs( merge_band_job, &mj, bands_count );
+
+	for( i = 1 ; i < bands_count ; ++i )
+	{
+		if( mj.bands[i].imout )
+			stop_image_output( &(mj.bands[i].imout) );
+		if( mj.bands[i].imdecs )
+		{
+			for( k = 0 ; k < count ; ++k )
+				if( mj.bands[i].imdecs[k] )
+					stop_image_decoding( &(mj.bands[i].imdecs[k]) );
+			free( mj.bands[i].imdecs );
+		}
+	}
+	free( mj.bands );
+	return success;
+}
+
 ASImage *
 merge_layers( ASVisual *asv,
 				ASImageLayer *layers, int count,
@@ -1097,7 +1832,6 @@ merge_layers( ASVisual *asv,
 	ASImageOutput  *imout ;
 	ASImageLayer *pcurr = layers;
 	int i ;
-	ASScanline dst_line ;
 	START_TIME(started);
 
 LOCAL_DEBUG_CALLER_OUT( "dst_width = %d, dst_height = %d", dst_width, dst_height );
@@ -1108,9 +1842,6 @@ LOCAL_DEBUG_CALLER_OUT( "dst_width = %d, dst_height = %d", dst_width, dst_height
 
 	if( asv == NULL ) 	asv = &__transform_fake_asv ;
 
-	prepare_scanline( dst_width, QUANT_ERR_BITS, &dst_line, asv->BGR_mode );
-	dst_line.flags = SCL_DO_ALL ;
-
 	imdecs = safecalloc( count+20, sizeof(ASImageDecoder*));
 
 	for( i = 0 ; i < count ; i++ )
@@ -1118,20 +1849,7 @@ LOCAL_DEBUG_CALLER_OUT( "dst_width = %d, dst_height = %d", dst_width, dst_height
 		/* all laayers but first must have valid image or solid_color ! */
 		if( (pcurr->im != NULL || pcurr->solid_color != 0 || i == 0) &&
 			pcurr->dst_x < (int)dst_width && pcurr->dst_x+(int)pcurr->clip_width > 0 )
-		{
-			imdecs[i] = start_image_decoding(asv, pcurr->im, SCL_DO_ALL,
-				                             pcurr->clip_x, pcurr->clip_y,
-											 pcurr->clip_width, pcurr->clip_height,
-											 pcurr->bevel);
-			if( pcurr->bevel_width != 0 && pcurr->bevel_height != 0 )
-				set_decoder_bevel_geom( imdecs[i],
-				                        pcurr->bevel_x, pcurr->bevel_y,
-										pcurr->bevel_width, pcurr->bevel_height );
-  			if( pcurr->tint == 0 && i != 0 )
-				set_decoder_shift( imdecs[i], 8 );
-			if( pcurr->im == NULL )
-				set_decoder_back_color( imdecs[i], pcurr->solid_color );
-		}
+			imdecs[i] = start_layer_decoding( asv, pcurr, (i == 0) );
 		if( pcurr->next == pcurr )
 			break;
 		else
@@ -1147,13 +1865,11 @@ LOCAL_DEBUG_CALLER_OUT( "dst_width = %d, dst_height = %d", dst_width, dst_height
 				stop_image_decoding( &(imdecs[i]) );
 
         destroy_asimage( &dst );
-		free_scanline( &dst_line, True );
     }else
 	{
-		int y, max_y = 0;
+		int max_y = 0;
 		int min_y = dst_height;
-		int bg_tint = (layers[0].tint==0)?0x7F7F7F7F:layers[0].tint ;
-		int bg_bottom = layers[0].dst_y+layers[0].clip_height+imdecs[0]->bevel_v_addon ;
+		merge_packed_scanlines_func *packed_funcs ;
 LOCAL_DEBUG_OUT("blending actually...%s", "");
 		pcurr = layers ;
 		for( i = 0 ; i < count ; i++ )
@@ -1176,58 +1892,24 @@ LOCAL_DEBUG_OUT("blending actually...%s", "");
 			
 		if( max_y >= (int)dst_height )
 			max_y = dst_height ;
-		else
-			imout->tiling_step = max_y ;
 
 LOCAL_DEBUG_OUT( "min_y = %d, max_y = %d", min_y, max_y );
-		dst_line.back_color = imdecs[0]->back_color ;
-		dst_line.flags = 0 ;
-		for( y = 0 ; y < min_y ; ++y  )
-			imout->output_image_scanline( imout, &dst_line, 1);
-		dst_line.flags = SCL_DO_ALL ;
-		pcurr = layers ;
-		for( i = 0 ; i < count ; ++i )
-		{
-			if( imdecs[i] && pcurr->dst_y < min_y  )
-				imdecs[i]->next_line = min_y - pcurr->dst_y ;
-			pcurr = (pcurr->next!=NULL)?pcurr->next:pcurr+1 ;
-		}
-		for( ; y < max_y ; ++y  )
+		seek_layers_decoding( imdecs, layers, count, min_y );
+		packed_funcs = get_packed_merge_funcs( imdecs, layers, count, imout->quality );
+		if( !merge_layers_in_bands( asv, layers, count, imdecs, imout, packed_funcs,
+									dst_width, dst_height, min_y, max_y ) )
 		{
-			if( layers[0].dst_y <= y && bg_bottom > y )
-				imdecs[0]->decode_image_scanline( imdecs[0] );
+			if( max_y < (int)dst_height )
+				imout->tiling_step = max_y ;
+			if( packed_funcs )
+				merge_packed_layers( imout, imdecs, layers, count, packed_funcs,
+									 dst_width, min_y, max_y, 0, dst_height );
 			else
-			{
-				imdecs[0]->buffer.back_color = imdecs[0]->back_color ;
-				imdecs[0]->buffer.flags = 0 ;
-			}
-			copytintpad_scanline( &(imdecs[0]->buffer), &dst_line, layers[0].dst_x, bg_tint );
-			pcurr = layers[0].next?layers[0].next:&(layers[1]) ;
-			for( i = 1 ; i < count ; i++ )
-			{
-				if( imdecs[i] && pcurr->dst_y <= y &&
-					pcurr->dst_y+(int)pcurr->clip_height+(int)imdecs[i]->bevel_v_addon > y )
-				{
-					register ASScanline *b = &(imdecs[i]->buffer);
-					CARD32 tint = pcurr->tint ;
-					imdecs[i]->decode_image_scanline( imdecs[i] );
-					if( tint != 0 )
-					{
-						tint_component_mod( b->red,   (CARD16)(ARGB32_RED8(tint)<<1),   b->width );
-						tint_component_mod( b->green, (CARD16)(ARGB32_GREEN8(tint)<<1), b->width );
-  					   	tint_component_mod( b->blue,  (CARD16)(ARGB32_BLUE8(tint)<<1),  b->width );
-					  	tint_component_mod( b->alpha, (CARD16)(ARGB32_ALPHA8(tint)<<1), b->width );
-					}
-					pcurr->merge_scanlines( &dst_line, b, pcurr->dst_x );
-				}
-				pcurr = (pcurr->next!=NULL)?pcurr->next:pcurr+1 ;
-			}
-			imout->output_image_scanline( imout, &dst_line, 1);
+				merge_planar_layers( imout, imdecs, layers, count,
+									 dst_width, min_y, max_y, 0, dst_height );
 		}
-		dst_line.back_color = imdecs[0]->back_color ;
-		dst_line.flags = 0 ;
-		for( ; y < (int)dst_height ; y++  )
-			imout->output_image_scanline( imout, &dst_line, 1);
+		if( packed_funcs )
+			free( packed_funcs );
 		stop_image_output( &imout );
 	}
 	for( i = 0 ; i < count ; i++ )
@@ -1236,7 +1918,6 @@ LOCAL_DEBUG_OUT( "min_y = %d, max_y = %d", min_y, max_y );
 			stop_image_decoding( &(imdecs[i]) );
 		}
 	free( imdecs );
-	free_scanline( &dst_line, True );
 	SHOW_TIME("", started);
 	return dst;
 }
@@ -1299,16 +1980,7 @@ LOCAL_DEBUG_CALLER_OUT( "width = %d, height = %d, filetr = 0x%lX, dither_count =
 					LOCAL_DEBUG_OUT( "back_color = %8.8lX", result.back_color);
 				}else
 				{
-					register CARD32  *dst = result.channels[color] ;
-					for( line = 0 ; line  < dither_lines_num ; line++ )
-					{
-						register int x ;
-						register CARD32 d = chan_data[line] ;
-						for( x = line ; x < width ; x+=dither_lines_num )
-						{
-							dst[x] = d ;
-						}
-					}
+					fill_dither_pattern_impl( result.channels[color], &(chan_data[0]), dither_lines_num, width );
 					set_flags(result.flags, 0x01<<color);
 				}
 			}
@@ -1358,10 +2030,13 @@ make_gradient_diag_height( ASImageOutput *imout, ASScanline *dither_lines, int d
 	int eps;
 	ASScanline result;
 	int *offsets ;
+	int line_len = dither_lines[0].width ;
+	CARD32 *chan_lines[IC_NUM_CHANNELS] = {NULL, NULL, NULL, NULL} ;
+	int *index[MAX_GRADIENT_DITHER_LINES] ;
+	int color ;
 
 	prepare_scanline( width, QUANT_ERR_BITS, &result, imout->asv->BGR_mode );
-	offsets = safemalloc( sizeof(int)*width );
-	offsets[0] = 0 ;
+	offsets = safecalloc( width, sizeof(int) );
 
 	eps = -(bigger>>1);
 	for ( i = 0 ; i < bigger ; i++ )
@@ -1377,50 +2052,42 @@ make_gradient_diag_height( ASImageOutput *imout, ASScanline *dither_lines, int d
 		}
 	}
 
+	/* dither lines are alternated with every pixel, so we put them all into 
+	 * single buffer per channel, and then each row could be gathered using 
+	 * one of dither_lines_num precomputed index arrays : */
+	for( color = 0 ; color < IC_NUM_CHANNELS ; ++color )
+		if( get_flags( filter, 0x01<<color ) )
+		{
+			chan_lines[color] = safemalloc( line_len*dither_lines_num*sizeof(CARD32) );
+			for( line = 0 ; line < dither_lines_num ; ++line )
+				memcpy( chan_lines[color]+line*line_len, dither_lines[line].channels[color], line_len*sizeof(CARD32) );
+		}
+	for( line = 0 ; line < dither_lines_num ; ++line )
+	{
+		index[line] = safemalloc( width*sizeof(int) );
+		for( k = 0 ; k < width ; k++ )
+			index[line][k] = ((line+k)%dither_lines_num)*line_len + offsets[k] ;
+	}
+
 	if( from_bottom )
 		toggle_image_output_direction( imout );
 
 	result.flags = (filter&SCL_DO_ALL);
-	if( (filter&SCL_DO_ALL) == SCL_DO_ALL )
-	{
-		for( i = 0 ; i < height ; i++ )
-		{
-			for( k = 0 ; k < width ; k++ )
-			{
-				int offset = i+offsets[k] ;
-				CARD32 **src_chan = &(dither_lines[line].channels[0]) ;
-				result.alpha[k] = src_chan[IC_ALPHA][offset] ;
-				result.red  [k] = src_chan[IC_RED]  [offset] ;
-				result.green[k] = src_chan[IC_GREEN][offset] ;
-				result.blue [k] = src_chan[IC_BLUE] [offset] ;
-				if( ++line >= dither_lines_num )
-					line = 0 ;
-			}
-			imout->output_image_scanline( imout, &result, 1);
-		}
-	}else
+	line = 0 ;
+	for( i = 0 ; i < height ; i++ )
 	{
-		for( i = 0 ; i < height ; i++ )
-		{
-			for( k = 0 ; k < width ; k++ )
-			{
-				int offset = i+offsets[k] ;
-				CARD32 **src_chan = &(dither_lines[line].channels[0]) ;
-				if( get_flags(filter, SCL_DO_ALPHA) )
-					result.alpha[k] = src_chan[IC_ALPHA][offset] ;
-				if( get_flags(filter, SCL_DO_RED) )
-					result.red[k]   = src_chan[IC_RED]  [offset] ;
-				if( get_flags(filter, SCL_DO_GREEN) )
-					result.green[k] = src_chan[IC_GREEN][offset] ;
-				if( get_flags(filter, SCL_DO_BLUE) )
-					result.blue[k]  = src_chan[IC_BLUE] [offset] ;
-				if( ++line >= dither_lines_num )
-					line = 0 ;
-			}
-			imout->output_image_scanline( imout, &result, 1);
-		}
+		for( color = 0 ; color < IC_NUM_CHANNELS ; ++color )
+			if( chan_lines[color] )
+				gather_dither_line_impl( result.channels[color], chan_lines[color]+i, index[line], width );
+		imout->output_image_scanline( imout, &result, 1);
+		line = (line+width)%dither_lines_num ;
 	}
 
+	for( color = 0 ; color < IC_NUM_CHANNELS ; ++color )
+		if( chan_lines[color] )
+			free( chan_lines[color] );
+	for( line = 0 ; line < dither_lines_num ; ++line )
+		free( index[line] );
 	free( offsets );
 	free_scanline( &result, True );
 }
@@ -1456,6 +2123,201 @@ get_best_grad_back_color( ASGradient *grad )
 	return back_color;
 }
 
+/* **************************************************************************************/
+/* GRADIENT cache : 																   */
+/* **************************************************************************************/
+/* Frame decorations keep on rendering the very same gradients of the very same 
+ * size, so we keep the most recently rendered ones around, and hand out 
+ * references to their already encoded rows instead of rendering them again. 
+ * Disabled until set_gradient_cache_budget() is called : */
+#define GRADIENT_CACHE_MAX_ENTRIES		32
+/* we don't want to hold on to huge root backgrounds : */
+#define GRADIENT_CACHE_MAX_PIXELS		(1024*1024)
+
+typedef struct ASGradientCacheEntry
+{
+	/* key : */
+	int 		  type, npoints ;
+	ARGB32 		 *color ;
+	double 		 *offset ;
+	int 		  width, height ;
+	ASFlagType 	  filter ;
+	unsigned int  compression ;
+	int 		  quality ;		/* defines dither seeds too */
+	/* value : */
+	ASImage 	 *im ;
+	size_t 		  size ;		/* asimage_memory_size() of im */
+	unsigned long last_used ;
+}ASGradientCacheEntry;
+
+static ASGradientCacheEntry *__as_gradient_cache = NULL ;
+static size_t __as_gradient_cache_budget = 0 ;
+static size_t __as_gradient_cache_used = 0 ;
+static unsigned long __as_gradient_cache_clock = 0 ;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t __as_gradient_cache_lock = PTHREAD_MUTEX_INITIALIZER ;
+#define LOCK_GRADIENT_CACHE()		pthread_mutex_lock( &__as_gradient_cache_lock )
+#define UNLOCK_GRADIENT_CACHE()		pthread_mutex_unlock( &__as_gradient_cache_lock )
+#else
+#define LOCK_GRADIENT_CACHE()		do{}while(0)
+#define UNLOCK_GRADIENT_CACHE()		do{}while(0)
+#endif
+
+static void
+free_gradient_cache_entry( ASGradientCacheEntry *entry )
+{
+	if( entry->im )
+		destroy_asimage( &(entry->im) );
+	__as_gradient_cache_used -= entry->size ;
+	if( entry->color )
+		free( entry->color );
+	if( entry->offset )
+		free( entry->offset );
+	memset( entry, 0x00, sizeof(ASGradientCacheEntry) );
+}
+
+static ASGradientCacheEntry *
+find_gradient_cache_entry( ASGradient *grad, int width, int height, ASFlagType filter, unsigned int compression, int quality )
+{
+	int i ;
+	if( __as_gradient_cache == NULL )
+		return NULL;
+	for( i = 0 ; i < GRADIENT_CACHE_MAX_ENTRIES ; ++i )
+	{
+		ASGradientCacheEntry *entry = &(__as_gradient_cache[i]);
+		if( entry->im != NULL &&
+			entry->type == grad->type && entry->npoints == grad->npoints &&
+			entry->width == width && entry->height == height &&
+			entry->filter == filter && entry->compression == compression &&
+			entry->quality == quality &&
+			memcmp( entry->color, grad->color, grad->npoints*sizeof(ARGB32) ) == 0 &&
+			memcmp( entry->offset, grad->offset, grad->npoints*sizeof(double) ) == 0 )
+			return entry;
+	}
+	return NULL;
+}
+
+/* fills rows of blank im with references to rows of cached gradient : */
+static Bool
+fetch_cached_gradient( ASGradient *grad, ASImage *im, ASFlagType filter, unsigned int compression, int quality )
+{
+	ASGradientCacheEntry *entry ;
+	Bool found = False ;
+
+	LOCK_GRADIENT_CACHE();
+	if( (entry = find_gradient_cache_entry( grad, im->width, im->height, filter, compression, quality )) != NULL )
+	{
+		int chan ;
+		for( chan = 0 ; chan < IC_NUM_CHANNELS;  chan++ )
+		{
+			register int i = im->height;
+			register ASStorageID *dst_rows = im->channels[chan] ;
+			register ASStorageID *src_rows = entry->im->channels[chan] ;
+			while( --i >= 0 )
+				dst_rows[i] = dup_data( NULL, src_rows[i] );
+		}
+		im->back_color = entry->im->back_color ;
+		entry->last_used = ++__as_gradient_cache_clock ;
+		found = True ;
+	}
+	UNLOCK_GRADIENT_CACHE();
+	return found;
+}
+
+/* least recently used entry, or the empty one : */
+static ASGradientCacheEntry *
+get_gradient_cache_victim()
+{
+	ASGradientCacheEntry *entry = &(__as_gradient_cache[0]) ;
+	int i ;
+	for( i = 1 ; i < GRADIENT_CACHE_MAX_ENTRIES && entry->im != NULL ; ++i )
+		if( __as_gradient_cache[i].im == NULL ||
+			__as_gradient_cache[i].last_used < entry->last_used )
+			entry = &(__as_gradient_cache[i]);
+	return entry;
+}
+
+static void
+evict_cached_gradients( size_t budget )
+{
+	while( __as_gradient_cache_used > budget )
+	{
+		ASGradientCacheEntry *victim = NULL ;
+		int i ;
+		for( i = 0 ; i < GRADIENT_CACHE_MAX_ENTRIES ; ++i )
+			if( __as_gradient_cache[i].im != NULL &&
+				(victim == NULL || __as_gradient_cache[i].last_used < victim->last_used) )
+				victim = &(__as_gradient_cache[i]);
+		if( victim == NULL )
+			break;
+		free_gradient_cache_entry( victim );
+	}
+}
+
+static void
+store_cached_gradient( ASGradient *grad, ASImage *im, ASFlagType filter, unsigned int compression, int quality )
+{
+	size_t size = asimage_memory_size( im );
+	LOCK_GRADIENT_CACHE();
+	if( __as_gradient_cache == NULL && size <= __as_gradient_cache_budget )
+		__as_gradient_cache = safecalloc( GRADIENT_CACHE_MAX_ENTRIES, sizeof(ASGradientCacheEntry) );
+	/* another thread might have rendered the same gradient in the mean time : */
+	if( __as_gradient_cache != NULL && size <= __as_gradient_cache_budget &&
+		find_gradient_cache_entry( grad, im->width, im->height, filter, compression, quality ) == NULL )
+	{
+		ASGradientCacheEntry *entry ;
+		evict_cached_gradients( __as_gradient_cache_budget - size );
+		entry = get_gradient_cache_victim();
+		free_gradient_cache_entry( entry );
+
+		entry->type = grad->type ;
+		entry->npoints = grad->npoints ;
+		entry->color = safemalloc( grad->npoints*sizeof(ARGB32) );
+		memcpy( entry->color, grad->color, grad->npoints*sizeof(ARGB32) );
+		entry->offset = safemalloc( grad->npoints*sizeof(double) );
+		memcpy( entry->offset, grad->offset, grad->npoints*sizeof(double) );
+		entry->width = im->width ;
+		entry->height = im->height ;
+		entry->filter = filter ;
+		entry->compression = compression ;
+		entry->quality = quality ;
+		entry->im = clone_asimage( im, SCL_DO_ALL );
+		entry->size = size ;
+		__as_gradient_cache_used += size ;
+		entry->last_used = ++__as_gradient_cache_clock ;
+	}
+	UNLOCK_GRADIENT_CACHE();
+}
+
+void
+flush_gradient_cache()
+{
+	LOCK_GRADIENT_CACHE();
+	if( __as_gradient_cache )
+	{
+		int i ;
+		for( i = 0 ; i < GRADIENT_CACHE_MAX_ENTRIES ; ++i )
+			free_gradient_cache_entry( &(__as_gradient_cache[i]) );
+		free( __as_gradient_cache );
+		__as_gradient_cache = NULL ;
+	}
+	UNLOCK_GRADIENT_CACHE();
+}
+
+size_t
+set_gradient_cache_budget( size_t budget )
+{
+	size_t old_budget ;
+	LOCK_GRADIENT_CACHE();
+	old_budget = __as_gradient_cache_budget ;
+	__as_gradient_cache_budget = budget ;
+	if( __as_gradient_cache )
+		evict_cached_gradients( budget );
+	UNLOCK_GRADIENT_CACHE();
+	return old_budget;
+}
+
 ASImage*
 make_gradient( ASVisual *asv, ASGradient *grad,
                int width, int height, ASFlagType filter,
@@ -1492,6 +2354,18 @@ LOCAL_DEBUG_CALLER_OUT( "type = 0x%X, width=%d, height = %d, filter = 0x%lX", gr
 		int line;
 		static ARGB32 dither_seeds[MAX_GRADIENT_DITHER_LINES] = { 0, 0xFFFFFFFF, 0x7F0F7F0F, 0x0F7F0F7F };
 
+		int used_quality = imout->quality ;
+		Bool cacheable = ( out_format == ASA_ASImage && grad->npoints > 0 &&
+						   __as_gradient_cache_budget > 0 &&
+						   width*height <= GRADIENT_CACHE_MAX_PIXELS );
+
+		if( cacheable && fetch_cached_gradient( grad, im, filter, compression_out, used_quality ) )
+		{
+			stop_image_output( &imout );
+			SHOW_TIME("", started);
+			return im;
+		}
+
 		if( dither_lines > (int)im->height || dither_lines > (int)im->width )
 			dither_lines = MIN(im->height, im->width) ;
 
@@ -1525,6 +2399,8 @@ LOCAL_DEBUG_CALLER_OUT( "type = 0x%X, width=%d, height = %d, filter = 0x%lX", gr
 		for( line = 0 ; line < dither_lines ; line++ )
 			free_scanline( &(lines[line]), True );
 		free( lines );
+		if( cacheable )
+			store_cached_gradient( grad, im, filter, compression_out, used_quality );
 	}
 	SHOW_TIME("", started);
 	return im;
@@ -2778,6 +3654,313 @@ static void calc_gauss_int(int radius, GAUSS_COEFF_TYPE* gauss, GAUSS_COEFF_TYPE
 }
 
 
+/***********************************************************************
+ * Large radius blur - gaussian is approximated with several successive
+ * box blurs, each done with running sum, so that cost per pixel does
+ * not depend on radius.
+ **********************************************************************/
+#define BOX_BLUR_PASSES			3
+#define BOX_BLUR_BAND_MIN_LINES	32   /* don't bother spawning threads for less */
+#define BOX_BLUR_RECIP_SHIFT	24
+/* sum/count, given recip = (1<<24)/count. Stays within 32 bits for
+ * count of up to 65535 : */
+#define BOX_AVERAGE(sum,recip)	((CARD8)(((sum)*(recip)+(0x01<<(BOX_BLUR_RECIP_SHIFT-1)))>>BOX_BLUR_RECIP_SHIFT))
+
+typedef struct ASBoxBlurJob
+{
+	CARD8 *planes[IC_NUM_CHANNELS] ;	/* NULL for channels we don't blur */
+	int width, height ;
+	int radii[BOX_BLUR_PASSES] ;
+	CARD32 *recips ;					/* recips[count] = (1<<24)/count */
+	Bool vertical ;
+}ASBoxBlurJob;
+
+/* sizes of the boxes giving the same standard deviation as gaussian of
+ * given radius in blur_asimage_gauss() : */
+static void
+calc_box_blur_radii( int radius, int *radii )
+{
+	double std_dev, var12 ;
+	int wl, m, i ;
+
+	if( radius <= 128 )
+		std_dev = standard_deviations[radius > 1 ? radius-1 : 0] ;
+	else
+		std_dev = standard_deviations[127]*radius/128 ;
+	var12 = 12.0*std_dev*std_dev ;
+	wl = (int)sqrt( var12/BOX_BLUR_PASSES + 1.0 );
+	if( (wl&0x01) == 0 )
+		--wl ;
+	m = (int)floor( (var12 - BOX_BLUR_PASSES*(wl*wl + 4*wl + 3))/(-4.0*wl - 4.0) + 0.5 );
+	for( i = 0 ; i < BOX_BLUR_PASSES ; ++i )
+		radii[i] = ((i < m)? wl-1 : wl+1)/2 ;
+}
+
+static inline void
+box_blur_line( CARD8 *src, CARD8 *dst, int len, int radius, CARD32 *recips )
+{
+	register CARD32 sum = 0 ;
+	register int x = 0 ;
+	int left = MIN(radius,len), right = MAX(len-radius,left) ;
+	CARD32 recip = recips[MIN(radius+radius+1,len)] ;
+
+	for( ; x < radius && x < len ; ++x )
+		sum += src[x] ;
+	/* [0, radius) - window gets clipped on the left : */
+	for( x = 0 ; x < left ; ++x )
+	{
+		if( x+radius < len )
+			sum += src[x+radius] ;
+		dst[x] = BOX_AVERAGE( sum, recips[MIN(x+radius+1,len)] );
+	}
+	/* full windows : */
+	for( ; x < right ; ++x )
+	{
+		sum += src[x+radius] ;
+		dst[x] = BOX_AVERAGE( sum, recip );
+		sum -= src[x-radius] ;
+	}
+	/* window is clipped on the right, and maybe on the left as well : */
+	for( ; x < len ; ++x )
+	{
+		int lo = MAX(x-radius,0) ;
+		dst[x] = BOX_AVERAGE( sum, recips[len-lo] );
+		if( x >= radius )
+			sum -= src[x-radius] ;
+	}
+}
+
+/* Vertical pass over the stripe of columns, done in place. Original values
+ * of the last radius+1 lines are kept in the ring so that we can subtract
+ * them from running sums after they have been overwritten : */
+static void
+box_blur_columns( CARD8 *plane, int stride, int width, int height, int radius,
+				  CARD32 *recips, CARD32 *sums, CARD8 *ring )
+{
+	int x, y ;
+	int ring_size = radius+1 ;
+
+	memset( sums, 0x00, width*sizeof(CARD32) );
+	for( y = 0 ; y < radius && y < height ; ++y )
+	{
+		register CARD8 *row = plane + y*stride ;
+		for( x = 0 ; x < width ; ++x )
+			sums[x] += row[x] ;
+	}
+	for( y = 0 ; y < height ; ++y )
+	{
+		register CARD8 *row = plane + y*stride ;
+		CARD32 recip = recips[MIN(y+radius,height-1) - MAX(y-radius,0) + 1] ;
+		if( y+radius < height )
+		{
+			register CARD8 *add = plane + (y+radius)*stride ;
+			for( x = 0 ; x < width ; ++x )
+				sums[x] += add[x] ;
+		}
+		memcpy( ring + (y%ring_size)*width, row, width );
+		for( x = 0 ; x < width ; ++x )
+			row[x] = BOX_AVERAGE( sums[x], recip );
+		if( y >= radius )
+		{
+			register CARD8 *sub = ring + ((y-radius)%ring_size)*width ;
+			for( x = 0 ; x < width ; ++x )
+				sums[x] -= sub[x] ;
+		}
+	}
+}
+
+/* horizontal passes are split into bands of rows, and vertical passes
+ * into stripes of columns : */
+static void
+box_blur_job( void *data, int job, int jobs_count )
+{
+	ASBoxBlurJob *bj = (ASBoxBlurJob*)data ;
+	int width = bj->width, height = bj->height ;
+	int chan, i ;
+
+	if( !bj->vertical )
+	{
+		int start = (height*job)/jobs_count, end = (height*(job+1))/jobs_count ;
+		CARD8 *tmp = safemalloc( width*2 );
+		for( chan = 0 ; chan < IC_NUM_CHANNELS ; ++chan )
+			if( bj->planes[chan] )
+			{
+				int y ;
+				for( y = start ; y < end ; ++y )
+				{
+					CARD8 *src = bj->planes[chan] + y*width ;
+					CARD8 *bufs[2] ;
+					bufs[0] = tmp ;
+					bufs[1] = tmp + width ;
+					/* ping-pong between temp buffers and back : */
+					for( i = 0 ; i < BOX_BLUR_PASSES ; ++i )
+					{
+						CARD8 *dst = (i == BOX_BLUR_PASSES-1)? bj->planes[chan] + y*width : bufs[i&0x01] ;
+						box_blur_line( src, dst, width, bj->radii[i], bj->recips );
+						src = dst ;
+					}
+				}
+			}
+		free( tmp );
+	}else
+	{
+		int start = (width*job)/jobs_count, end = (width*(job+1))/jobs_count ;
+		int max_radius = 0 ;
+		CARD32 *sums = safemalloc( (end-start)*sizeof(CARD32) );
+		CARD8 *ring ;
+		for( i = 0 ; i < BOX_BLUR_PASSES ; ++i )
+			if( bj->radii[i] > max_radius )
+				max_radius = bj->radii[i] ;
+		ring = safemalloc( (max_radius+1)*(end-start) );
+		for( chan = 0 ; chan < IC_NUM_CHANNELS ; ++chan )
+			if( bj->planes[chan] )
+				for( i = 0 ; i < BOX_BLUR_PASSES ; ++i )
+					box_blur_columns( bj->planes[chan]+start, width, end-start, height,
+									  bj->radii[i], bj->recips, sums, ring );
+		free( ring );
+		free( sums );
+	}
+}
+
+static void
+run_box_blur( ASBoxBlurJob *bj, int radius, Bool vertical )
+{
+	int lines = vertical ? bj->width : bj->height ;
+	int jobs_count = MIN(get_asimage_threads(), lines/BOX_BLUR_BAND_MIN_LINES) ;
+	int i ;
+
+	calc_box_blur_radii( radius, bj->radii );
+	for( i = 0 ; i < BOX_BLUR_PASSES ; ++i )
+		if( bj->radii[i] >= (vertical ? bj->height : bj->width) )
+			bj->radii[i] = (vertical ? bj->height : bj->width) - 1 ;
+	bj->vertical = vertical ;
+	run_asimage_jobs( box_blur_job, bj, MAX(jobs_count,1) );
+}
+
+ASImage* blur_asimage_box(ASVisual* asv, ASImage* src, double dhorz, double dvert,
+                          ASFlagType filter,
+						  ASAltImFormats out_format, unsigned int compression_out, int quality)
+{
+	ASImage *dst = NULL;
+	ASImageOutput *imout;
+	ASImageDecoder *imdec;
+	ASBoxBlurJob bj ;
+	ASScanline result ;
+	int horz = (int)dhorz;
+	int vert = (int)dvert;
+	int width, height, x, y, chan ;
+	ASFlagType blurred = 0 ;
+
+	if (!src) return NULL;
+
+	if( asv == NULL ) 	asv = &__transform_fake_asv ;
+
+	width = src->width ;
+	height = src->height ;
+	/* recips below stay precise up to that : */
+	if( horz > 0x7FFF ) horz = 0x7FFF ;
+	if( vert > 0x7FFF ) vert = 0x7FFF ;
+	if( horz <= 1 && vert <= 1 )
+		filter = 0 ;
+
+	dst = create_destination_image( width, height, out_format, compression_out, src->back_color);
+	imout = start_image_output(asv, dst, out_format, 0, quality);
+    if (!imout)
+    {
+        destroy_asimage( &dst );
+		return NULL;
+	}
+	imdec = start_image_decoding(asv, src, SCL_DO_ALL, 0, 0, width, height, NULL);
+	if (!imdec)
+	{
+		stop_image_output(&imout);
+        destroy_asimage( &dst );
+		return NULL;
+	}
+
+	memset( &bj, 0x00, sizeof(bj));
+	bj.width = width ;
+	bj.height = height ;
+	for( chan = 0 ; chan < IC_NUM_CHANNELS ; ++chan )
+		if( get_flags( filter, 0x01<<chan ) )
+		{
+			bj.planes[chan] = safemalloc( width*height );
+			set_flags( blurred, 0x01<<chan );
+		}
+
+	if( blurred )
+	{
+		int max_dim = MAX(width,height) ;
+		/* loading channels that we'll blur into 8 bit planes : */
+		for( y = 0 ; y < height ; ++y )
+		{
+			imdec->decode_image_scanline( imdec );
+			for( chan = 0 ; chan < IC_NUM_CHANNELS ; ++chan )
+				if( bj.planes[chan] )
+				{
+					register CARD8 *row = bj.planes[chan] + y*width ;
+					register CARD32 *src_chan = imdec->buffer.channels[chan] ;
+					if( get_flags( imdec->buffer.flags, 0x01<<chan ) )
+						for( x = 0 ; x < width ; ++x )
+							row[x] = src_chan[x] ;
+					else
+						memset( row, ARGB32_CHAN8(imdec->buffer.back_color,chan), width );
+				}
+		}
+		bj.recips = safemalloc( (max_dim+1)*sizeof(CARD32));
+		bj.recips[0] = 0 ;
+		for( x = 1 ; x <= max_dim ; ++x )
+			bj.recips[x] = ((0x01<<BOX_BLUR_RECIP_SHIFT)+(x>>1))/x ;
+
+		if( horz > 1 )
+			run_box_blur( &bj, horz, False );
+		if( vert > 1 )
+			run_box_blur( &bj, vert, True );
+		free( bj.recips );
+
+		/* channels we don't blur are taken straight from the source : */
+		if( (blurred&SCL_DO_ALL) != SCL_DO_ALL )
+		{
+			stop_image_decoding(&imdec);
+			imdec = start_image_decoding(asv, src, SCL_DO_ALL&(~blurred), 0, 0, width, height, NULL);
+		}
+	}
+
+	prepare_scanline( width, 0, &result, asv->BGR_mode);
+	result.flags = 0 ;
+	result.back_color = src->back_color ;
+	for( y = 0 ; y < height ; ++y )
+	{
+		if( imdec )
+		{
+			imdec->decode_image_scanline( imdec );
+			result.flags = imdec->buffer.flags & ~blurred ;
+			result.back_color = imdec->buffer.back_color ;
+		}
+		for( chan = 0 ; chan < IC_NUM_CHANNELS ; ++chan )
+			if( bj.planes[chan] )
+			{
+				register CARD8 *row = bj.planes[chan] + y*width ;
+				register CARD32 *res_chan = result.channels[chan] ;
+				for( x = 0 ; x < width ; ++x )
+					res_chan[x] = row[x] ;
+			}else if( imdec && get_flags( result.flags, 0x01<<chan ) )
+				copy_component( imdec->buffer.channels[chan], result.channels[chan], 0, width);
+		result.flags |= blurred ;
+		imout->output_image_scanline(imout, &result, 1);
+	}
+	free_scanline(&result, True);
+
+	for( chan = 0 ; chan < IC_NUM_CHANNELS ; ++chan )
+		if( bj.planes[chan] )
+			free( bj.planes[chan] );
+	if( imdec )
+		stop_image_decoding(&imdec);
+	stop_image_output(&imout);
+
+	return dst;
+}
+
 /***********************************************************************
  * Hue,saturation and lightness adjustments.
  **********************************************************************/
@@ -3438,3 +4621,132 @@ fprintf (stderr, "result: %8.8X %8.8X %8.8X %8.8X.\n", src->alpha[x], src->red[x
 /* The end !!!! 																 */
 /* ********************************************************************************/
 
+#ifdef TEST_TRANSFORM
+/* Verifies that merge_layers() split into bands between several threads
+ * produces exactly the same image as single threaded one, with layers
+ * clipped and placed partially outside of the canvas.
+ * Usage: test_transform [threads] */
+#include "import.h"
+
+static CARD32 rnd32_seed = 345824357;
+#define MY_RND32() (rnd32_seed = (1664525L*rnd32_seed)+1013904223L)
+
+static ASImage *
+make_test_image( ASVisual *asv, int width, int height )
+{
+	ARGB32 *argb = safemalloc( width*height*sizeof(ARGB32) );
+	ASImage *im ;
+	int i ;
+	for( i = 0 ; i < width*height ; ++i )
+		argb[i] = MY_RND32() ;
+	im = convert_argb2ASImage( asv, width, height, argb, NULL );
+	free( argb );
+	return im;
+}
+
+static ASImage *
+merge_test_layers( ASVisual *asv, ASImageLayer *layers, int count, int threads, ASAltImFormats out_format, int quality )
+{
+	ASImage *res, *argb ;
+	int old_threads = set_asimage_threads( threads );
+	res = merge_layers( asv, layers, count, 900, 700, out_format, 0, quality );
+	set_asimage_threads( old_threads );
+	if( res == NULL || out_format == ASA_ARGB32 )
+		return res;
+	/* to compare pixels we need them all decoded : */
+	argb = tile_asimage( asv, res, 0, 0, res->width, res->height, 0, ASA_ARGB32, 0, ASIMAGE_QUALITY_DEFAULT );
+	destroy_asimage( &res );
+	return argb;
+}
+
+static int
+compare_test_merges( ASImage *control, ASImage *test, const char *op, ASAltImFormats out_format, int quality )
+{
+	int i, differ = 0, first = -1 ;
+	int size = (int)(control->width*control->height) ;
+	for( i = 0 ; i < size ; ++i )
+		if( control->alt.argb32[i] != test->alt.argb32[i] )
+		{
+			if( first < 0 )
+				first = i ;
+			++differ ;
+		}
+	if( differ )
+		fprintf( stderr, "\t\"%s\", format %d, quality %d : %d pixels differ, first at %d,%d\n",
+				 op, out_format, quality, differ, first%(int)control->width, first/(int)control->width );
+	return differ;
+}
+
+int main(int argc, char **argv )
+{
+	/* dissipate is random by design, so it is left out : */
+	static const char *ops[] = { "add", "alphablend", "allanon", "colorize", "darken", "diff", "hue", "lighten",
+								 "overlay", "saturate", "screen", "sub", "tint", "value", NULL };
+	static ASAltImFormats formats[] = { ASA_ARGB32, ASA_ASImage };
+	/* fast quality composes packed ARGB32, default one - planar : */
+	static int qualities[] = { ASIMAGE_QUALITY_DEFAULT, ASIMAGE_QUALITY_FAST };
+	int threads = (argc > 1)? atoi(argv[1]) : 4 ;
+	ASVisual *asv = create_asvisual( NULL, 0, 0, NULL );
+	ASImage *back = make_test_image( asv, 900, 700 );
+	ASImage *fore = make_test_image( asv, 640, 480 );
+	ASImageLayer layers[4] ;
+	int res = 0, f, q, i ;
+
+	init_image_layers( &layers[0], 4 );
+	layers[0].im = back ;
+	layers[0].clip_width = 900 ;
+	layers[0].clip_height = 700 ;
+	/* clipped from both sides : */
+	layers[1].im = fore ;
+	layers[1].dst_x = 40 ;
+	layers[1].dst_y = 30 ;
+	layers[1].clip_x = 17 ;
+	layers[1].clip_y = 9 ;
+	layers[1].clip_width = 600 ;
+	layers[1].clip_height = 450 ;
+	/* sticking out of the top left corner, tinted : */
+	layers[2].im = fore ;
+	layers[2].dst_x = -7 ;
+	layers[2].dst_y = -23 ;
+	layers[2].clip_y = 5 ;
+	layers[2].clip_width = 500 ;
+	layers[2].clip_height = 400 ;
+	layers[2].tint = 0x7F9F5F7F ;
+	/* tiled past the bottom of the image : */
+	layers[3].im = fore ;
+	layers[3].dst_x = 300 ;
+	layers[3].dst_y = 200 ;
+	layers[3].clip_x = 3 ;
+	layers[3].clip_y = 401 ;
+	layers[3].clip_width = 550 ;
+	layers[3].clip_height = 520 ;
+
+	fprintf( stderr, "Comparing merge_layers() in 1 and %d threads ...\n", threads );
+	for( i = 0 ; ops[i] != NULL ; ++i )
+	{
+		layers[1].merge_scanlines = layers[2].merge_scanlines =
+		layers[3].merge_scanlines = blend_scanlines_name2func( ops[i] );
+		for( f = 0 ; f < (int)(sizeof(formats)/sizeof(formats[0])) ; ++f )
+			for( q = 0 ; q < (int)(sizeof(qualities)/sizeof(qualities[0])) ; ++q )
+			{
+				ASImage *control = merge_test_layers( asv, layers, 4, 1, formats[f], qualities[q] );
+				ASImage *test = merge_test_layers( asv, layers, 4, threads, formats[f], qualities[q] );
+				if( control == NULL || test == NULL )
+				{
+					fprintf( stderr, "\t\"%s\", format %d, quality %d : merge_layers() failed\n", ops[i], formats[f], qualities[q] );
+					res = 1 ;
+				}else if( compare_test_merges( control, test, ops[i], formats[f], qualities[q] ) != 0 )
+					res = 1 ;
+				if( control )
+					destroy_asimage( &control );
+				if( test )
+					destroy_asimage( &test );
+			}
+	}
+	fprintf( stderr, "%s\n", res?"failed":"success." );
+	destroy_asimage( &fore );
+	destroy_asimage( &back );
+	destroy_asvisual( asv, False );
+	return res;
+}
+#endif
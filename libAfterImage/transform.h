@@ -36,9 +36,10 @@ extern "C" {
  * SEE ALSO
  *  Transformations :
  *          scale_asimage(), tile_asimage(), merge_layers(), 
- * 			make_gradient(), flip_asimage(), mirror_asimage(), 
- * 			pad_asimage(), blur_asimage_gauss(), fill_asimage(), 
- * 			adjust_asimage_hsv()
+ * 			make_gradient(), flush_gradient_cache(), flip_asimage(),
+ * 			mirror_asimage(), 
+ * 			pad_asimage(), blur_asimage_gauss(), blur_asimage_box(),
+ * 			fill_asimage(), adjust_asimage_hsv()
  *
  *  Other libAfterImage modules :
  *          ascmap.h asfont.h asimage.h asvisual.h blender.h export.h
@@ -72,6 +73,12 @@ extern "C" {
  * If size has to be reduced - then several neighboring pixels will be 
  * averaged into single pixel. If size has to be increased then new 
  * pixels will be interpolated based on values of four neighboring pixels.
+ * If parallel processing has been enabled with set_asimage_threads(),
+ * large images are split into horizontal bands scaled in separate
+ * threads. Result is identical to that of sequential scaling.
+ * ASIMAGE_QUALITY_TOP output is always produced sequentially, since
+ * its dithering depends on previous lines. Same applies to
+ * scale_asimage2().
  * EXAMPLE
  * ASScale
  *********/
@@ -144,6 +151,15 @@ extern "C" {
  * then destination image, and maybe placed in arbitrary locations. Each
  * layer will be padded to fit width of the destination image with all 0
  * effectively making it transparent.
+ * If parallel processing has been enabled with set_asimage_threads(),
+ * destination is split into horizontal bands composed in separate
+ * threads, each with its own set of layer decoders. Result is identical
+ * to that of sequential composition. As with scale_asimage(),
+ * ASIMAGE_QUALITY_TOP output is always produced sequentially.
+ * With ASIMAGE_QUALITY_FAST or ASIMAGE_QUALITY_POOR most of the merging
+ * methods are applied to 8 bit per channel packed ARGB32 data instead of
+ * 24.8 fixed point scanlines, which is faster, at the cost of rounding
+ * errors of up to a few units per channel.
  *********/
 /****f* libAfterImage/transform/make_gradient()
  * NAME
@@ -175,6 +191,33 @@ extern "C" {
  * fill it with gradient, described in structure pointed to by grad.
  * Different dithering techniques will be applied to produce nicer
  * looking gradients.
+ * Gradients rendered as ASImage (ASA_ASImage) are memoized - when the
+ * same gradient of the same size, filter, compression and quality is
+ * requested again, the new image simply references already encoded
+ * rows of the previous one, while cache is enabled with
+ * set_gradient_cache_budget().
+ *********/
+/****f* libAfterImage/transform/flush_gradient_cache()
+ * NAME
+ * flush_gradient_cache() - releases all memoized gradients.
+ * NAME
+ * set_gradient_cache_budget() - sets amount of memory used to memoize
+ * gradients.
+ * SYNOPSIS
+ * void   flush_gradient_cache();
+ * size_t set_gradient_cache_budget( size_t budget );
+ * INPUTS
+ * budget       - number of bytes, 0 disables the cache.
+ * RETURN VALUE
+ * set_gradient_cache_budget() returns previous budget.
+ * DESCRIPTION
+ * Cache is disabled by default. With non-zero budget make_gradient()
+ * keeps up to 32 most recently used gradients of no more then
+ * 1 megapixel in size, for as long as their memory stays within the
+ * budget - least recently used ones are released first. Cached images
+ * hold references to image data in default ASStorage, so
+ * flush_gradient_cache() must be called before
+ * flush_default_asstorage().
  *********/
 /****f* libAfterImage/transform/flip_asimage()
  * NAME
@@ -285,6 +328,45 @@ extern "C" {
  * quality      - output quality
  * RETURN VALUE
  * returns newly created and encoded ASImage on success, NULL of failure.
+ * NOTES
+ * Cost of the exact Gaussian blur grows linearly with the radius, and
+ * radii above 128 are treated as 128. For large radii use
+ * blur_asimage_box() instead.
+ *********/
+/****f* libAfterImage/transform/blur_asimage_box()
+ * NAME
+ * blur_asimage_box() Performs fast approximation of Gaussian blur of
+ * the image, suitable for large radii.
+ * SYNOPSIS
+ * ASImage* blur_asimage_box( ASVisual* asv, ASImage* src,
+ *                            double horz, double vert,
+ *                            ASFlagType filter,
+ *                            ASAltImFormats out_format,
+ *                            unsigned int compression_out,
+ *                            int quality );
+ * INPUTS
+ * asv          - pointer to valid ASVisual structure
+ * src          - source ASImage
+ * horz         - horizontal radius of the blur
+ * vert         - vertical radius of the blur
+ * filter       - only channels corresponding to set bits will be
+ *                blurred, others are copied unchanged.
+ * out_format 	- optionally describes alternative ASImage format that
+ *                should be produced as the result - XImage, ARGB32, etc.
+ * compression_out - compression level of resulting image in range 0-100.
+ * quality      - output quality
+ * RETURN VALUE
+ * returns newly created and encoded ASImage on success, NULL of failure.
+ * DESCRIPTION
+ * Gaussian is approximated with three successive box blurs of sizes
+ * yielding the same standard deviation as the kernel
+ * blur_asimage_gauss() would use for the same radius. Each box blur is
+ * computed with running sums, so time per pixel does not depend on
+ * radius. Near the edges only pixels within the image are averaged.
+ * If parallel processing has been enabled with set_asimage_threads(),
+ * horizontal passes are split into bands of rows, and vertical passes
+ * into stripes of columns, processed in separate threads. Result does
+ * not depend on number of threads.
  *********/
 /****f* libAfterImage/transform/fill_asimage()
  * NAME
@@ -388,6 +470,8 @@ ASImage *make_gradient( struct ASVisual *asv, struct ASGradient *grad,
                			int width, int height, ASFlagType filter,
   			   			ASAltImFormats out_format,
 						unsigned int compression_out, int quality  );
+void flush_gradient_cache();
+size_t set_gradient_cache_budget( size_t budget );
 ASImage *flip_asimage( struct ASVisual *asv, ASImage *src,
 		 		       int offset_x, int offset_y,
 			  		   int to_width, int to_height,
@@ -411,6 +495,11 @@ ASImage* blur_asimage_gauss( ASVisual* asv, ASImage* src,
                              ASFlagType filter,
                              ASAltImFormats out_format,
 							 unsigned int compression_out, int quality);
+ASImage* blur_asimage_box( ASVisual* asv, ASImage* src,
+	                       double horz, double vert,
+                           ASFlagType filter,
+                           ASAltImFormats out_format,
+						   unsigned int compression_out, int quality);
 
 Bool fill_asimage( ASVisual *asv, ASImage *im,
                	   int x, int y, int width, int height,
@@ -556,6 +645,11 @@ color2alpha_asimage (ASVisual *asv, ASImage *src,
 				     ARGB32 color,
 				     ASAltImFormats out_format, unsigned int compression_out, int quality);
 
+/* selects vectorized implementation of gradient drawing best suited for the CPU.
+ * Called internally from get_asimage_cpu_features() - results are the same
+ * regardless : */
+void select_gradient_impl( CARD32 cpu_features );
+
 #ifdef __cplusplus
 }
 #endif
@@ -478,7 +478,7 @@ put_ximage( ASVisual *asv, XImage *xim, Drawable d, GC gc,
 		src_x = 0;
 	}else if( src_x > xim->width )
 		return False;
-	if( xim->width  > src_x+width )
+	if( xim->width  < src_x+width )
 		width = xim->width - src_x ;
 	if( src_y < 0 )
 	{
@@ -486,7 +486,7 @@ put_ximage( ASVisual *asv, XImage *xim, Drawable d, GC gc,
 		src_y = 0;
 	}else if( src_y > xim->height )
 		return False;
-	if( xim->height  > src_y+height )
+	if( xim->height  < src_y+height )
 		height = xim->height - src_y ;
 
 	if( my_gc == NULL )
@@ -664,11 +664,21 @@ asimage2drawable( ASVisual *asv, Drawable d, ASImage *im, GC gc,
 	{
 		Bool 		  my_xim = False ;
 		XImage       *xim ;
+		XImage       *pooled_xim = NULL ;
 		Bool res = False;
 		if ( !use_cached || im->alt.ximage == NULL )
 		{
+			/* converting straight into reusable (possibly shared memory) XImage : */
+			if( im->alt.ximage == NULL &&
+				(pooled_xim = acquire_visual_ximage( asv, im->width, im->height )) != NULL )
+				im->alt.ximage = pooled_xim ;
             if( (xim = asimage2ximage_ext( asv, im, False )) == NULL )
 			{
+				if( pooled_xim )
+				{
+					im->alt.ximage = NULL ;
+					release_visual_ximage( pooled_xim );
+				}
 				show_error("cannot export image into XImage.");
 				return None ;
 			}
@@ -680,7 +690,9 @@ asimage2drawable( ASVisual *asv, Drawable d, ASImage *im, GC gc,
             res = put_ximage( asv, xim, d, gc,  src_x, src_y, dest_x, dest_y, width, height );
 			if( my_xim && xim == im->alt.ximage ) 
 				im->alt.ximage = NULL ;
-			if( xim != im->alt.ximage )
+			if( xim == pooled_xim )
+				release_visual_ximage( xim );
+			else if( xim != im->alt.ximage )
 				XDestroyImage (xim);
 		}
 		return res;
@@ -790,6 +802,189 @@ asimage2mask(ASVisual *asv, Window root, ASImage *im, GC gc, Bool use_cached)
 {
 	return asimage2alpha(asv, root, im, gc, use_cached, True);
 }
+#ifdef TEST_XIMAGE
+/* Verifies that vectorized XImage packing produces the same pixels as plain C
+ * code, and, when X display is available (Xvfb will do), that image drawn via
+ * pooled (optionally shared memory) XImage reads back identical to image
+ * drawn via regular XImage.
+ * Usage: test_ximage [-shm] [width height [repetitions]] */
+#include <string.h>
+#include <time.h>
+
+static CARD32 rnd32_seed = 345824357;
+#define MY_RND32() (rnd32_seed = (1664525L*rnd32_seed)+1013904223L)
+
+static int
+test_ximage_packing( int width, int reps )
+{
+	static CARD32 masks[3] = { 0, ASIM_CPU_MMX|ASIM_CPU_SSE2, ASIM_CPU_ALL };
+	ASVisual asv ;
+	XImage xim ;
+	ASScanline sl ;
+	ARGB32 *argb = safemalloc( width*sizeof(ARGB32) );
+	CARD32 *control = safemalloc( width*sizeof(CARD32) );
+	CARD32 *test = safemalloc( width*sizeof(CARD32) );
+	int res = 0, i, m, mode, w ;
+
+	memset( &asv, 0x00, sizeof(asv));
+	memset( &xim, 0x00, sizeof(xim));
+	prepare_scanline( width, 0, &sl, False );
+	for( i = 0 ; i < width ; ++i )
+	{
+		sl.alpha[i] = MY_RND32()&0x00FF ;
+		sl.red[i] = MY_RND32()&0x00FF ;
+		sl.green[i] = MY_RND32()&0x00FF ;
+		sl.blue[i] = MY_RND32()&0x00FF ;
+		argb[i] = MY_RND32();
+	}
+	for( mode = 0 ; mode < 4 ; ++mode )
+	{
+		asv.msb_first = mode&0x01 ;
+		asv.BGR_mode = (mode>>1)&0x01 ;
+		for( w = 1 ; w <= width ; w += (w < 40)? 1 : width/7 )
+		{
+			xim.width = w ;
+			for( m = 1 ; m < 3 ; ++m )
+			{
+				set_asimage_cpu_features_mask( 0 );
+				scanline2ximage32( &asv, &xim, &sl, 0, (unsigned char*)control );
+				set_asimage_cpu_features_mask( masks[m] );
+				scanline2ximage32( &asv, &xim, &sl, 0, (unsigned char*)test );
+				if( memcmp( control, test, w*sizeof(CARD32) ) != 0 )
+				{
+					fprintf( stderr, "scanline2ximage32 mismatch: width %d, mode %d, cpu 0x%lX\n", w, mode, (unsigned long)masks[m] );
+					++res ;
+				}
+				set_asimage_cpu_features_mask( 0 );
+				argb32_line2ximage32( &asv, control, argb, w );
+				set_asimage_cpu_features_mask( masks[m] );
+				argb32_line2ximage32( &asv, test, argb, w );
+				if( memcmp( control, test, w*sizeof(CARD32) ) != 0 )
+				{
+					fprintf( stderr, "argb32_line2ximage32 mismatch: width %d, mode %d, cpu 0x%lX\n", w, mode, (unsigned long)masks[m] );
+					++res ;
+				}
+			}
+		}
+	}
+	asv.msb_first = asv.BGR_mode = 0 ;
+	xim.width = width ;
+	for( m = 0 ; m < 3 ; ++m )
+	{
+		clock_t started ;
+		set_asimage_cpu_features_mask( masks[m] );
+		started = clock();
+		for( i = 0 ; i < reps ; ++i )
+			scanline2ximage32( &asv, &xim, &sl, 0, (unsigned char*)test );
+		printf( "scanline2ximage32 cpu features 0x%lX : %.2f Mpixel/sec\n", (unsigned long)get_asimage_cpu_features(),
+		        (double)width*reps/1000000./((double)(clock()-started+1)/CLOCKS_PER_SEC) );
+	}
+	set_asimage_cpu_features_mask( ASIM_CPU_ALL );
+	free_scanline( &sl, True );
+	free( argb );
+	free( control );
+	free( test );
+	return res;
+}
+
+#ifndef X_DISPLAY_MISSING
+static int
+test_ximage_drawing( Display *dpy, Bool use_shm, int width, int height, int reps )
+{
+	int screen = DefaultScreen(dpy);
+	ASVisual *asv = create_asvisual( dpy, screen, DefaultDepth( dpy, screen ), NULL );
+	ASImage *im = create_asimage( width, height, 100 );
+	CARD32 *line = safemalloc( width*sizeof(CARD32) );
+	Pixmap control, test ;
+	XImage *control_xim, *test_xim ;
+	int res = 0, x, y, i ;
+	clock_t started ;
+
+	if( use_shm && !enable_shmem_images() )
+		printf( "shared memory images are not available\n" );
+	for( y = 0 ; y < height ; ++y )
+	{
+		int color ;
+		for( color = 0 ; color < IC_NUM_CHANNELS ; ++color )
+		{
+			for( x = 0 ; x < width ; ++x )
+				line[x] = (color == IC_ALPHA)? 0x00FF : (MY_RND32()>>8)&0x00FF ;
+			asimage_add_line( im, color, line, y );
+		}
+	}
+	control = create_visual_pixmap( asv, RootWindow(dpy,screen), width, height, 0 );
+	test = create_visual_pixmap( asv, RootWindow(dpy,screen), width, height, 0 );
+
+	control_xim = asimage2ximage( asv, im );
+	put_ximage( asv, control_xim, control, NULL, 0, 0, 0, 0, width, height );
+	XDestroyImage( control_xim );
+
+	started = clock();
+	for( i = 0 ; i < reps ; ++i )
+		asimage2drawable( asv, test, im, NULL, 0, 0, 0, 0, width, height, False );
+	XSync( dpy, False );
+	printf( "asimage2drawable %dx%d%s : %.3f ms per call\n", width, height, check_shmem_images_enabled()?" (shm)":"",
+	        (double)(clock()-started)*1000./CLOCKS_PER_SEC/reps );
+
+	control_xim = XGetImage( dpy, control, 0, 0, width, height, AllPlanes, ZPixmap );
+	test_xim = XGetImage( dpy, test, 0, 0, width, height, AllPlanes, ZPixmap );
+	for( y = 0 ; y < height && res < 10 ; ++y )
+		for( x = 0 ; x < width && res < 10 ; ++x )
+			if( XGetPixel( control_xim, x, y ) != XGetPixel( test_xim, x, y ) )
+			{
+				fprintf( stderr, "pixel %d,%d differs : %lX vs. %lX\n", x, y,
+				         XGetPixel( control_xim, x, y ), XGetPixel( test_xim, x, y ) );
+				++res ;
+			}
+	XDestroyImage( control_xim );
+	XDestroyImage( test_xim );
+	XFreePixmap( dpy, control );
+	XFreePixmap( dpy, test );
+	destroy_asimage( &im );
+	free( line );
+	destroy_asvisual( asv, False );
+	return res;
+}
+#endif
+
+int main( int argc, char **argv )
+{
+	int width = 640, height = 480, reps = 100 ;
+	int res, arg = 1 ;
+	Bool use_shm = False ;
+#ifndef X_DISPLAY_MISSING
+	Display *dpy ;
+#endif
+
+	if( arg < argc && strcmp( argv[arg], "-shm" ) == 0 )
+	{
+		use_shm = True ;
+		++arg ;
+	}
+	if( arg+1 < argc )
+	{
+		width = atoi( argv[arg] );
+		height = atoi( argv[arg+1] );
+		if( arg+2 < argc )
+			reps = atoi( argv[arg+2] );
+	}
+	if( width <= 0 || height <= 0 || reps <= 0 )
+		return 1;
+
+	res = test_ximage_packing( width, reps*height );
+#ifndef X_DISPLAY_MISSING
+	if( (dpy = XOpenDisplay(NULL)) != NULL )
+	{
+		res += test_ximage_drawing( dpy, use_shm, width, height, reps );
+		XCloseDisplay( dpy );
+	}else
+		printf( "no X display available - skipping drawing test\n" );
+#endif
+	printf( "%s\n", (res == 0)? "passed":"failed" );
+	return (res == 0)? 0 : 1;
+}
+#endif
+
 /* ********************************************************************************/
 /* The end !!!! 																 */
 /* ********************************************************************************/
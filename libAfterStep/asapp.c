@@ -1017,6 +1017,9 @@ ASEnvironment *make_default_environment ()
 			"%s/desktop/cursors:" "%s/desktop/cursors";
 
 	e->desk_scale = 24;
+	e->image_cache_size = ASE_DEFAULT_IMAGE_CACHE_SIZE;
+	e->text_cache_size = ASE_DEFAULT_TEXT_CACHE_SIZE;
+	e->gradient_cache_size = ASE_DEFAULT_GRADIENT_CACHE_SIZE;
 	e->desk_pages_h = 2;
 	e->desk_pages_v = 2;
 	e->module_path = mystrdup (AFTER_BIN_DIR);
@@ -1217,6 +1220,7 @@ void FreeMyAppResources ()
 	flush_shm_cache ();
 #endif
 	free (ASDefaultScr);
+	flush_gradient_cache ();
 	flush_default_asstorage ();
 	flush_asbidirlist_memory_pool ();
 	flush_ashash_memory_pool ();
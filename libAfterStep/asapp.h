@@ -210,6 +210,12 @@ typedef struct ASEnvironment
   char *cursor_path;
   unsigned short desk_pages_h, desk_pages_v ;
   unsigned short desk_scale ;
+#define ASE_DEFAULT_IMAGE_CACHE_SIZE	4096	/* Kbytes */
+  unsigned int image_cache_size ;	/* Kbytes of unreferenced images kept by image manager */
+#define ASE_DEFAULT_TEXT_CACHE_SIZE		512		/* Kbytes */
+  unsigned int text_cache_size ;	/* Kbytes of text layouts/images kept by font manager */
+#define ASE_DEFAULT_GRADIENT_CACHE_SIZE	2048	/* Kbytes */
+  unsigned int gradient_cache_size ;	/* Kbytes of rendered gradients kept by make_gradient() */
 
 	enum{ ASE_AllowModuleNameCollision = 0,
 		  ASE_KillOldModuleOnNameCollision,	
@@ -37,6 +37,11 @@ Bool load_font (const char *name_in, MyFont * font)
 		if (path == NULL)
 			path = getenv ("PATH");
 		ASDefaultScr->font_manager = create_font_manager (dpy, path, NULL);
+		set_asfont_text_cache_budget (ASDefaultScr->font_manager,
+																	(size_t)(Environment ? Environment->
+																					 text_cache_size :
+																					 ASE_DEFAULT_TEXT_CACHE_SIZE) *
+																	1024);
 	}
 
 	name = name_in ? (char *)name_in : font->name;
@@ -126,6 +126,8 @@ reload_screen_image_manager (ScreenInfo * scr,
 														Environment->IconThemePath ? Environment->
 														IconThemePath : "", env_path1, env_path2,
 														NULL);
+	set_asimage_manager_budget (scr->image_manager,
+															(size_t)Environment->image_cache_size * 1024);
 	set_xml_image_manager (scr->image_manager);
 	show_progress ("Pixmap Path changed to \"%s:%s:%s:%s\" ...",
 								 Environment->pixmap_path ? Environment->pixmap_path : "",
@@ -789,6 +789,20 @@ void check_AfterStep_dirtree (char *ashome, Bool create_non_conf)
 
 	set_asimage_thumbnails_cache_dir (cachefilename);
 	free (cachefilename);
+
+	cachefilename = make_file_name (ashome, IMAGECACHE_DIR);
+	CheckOrCreate (cachefilename);
+	extern void set_asimage_cache_dir (const char *);
+
+	set_asimage_cache_dir (cachefilename);
+	free (cachefilename);
+
+	cachefilename = make_file_name (ashome, FONTCACHE_DIR);
+	CheckOrCreate (cachefilename);
+	extern void set_asfont_cache_dir (const char *);
+
+	set_asfont_cache_dir (cachefilename);
+	free (cachefilename);
 }
 
 static const char *get_desk_file (ASDeskSession * d, int function)
@@ -287,6 +287,7 @@ convert_data_file( const char *source_dir, const char *dst_dir, ASXMLInterpreter
 			if( curr->preview )
 			{
 				ASImageExportParams params ;
+				memset( &params, 0x00, sizeof(params) );
 				if( curr->type != ASIT_Jpeg &&
 					get_flags( get_asimage_chanmask(curr->preview), SCL_DO_ALPHA) &&
 					curr->preview->width < 200 && curr->preview->height < 200 )
@@ -109,6 +109,41 @@ CommandLineOpts AfterStep_cmdl_options[3] = {
 };
 
 
+/* Image storage gets compacted in small steps from the timer loop, so that
+ * memory of destroyed images would find its way back to the system
+ * without stalling image operations : */
+#define STORAGE_DEFRAG_PERIOD		5000	/* msec */
+#define STORAGE_DEFRAG_STEP_PERIOD	50	/* msec */
+#define STORAGE_DEFRAG_STEP_WORK	(64*1024)	/* bytes moved per step */
+
+/* Summary of storage stats is kept up to date in the root window property,
+ * so that memory usage could be looked at with asstats -r : */
+static void PublishStorageStats ()
+{
+	static ASStorageStats published;
+	ASStorageStats stats;
+	char *json;
+
+	get_asstorage_stats (NULL, &stats, NULL, 0);
+	if (memcmp (&stats, &published, sizeof (ASStorageStats)) == 0)
+		return;
+	published = stats;
+	if ((json = asstorage_stats2json (&stats, NULL, 0)) != NULL) {
+		set_string_property (Scr.Root, XInternAtom (dpy, ASSTORAGE_STATS_PROPERTY, False), json);
+		free (json);
+	}
+}
+
+static void StorageDefragHandler (void *data)
+{
+	if (defragment_asstorage (NULL, STORAGE_DEFRAG_STEP_WORK))
+		timer_new (STORAGE_DEFRAG_STEP_PERIOD, &StorageDefragHandler, NULL);
+	else {
+		PublishStorageStats ();
+		timer_new (STORAGE_DEFRAG_PERIOD, &StorageDefragHandler, NULL);
+	}
+}
+
 void AfterStep_usage (void)
 {
 	printf (OPTION_USAGE_FORMAT " [additional options]\n", MyName);
@@ -358,6 +393,7 @@ int main (int argc, char **argv, char **envp)
 	/* all system Go! we are completely Operational! */
 	set_flags (AfterStepState, ASS_NormalOperation);
 	ChangeDeskAndViewport (start_desk, start_viewport_x, start_viewport_y, False);
+	timer_new (STORAGE_DEFRAG_PERIOD, &StorageDefragHandler, NULL);
 
 #if (defined(LOCAL_DEBUG)||defined(DEBUG)) && defined(DEBUG_ALLOCS)
 	LOCAL_DEBUG_OUT ("printing memory%s", "");
@@ -966,6 +1002,7 @@ void Done (Bool restart, char *command)
 		free_as_app_args ();
 		free (ASDefaultScr);
 
+		flush_gradient_cache ();
 		flush_default_asstorage ();
 		flush_asbidirlist_memory_pool ();
 		flush_ashash_memory_pool ();
@@ -566,13 +566,47 @@ MyBackground *get_desk_back_or_default (int desk, Bool old_desk)
 }
 
 
+/* When background is going to be scaled anyway, and nobody else has it
+ * loaded already - we let the decoder produce reduced image right away,
+ * which is much faster for large JPEGs and interlaced PNGs : */
+static ASImage *load_scaled_myback_image (MyBackground * back)
+{
+	ASImageImportParams iparams;
+	ASImage *im;
+	char *realfilename;
+
+	if (get_flags (back->scale.flags, (WidthValue | HeightValue)) !=
+			(WidthValue | HeightValue))
+		return NULL;
+	if ((im = fetch_asimage (Scr.image_manager, back->data)) != NULL)
+		return im;
+
+	init_asimage_import_params (&iparams);
+	iparams.gamma = Scr.image_manager->gamma;
+	iparams.search_path = &(Scr.image_manager->search_path[0]);
+	iparams.width = back->scale.width;
+	iparams.height = back->scale.height;
+	iparams.flags = AS_IMPORT_RESIZED | AS_IMPORT_SCALED_BOTH |
+			AS_IMPORT_IGNORE_IF_MISSING;
+	/* full image may have been loaded by its path, resolved through
+	   the image manager's search path same way get_asimage() does : */
+	if ((realfilename = locate_image_file_in_path (back->data, &iparams)) == NULL)
+		return NULL;
+	if ((im = fetch_asimage (Scr.image_manager, realfilename)) == NULL)
+		im = file2ASImage_extra (realfilename, &iparams);
+	free (realfilename);
+	return im;
+}
+
 ASImage *load_myback_image (int desk, MyBackground * back)
 {
 	ASImage *im = NULL;
 	if (back->data && back->data[0]) {
 		LOCAL_DEBUG_OUT ("Attempting to load background image from \"%s\"",
 										 back->data ? back->data : "NULL");
-		im = get_asimage (Scr.image_manager, back->data, 0xFFFFFFFF, 100);
+		im = load_scaled_myback_image (back);
+		if (im == NULL)
+			im = get_asimage (Scr.image_manager, back->data, 0xFFFFFFFF, 100);
 	}
 
 	if (im == NULL) {
@@ -432,6 +432,7 @@ void generate_dir_html( char *dir, char *html_dir )
 			if( curr->preview )
 			{
 				ASImageExportParams params ;
+				memset( &params, 0x00, sizeof(params) );
 				if( curr->type != ASIT_Jpeg &&
 					get_flags( get_asimage_chanmask(curr->preview), SCL_DO_ALPHA) &&
 					curr->preview->width < 200 && curr->preview->height < 200 )